@@ -25,8 +25,12 @@ endif
 -include $(USPIHOME)/Config.mk
 
 AARCH64	?= 0
+HOSTSIM	?= 0
 
-ifeq ($(strip $(AARCH64)),0)
+ifneq ($(strip $(HOSTSIM)),0)
+RASPPI	= 2
+PREFIX	=
+else ifeq ($(strip $(AARCH64)),0)
 RASPPI	?= 1
 PREFIX	?= arm-none-eabi-
 else
@@ -39,7 +43,9 @@ AS	= $(CC)
 LD	= $(PREFIX)ld
 AR	= $(PREFIX)ar
 
-ifeq ($(strip $(AARCH64)),0)
+ifneq ($(strip $(HOSTSIM)),0)
+ARCH	= -DUSPI_HOSTSIM -DUSPI_MMIO_BACKEND -fno-pie
+else ifeq ($(strip $(AARCH64)),0)
 ifeq ($(strip $(RASPPI)),1)
 ARCH	?= -march=armv6j -mtune=arm1176jzf-s
 TARGET	?= kernel
@@ -43,6 +43,11 @@ extern "C" {
 // returns 0 on failure
 int USPiInitialize (void);
 
+// Call this frequently from your application main loop, if USPI_DEFER_COMPLETION is defined
+// in uspios.h. The keyboard, mouse, gamepad and MIDI handlers are called from here then.
+// Must be called from one task only. Does nothing otherwise.
+void USPiProcessCompletions (void);
+
 //
 // Keyboard device
 //
@@ -108,20 +113,85 @@ void USPiMouseRegisterStatusHandler (TUSPiMouseStatusHandler *pStatusHandler);
 // returns number of available devices
 int USPiMassStorageDeviceAvailable (void);
 
-#define USPI_BLOCK_SIZE		512			// other block sizes are not supported
+#define USPI_BLOCK_SIZE		512			// min. block size, see USPiMassStorageDeviceGetBlockSize()
 
-// ullOffset and nCount must be multiple of USPI_BLOCK_SIZE
+// ullOffset and nCount must be multiple of the block size of the device
 // returns number of read bytes or < 0 on failure
 // nDeviceIndex is 0-based
 int USPiMassStorageDeviceRead (unsigned long long ullOffset, void *pBuffer, unsigned nCount, unsigned nDeviceIndex);
 
-// ullOffset and nCount must be multiple of USPI_BLOCK_SIZE
+// ullOffset and nCount must be multiple of the block size of the device
 // returns number of written bytes or < 0 on failure
 // nDeviceIndex is 0-based
 int USPiMassStorageDeviceWrite (unsigned long long ullOffset, const void *pBuffer, unsigned nCount, unsigned nDeviceIndex);
 
-// returns the number of available blocks of USPI_BLOCK_SIZE or 0 on failure
+// returns the logical block size of the device (USPI_BLOCK_SIZE or a higher power of 2, e.g. 4096)
+// or 0 on failure
+unsigned USPiMassStorageDeviceGetBlockSize (unsigned nDeviceIndex);
+
+// returns the number of available blocks of USPiMassStorageDeviceGetBlockSize() or 0 on failure,
+// 0xFFFFFFFF if the device has more blocks (use USPiMassStorageDeviceGetCapacity64() then)
 unsigned USPiMassStorageDeviceGetCapacity (unsigned nDeviceIndex);
+unsigned long long USPiMassStorageDeviceGetCapacity64 (unsigned nDeviceIndex);
+
+// nResult is the number of transferred bytes or < 0 on failure
+typedef void TUSPiMassStorageCompletionHandler (int nResult, void *pParam);
+
+// queues a read or write, which is executed after the previously queued requests of this device,
+// so that the next command follows the completion of the previous one without delay,
+// the buffer must remain valid until pHandler is called (from interrupt context or from
+// USPiProcessCompletions() with USPI_DEFER_COMPLETION), returns 0 if the queue is full
+// or the parameters are invalid, synchronous calls wait until the queue is empty
+int USPiMassStorageDeviceReadAsync (unsigned long long ullOffset, void *pBuffer, unsigned nCount,
+				    unsigned nDeviceIndex,
+				    TUSPiMassStorageCompletionHandler *pHandler, void *pParam);
+int USPiMassStorageDeviceWriteAsync (unsigned long long ullOffset, const void *pBuffer, unsigned nCount,
+				     unsigned nDeviceIndex,
+				     TUSPiMassStorageCompletionHandler *pHandler, void *pParam);
+
+// queues a flush of the write cache (see USPiMassStorageDeviceFlush()), nResult is 0 on success
+int USPiMassStorageDeviceFlushAsync (unsigned nDeviceIndex,
+				     TUSPiMassStorageCompletionHandler *pHandler, void *pParam);
+
+// waits until all queued requests of this device have been completed, with
+// USPI_DEFER_COMPLETION their handlers may still be pending in USPiProcessCompletions()
+void USPiMassStorageDeviceWaitAsync (unsigned nDeviceIndex);
+
+// write cache policy
+#define USPI_WRITE_FUA		0			// every write is forced to the media (default)
+#define USPI_WRITE_THROUGH	1			// every write is followed by SYNCHRONIZE CACHE
+#define USPI_WRITE_BACK		2			// the device may cache the written data until
+							// USPiMassStorageDeviceFlush() is called
+
+// the cache is flushed before the policy is changed,
+// returns 0 on failure (e.g. the device does not support SYNCHRONIZE CACHE)
+int USPiMassStorageDeviceSetWritePolicy (unsigned nPolicy, unsigned nDeviceIndex);
+
+// writes the cached data to the media (SYNCHRONIZE CACHE), after the queued requests have been
+// completed, does nothing with USPI_WRITE_FUA, returns 0 on success or < 0 on failure
+int USPiMassStorageDeviceFlush (unsigned nDeviceIndex);
+
+// enables a read cache for this device, which uses nSize bytes of memory (at least 16 pages of
+// 4 KByte or of the block size, if larger), or disables it (0), USPiMassStorageDeviceRead() is
+// served from the cache then, sequential reads are continued in advance (asynchronous read-ahead,
+// with USPI_DEFER_COMPLETION a read, which waits for it, calls USPiProcessCompletions()), writes
+// go to the device and update the cache, returns 0 on failure
+int USPiMassStorageDeviceSetCache (unsigned nSize, unsigned nDeviceIndex);
+
+typedef struct TUSPiCacheStatistics
+{
+	unsigned	nHits;				// pages found in the cache
+	unsigned	nMisses;			// pages read from the device on request
+	unsigned	nPrefetches;			// pages read ahead
+	unsigned	nPrefetchHits;			// read-ahead pages, which have been requested
+	unsigned	nEvictions;			// least recently used pages replaced
+	unsigned	nBypasses;			// requests read from the device directly
+}
+TUSPiCacheStatistics;
+
+// returns 0 on failure (e.g. the cache is not enabled)
+int USPiMassStorageDeviceGetCacheStatistics (TUSPiCacheStatistics *pStatistics,	// provided buffer is filled
+					     unsigned nDeviceIndex);
 
 //
 // Ethernet services
@@ -220,6 +290,112 @@ int USPiDeviceGetInformation (unsigned nClass,			// see above
 			      unsigned nDeviceIndex,		// 0-based index
 			      TUSPiDeviceInformation *pInfo);	// provided buffer is filled
 
+//
+// Host controller statistics
+//
+// The counters are collected all the time. Endpoints are identified by device and endpoint
+// address. Endpoints, which do not fit into the table, are counted in the channels only.
+//
+
+#define USPI_MAX_CHANNELS		16
+#define USPI_MAX_STAT_ENDPOINTS		32
+
+// bucket n counts the latencies from 2^n to 2^(n+1)-1 microseconds (bucket 0 from 0 to 1),
+// the last bucket counts all longer latencies
+#define USPI_LATENCY_BUCKETS		20
+
+typedef struct TUSPiTransferCounters
+{
+	unsigned		nTransactions;
+	unsigned long long	nBytes;
+	unsigned		nNAKs;
+	unsigned		nNYETs;
+	unsigned		nXactErrors;		// CRC, timeout, bit stuff or PID error
+	unsigned		nBabbleErrors;
+	unsigned		nOtherErrors;		// stall, data toggle, frame overrun, AHB error
+	unsigned		nSplitRetries;		// complete splits repeated after NYET
+}
+TUSPiTransferCounters;
+
+typedef struct TUSPiEndpointStatistics
+{
+	unsigned char		ucDeviceAddress;
+	unsigned char		ucEndpointAddress;	// bit 7 set for IN, 0 for control endpoint 0
+	unsigned char		ucType;			// 0: control, 1: isochronous, 2: bulk, 3: interrupt
+
+	TUSPiTransferCounters	Counters;
+
+	unsigned		nAllocationFailures;	// no channel was free, request had to wait
+
+	unsigned		nRequests;		// completed requests
+	unsigned		nFailedRequests;	// of them
+	unsigned		nLatencyHistogram[USPI_LATENCY_BUCKETS];	// submit to complete
+	unsigned long long	nLatencySum;		// microseconds
+	unsigned		nLatencyMax;		// microseconds
+
+	unsigned		nBouncedStages;		// buffer was not suitable for DMA
+	unsigned long long	nBouncedBytes;		// size of these stages
+}
+TUSPiEndpointStatistics;
+
+typedef struct TUSPiHostStatistics
+{
+	unsigned		nChannels;
+	TUSPiTransferCounters	Channel[USPI_MAX_CHANNELS];
+
+	unsigned		nChannelAllocations;
+	unsigned		nChannelAllocationFailures;	// no channel was free, request had to wait
+
+	unsigned		nBouncedStages;			// of all endpoints
+	unsigned long long	nBouncedBytes;
+
+	unsigned		nEndpoints;			// valid entries in Endpoint[]
+	TUSPiEndpointStatistics	Endpoint[USPI_MAX_STAT_ENDPOINTS];
+}
+TUSPiHostStatistics;
+
+// returns 0 on failure
+int USPiGetHostStatistics (TUSPiHostStatistics *pStatistics);	// provided buffer is filled
+
+//
+// Capture of USB requests
+//
+// The submitted and completed requests are recorded in the pcap format of the Linux usbmon
+// interface (LINKTYPE_USB_LINUX_MMAPPED), the data of all USPiCaptureRead() calls written to
+// a file can be opened with Wireshark and compared with a capture of Linux.
+//
+
+#define USPI_CAPTURE_MIN_READ		128	// min. buffer size for USPiCaptureRead()
+
+// starts capturing into the provided buffer,
+// which must stay valid until the capture has been read,
+// can be called before USPiInitialize() to capture the enumeration,
+// nSnapLen is the max. number of data bytes captured per request,
+// returns 0 on failure
+int USPiCaptureStart (void *pBuffer, unsigned nBufSize, unsigned nSnapLen);
+// the captured records can be read after stop
+void USPiCaptureStop (void);
+
+// copies the captured records (the first call after start: the pcap file header too), which
+// fit into the buffer, and removes them from the capture buffer, returns the number of bytes,
+// call this frequently from task context,
+// a complete record needs 80 bytes + 16 bytes per ISO packet + up to nSnapLen data bytes,
+// a record, which is larger than the buffer, is returned truncated (marked in the pcap
+// record header), the buffer must have at least USPI_CAPTURE_MIN_READ bytes
+unsigned USPiCaptureRead (void *pBuffer, unsigned nBufSize);
+
+// returns the number of records, which have been dropped, because the capture buffer was full
+unsigned USPiCaptureGetDropped (void);
+
+//
+// Event trace (only if USPI_TRACE is defined in uspios.h)
+//
+
+// copies the most recent events of the host controller driver into the buffer, which can
+// be written to a file and decoded with sim/trace/uspitrace (see uspi/trace.h for the format),
+// returns the size of the data or 0 if tracing is disabled or the buffer is too small
+unsigned USPiTraceDump (void *pBuffer, unsigned nBufSize);
+
 #ifdef __cplusplus
 }
 #endif
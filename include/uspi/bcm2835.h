@@ -45,7 +45,18 @@
 
 // Convert physical ARM address into bus address
 // (does even work, if a bus address is provided already)
+#ifndef USPI_HOSTSIM
 #define BUS_ADDRESS(phys)	(((phys) & ~0xC0000000) | GPU_MEM_BASE)
+#else
+#define BUS_ADDRESS(phys)	(phys)		// the simulated core uses host addresses
+#endif
+
+//
+// System Timer
+//
+#define ARM_SYSTIMER_BASE	(ARM_IO_BASE + 0x3000)
+
+#define ARM_SYSTIMER_CLO	(ARM_SYSTIMER_BASE + 0x04)	// free running 1 MHz counter (low word)
 
 //
 // USB Host Controller
@@ -26,23 +26,106 @@
 #include <uspi/dwhcirootport.h>
 #include <uspi/dwhcixferstagedata.h>
 #include <uspi/dwhciregister.h>
+#include <uspi/usbcapture.h>
 #include <uspi/dwhci.h>
 #include <uspi/usb.h>
 #include <uspi/types.h>
 #include <uspios.h>
+#include <uspi.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if defined (USPI_USE_FIQ) && defined (USPI_DEFER_COMPLETION)
+	#error USPI_USE_FIQ and USPI_DEFER_COMPLETION cannot be defined together
+#endif
+
+#define DWHCI_BOUNCE_BUFFER_SIZE	4096		// per channel, larger stages are bounced in parts
+
+#if defined (USPI_USE_FIQ) || defined (USPI_DEFER_COMPLETION)
+	#define DWHCI_COMPLETION_QUEUE
+	#define DWHCI_COMPLETION_QUEUE_SIZE	64		// must be a power of 2
+#endif
+
+// m_EndpointStatisticsIndex[] holds the entry + 1 in m_EndpointStatistics[] or one of these
+#define DWHCI_STAT_ENDPOINTS		32		// endpoint number, 16 added for IN
+#define DWHCI_STAT_NO_ENTRY		0		// not used before
+#define DWHCI_STAT_TABLE_FULL		0xFF		// not counted, the table was full
+
+#if USPI_MAX_STAT_ENDPOINTS >= DWHCI_STAT_TABLE_FULL
+	#error USPI_MAX_STAT_ENDPOINTS is too large
+#endif
+
+typedef enum
+{
+	DWHCIChannelClassPeriodic,			// interrupt and isochronous transfers
+	DWHCIChannelClassControl,
+	DWHCIChannelClassBulk,
+	DWHCIChannelClassUnknown			// number of classes
+}
+TDWHCIChannelClass;					// in order of priority
+
+typedef struct TDWHCIChannelStatistics
+{
+	unsigned nAllocations;				// channels allocated so far
+	unsigned nDeferred;				// requests, which had to wait for a channel
+	unsigned nInUse;				// channels currently allocated
+	unsigned nMaxInUse;				// maximum of nInUse
+}
+TDWHCIChannelStatistics;
+
+typedef struct TDWHCIBounceStatistics
+{
+	unsigned nStages;				// transfer stages, which used a bounce buffer
+	u64	 nBytes;				// size of these stages
+}
+TDWHCIBounceStatistics;
+
 typedef struct TDWHCIDevice
 {
 	unsigned m_nChannels;
 	volatile unsigned m_nChannelAllocated;		// one bit per channel, set if allocated
+	unsigned m_nChannelReserved;			// one bit per channel, for periodic transfers only
+	u8 m_ChannelClass[DWHCI_MAX_CHANNELS];		// of allocated channels
 
 	TDWHCITransferStageData m_StageData[DWHCI_MAX_CHANNELS];
 
-	volatile boolean m_bWaiting;
+	// endpoints with requests waiting for a channel, one list per class
+	TUSBEndpoint *m_pFirstPending[DWHCIChannelClassUnknown];
+	TUSBEndpoint *m_pLastPending[DWHCIChannelClassUnknown];
+
+	TDWHCIChannelStatistics m_ChannelStatistics[DWHCIChannelClassUnknown];
+
+	// bounce buffers for URB buffers, which are not suitable for DMA, one per channel,
+	// allocated by DWHCIDeviceInitialize(), never at interrupt level
+	void *m_pBounceBlock;				// from malloc() or 0
+	u8 *m_pBounceBuffer;				// aligned, DWHCI_BOUNCE_BUFFER_SIZE per channel
+	TDWHCIBounceStatistics m_BounceStatistics;
+
+	// statistics, see DWHCIDeviceGetHostStatistics()
+	TUSPiTransferCounters m_ChannelCounters[DWHCI_MAX_CHANNELS];
+	TUSPiEndpointStatistics m_EndpointStatistics[USPI_MAX_STAT_ENDPOINTS];
+	unsigned m_nEndpointStatistics;			// used entries
+	u8 m_EndpointStatisticsIndex[USB_MAX_ADDRESS+1][DWHCI_STAT_ENDPOINTS];
+
+	TUSBCapture *m_pCapture;			// of submitted and completed requests
+
+	volatile unsigned m_nChannelAborted;		// one bit per channel, aborted during current IRQ
+	volatile unsigned m_nChannelHalting;		// one bit per channel, aborted, waiting for CHHLTD
+	volatile unsigned m_nFrameWaiting;		// one bit per channel, waiting for its (micro)frame
+
+#ifdef DWHCI_COMPLETION_QUEUE
+	// requests completed at interrupt level, their completion routines are called later
+	// (lock-free ring, written by the interrupt handler, read by DWHCIDeviceProcessCompletions())
+	TUSBRequest *m_pCompleted[DWHCI_COMPLETION_QUEUE_SIZE];
+	volatile unsigned m_nCompletedIn;		// modified by the interrupt handler only
+	volatile unsigned m_nCompletedOut;		// modified by the consumer only
+
+	// requests, which did not fit into the ring, are moved into it in a critical section
+	TUSBRequest * volatile m_pFirstOverflow;
+	TUSBRequest *m_pLastOverflow;
+#endif
 
 	TDWHCIRootPort m_RootPort;
 }
@@ -72,8 +155,33 @@ int DWHCIDeviceControlMessage (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint,
 int DWHCIDeviceTransfer (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint, void *pBuffer, unsigned nBufSize);
 
 boolean DWHCIDeviceSubmitBlockingRequest (TDWHCIDevice *pThis, TUSBRequest *pURB);
+// the request is queued, if the endpoint is busy or no channel is free,
+// control requests run through all stages before the completion routine is called
 boolean DWHCIDeviceSubmitAsyncRequest (TDWHCIDevice *pThis, TUSBRequest *pURB);
 
+// halts the channel (if any) and completes the request with USBErrorCancelled (when the channel
+// has been halted, if it is active), returns FALSE if the request is not active or is already
+// being aborted (can be called from interrupt context)
+boolean DWHCIDeviceCancelRequest (TDWHCIDevice *pThis, TUSBRequest *pURB);
+
+// calls the completion routines of the requests, which have been completed at interrupt level,
+// called from the soft interrupt with USPI_USE_FIQ, must be called from task context with
+// USPI_DEFER_COMPLETION, does nothing otherwise
+void DWHCIDeviceProcessCompletions (TDWHCIDevice *pThis);
+
+#ifdef DWHCI_COMPLETION_QUEUE
+// queues a request, which has been completed by the caller (e.g. a class driver, which
+// completes its own requests at interrupt level), its completion routine is called from
+// DWHCIDeviceProcessCompletions(), must be called with interrupts disabled
+void DWHCIDeviceDeferCompletion (TDWHCIDevice *pThis, TUSBRequest *pURB);
+#endif
+
+void DWHCIDeviceGetChannelStatistics (TDWHCIDevice *pThis, TDWHCIChannelClass Class,
+				      TDWHCIChannelStatistics *pStatistics);
+
+// transactions and errors per channel and endpoint, latencies of the requests per endpoint
+void DWHCIDeviceGetHostStatistics (TDWHCIDevice *pThis, TUSPiHostStatistics *pStatistics);
+
 TUSBSpeed DWHCIDeviceGetPortSpeed (TDWHCIDevice *pThis);
 boolean DWHCIDeviceOvercurrentDetected (TDWHCIDevice *pThis);
 void DWHCIDeviceDisableRootPort (TDWHCIDevice *pThis);
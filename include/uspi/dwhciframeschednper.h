@@ -29,6 +29,7 @@ typedef struct TDWHCIFrameSchedulerNonPeriodic
 	 
 	unsigned m_nState;
 	unsigned m_nTries;
+	unsigned m_nDelay;			// microframes, before the next transaction
 }
 TDWHCIFrameSchedulerNonPeriodic;
 
@@ -39,7 +40,7 @@ void DWHCIFrameSchedulerNonPeriodicStartSplit (TDWHCIFrameScheduler *pBase);
 boolean DWHCIFrameSchedulerNonPeriodicCompleteSplit (TDWHCIFrameScheduler *pBase);
 void DWHCIFrameSchedulerNonPeriodicTransactionComplete (TDWHCIFrameScheduler *pBase, u32 nStatus);
 
-void DWHCIFrameSchedulerNonPeriodicWaitForFrame (TDWHCIFrameScheduler *pBase);
+unsigned DWHCIFrameSchedulerNonPeriodicGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame);
 
 boolean DWHCIFrameSchedulerNonPeriodicIsOddFrame (TDWHCIFrameScheduler *pBase);
 
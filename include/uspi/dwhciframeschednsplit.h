@@ -29,6 +29,7 @@ typedef struct TDWHCIFrameSchedulerNoSplit
 	
 	boolean m_bIsPeriodic;
 	unsigned m_nNextFrame;
+	boolean m_bWaiting;
 }
 TDWHCIFrameSchedulerNoSplit;
 
@@ -39,7 +40,7 @@ void DWHCIFrameSchedulerNoSplitStartSplit (TDWHCIFrameScheduler *pBase);
 boolean DWHCIFrameSchedulerNoSplitCompleteSplit (TDWHCIFrameScheduler *pBase);
 void DWHCIFrameSchedulerNoSplitTransactionComplete (TDWHCIFrameScheduler *pBase, u32 nStatus);
 
-void DWHCIFrameSchedulerNoSplitWaitForFrame (TDWHCIFrameScheduler *pBase);
+unsigned DWHCIFrameSchedulerNoSplitGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame);
 
 boolean DWHCIFrameSchedulerNoSplitIsOddFrame (TDWHCIFrameScheduler *pBase);
 
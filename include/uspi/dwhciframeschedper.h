@@ -30,18 +30,21 @@ typedef struct TDWHCIFrameSchedulerPeriodic
 	unsigned m_nState;
 	unsigned m_nTries;
 
+	unsigned m_nStartFrame;			// reserved in the TT or FRAME_UNSET
 	unsigned m_nNextFrame;
+	unsigned m_nDelay;			// microframes, before the next transaction
 }
 TDWHCIFrameSchedulerPeriodic;
 
-void DWHCIFrameSchedulerPeriodic (TDWHCIFrameSchedulerPeriodic *pThis);
+// nStartMicroframe: start split microframe reserved in the TT (USB_TT_NO_MICROFRAME if none)
+void DWHCIFrameSchedulerPeriodic (TDWHCIFrameSchedulerPeriodic *pThis, unsigned nStartMicroframe);
 void _DWHCIFrameSchedulerPeriodic (TDWHCIFrameScheduler *pBase);
 
 void DWHCIFrameSchedulerPeriodicStartSplit (TDWHCIFrameScheduler *pBase);
 boolean DWHCIFrameSchedulerPeriodicCompleteSplit (TDWHCIFrameScheduler *pBase);
 void DWHCIFrameSchedulerPeriodicTransactionComplete (TDWHCIFrameScheduler *pBase, u32 nStatus);
 
-void DWHCIFrameSchedulerPeriodicWaitForFrame (TDWHCIFrameScheduler *pBase);
+unsigned DWHCIFrameSchedulerPeriodicGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame);
 
 boolean DWHCIFrameSchedulerPeriodicIsOddFrame (TDWHCIFrameScheduler *pBase);
 
@@ -34,7 +34,10 @@ typedef struct TDWHCIFrameScheduler
 	boolean (*CompleteSplit) (struct TDWHCIFrameScheduler *pThis);
 	void (*TransactionComplete) (struct TDWHCIFrameScheduler *pThis, u32 nStatus);
 	
-	void (*WaitForFrame) (struct TDWHCIFrameScheduler *pThis);
+	// returns the number of (micro)frames to wait from frame nFrame (current frame number),
+	// before the next transaction can be started (0 to start it immediately),
+	// is called again, when this number of (micro)frames has elapsed
+	unsigned (*GetFramesToWait) (struct TDWHCIFrameScheduler *pThis, unsigned nFrame);
 	
 	boolean (*IsOddFrame) (struct TDWHCIFrameScheduler *pThis);
 }
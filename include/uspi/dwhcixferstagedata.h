@@ -45,6 +45,11 @@ typedef struct TDWHCITransferStageData
 	boolean		 m_bSplitTransaction;
 	boolean		 m_bSplitComplete;
 
+	boolean		 m_bIsochronous;		// one transaction per packet descriptor
+	unsigned	 m_nIsoPacket;			// index of the current packet
+	unsigned	 m_nIsoStartFrame;		// (micro)frame number of the first packet
+	unsigned	 m_nIsoInterval;		// in (micro)frames
+
 	TUSBDevice	*m_pDevice;			// cached from *pURB
 	TUSBEndpoint	*m_pEndpoint;
 	TUSBSpeed	 m_Speed;
@@ -59,9 +64,14 @@ typedef struct TDWHCITransferStageData
 	unsigned	 m_nState;
 	unsigned	 m_nSubState;
 	u32		 m_nTransactionStatus;
+	unsigned	 m_nDueFrame;			// (micro)frame number in StageStatePeriodicDelay
 
 	u32		 m_TempBuffer ALIGN (4);	// DMA buffer
 	void		*m_pBufferPointer;
+	void		*m_pBounceBuffer;		// used instead of the buffer of the URB or 0
+	u32		 m_nBounceSize;			// multiple of the max. packet size
+	u32		 m_nBounceOffset;		// of the bounced part in the data of the stage
+	void		*m_pBounceData;			// data of the stage (URB buffer or setup data)
 
 	boolean		 m_bFrameSchedulerUsed;
 	union
@@ -86,9 +96,23 @@ void DWHCITransferStageDataSetState (TDWHCITransferStageData *pThis, unsigned nS
 unsigned DWHCITransferStageDataGetState (TDWHCITransferStageData *pThis);
 void DWHCITransferStageDataSetSubState (TDWHCITransferStageData *pThis, unsigned nSubState);
 unsigned DWHCITransferStageDataGetSubState (TDWHCITransferStageData *pThis);
+void DWHCITransferStageDataSetDueFrame (TDWHCITransferStageData *pThis, unsigned nFrame);
+unsigned DWHCITransferStageDataGetDueFrame (TDWHCITransferStageData *pThis);
 
 boolean DWHCITransferStageDataBeginSplitCycle (TDWHCITransferStageData *pThis);
 
+// isochronous transfer
+boolean DWHCITransferStageDataIsIsochronous (TDWHCITransferStageData *pThis);
+void DWHCITransferStageDataSetIsoSchedule (TDWHCITransferStageData *pThis, unsigned nStartFrame, unsigned nInterval);
+unsigned DWHCITransferStageDataGetIsoFrame (TDWHCITransferStageData *pThis);	// of the current packet
+// sets the result of the current packet and continues with the next one
+void DWHCITransferStageDataIsoPacketComplete (TDWHCITransferStageData *pThis, TUSBError Error);
+
+// bounce buffer, a larger stage (not isochronous) is bounced in parts of nSize bytes at most,
+// IN data is copied back to the buffer of the URB after each part and by the destructor
+u32 DWHCITransferStageDataGetBounceSize (TDWHCITransferStageData *pThis);	// 0 if not required
+void DWHCITransferStageDataSetBounceBuffer (TDWHCITransferStageData *pThis, void *pBuffer, u32 nSize);
+
 // get transaction parameters
 unsigned DWHCITransferStageDataGetChannelNumber (TDWHCITransferStageData *pThis);
 u8 DWHCITransferStageDataGetDeviceAddress (TDWHCITransferStageData *pThis);
@@ -96,6 +120,7 @@ boolean DWHCITransferStageDataIsPeriodic (TDWHCITransferStageData *pThis);
 u8 DWHCITransferStageDataGetEndpointType (TDWHCITransferStageData *pThis);
 u8 DWHCITransferStageDataGetEndpointNumber (TDWHCITransferStageData *pThis);
 u32 DWHCITransferStageDataGetMaxPacketSize (TDWHCITransferStageData *pThis);
+unsigned DWHCITransferStageDataGetMultiCount (TDWHCITransferStageData *pThis);	// packets per (micro)frame
 TUSBSpeed DWHCITransferStageDataGetSpeed (TDWHCITransferStageData *pThis);
 
 u8 DWHCITransferStageDataGetPID (TDWHCITransferStageData *pThis);
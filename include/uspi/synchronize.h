@@ -22,6 +22,7 @@
 
 #include <uspi/macros.h>
 #include <uspi/types.h>
+#include <uspios.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,7 +34,27 @@ extern "C" {
 void uspi_EnterCritical (void);		// disable interrupts (nested calls possible)
 void uspi_LeaveCritical (void);		// enable interrupts (nested calls possible)
 
-#ifndef AARCH64
+// wait for an interrupt and let it be handled, must be called with interrupts disabled
+// (inside of uspi_EnterCritical/uspi_LeaveCritical), returns with interrupts disabled,
+// the critical section must not be nested and interrupts must have been enabled before
+void uspi_WaitForInterrupt (void);
+
+#ifdef USPI_HOSTSIM
+
+//
+// Cache control (the simulated core is cache coherent, the operations are only counted)
+//
+void uspi_CleanAndInvalidateDataCacheRange (u64 nAddress, u64 nLength);
+void uspi_CleanDataCacheRange (u64 nAddress, u64 nLength);
+void uspi_InvalidateDataCacheRange (u64 nAddress, u64 nLength);
+
+//
+// Barriers
+//
+#define DataSyncBarrier()	__sync_synchronize ()
+#define DataMemBarrier() 	__sync_synchronize ()
+
+#elif !defined (AARCH64)
 
 #if RASPPI == 1
 
@@ -49,6 +70,8 @@ void uspi_LeaveCritical (void);		// enable interrupts (nested calls possible)
 #define CleanDataCache()	__asm volatile ("mcr p15, 0, %0, c7, c10, 0" : : "r" (0) : "memory")
 
 void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
+void uspi_CleanDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
+void uspi_InvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
 
 //
 // Barriers
@@ -71,6 +94,8 @@ void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
 				__asm volatile ("mcr p15, 0, %0, c7, c5,  6" : : "r" (0) : "memory")
 
 void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
+void uspi_CleanDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
+void uspi_InvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
 
 //
 // Barriers
@@ -89,6 +114,8 @@ void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength) MAXOPT;
 // Cache control
 //
 void uspi_CleanAndInvalidateDataCacheRange (u64 nAddress, u64 nLength) MAXOPT;
+void uspi_CleanDataCacheRange (u64 nAddress, u64 nLength) MAXOPT;
+void uspi_InvalidateDataCacheRange (u64 nAddress, u64 nLength) MAXOPT;
 
 //
 // Barriers
@@ -98,6 +125,33 @@ void uspi_CleanAndInvalidateDataCacheRange (u64 nAddress, u64 nLength) MAXOPT;
 
 #endif	// #ifdef AARCH64
 
+//
+// Cache maintenance for DMA buffers:
+//
+// Before the controller reads from memory (OUT) the range has to be cleaned. Before and after
+// the controller writes to memory (IN) it has to be invalidated. Partial cache lines at the
+// borders of the range are cleaned and invalidated by uspi_InvalidateDataCacheRange(), because
+// they may contain other data.
+//
+// DMA buffers for IN transfers should be aligned to DMA_ALIGNMENT and their size should be a
+// multiple of it, so that they do not share cache lines with other data. Otherwise a bounce
+// buffer is used. This is not required for buffers in the non-cacheable memory region, which
+// can be defined in uspios.h.
+//
+#if RASPPI == 1 && !defined (AARCH64) && !defined (USPI_HOSTSIM)
+	#define DMA_ALIGNMENT		32
+#else
+	#define DMA_ALIGNMENT		64
+#endif
+
+#ifdef USPI_DMA_COHERENT_REGION
+	#define IS_DMA_COHERENT(addr, len)	(   (addr) >= USPI_DMA_COHERENT_REGION		\
+						 && (addr) + (len) <= USPI_DMA_COHERENT_REGION	\
+								      + USPI_DMA_COHERENT_SIZE)
+#else
+	#define IS_DMA_COHERENT(addr, len)	FALSE
+#endif
+
 #define CompilerBarrier()	__asm volatile ("" ::: "memory")
 
 #ifdef __cplusplus
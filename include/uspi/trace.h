@@ -0,0 +1,103 @@
+//
+// trace.h
+//
+// Binary trace of the transfer state machine of the DWHCI driver
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspi_trace_h
+#define _uspi_trace_h
+
+#include <uspi/types.h>
+#include <uspios.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef USPI_TRACE_EVENTS
+	#define USPI_TRACE_EVENTS	1024		// size of the ring, must be a power of 2
+#endif
+
+typedef enum
+{
+	TraceEventSubmit,		// param: endpoint address, 1: URB, 2: buffer length
+	TraceEventStageStart,		// param: 1: IN, 2: status stage, 4: split, 1: URB, 2: transfer size
+	TraceEventChannelStart,		// param: PID, 1: XFER_SIZ, 2: CHARACTER
+	TraceEventStartSplit,		// param: PID, 1: XFER_SIZ, 2: SPLT
+	TraceEventCompleteSplit,	// param: PID, 1: XFER_SIZ, 2: SPLT
+	TraceEventChannelDisable,	// channel still enabled, waiting for halt, 2: CHARACTER
+	TraceEventChannelHalt,		// channel halted by the driver (abort), param: state, 1: URB
+	TraceEventTransaction,		// param: state << 8 | substate, 1: HCINT, 2: XFER_SIZ
+	TraceEventWaitFrame,		// param: stage state, 1: due (micro)frame
+	TraceEventStageFinish,		// param: control stage, 1: URB, 2: status
+	TraceEventComplete,		// param: USB error, 1: URB, 2: status << 31 | result length
+	TraceEventUnknown
+}
+TTraceEvent;
+
+typedef struct TUSPiTraceEvent		// 16 bytes
+{
+	u32	nTime;			// clock ticks (see nClockRate), wraps around
+	u8	ucEvent;		// see TTraceEvent
+	u8	ucChannel;		// USPI_TRACE_NO_CHANNEL if not assigned
+	u16	usParam;
+	u32	nParam1;
+	u32	nParam2;
+}
+TUSPiTraceEvent;
+
+#define USPI_TRACE_NO_CHANNEL	0xFF
+
+// the blob, which is returned by USPiTraceDump(), starts with this header,
+// the events follow, oldest first (all values little endian)
+typedef struct TUSPiTraceHeader
+{
+	u32	nMagic;
+#define USPI_TRACE_MAGIC	0x54505355	// "USPT"
+	u16	usVersion;
+#define USPI_TRACE_VERSION	1
+	u16	usEventSize;		// sizeof (TUSPiTraceEvent)
+	u32	nClockRate;		// ticks per second of nTime
+	u32	nEvents;		// following the header
+	u32	nLost;			// events, which have been overwritten before
+}
+TUSPiTraceHeader;
+
+#ifdef USPI_TRACE
+
+// records an event, must be called with interrupts disabled
+void uspi_Trace (unsigned nEvent, unsigned nChannel, unsigned nParam, u32 nParam1, u32 nParam2);
+
+#define TRACE(event, channel, param, param1, param2)	\
+	uspi_Trace (event, channel, param, (u32) (unsigned long) (param1), (u32) (unsigned long) (param2))
+
+#else
+
+#define TRACE(event, channel, param, param1, param2)	((void) 0)
+
+#endif
+
+// copies the most recent events, which fit into the buffer, as a blob (header and events),
+// returns the size of the blob or 0 if tracing is disabled or the buffer is too small
+unsigned uspi_TraceDump (void *pBuffer, unsigned nBufSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -38,7 +38,7 @@ typedef signed long long	s64;
 typedef signed long		s64;
 #endif
 
-#ifndef AARCH64
+#if !defined (AARCH64) && !defined (USPI_HOSTSIM)
 typedef s32			intptr;
 typedef u32			uintptr;
 #else
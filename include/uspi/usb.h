@@ -68,6 +68,7 @@ PACKED TSetupData;
 #define REQUEST_VENDOR			0x40
 
 #define REQUEST_TO_INTERFACE		1
+#define REQUEST_TO_ENDPOINT		2
 #define REQUEST_TO_OTHER		3
 
 // Standard Request Codes
@@ -0,0 +1,91 @@
+//
+// usbcapture.h
+//
+// Capture of USB requests in the pcap format of the Linux usbmon interface
+// (LINKTYPE_USB_LINUX_MMAPPED), which can be opened with Wireshark
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspi_usbcapture_h
+#define _uspi_usbcapture_h
+
+#include <uspi/usbrequest.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_CAPTURE_LINKTYPE		220		// LINKTYPE_USB_LINUX_MMAPPED
+#define USB_CAPTURE_BUS			1		// bus number in the records
+
+// usbmon event types
+#define USB_CAPTURE_SUBMIT		'S'
+#define USB_CAPTURE_COMPLETE		'C'
+#define USB_CAPTURE_ERROR		'E'		// submit failed
+
+typedef struct TUSBCapture
+{
+	u8	*m_pBuffer;				// ring, provided by the application
+	unsigned m_nSize;
+	unsigned m_nSnapLen;				// max. payload bytes per record
+	boolean	 m_bActive;
+
+	// records are written at interrupt level and read in task context,
+	// one free byte separates the write from the read position
+	volatile unsigned m_nIn;			// modified by USBCaptureRequest() only
+	volatile unsigned m_nOut;			// modified by USBCaptureRead() only
+	boolean	 m_bHeaderRead;				// pcap file header returned
+
+	u32	 m_nLastTime;				// system timer (microseconds)
+	u64	 m_nTimeHigh;				// to extend the time to 64 bits
+
+	unsigned m_nRecords;				// written since start
+	unsigned m_nDropped;				// ring was full
+}
+TUSBCapture;
+
+// there is one instance only, which is inactive until it is started,
+// so that the capture can be started before the library is initialized
+TUSBCapture *USBCaptureGet (void);
+
+// starts capturing into the buffer (must remain valid until the capture is read completely),
+// nSnapLen limits the captured payload of each request, returns FALSE if buffer is too small
+boolean USBCaptureStart (TUSBCapture *pThis, void *pBuffer, unsigned nSize, unsigned nSnapLen);
+// records, which have not been read yet, remain available
+void USBCaptureStop (TUSBCapture *pThis);
+
+boolean USBCaptureIsActive (TUSBCapture *pThis);
+
+// records a submit, completion or submit error (see above) of a request,
+// nTime is the system timer (microseconds), must be called with interrupts disabled
+void USBCaptureRequest (TUSBCapture *pThis, TUSBRequest *pURB, char chEvent, u32 nTime);
+
+// copies the pcap file header (on the first call after start) and the complete records,
+// which fit into the buffer, and removes them from the ring, returns the number of bytes,
+// the data of all calls concatenated is a pcap file (called from task context only),
+// a record larger than the buffer is truncated, if the buffer has USPI_CAPTURE_MIN_READ bytes
+unsigned USBCaptureRead (TUSBCapture *pThis, void *pBuffer, unsigned nBufSize);
+
+// records, which have been dropped, because the ring was full
+unsigned USBCaptureGetDropped (TUSBCapture *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
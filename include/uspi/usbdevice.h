@@ -43,6 +43,7 @@ TDeviceNameSelector;
 
 struct TDWHCIDevice;
 struct TUSBEndpoint;
+struct TUSBTransactionTranslator;
 
 typedef struct TUSBDevice
 {
@@ -55,6 +56,7 @@ typedef struct TUSBDevice
 	boolean		    m_bSplitTransfer;
 	u8		    m_ucHubAddress;
 	u8		    m_ucHubPortNumber;
+	struct TUSBTransactionTranslator *m_pTT;	// for split transfers or 0
 	
 	TUSBDeviceDescriptor	    *m_pDeviceDesc;
 	TUSBConfigurationDescriptor *m_pConfigDesc;
@@ -85,6 +87,10 @@ boolean USBDeviceIsSplit (TUSBDevice *pThis);
 u8 USBDeviceGetHubAddress (TUSBDevice *pThis);
 u8 USBDeviceGetHubPortNumber (TUSBDevice *pThis);
 
+// the TT is owned by the hub, which does the split transactions for this device
+void USBDeviceSetTT (TUSBDevice *pThis, struct TUSBTransactionTranslator *pTT);
+struct TUSBTransactionTranslator *USBDeviceGetTT (TUSBDevice *pThis);
+
 struct TUSBEndpoint *USBDeviceGetEndpoint0 (TUSBDevice *pThis);
 struct TDWHCIDevice *USBDeviceGetHost (TUSBDevice *pThis);
 
@@ -22,6 +22,7 @@
 
 #include <uspi/usb.h>
 #include <uspi/usbdevice.h>
+#include <uspi/usbtranslator.h>
 #include <uspi/types.h>
 
 #ifdef __cplusplus
@@ -37,6 +38,10 @@ typedef enum
 }
 TEndpointType;
 
+#define USB_ENDPOINT_NO_FRAME	((unsigned) -1)
+
+struct TUSBRequest;
+
 typedef struct TUSBEndpoint
 {
 	TUSBDevice	*m_pDevice;
@@ -44,8 +49,18 @@ typedef struct TUSBEndpoint
 	TEndpointType	 m_Type;
 	boolean		 m_bDirectionIn;
 	u32		 m_nMaxPacketSize;
+	unsigned	 m_nPacketsPerMicroframe;	// 1..3 (high-bandwidth endpoint)
 	unsigned	 m_nInterval;			// Milliseconds
+	unsigned	 m_nIntervalMicroframes;	// exact value (125 us units)
 	TUSBPID		 m_NextPID;
+
+	// used by the host controller driver
+	struct TUSBRequest	*m_pFirstRequest;	// requests waiting for transfer (FIFO)
+	struct TUSBRequest	*m_pLastRequest;
+	volatile boolean	 m_bActive;		// a request is being transferred
+	struct TUSBEndpoint	*m_pNextPending;	// list of endpoints with waiting requests
+	unsigned		 m_nStartSplitMicroframe; // reserved in the TT or USB_TT_NO_MICROFRAME
+	unsigned		 m_nNextFrame;		// isochronous: (micro)frame of the next packet
 }
 TUSBEndpoint;
 
@@ -63,12 +78,38 @@ boolean USBEndpointIsDirectionIn (TUSBEndpoint *pThis);
 void USBEndpointSetMaxPacketSize (TUSBEndpoint *pThis, u32 nMaxPacketSize);
 u32 USBEndpointGetMaxPacketSize (TUSBEndpoint *pThis);
 
-unsigned USBEndpointGetInterval (TUSBEndpoint *pThis);		// Milliseconds
+// number of transactions per microframe of a high-speed periodic endpoint, 1 otherwise
+unsigned USBEndpointGetPacketsPerMicroframe (TUSBEndpoint *pThis);
+
+unsigned USBEndpointGetInterval (TUSBEndpoint *pThis);		// Milliseconds (full-speed isochronous: frames)
+unsigned USBEndpointGetIntervalMicroframes (TUSBEndpoint *pThis);
 
 TUSBPID USBEndpointGetNextPID (TUSBEndpoint *pThis, boolean bStatusStage);
 void USBEndpointSkipPID (TUSBEndpoint *pThis, unsigned nPackets, boolean bStatusStage);
 void USBEndpointResetPID (TUSBEndpoint *pThis);
 
+// request queue (must be called with interrupts disabled)
+void USBEndpointEnqueueRequest (TUSBEndpoint *pThis, struct TUSBRequest *pURB);
+struct TUSBRequest *USBEndpointDequeueRequest (TUSBEndpoint *pThis);	// returns 0 if empty
+boolean USBEndpointRemoveRequest (TUSBEndpoint *pThis, struct TUSBRequest *pURB);	// FALSE if not queued
+boolean USBEndpointHasQueuedRequests (TUSBEndpoint *pThis);
+
+void USBEndpointSetActive (TUSBEndpoint *pThis, boolean bActive);
+boolean USBEndpointIsActive (TUSBEndpoint *pThis);
+
+void USBEndpointSetNextPending (TUSBEndpoint *pThis, TUSBEndpoint *pEndpoint);
+TUSBEndpoint *USBEndpointGetNextPending (TUSBEndpoint *pThis);
+
+// reserves the bus time of a periodic endpoint, which is accessed using split transactions,
+// in the transaction translator of the hub, returns TRUE if reserved before or not required
+boolean USBEndpointReserveBandwidth (TUSBEndpoint *pThis);
+unsigned USBEndpointGetStartSplitMicroframe (TUSBEndpoint *pThis);	// or USB_TT_NO_MICROFRAME
+
+// (micro)frame number, in which the next request of an isochronous stream continues,
+// USB_ENDPOINT_NO_FRAME if the stream has been interrupted
+void USBEndpointSetNextFrame (TUSBEndpoint *pThis, unsigned nFrame);
+unsigned USBEndpointGetNextFrame (TUSBEndpoint *pThis);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56,6 +56,12 @@ typedef struct TUSBKeyboardDevice
 	TKeyMap m_KeyMap;
 
 	u8 m_ucLastLEDStatus;
+
+	TUSBRequest m_LEDURB;			// SET_REPORT is sent asynchronously
+	TSetupData *m_pLEDSetupData;		// DMA buffers
+	u8 *m_pLEDBuffer;
+	volatile boolean m_bLEDRequestActive;
+	volatile int m_nLEDMaskPending;		// -1 if nothing to send
 }
 TUSBKeyboardDevice;
 
@@ -0,0 +1,110 @@
+//
+// usbmasscache.h
+//
+// Read cache for USB mass storage devices (LRU, with asynchronous read-ahead for sequential streams)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspi_usbmasscache_h
+#define _uspi_usbmasscache_h
+
+#include <uspi/usbmassdevice.h>
+#include <uspi/types.h>
+#include <uspi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UMSC_PAGE_SIZE		4096		// min. size of a cache page (the block size, if larger)
+#define UMSC_MIN_PAGES		16		// the cache must hold at least this number of pages
+#define UMSC_MIN_READ_AHEAD	4		// pages, first read-ahead of a sequential stream
+#define UMSC_MAX_READ_AHEAD	64		// pages, the read-ahead doubles up to this size
+
+typedef struct TUSBMassStorageCachePage
+{
+	unsigned long long ullPage;		// offset / page size
+	boolean		   bValid;
+	boolean		   bPrefetched;		// read ahead and not used yet
+	boolean		   bPending;		// read ahead is active, pData is not valid yet
+	u8		  *pData;
+	struct TUSBMassStorageCachePage *pHashNext;
+	struct TUSBMassStorageCachePage *pPrev;	// LRU list, the most recently used page first
+	struct TUSBMassStorageCachePage *pNext;
+}
+TUSBMassStorageCachePage;
+
+typedef struct TUSBMassStorageCache
+{
+	TUSBBulkOnlyMassStorageDevice *m_pDevice;
+
+	unsigned m_nPageSize;
+	unsigned m_nPageShift;
+	unsigned long long m_ullDevicePages;		// complete pages on the device
+
+	unsigned m_nPages;
+	TUSBMassStorageCachePage *m_pPage;		// [m_nPages]
+	TUSBMassStorageCachePage m_LRU;			// list head
+	TUSBMassStorageCachePage **m_ppHash;		// [m_nHashMask+1]
+	unsigned m_nHashMask;
+
+	void *m_pMemory;				// page data and read buffers
+	u8 *m_pReadBuffer;				// suitable for DMA
+	u8 *m_pPrefetchBuffer;				// for the asynchronous read-ahead
+	unsigned m_nMaxRead;				// pages per read-ahead and per cached request
+
+	unsigned long long m_ullNextOffset;		// after the previous request
+	boolean m_bSequential;				// the previous request continued a stream
+	unsigned m_nReadAhead;				// pages
+
+	// one read-ahead is queued to the device at a time, its pages are pending until the
+	// completion is collected in task context (before the pages are modified otherwise)
+	unsigned long long m_ullPrefetchPage;		// first page
+	unsigned m_nPrefetchPages;			// 0 if no read-ahead is active
+	volatile int m_bPrefetchDone;			// set by the completion routine
+	volatile int m_nPrefetchResult;
+
+	TUSPiCacheStatistics m_Statistics;
+}
+TUSBMassStorageCache;
+
+// the page data and a read buffer are allocated from nSize bytes,
+// returns FALSE if the memory is not available or too small
+boolean USBMassStorageCache (TUSBMassStorageCache *pThis, TUSBBulkOnlyMassStorageDevice *pDevice,
+			     unsigned nSize);
+void _USBMassStorageCache (TUSBMassStorageCache *pThis);
+
+// returns number of read bytes or < 0 on failure
+int USBMassStorageCacheRead (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+			     void *pBuffer, unsigned nCount);
+
+// the data is written to the device immediately (write-through) and updated in the cache,
+// returns number of written bytes or < 0 on failure
+int USBMassStorageCacheWrite (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+			      const void *pBuffer, unsigned nCount);
+
+// removes the pages of this range from the cache (e.g. before an asynchronous write)
+void USBMassStorageCacheInvalidate (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+				    unsigned nCount);
+
+void USBMassStorageCacheGetStatistics (TUSBMassStorageCache *pThis, TUSPiCacheStatistics *pStatistics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
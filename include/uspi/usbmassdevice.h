@@ -22,17 +22,97 @@
 
 #include <uspi/usbfunction.h>
 #include <uspi/usbendpoint.h>
+#include <uspi/usbrequest.h>
+#include <uspi/synchronize.h>
+#include <uspi/macros.h>
 #include <uspi/types.h>
+#include <uspios.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define UMSD_BLOCK_SIZE		512
-#define UMSD_BLOCK_MASK		(UMSD_BLOCK_SIZE-1)
-#define UMSD_BLOCK_SHIFT	9
+#define UMSD_BLOCK_SIZE		512				// min. logical block size
+#define UMSD_MAX_BLOCK_SIZE	65536
 
-#define UMSD_MAX_OFFSET		0x1FFFFFFFFFFULL		// 2TB
+// max. data size of one command: larger requests are split, because larger commands do not
+// improve the throughput, but delay other requests to the device longer
+#define UMSD_MAX_TRANSFER_SIZE	0x100000
+
+#define UMSD_ASYNC_QUEUE_SIZE	16				// must be a power of 2
+#define UMSD_CBW_SIZE		31
+#define UMSD_CSW_SIZE		13
+#define UMSD_CSW_BUFFER_SIZE	((UMSD_CSW_SIZE + DMA_ALIGNMENT-1) & ~(DMA_ALIGNMENT-1))
+
+// nResult is the number of transferred bytes or < 0 on failure
+typedef void TUSBMassStorageCompletionRoutine (int nResult, void *pParam);
+
+typedef enum
+{
+	UMSDWriteFUA,					// every write is forced to the media (default)
+	UMSDWriteThrough,				// every write is followed by SYNCHRONIZE CACHE
+	UMSDWriteBack,					// cached until USBBulkOnlyMassStorageDeviceFlush()
+	UMSDWritePolicyUnknown
+}
+TUSBMassStorageWritePolicy;
+
+typedef enum
+{
+	UMSDOpRead,
+	UMSDOpWrite,
+	UMSDOpFlush					// SYNCHRONIZE CACHE
+}
+TUSBMassStorageOp;
+
+typedef struct TUSBMassStorageCommand		// queued asynchronous read, write or flush
+{
+	TUSBMassStorageOp  Op;
+	boolean		   bFlush;			// write is followed by a flush
+	unsigned long long ullOffset;
+	void		  *pBuffer;
+	unsigned	   nCount;
+	unsigned	   nDone;			// bytes transferred by previous commands
+	unsigned	   nChunk;			// bytes of the current command
+	unsigned	   nTries;
+	TUSBMassStorageCompletionRoutine *pRoutine;
+	void		  *pParam;
+#ifdef USPI_DEFER_COMPLETION
+	volatile boolean   bRoutinePending;		// the slot is in use until pRoutine is called
+	int		   nResult;
+	TUSBRequest	   CompletionURB;		// passes pRoutine to DWHCIDeviceProcessCompletions()
+#endif
+}
+TUSBMassStorageCommand;
+
+typedef struct TUSBMassStorageAsyncData		// allocated separately, aligned to DMA_ALIGNMENT
+{
+	// DMA buffers, each in its own cache lines, so that it is not bounced
+	TSetupData Setup ALIGN (DMA_ALIGNMENT);
+	u8	   CBW[UMSD_CBW_SIZE] ALIGN (DMA_ALIGNMENT);
+	u8	   CSW[UMSD_CSW_BUFFER_SIZE] ALIGN (DMA_ALIGNMENT);	// requested with this size
+
+	TUSBMassStorageCommand Queue[UMSD_ASYNC_QUEUE_SIZE];
+
+	void	  *pBlock;				// from malloc()
+#ifdef USPI_DEFER_COMPLETION
+	// the device has been removed, while completion routines were still pending,
+	// the last of them frees the block
+	volatile boolean bOrphaned;
+#endif
+}
+TUSBMassStorageAsyncData;
+
+typedef enum
+{
+	UMSDAsyncIdle,
+	UMSDAsyncCBW,
+	UMSDAsyncData,
+	UMSDAsyncCSW,
+	UMSDAsyncReset,					// reset recovery after a failed command
+	UMSDAsyncClearHaltIn,
+	UMSDAsyncClearHaltOut
+}
+TUSBMassStorageAsyncState;
 
 typedef struct TUSBBulkOnlyMassStorageDevice
 {
@@ -42,8 +122,24 @@ typedef struct TUSBBulkOnlyMassStorageDevice
 	TUSBEndpoint *m_pEndpointOut;
 
 	unsigned m_nCWBTag;
-	unsigned m_nBlockCount;
+	unsigned long long m_ullBlockCount;
+	unsigned m_nBlockSize;				// logical block size (power of 2)
+	unsigned m_nBlockShift;
+	unsigned m_nMaxTransfer;			// bytes per command
 	unsigned long long m_ullOffset;
+	TUSBMassStorageWritePolicy m_WritePolicy;
+
+	// asynchronous commands, which are chained from the completion routine
+	TUSBMassStorageAsyncData *m_pAsync;		// queue and DMA buffers
+	volatile unsigned m_nAsyncIn;			// modified in task context only
+	volatile unsigned m_nAsyncOut;			// modified by the completion routine only
+	volatile int m_bAsyncIdle;			// no command active
+	volatile boolean m_bAsyncShutdown;		// device is removed, fail all commands
+	boolean m_bAsyncStarting;			// started from ...DeviceQueue() with IRQs disabled
+	boolean m_bAsyncStartCompleted;			// the command completed immediately,
+	int m_nAsyncStartResult;			// its routine is called from ...DeviceQueue()
+	TUSBMassStorageAsyncState m_AsyncState;
+	TUSBRequest m_AsyncURB;
 }
 TUSBBulkOnlyMassStorageDevice;
 
@@ -55,9 +151,41 @@ boolean USBBulkOnlyMassStorageDeviceConfigure (TUSBFunction *pUSBFunction);
 int USBBulkOnlyMassStorageDeviceRead (TUSBBulkOnlyMassStorageDevice *pThis, void *pBuffer, unsigned nCount);
 int USBBulkOnlyMassStorageDeviceWrite (TUSBBulkOnlyMassStorageDevice *pThis, const void *pBuffer, unsigned nCount);
 
+// queue a read or write, which is executed after the previously queued commands, the buffer must
+// remain valid until pRoutine is called (from interrupt context or from DWHCIDeviceProcessCompletions()
+// with USPI_DEFER_COMPLETION), returns FALSE if the queue is full or the parameters are invalid,
+// synchronous calls wait until the queue is empty
+boolean USBBulkOnlyMassStorageDeviceReadAsync (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset,
+					       void *pBuffer, unsigned nCount,
+					       TUSBMassStorageCompletionRoutine *pRoutine, void *pParam);
+boolean USBBulkOnlyMassStorageDeviceWriteAsync (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset,
+						const void *pBuffer, unsigned nCount,
+						TUSBMassStorageCompletionRoutine *pRoutine, void *pParam);
+
+// queue a flush of the write cache of the device, nResult is 0 on success, with the FUA write
+// policy nothing is cached and pRoutine is called before this returns (with IRQs enabled again),
+// or from DWHCIDeviceProcessCompletions() with USPI_DEFER_COMPLETION
+boolean USBBulkOnlyMassStorageDeviceFlushAsync (TUSBBulkOnlyMassStorageDevice *pThis,
+						TUSBMassStorageCompletionRoutine *pRoutine, void *pParam);
+
+// waits until all queued commands have been completed, with USPI_DEFER_COMPLETION
+// their completion routines may not have been called yet
+void USBBulkOnlyMassStorageDeviceWaitAsync (TUSBBulkOnlyMassStorageDevice *pThis);
+
+// writes the write cache of the device to the media, returns 0 on success or < 0 on failure
+int USBBulkOnlyMassStorageDeviceFlush (TUSBBulkOnlyMassStorageDevice *pThis);
+
+// the cache is flushed before the policy is changed, returns FALSE if the device does not
+// support SYNCHRONIZE CACHE and a policy other than UMSDWriteFUA is requested
+boolean USBBulkOnlyMassStorageDeviceSetWritePolicy (TUSBBulkOnlyMassStorageDevice *pThis,
+						    TUSBMassStorageWritePolicy Policy);
+
 unsigned long long USBBulkOnlyMassStorageDeviceSeek (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset);
 
-unsigned USBBulkOnlyMassStorageDeviceGetCapacity (TUSBBulkOnlyMassStorageDevice *pThis);
+// returns the number of logical blocks
+unsigned long long USBBulkOnlyMassStorageDeviceGetCapacity (TUSBBulkOnlyMassStorageDevice *pThis);
+
+unsigned USBBulkOnlyMassStorageDeviceGetBlockSize (TUSBBulkOnlyMassStorageDevice *pThis);
 
 #ifdef __cplusplus
 }
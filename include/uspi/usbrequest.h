@@ -30,6 +30,33 @@ extern "C" {
 
 struct TUSBRequest;
 
+typedef enum
+{
+	USBErrorNone,
+	USBErrorStall,
+	USBErrorTransaction,
+	USBErrorBabble,
+	USBErrorFrameOverrun,
+	USBErrorDataToggle,
+	USBErrorHostBus,
+	USBErrorSplit,
+	USBErrorTimeout,
+	USBErrorCancelled,
+	USBErrorBandwidth,			// periodic bandwidth of the TT exhausted
+	USBErrorBuffer,				// isochronous buffer too large to bounce or invalid packet
+	USBErrorUnknown
+}
+TUSBError;
+
+typedef struct TUSBIsoPacket		// packet descriptor of an isochronous request
+{
+	u32		nOffset;		// in the buffer of the request, must be a multiple of 4
+	u32		nLength;		// max. packet size * packets per microframe at most
+	u32		nActualLength;		// set on completion
+	TUSBError	Error;			// set on completion
+}
+TUSBIsoPacket;
+
 typedef void TURBCompletionRoutine (struct TUSBRequest *pURB, void *pParam, void *pContext);
 
 typedef struct TUSBRequest		// URB
@@ -42,10 +69,26 @@ typedef struct TUSBRequest		// URB
 	
 	int	    m_bStatus;
 	u32	    m_nResultLen;
+	TUSBError   m_USBError;			// reason, if m_bStatus == 0
+
+	unsigned    m_nTimeoutMs;			// 0: no timeout
+
+	TUSBIsoPacket *m_pIsoPackets;			// isochronous request only
+	unsigned    m_nIsoPackets;
+	unsigned    m_nStartFrame;			// (micro)frame number of the first packet
 	
 	TURBCompletionRoutine *m_pCompletionRoutine;
 	void *m_pCompletionParam;
 	void *m_pCompletionContext;
+	boolean m_bCompleteAtIRQ;		// not deferred with USPI_DEFER_COMPLETION
+
+	// used by the host controller driver
+	boolean m_bStageIn;			// parameters of the stage to be transferred
+	boolean m_bStatusStage;
+	unsigned m_nControlStage;		// 0: SETUP, 1: DATA or STATUS, 2: STATUS
+	unsigned m_hTimeoutTimer;		// kernel timer handle or 0
+	u32 m_nSubmitTime;			// system timer (microseconds), for the statistics
+	struct TUSBRequest *m_pNext;		// in the request queue of the endpoint or the completion queue
 }
 TUSBRequest;
 
@@ -60,6 +103,30 @@ void USBRequestSetResultLen (TUSBRequest *pThis, u32 nLength);
 int USBRequestGetStatus (TUSBRequest *pThis);
 u32 USBRequestGetResultLength (TUSBRequest *pThis);
 
+void USBRequestSetUSBError (TUSBRequest *pThis, TUSBError Error);
+TUSBError USBRequestGetUSBError (TUSBRequest *pThis);
+
+// the request completes with status 0 and USBErrorTimeout, if it is not completed in time,
+// the time starts, when the request is submitted (set this before)
+void USBRequestSetTimeout (TUSBRequest *pThis, unsigned nMilliSeconds);	// 0: no timeout (default)
+unsigned USBRequestGetTimeout (TUSBRequest *pThis);
+
+// the completion routine is called with status 0 and USBErrorCancelled, if the request was
+// submitted and not completed yet, returns FALSE otherwise (can be called from interrupt context)
+boolean USBRequestCancel (TUSBRequest *pThis);
+
+// an isochronous request transfers one packet per interval of the endpoint, it continues
+// without a gap after the previous request of the endpoint, if submitted in time (otherwise
+// starts as soon as possible), the request completes with status 1 and the sum of the actual
+// lengths, packets, which could not be transferred, have an error set in their descriptor
+void USBRequestSetIsoPackets (TUSBRequest *pThis, TUSBIsoPacket *pPackets, unsigned nPackets);
+unsigned USBRequestGetIsoPacketCount (TUSBRequest *pThis);
+TUSBIsoPacket *USBRequestGetIsoPacket (TUSBRequest *pThis, unsigned nPacket);
+
+// set by the host controller driver, when the first packet has been scheduled
+void USBRequestSetStartFrame (TUSBRequest *pThis, unsigned nFrame);
+unsigned USBRequestGetStartFrame (TUSBRequest *pThis);
+
 TSetupData *USBRequestGetSetupData (TUSBRequest *pThis);
 void *USBRequestGetBuffer (TUSBRequest *pThis);
 u32 USBRequestGetBufLen (TUSBRequest *pThis);
@@ -67,6 +134,24 @@ u32 USBRequestGetBufLen (TUSBRequest *pThis);
 void USBRequestSetCompletionRoutine (TUSBRequest *pThis, TURBCompletionRoutine *pRoutine, void *pParam, void *pContext);
 void USBRequestCallCompletionRoutine (TUSBRequest *pThis);
 
+// the completion routine is called at interrupt level even with USPI_DEFER_COMPLETION,
+// for requests of a driver, which are not reported to the application directly
+void USBRequestSetCompleteAtIRQ (TUSBRequest *pThis, boolean bAtIRQ);
+boolean USBRequestIsCompleteAtIRQ (TUSBRequest *pThis);
+
+void USBRequestSetStage (TUSBRequest *pThis, boolean bIn, boolean bStatusStage);
+boolean USBRequestIsStageIn (TUSBRequest *pThis);
+boolean USBRequestIsStatusStage (TUSBRequest *pThis);
+
+void USBRequestSetControlStage (TUSBRequest *pThis, unsigned nStage);
+unsigned USBRequestGetControlStage (TUSBRequest *pThis);
+
+void USBRequestSetTimeoutTimer (TUSBRequest *pThis, unsigned hTimer);
+unsigned USBRequestGetTimeoutTimer (TUSBRequest *pThis);
+
+void USBRequestSetSubmitTime (TUSBRequest *pThis, u32 nTime);
+u32 USBRequestGetSubmitTime (TUSBRequest *pThis);
+
 #ifdef __cplusplus
 }
 #endif
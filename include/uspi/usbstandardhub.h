@@ -24,6 +24,7 @@
 #include <uspi/usbhub.h>
 #include <uspi/usbfunction.h>
 #include <uspi/usbhostcontroller.h>
+#include <uspi/usbtranslator.h>
 #include <uspi/string.h>
 #include <uspi/types.h>
 
@@ -40,6 +41,9 @@ typedef struct TUSBStandardHub
 	unsigned m_nPorts;
 	TUSBDevice *m_pDevice[USB_HUB_MAX_PORTS];
 	TUSBPortStatus *m_pStatus[USB_HUB_MAX_PORTS];
+
+	boolean m_bMultiTT;				// one TT per port
+	TUSBTransactionTranslator *m_pTT[USB_HUB_MAX_PORTS];	// [0] only for single TT
 }
 TUSBStandardHub;
 
@@ -0,0 +1,65 @@
+//
+// usbtranslator.h
+//
+// Periodic bandwidth budget of a transaction translator (TT) in a high-speed hub
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspi_usbtranslator_h
+#define _uspi_usbtranslator_h
+
+#include <uspi/usb.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_TT_MICROFRAMES		8
+#define USB_TT_NO_MICROFRAME		USB_TT_MICROFRAMES	// no start split reserved
+
+// The budget is kept per microframe, in which the start split of a periodic transaction is
+// issued (the full-/low-speed transaction follows in the next microframe). Microframe 6 is
+// never used, because the complete splits would not fit into the frame.
+typedef struct TUSBTransactionTranslator
+{
+	u8	 m_ucHubAddress;
+	u8	 m_ucHubPortNumber;			// 0 for the single TT of a hub
+
+	unsigned m_nBusTime[USB_TT_MICROFRAMES];	// full-speed byte times reserved
+	unsigned m_nTotalBusTime;			// reserved in the whole frame
+}
+TUSBTransactionTranslator;
+
+void USBTransactionTranslator (TUSBTransactionTranslator *pThis, u8 ucHubAddress, u8 ucHubPortNumber);
+void _USBTransactionTranslator (TUSBTransactionTranslator *pThis);
+
+// reserves the bus time of one periodic transaction per frame, returns the microframe,
+// in which its start split has to be issued, or USB_TT_NO_MICROFRAME if the TT is full
+unsigned USBTransactionTranslatorReserve (TUSBTransactionTranslator *pThis,
+					  TUSBSpeed Speed, u32 nMaxPacketSize);
+void USBTransactionTranslatorRelease (TUSBTransactionTranslator *pThis, unsigned nMicroframe,
+				      TUSBSpeed Speed, u32 nMaxPacketSize);
+
+u8 USBTransactionTranslatorGetHubAddress (TUSBTransactionTranslator *pThis);
+u8 USBTransactionTranslatorGetHubPortNumber (TUSBTransactionTranslator *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
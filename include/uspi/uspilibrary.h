@@ -26,6 +26,7 @@
 #include <uspi/usbmouse.h>
 #include <uspi/usbgamepad.h>
 #include <uspi/usbmassdevice.h>
+#include <uspi/usbmasscache.h>
 #include <uspi/usbmidi.h>
 #include <uspi/smsc951x.h>
 #include <uspi/lan7800.h>
@@ -43,6 +44,7 @@ typedef struct TUSPiLibrary
 	TUSBKeyboardDevice		*pUKBD1;
 	TUSBMouseDevice			*pUMouse1;
 	TUSBBulkOnlyMassStorageDevice	*pUMSD[MAX_DEVICES];
+	TUSBMassStorageCache		*pUMSDCache[MAX_DEVICES];	// or 0
 	TSMSC951xDevice			*pEth0;
 	TLAN7800Device			*pEth10;
 	TUSBGamePadDevice       	*pUPAD[MAX_DEVICES];
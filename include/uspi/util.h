@@ -63,6 +63,8 @@ u16 uspi_le2be16 (u16 usValue);
 
 u32 uspi_le2be32 (u32 ulValue);
 
+u64 uspi_le2be64 (u64 ullValue);
+
 #ifdef __cplusplus
 }
 #endif
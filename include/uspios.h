@@ -44,15 +44,58 @@ extern "C" {
 //#define USPI_DEFAULT_KEYMAP_US
 
 // Undefine this if you want to use your own implementation of the functions in uspi/util.h
+#ifndef USPI_HOSTSIM
 #define USPI_PROVIDE_MEM_FUNCTIONS	// mem*()
 #define USPI_PROVIDE_STR_FUNCTIONS	// str*()
+#endif
+
+// Define this if the registers of the USB host controller should not be accessed directly,
+// but using MMIORead() and MMIOWrite() (see below). This is defined automatically, when the
+// library is built for the host simulation (make HOSTSIM=1, see sim/README).
+//#define USPI_MMIO_BACKEND
+
+// Define this if a task, which issues a blocking USB request, should not wait with WFI for its
+// completion, but using WaitForCompletion() and SignalCompletion() (see below). This allows
+// a scheduler to run other tasks, while the request is active.
+//#define USPI_WAIT_HOOK
+
+// Define this if the USB interrupt should be handled as FIQ (see ConnectFIQ() below). All
+// transactions, including the start and complete splits to full- and low-speed devices behind
+// a hub, are processed at FIQ level then. A normal IRQ is triggered (see TriggerSoftInterrupt())
+// only to call the completion routines of the requests.
+//#define USPI_USE_FIQ
+
+// Define this if the completion routines of asynchronous USB requests (e.g. keyboard, mouse,
+// gamepad and MIDI reports) should not be called from the USB IRQ handler, but from
+// USPiProcessCompletions() (see uspi.h), which the application has to call frequently from
+// task context then. This keeps the IRQ handler short. Cannot be used with USPI_USE_FIQ.
+//#define USPI_DEFER_COMPLETION
+
+// Define this to record the events of the transfer state machine of the USB host controller
+// driver (channel start, split transactions, halt interrupts, request completion) with a time
+// stamp in a ring buffer. It can be read with USPiTraceDump() (see uspi.h) and decoded with
+// the program sim/trace/uspitrace on the development host. The size of the ring buffer
+// (number of events, 16 bytes each) can be set with USPI_TRACE_EVENTS.
+//#define USPI_TRACE
+//#define USPI_TRACE_EVENTS	1024
+
+// Define this if the buffers of USB requests may be allocated from a memory region, which is
+// mapped non-cacheable (e.g. MEM_COHERENT_REGION of the USPi environment). No cache maintenance
+// is done for DMA buffers, which are completely located in this region. The values are the ARM
+// physical start address and the size of the region.
+//#define USPI_DMA_COHERENT_REGION	0x400000
+//#define USPI_DMA_COHERENT_SIZE	0x100000
 
 //
 // Memory allocation
 //
 // (Must work from interrupt context)
 //
+#ifndef USPI_HOSTSIM
 void *malloc (unsigned nSize);		// result must be 4-byte aligned
+#else
+void *malloc (unsigned long nSize);	// from the C library of the host
+#endif
 void free (void *pBlock);
 
 //
@@ -84,6 +127,38 @@ typedef void TInterruptHandler (void *pParam);
 // USPi uses USB IRQ 9
 void ConnectInterrupt (unsigned nIRQ, TInterruptHandler *pHandler, void *pParam);
 
+//
+// Fast interrupt handling (only used if USPI_USE_FIQ is defined)
+//
+// LogWrite() must work from FIQ context then.
+//
+#ifdef USPI_USE_FIQ
+
+// USPi uses USB IRQ 9 as FIQ, the handler is called with IRQ and FIQ disabled
+void ConnectFIQ (unsigned nIRQ, TInterruptHandler *pHandler, void *pParam);
+
+// the handler is called at IRQ level, after TriggerSoftInterrupt() has been called
+void ConnectSoftInterrupt (TInterruptHandler *pHandler, void *pParam);
+
+// called from FIQ or task context, the pending soft interrupt must terminate WFI
+void TriggerSoftInterrupt (void);
+
+#endif
+
+//
+// Waiting for the completion of a blocking request (only used if USPI_WAIT_HOOK is defined)
+//
+#ifdef USPI_WAIT_HOOK
+
+// called in task context, should return when *pCompleted != 0 (may return earlier, it will
+// be called again then), other tasks may run in the meantime
+void WaitForCompletion (volatile int *pCompleted);
+
+// called from interrupt context, after *pCompleted has been set to 1
+void SignalCompletion (volatile int *pCompleted);
+
+#endif
+
 //
 // Property tags (ARM -> VC)
 //
@@ -110,6 +185,43 @@ void LogWrite (const char *pSource,		// short name of module
 	       unsigned	   Severity,		// see above
 	       const char *pMessage, ...);	// uses printf format options
 
+//
+// Register access (only used if USPI_MMIO_BACKEND is defined)
+//
+// nAddress is the ARM physical address of the register (see uspi/dwhci.h), the counter of the
+// system timer (ARM_SYSTIMER_CLO in uspi/bcm2835.h) is read this way too
+//
+#ifdef USPI_MMIO_BACKEND
+
+unsigned MMIORead (unsigned long nAddress);
+void MMIOWrite (unsigned long nAddress, unsigned nValue);
+
+#endif
+
+//
+// Host simulation support (only if the library is built with HOSTSIM=1)
+//
+#ifdef USPI_HOSTSIM
+
+void SimDisableInterrupts (void);		// replaces "cpsid i"
+void SimEnableInterrupts (void);		// replaces "cpsie i"
+int SimInterruptsEnabled (void);		// returns 0 if interrupts are disabled
+
+void SimIdle (void);				// waits for an interrupt (like WFI)
+
+// cache maintenance, which would be required on a Raspberry Pi (is only counted)
+#define SIM_CACHE_CLEAN		1
+#define SIM_CACHE_INVALIDATE	2
+void SimCacheMaintenance (unsigned long nAddress, unsigned long nLength, int nOperation);
+
+#ifdef USPI_USE_FIQ
+void SimDisableFIQ (void);			// replaces "cpsid f"
+void SimEnableFIQ (void);			// replaces "cpsie f"
+int SimFIQEnabled (void);			// returns 0 if FIQ is disabled
+#endif
+
+#endif
+
 //
 // Debug support
 //
@@ -3,7 +3,8 @@
 //
 // Supports:
 //	internal DMA only,
-//	no ISO transfers
+//	ISO transfers (asynchronous requests only, one packet per interval,
+//		       no split transfers to full-/low-speed devices behind a hub)
 //	no dynamic attachments
 //
 // USPi - An USB driver for Raspberry Pi written in C
@@ -26,10 +27,12 @@
 #include <uspios.h>
 #include <uspi/bcm2835.h>
 #include <uspi/synchronize.h>
+#include <uspi/trace.h>
 #include <uspi/macros.h>
+#include <uspi/util.h>
 #include <uspi/assert.h>
 
-#define ARM_IRQ_USB		9		// for ConnectInterrupt()
+#define ARM_IRQ_USB		9		// for ConnectInterrupt() or ConnectFIQ()
 
 #define DEVICE_ID_USB_HCD	3		// for SetPowerStateOn()
 
@@ -41,7 +44,10 @@
 	#define DWC_CFG_HOST_NPER_TX_FIFO_SIZE	1024	// number of 32 bit words
 	#define DWC_CFG_HOST_PER_TX_FIFO_SIZE	1024	// number of 32 bit words
 
-#define MSEC2HZ(msec)		((msec) * HZ / 1000)
+#define DWC_CFG_PERIODIC_CHANNELS	1		// reserved for interrupt/isochronous transfers
+
+#define USB_CONTROL_TIMEOUT	5000			// ms, default for control messages
+#define ISO_START_DELAY		2			// (micro)frames, before a new isochronous stream starts
 
 typedef enum
 {
@@ -49,6 +55,7 @@ typedef enum
 	StageStateStartSplit,
 	StageStateCompleteSplit,
 	StageStatePeriodicDelay,
+	StageStateIsochronous,
 	StageStateUnknown
 }
 TStageState;
@@ -57,6 +64,7 @@ typedef enum
 {
 	StageSubStateWaitForChannelDisable,
 	StageSubStateWaitForTransactionComplete,
+	StageSubStateWaitForFrame,
 	StageSubStateUnknown
 }
 TStageSubState;
@@ -74,15 +82,49 @@ void DWHCIDeviceEnableChannelInterrupt (TDWHCIDevice *pThis, unsigned nChannel);
 void DWHCIDeviceDisableChannelInterrupt (TDWHCIDevice *pThis, unsigned nChannel);
 void DWHCIDeviceFlushTxFIFO (TDWHCIDevice *pThis, unsigned nFIFO);
 void DWHCIDeviceFlushRxFIFO (TDWHCIDevice *pThis);
-boolean DWHCIDeviceTransferStage (TDWHCIDevice *pThis, TUSBRequest *pURB, boolean bIn, boolean bStatusStage);
+boolean DWHCIDeviceSetControlStage (TDWHCIDevice *pThis, TUSBRequest *pURB, unsigned nStage);
 void DWHCIDeviceCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext);
 boolean DWHCIDeviceTransferStageAsync (TDWHCIDevice *pThis, TUSBRequest *pURB, boolean bIn, boolean bStatusStage);
+boolean DWHCIDeviceCheckIsoPackets (TUSBRequest *pURB);
+boolean DWHCIDeviceStartStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBRequest *pURB);
+void DWHCIDeviceFinishStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBRequest *pURB);
+void DWHCIDeviceStartPendingStages (TDWHCIDevice *pThis);
+void DWHCIDeviceRemovePendingEndpoint (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint);
+void DWHCIDeviceCompleteRequest (TDWHCIDevice *pThis, TUSBRequest *pURB);
+void DWHCIDeviceCallCompletionRoutine (TDWHCIDevice *pThis, TUSBRequest *pURB);
+boolean DWHCIDeviceAbortRequest (TDWHCIDevice *pThis, TUSBRequest *pURB, TUSBError Error);
+void DWHCIDeviceFinishAbortedStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBError Error);
+boolean DWHCIDeviceHaltChannel (TDWHCIDevice *pThis, unsigned nChannel);
+void DWHCIDeviceChannelHalted (TDWHCIDevice *pThis, unsigned nChannel);
 void DWHCIDeviceStartTransaction (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
 void DWHCIDeviceStartChannel (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
+void DWHCIDevicePrepareDMA (TDWHCITransferStageData *pStageData);
+void *DWHCIDeviceGetBounceBuffer (TDWHCIDevice *pThis, unsigned nChannel);
+void DWHCIDeviceCompleteDMA (TDWHCITransferStageData *pStageData);
 void DWHCIDeviceChannelInterruptHandler (TDWHCIDevice *pThis, unsigned nChannel);
 void DWHCIDeviceInterruptHandler (void *pParam);
-void DWHCIDeviceTimerHandler (TKernelTimerHandle hTimer, void *pParam, void *pContext);
-unsigned DWHCIDeviceAllocateChannel (TDWHCIDevice *pThis);
+#ifdef USPI_USE_FIQ
+void DWHCIDeviceSoftInterruptHandler (void *pParam);
+#endif
+void DWHCIDeviceSchedulePeriodic (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
+void DWHCIDeviceStartPeriodic (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
+void DWHCIDeviceWaitForFrame (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData, unsigned nDueFrame);
+void DWHCIDeviceStartIsochronous (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
+void DWHCIDeviceScheduleIsochronous (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData);
+unsigned DWHCIDeviceGetFrameNumber (TDWHCIDevice *pThis);
+unsigned DWHCIDeviceGetFrameInterval (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint);
+void DWHCIDeviceFrameHandler (TDWHCIDevice *pThis);
+void DWHCIDeviceEnableFrameInterrupt (TDWHCIDevice *pThis, boolean bEnable);
+void DWHCIDeviceTimeoutHandler (TKernelTimerHandle hTimer, void *pParam, void *pContext);
+TUSBError DWHCIDeviceGetUSBError (unsigned nStatus);
+
+u32 DWHCIDeviceGetTime (void);
+TUSPiEndpointStatistics *DWHCIDeviceGetEndpointStatistics (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint);
+void DWHCIDeviceCountTransaction (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData, u32 nStatus, u32 nBytes);
+void DWHCIDeviceCountStatus (TUSPiTransferCounters *pCounters, u32 nStatus, u32 nBytes, boolean bSplitRetry);
+void DWHCIDeviceCountRequest (TDWHCIDevice *pThis, TUSBRequest *pURB);
+TDWHCIChannelClass DWHCIDeviceGetChannelClass (TUSBEndpoint *pEndpoint);
+unsigned DWHCIDeviceAllocateChannel (TDWHCIDevice *pThis, TDWHCIChannelClass Class);
 void DWHCIDeviceFreeChannel (TDWHCIDevice *pThis, unsigned nChannel);
 boolean DWHCIDeviceWaitForBit (TDWHCIDevice *pThis, TDWHCIRegister *pRegister, u32 nMask,boolean bWaitUntilSet, unsigned nMsTimeout);
 #ifndef NDEBUG
@@ -96,13 +138,48 @@ void DWHCIDevice (TDWHCIDevice *pThis)
 
 	pThis->m_nChannels = 0;
 	pThis->m_nChannelAllocated = 0;
-	pThis->m_bWaiting = FALSE;
+	pThis->m_nChannelReserved = 0;
+
+	for (unsigned nClass = 0; nClass < DWHCIChannelClassUnknown; nClass++)
+	{
+		pThis->m_pFirstPending[nClass] = 0;
+		pThis->m_pLastPending[nClass] = 0;
+
+		memset (&pThis->m_ChannelStatistics[nClass], 0, sizeof (TDWHCIChannelStatistics));
+	}
+
+	pThis->m_pBounceBlock = 0;
+	pThis->m_pBounceBuffer = 0;
+	memset (&pThis->m_BounceStatistics, 0, sizeof (TDWHCIBounceStatistics));
+
+	memset (pThis->m_ChannelCounters, 0, sizeof pThis->m_ChannelCounters);
+	pThis->m_nEndpointStatistics = 0;
+	memset (pThis->m_EndpointStatisticsIndex, DWHCI_STAT_NO_ENTRY, sizeof pThis->m_EndpointStatisticsIndex);
+
+	pThis->m_pCapture = USBCaptureGet ();
+
+	pThis->m_nChannelAborted = 0;
+	pThis->m_nChannelHalting = 0;
+	pThis->m_nFrameWaiting = 0;
+#ifdef DWHCI_COMPLETION_QUEUE
+	pThis->m_nCompletedIn = 0;
+	pThis->m_nCompletedOut = 0;
+	pThis->m_pFirstOverflow = 0;
+	pThis->m_pLastOverflow = 0;
+#endif
 	DWHCIRootPort (&pThis->m_RootPort, pThis);
 }
 
 void _DWHCIDevice (TDWHCIDevice *pThis)
 {
 	_DWHCIRootPort (&pThis->m_RootPort);
+
+	if (pThis->m_pBounceBlock != 0)
+	{
+		free (pThis->m_pBounceBlock);
+		pThis->m_pBounceBlock = 0;
+		pThis->m_pBounceBuffer = 0;
+	}
 }
 
 boolean DWHCIDeviceInitialize (TDWHCIDevice *pThis)
@@ -134,7 +211,12 @@ boolean DWHCIDeviceInitialize (TDWHCIDevice *pThis)
 	DWHCIRegisterAnd (&AHBConfig, ~DWHCI_CORE_AHB_CFG_GLOBALINT_MASK);
 	DWHCIRegisterWrite (&AHBConfig);
 	
+#ifndef USPI_USE_FIQ
 	ConnectInterrupt (ARM_IRQ_USB, DWHCIDeviceInterruptHandler, pThis);
+#else
+	ConnectSoftInterrupt (DWHCIDeviceSoftInterruptHandler, pThis);
+	ConnectFIQ (ARM_IRQ_USB, DWHCIDeviceInterruptHandler, pThis);
+#endif
 
 	if (!DWHCIDeviceInitCore (pThis))
 	{
@@ -143,6 +225,19 @@ boolean DWHCIDeviceInitialize (TDWHCIDevice *pThis)
 		_DWHCIRegister (&VendorId);
 		return FALSE;
 	}
+
+	assert (pThis->m_pBounceBlock == 0);
+	pThis->m_pBounceBlock = malloc (pThis->m_nChannels * DWHCI_BOUNCE_BUFFER_SIZE + DMA_ALIGNMENT);
+	if (pThis->m_pBounceBlock == 0)
+	{
+		LogWrite (FromDWHCI, LOG_ERROR, "Cannot allocate bounce buffers");
+		_DWHCIRegister (&AHBConfig);
+		_DWHCIRegister (&VendorId);
+		return FALSE;
+	}
+
+	pThis->m_pBounceBuffer = (u8 *) (  ((uintptr) pThis->m_pBounceBlock + DMA_ALIGNMENT - 1)
+					 & ~(uintptr) (DMA_ALIGNMENT - 1));
 	
 	DWHCIDeviceEnableGlobalInterrupts (pThis);
 	
@@ -238,6 +333,7 @@ int DWHCIDeviceControlMessage (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint,
 
 	TUSBRequest URB;
 	USBRequest (&URB, pEndpoint, pData, usDataSize, &SetupData);
+	USBRequestSetTimeout (&URB, USB_CONTROL_TIMEOUT);
 
 	int nResult = -1;
 
@@ -274,63 +370,37 @@ boolean DWHCIDeviceSubmitBlockingRequest (TDWHCIDevice *pThis, TUSBRequest *pURB
 {
 	assert (pThis != 0);
 
-	DataMemBarrier ();
+	// each blocking request has its own completion flag,
+	// so that requests from different tasks can be active at the same time
+	volatile int bCompleted = 0;
 
 	assert (pURB != 0);
-	USBRequestSetStatus (pURB, 0);
-	
-	if (USBEndpointGetType (USBRequestGetEndpoint (pURB)) == EndpointTypeControl)
+	USBRequestSetCompletionRoutine (pURB, DWHCIDeviceCompletionRoutine, (void *) &bCompleted, pThis);
+
+	if (!DWHCIDeviceSubmitAsyncRequest (pThis, pURB))
 	{
-		TSetupData *pSetup = USBRequestGetSetupData (pURB);
-		assert (pSetup != 0);
+		return FALSE;
+	}
 
-		if (pSetup->bmRequestType & REQUEST_IN)
-		{
-			assert (USBRequestGetBufLen (pURB) > 0);
-			
-			if (   !DWHCIDeviceTransferStage (pThis, pURB, FALSE, FALSE)
-			    || !DWHCIDeviceTransferStage (pThis, pURB, TRUE,  FALSE)
-			    || !DWHCIDeviceTransferStage (pThis, pURB, FALSE, TRUE))
-			{
-				return FALSE;
-			}
-		}
-		else
-		{
-			if (USBRequestGetBufLen (pURB) == 0)
-			{
-				if (   !DWHCIDeviceTransferStage (pThis, pURB, FALSE, FALSE)
-				    || !DWHCIDeviceTransferStage (pThis, pURB, TRUE,  TRUE))
-				{
-					return FALSE;
-				}
-			}
-			else
-			{
-				if (   !DWHCIDeviceTransferStage (pThis, pURB, FALSE, FALSE)
-				    || !DWHCIDeviceTransferStage (pThis, pURB, FALSE, FALSE)
-				    || !DWHCIDeviceTransferStage (pThis, pURB, TRUE,  TRUE))
-				{
-					return FALSE;
-				}
-			}
-		}
+#ifdef USPI_WAIT_HOOK
+	while (!bCompleted)
+	{
+		WaitForCompletion (&bCompleted);
 	}
-	else
+#else
+	uspi_EnterCritical ();
+
+	while (!bCompleted)
 	{
-		assert (   USBEndpointGetType (USBRequestGetEndpoint (pURB)) == EndpointTypeBulk
-		        || USBEndpointGetType (USBRequestGetEndpoint (pURB)) == EndpointTypeInterrupt);
-		assert (USBRequestGetBufLen (pURB) > 0);
-		
-		if (!DWHCIDeviceTransferStage (pThis, pURB, USBEndpointIsDirectionIn (USBRequestGetEndpoint (pURB)), FALSE))
-		{
-			return FALSE;
-		}
+		uspi_WaitForInterrupt ();
 	}
-	
+
+	uspi_LeaveCritical ();
+#endif
+
 	DataMemBarrier ();
 
-	return TRUE;
+	return USBRequestGetStatus (pURB);
 }
 
 boolean DWHCIDeviceSubmitAsyncRequest (TDWHCIDevice *pThis, TUSBRequest *pURB)
@@ -340,19 +410,115 @@ boolean DWHCIDeviceSubmitAsyncRequest (TDWHCIDevice *pThis, TUSBRequest *pURB)
 	DataMemBarrier ();
 
 	assert (pURB != 0);
-	assert (   USBEndpointGetType (USBRequestGetEndpoint (pURB)) == EndpointTypeBulk
-		|| USBEndpointGetType (USBRequestGetEndpoint (pURB)) == EndpointTypeInterrupt);
-	assert (USBRequestGetBufLen (pURB) > 0);
-	
 	USBRequestSetStatus (pURB, 0);
-	
-	boolean bOK = DWHCIDeviceTransferStageAsync (pThis, pURB, USBEndpointIsDirectionIn (USBRequestGetEndpoint (pURB)), FALSE);
+	USBRequestSetUSBError (pURB, USBErrorNone);
+	USBRequestSetSubmitTime (pURB, DWHCIDeviceGetTime ());
+
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+
+	if (   USBEndpointGetType (pEndpoint) == EndpointTypeIsochronous
+	    && USBDeviceIsSplit (USBEndpointGetDevice (pEndpoint)))
+	{
+		LogWrite (FromDWHCI, LOG_ERROR, "Isochronous split transfers are not supported");
+
+		USBRequestSetUSBError (pURB, USBErrorSplit);
+
+		return FALSE;
+	}
+
+	if (   USBEndpointGetType (pEndpoint) == EndpointTypeIsochronous
+	    && !DWHCIDeviceCheckIsoPackets (pURB))
+	{
+		LogWrite (FromDWHCI, LOG_ERROR, "Invalid isochronous packet descriptor");
+
+		USBRequestSetUSBError (pURB, USBErrorBuffer);
+
+		return FALSE;
+	}
+
+	// the timeout must not elapse, before the request is known to the driver
+	uspi_EnterCritical ();
+
+	TRACE (TraceEventSubmit, USPI_TRACE_NO_CHANNEL,
+	         USBEndpointGetNumber (pEndpoint)
+	       | (USBEndpointIsDirectionIn (pEndpoint) ? 0x80 : 0),
+	       pURB, USBRequestGetBufLen (pURB));
+
+	if (!USBEndpointReserveBandwidth (pEndpoint))
+	{
+		USBRequestSetUSBError (pURB, USBErrorBandwidth);
+
+		if (USBCaptureIsActive (pThis->m_pCapture))
+		{
+			USBCaptureRequest (pThis->m_pCapture, pURB, USB_CAPTURE_ERROR,
+					   USBRequestGetSubmitTime (pURB));
+		}
+
+		uspi_LeaveCritical ();
+
+		LogWrite (FromDWHCI, LOG_ERROR, "Periodic bandwidth of TT exhausted");
+
+		return FALSE;
+	}
+
+	if (USBCaptureIsActive (pThis->m_pCapture))
+	{
+		USBCaptureRequest (pThis->m_pCapture, pURB, USB_CAPTURE_SUBMIT,
+				   USBRequestGetSubmitTime (pURB));
+	}
+
+	unsigned nTimeout = USBRequestGetTimeout (pURB);
+	if (nTimeout != 0)
+	{
+		unsigned nHzDelay = (nTimeout * HZ + 999) / 1000;
+
+		USBRequestSetTimeoutTimer (pURB, StartKernelTimer (nHzDelay, DWHCIDeviceTimeoutHandler,
+								   pURB, pThis));
+	}
+
+	boolean bOK;
+
+	if (USBEndpointGetType (pEndpoint) == EndpointTypeControl)
+	{
+		// the following stages are started from DWHCIDeviceFinishStage()
+		DWHCIDeviceSetControlStage (pThis, pURB, 0);
+
+		bOK = DWHCIDeviceTransferStageAsync (pThis, pURB, USBRequestIsStageIn (pURB),
+						     USBRequestIsStatusStage (pURB));
+	}
+	else
+	{
+		assert (   USBEndpointGetType (pEndpoint) == EndpointTypeBulk
+			|| USBEndpointGetType (pEndpoint) == EndpointTypeInterrupt
+			|| (   USBEndpointGetType (pEndpoint) == EndpointTypeIsochronous
+			    && USBRequestGetIsoPacketCount (pURB) > 0));
+		assert (USBRequestGetBufLen (pURB) > 0);
+
+		bOK = DWHCIDeviceTransferStageAsync (pThis, pURB, USBEndpointIsDirectionIn (pEndpoint), FALSE);
+	}
+
+	if (   !bOK
+	    && USBRequestGetTimeoutTimer (pURB) != 0)
+	{
+		CancelKernelTimer (USBRequestGetTimeoutTimer (pURB));
+		USBRequestSetTimeoutTimer (pURB, 0);
+	}
+
+	uspi_LeaveCritical ();
 
 	DataMemBarrier ();
 
 	return bOK;
 }
 
+boolean DWHCIDeviceCancelRequest (TDWHCIDevice *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+
+	return DWHCIDeviceAbortRequest (pThis, pURB, USBErrorCancelled);
+}
+
 boolean DWHCIDeviceInitCore (TDWHCIDevice *pThis)
 {
 	assert (pThis != 0);
@@ -399,6 +565,14 @@ boolean DWHCIDeviceInitCore (TDWHCIDevice *pThis)
 	pThis->m_nChannels = DWHCI_CORE_HW_CFG2_NUM_HOST_CHANNELS (DWHCIRegisterGet (&HWConfig2));
 	assert (4 <= pThis->m_nChannels && pThis->m_nChannels <= DWHCI_MAX_CHANNELS);
 
+	// the highest channels are reserved, at least two channels remain for the other classes
+	unsigned nReserved = DWC_CFG_PERIODIC_CHANNELS;
+	if (nReserved > pThis->m_nChannels - 2)
+	{
+		nReserved = pThis->m_nChannels - 2;
+	}
+	pThis->m_nChannelReserved = ((1 << nReserved) - 1) << (pThis->m_nChannels - nReserved);
+
 	TDWHCIRegister AHBConfig;
 	DWHCIRegister (&AHBConfig, DWHCI_CORE_AHB_CFG);
 	DWHCIRegisterRead (&AHBConfig);
@@ -699,54 +873,194 @@ void DWHCIDeviceFlushRxFIFO (TDWHCIDevice *pThis)
 	_DWHCIRegister (&Reset);
 }
 
-boolean DWHCIDeviceTransferStage (TDWHCIDevice *pThis, TUSBRequest *pURB, boolean bIn, boolean bStatusStage)
+// selects stage nStage of a control transfer (0: SETUP, DATA if any, STATUS),
+// returns FALSE if the transfer has no such stage
+boolean DWHCIDeviceSetControlStage (TDWHCIDevice *pThis, TUSBRequest *pURB, unsigned nStage)
 {
 	assert (pThis != 0);
-
 	assert (pURB != 0);
-	USBRequestSetCompletionRoutine (pURB, DWHCIDeviceCompletionRoutine, 0, pThis);
 
-	assert (!pThis->m_bWaiting);
-	pThis->m_bWaiting = TRUE;
+	TSetupData *pSetup = USBRequestGetSetupData (pURB);
+	assert (pSetup != 0);
 
-	if (!DWHCIDeviceTransferStageAsync (pThis, pURB, bIn, bStatusStage))
-	{
-		pThis->m_bWaiting = FALSE;
+	boolean bDataStage = USBRequestGetBufLen (pURB) > 0;
+	boolean bDataIn = pSetup->bmRequestType & REQUEST_IN ? TRUE : FALSE;
+	assert (!bDataIn || bDataStage);
 
-		return FALSE;
+	if (nStage == 0)				// SETUP
+	{
+		USBRequestSetStage (pURB, FALSE, FALSE);
 	}
-
-	while (pThis->m_bWaiting)
+	else if (nStage == 1 && bDataStage)		// DATA
+	{
+		USBRequestSetStage (pURB, bDataIn, FALSE);
+	}
+	else if (nStage == (bDataStage ? 2 : 1))	// STATUS (opposite direction)
+	{
+		USBRequestSetStage (pURB, !bDataIn, TRUE);
+	}
+	else
 	{
-		// do nothing
+		return FALSE;
 	}
 
-	return USBRequestGetStatus (pURB);
+	USBRequestSetControlStage (pURB, nStage);
+
+	return TRUE;
 }
 
 void DWHCIDeviceCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext)
 {
-	TDWHCIDevice *pThis = (TDWHCIDevice *) pContext;
-	assert (pThis != 0);
+	volatile int *pCompleted = (volatile int *) pParam;
+	assert (pCompleted != 0);
+
+	*pCompleted = 1;
 
-	pThis->m_bWaiting = FALSE;
+#ifdef USPI_WAIT_HOOK
+	SignalCompletion (pCompleted);
+#endif
 }
 
 boolean DWHCIDeviceTransferStageAsync (TDWHCIDevice *pThis, TUSBRequest *pURB, boolean bIn, boolean bStatusStage)
 {
 	assert (pThis != 0);
 	assert (pURB != 0);
-	
-	unsigned nChannel = DWHCIDeviceAllocateChannel (pThis);
+
+	USBRequestSetStage (pURB, bIn, bStatusStage);
+
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+
+	uspi_EnterCritical ();
+
+	// only one request per endpoint can be active, because of the data toggle,
+	// requests are queued, if the endpoint is busy or no channel is available
+	TDWHCIChannelClass Class = DWHCIDeviceGetChannelClass (pEndpoint);
+
+	// the waiting requests get the free channels first in order of priority,
+	// a channel, which is left then, may be used by this request
+	DWHCIDeviceStartPendingStages (pThis);
+
+	unsigned nChannel = DWHCI_MAX_CHANNELS;
+	if (   !USBEndpointIsActive (pEndpoint)
+	    && !USBEndpointHasQueuedRequests (pEndpoint))
+	{
+		nChannel = DWHCIDeviceAllocateChannel (pThis, Class);
+	}
+
 	if (nChannel >= pThis->m_nChannels)
 	{
+		if (!USBEndpointHasQueuedRequests (pEndpoint))
+		{
+			USBEndpointSetNextPending (pEndpoint, 0);
+
+			if (pThis->m_pFirstPending[Class] == 0)
+			{
+				pThis->m_pFirstPending[Class] = pEndpoint;
+			}
+			else
+			{
+				USBEndpointSetNextPending (pThis->m_pLastPending[Class], pEndpoint);
+			}
+
+			pThis->m_pLastPending[Class] = pEndpoint;
+		}
+
+		if (!USBEndpointIsActive (pEndpoint))
+		{
+			pThis->m_ChannelStatistics[Class].nDeferred++;
+
+			TUSPiEndpointStatistics *pStat = DWHCIDeviceGetEndpointStatistics (pThis, pEndpoint);
+			if (pStat != 0)
+			{
+				pStat->nAllocationFailures++;
+			}
+		}
+
+		USBEndpointEnqueueRequest (pEndpoint, pURB);
+
+		uspi_LeaveCritical ();
+
+		return TRUE;
+	}
+
+	USBEndpointSetActive (pEndpoint, TRUE);
+
+	uspi_LeaveCritical ();
+
+	if (!DWHCIDeviceStartStage (pThis, nChannel, pURB))
+	{
+		uspi_EnterCritical ();
+
+		DWHCIDeviceStartPendingStages (pThis);
+
+		uspi_LeaveCritical ();
+
 		return FALSE;
 	}
 
+	return TRUE;
+}
+
+boolean DWHCIDeviceStartStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (nChannel < pThis->m_nChannels);
+	assert (pURB != 0);
+
 	TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
-	DWHCITransferStageData (pStageData, nChannel, pURB, bIn, bStatusStage);
+	DWHCITransferStageData (pStageData, nChannel, pURB, USBRequestIsStageIn (pURB),
+				USBRequestIsStatusStage (pURB));
+
+	TRACE (TraceEventStageStart, nChannel,
+		 (USBRequestIsStageIn (pURB) ? 1 : 0)
+	       | (USBRequestIsStatusStage (pURB) ? 2 : 0)
+	       | (DWHCITransferStageDataIsSplit (pStageData) ? 4 : 0),
+	       pURB, USBRequestIsStatusStage (pURB) ? 0 : USBRequestGetBufLen (pURB));
+
+	u32 nBounceSize = DWHCITransferStageDataGetBounceSize (pStageData);
+	if (nBounceSize > 0)
+	{
+		// other stages are bounced in parts, the packets of an isochronous request
+		// are transferred at arbitrary offsets of its buffer
+		if (   DWHCITransferStageDataIsIsochronous (pStageData)
+		    && nBounceSize > DWHCI_BOUNCE_BUFFER_SIZE)
+		{
+			LogWrite (FromDWHCI, LOG_ERROR, "Isochronous buffer is not suitable for DMA");
+
+			_DWHCITransferStageData (pStageData);
+
+			USBEndpointSetActive (USBRequestGetEndpoint (pURB), FALSE);
+
+			DWHCIDeviceFreeChannel (pThis, nChannel);
+
+			USBRequestSetUSBError (pURB, USBErrorBuffer);
+
+			return FALSE;
+		}
+
+		DWHCITransferStageDataSetBounceBuffer (pStageData, DWHCIDeviceGetBounceBuffer (pThis, nChannel),
+						       DWHCI_BOUNCE_BUFFER_SIZE);
+
+		pThis->m_BounceStatistics.nStages++;
+		pThis->m_BounceStatistics.nBytes += nBounceSize;
+
+		TUSPiEndpointStatistics *pStat = DWHCIDeviceGetEndpointStatistics (pThis, USBRequestGetEndpoint (pURB));
+		if (pStat != 0)
+		{
+			pStat->nBouncedStages++;
+			pStat->nBouncedBytes += nBounceSize;
+		}
+	}
 
 	DWHCIDeviceEnableChannelInterrupt (pThis, nChannel);
+
+	if (DWHCITransferStageDataIsIsochronous (pStageData))
+	{
+		DWHCIDeviceStartIsochronous (pThis, pStageData);
+
+		return TRUE;
+	}
 	
 	if (!DWHCITransferStageDataIsSplit (pStageData))
 	{
@@ -760,7 +1074,11 @@ boolean DWHCIDeviceTransferStageAsync (TDWHCIDevice *pThis, TUSBRequest *pURB, b
 
 			_DWHCITransferStageData (pStageData);
 
+			USBEndpointSetActive (USBRequestGetEndpoint (pURB), FALSE);
+
 			DWHCIDeviceFreeChannel (pThis, nChannel);
+
+			USBRequestSetUSBError (pURB, USBErrorSplit);
 			
 			return FALSE;
 		}
@@ -779,491 +1097,1595 @@ boolean DWHCIDeviceTransferStageAsync (TDWHCIDevice *pThis, TUSBRequest *pURB, b
 	return TRUE;
 }
 
-void DWHCIDeviceStartTransaction (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+// called from interrupt context, when the transfer of a stage is finished,
+// starts the next stage of a control transfer or completes the request
+void DWHCIDeviceFinishStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBRequest *pURB)
 {
 	assert (pThis != 0);
+	assert (pURB != 0);
 
-	assert (pStageData != 0);
-	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
-	assert (nChannel < pThis->m_nChannels);
-	
-	// channel must be disabled, if not already done but controller
-	TDWHCIRegister Character;
-	DWHCIRegister (&Character, DWHCI_HOST_CHAN_CHARACTER (nChannel));
-	DWHCIRegisterRead (&Character);
-	if (DWHCIRegisterIsSet (&Character, DWHCI_HOST_CHAN_CHARACTER_ENABLE))
+	TRACE (TraceEventStageFinish, nChannel, USBRequestGetControlStage (pURB), pURB,
+	       USBRequestGetStatus (pURB));
+
+	DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
+
+	_DWHCITransferStageData (&pThis->m_StageData[nChannel]);
+
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+
+	if (USBEndpointGetType (pEndpoint) == EndpointTypeControl)
 	{
-		DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForChannelDisable);
-		
-		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_ENABLE);
-		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_DISABLE);
-		DWHCIRegisterWrite (&Character);
+		// a control transfer keeps the endpoint and the channel until its last stage is done
+		if (   USBRequestGetStatus (pURB)
+		    && DWHCIDeviceSetControlStage (pThis, pURB, USBRequestGetControlStage (pURB) + 1))
+		{
+			if (DWHCIDeviceStartStage (pThis, nChannel, pURB))
+			{
+				return;
+			}
 
-		TDWHCIRegister ChanInterruptMask;
-		DWHCIRegister (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK (nChannel));
-		DWHCIRegisterSet (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_HALTED);
-		DWHCIRegisterWrite (&ChanInterruptMask);
+			// endpoint and channel have been released by DWHCIDeviceStartStage()
+			USBRequestSetStatus (pURB, 0);
+		}
+		else
+		{
+			USBEndpointSetActive (pEndpoint, FALSE);
 
-		_DWHCIRegister (&ChanInterruptMask);
+			DWHCIDeviceFreeChannel (pThis, nChannel);
+		}
+
+		if (!USBRequestGetStatus (pURB))
+		{
+			USBEndpointResetPID (pEndpoint);	// next transfer starts with SETUP
+		}
 	}
 	else
 	{
-		DWHCIDeviceStartChannel (pThis, pStageData);
+		// the next isochronous request cannot continue an aborted stream without a gap
+		if (   USBEndpointGetType (pEndpoint) == EndpointTypeIsochronous
+		    && !USBRequestGetStatus (pURB))
+		{
+			USBEndpointSetNextFrame (pEndpoint, USB_ENDPOINT_NO_FRAME);
+		}
+
+		USBEndpointSetActive (pEndpoint, FALSE);
+
+		DWHCIDeviceFreeChannel (pThis, nChannel);
 	}
 
-	_DWHCIRegister (&Character);
+	// queued requests are served first, so that a completion routine,
+	// which re-submits its request, cannot starve other endpoints
+	DWHCIDeviceStartPendingStages (pThis);
+
+	DWHCIDeviceCompleteRequest (pThis, pURB);
 }
 
-void DWHCIDeviceStartChannel (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+// starts the waiting requests of idle endpoints on free channels in order of priority,
+// must be called with interrupts disabled
+void DWHCIDeviceStartPendingStages (TDWHCIDevice *pThis)
 {
 	assert (pThis != 0);
 
-	assert (pStageData != 0);
-	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
-	assert (nChannel < pThis->m_nChannels);
-	
-	DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForTransactionComplete);
+	for (unsigned nClass = 0; nClass < DWHCIChannelClassUnknown; nClass++)
+	{
+		TUSBEndpoint *pPrev = 0;
+		TUSBEndpoint *pEndpoint = pThis->m_pFirstPending[nClass];
+		while (pEndpoint != 0)
+		{
+			TUSBEndpoint *pNext = USBEndpointGetNextPending (pEndpoint);
 
-	// reset all pending channel interrupts
-	TDWHCIRegister ChanInterrupt;
-	DWHCIRegister (&ChanInterrupt, DWHCI_HOST_CHAN_INT (nChannel));
-	DWHCIRegisterSetAll (&ChanInterrupt);
-	DWHCIRegisterWrite (&ChanInterrupt);
-	
-	// set transfer size, packet count and pid
-	TDWHCIRegister TransferSize;
-	DWHCIRegister2 (&TransferSize, DWHCI_HOST_CHAN_XFER_SIZ (nChannel), 0);
-	DWHCIRegisterOr (&TransferSize, DWHCITransferStageDataGetBytesToTransfer (pStageData) & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
-	DWHCIRegisterOr (&TransferSize, (DWHCITransferStageDataGetPacketsToTransfer (pStageData) << DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__SHIFT)
-					& DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__MASK);
-	DWHCIRegisterOr (&TransferSize, DWHCITransferStageDataGetPID (pStageData) << DWHCI_HOST_CHAN_XFER_SIZ_PID__SHIFT);
-	DWHCIRegisterWrite (&TransferSize);
+			if (USBEndpointIsActive (pEndpoint))
+			{
+				pPrev = pEndpoint;
+				pEndpoint = pNext;
 
-	// set DMA address
-	TDWHCIRegister DMAAddress;
-	DWHCIRegister2 (&DMAAddress, DWHCI_HOST_CHAN_DMA_ADDR (nChannel),
-			BUS_ADDRESS (DWHCITransferStageDataGetDMAAddress (pStageData)));
-	DWHCIRegisterWrite (&DMAAddress);
+				continue;
+			}
 
-	uspi_CleanAndInvalidateDataCacheRange (DWHCITransferStageDataGetDMAAddress (pStageData),
-					       DWHCITransferStageDataGetBytesToTransfer (pStageData));
-	DataMemBarrier ();
+			// a lower priority class cannot get a channel either
+			unsigned nChannel = DWHCIDeviceAllocateChannel (pThis, (TDWHCIChannelClass) nClass);
+			if (nChannel >= pThis->m_nChannels)
+			{
+				return;
+			}
 
-	// set split control
-	TDWHCIRegister SplitControl;
-	DWHCIRegister2 (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL (nChannel), 0);
-	if (DWHCITransferStageDataIsSplit (pStageData))
+			TUSBRequest *pURB = USBEndpointDequeueRequest (pEndpoint);
+			assert (pURB != 0);
+
+			if (!USBEndpointHasQueuedRequests (pEndpoint))
+			{
+				if (pPrev == 0)
+				{
+					pThis->m_pFirstPending[nClass] = pNext;
+				}
+				else
+				{
+					USBEndpointSetNextPending (pPrev, pNext);
+				}
+
+				if (pThis->m_pLastPending[nClass] == pEndpoint)
+				{
+					pThis->m_pLastPending[nClass] = pPrev;
+				}
+
+				USBEndpointSetNextPending (pEndpoint, 0);
+			}
+			else
+			{
+				pPrev = pEndpoint;
+			}
+
+			USBEndpointSetActive (pEndpoint, TRUE);
+
+			if (!DWHCIDeviceStartStage (pThis, nChannel, pURB))
+			{
+				USBRequestSetStatus (pURB, 0);
+
+				DWHCIDeviceCompleteRequest (pThis, pURB);
+
+				// the completion routine may have modified the lists
+				pPrev = 0;
+				pNext = pThis->m_pFirstPending[nClass];
+			}
+
+			pEndpoint = pNext;
+		}
+	}
+}
+
+// must be called with interrupts disabled
+void DWHCIDeviceRemovePendingEndpoint (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint)
+{
+	assert (pThis != 0);
+	assert (pEndpoint != 0);
+
+	TDWHCIChannelClass Class = DWHCIDeviceGetChannelClass (pEndpoint);
+
+	TUSBEndpoint *pPrev = 0;
+	for (TUSBEndpoint *pEP = pThis->m_pFirstPending[Class]; pEP != 0; pEP = USBEndpointGetNextPending (pEP))
 	{
-		DWHCIRegisterOr (&SplitControl, DWHCITransferStageDataGetHubPortAddress (pStageData));
-		DWHCIRegisterOr (&SplitControl,    DWHCITransferStageDataGetHubAddress (pStageData)
-						<< DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__SHIFT);
-		DWHCIRegisterOr (&SplitControl,    DWHCITransferStageDataGetSplitPosition (pStageData)
-						<< DWHCI_HOST_CHAN_SPLIT_CTRL_XACT_POS__SHIFT);
-		if (DWHCITransferStageDataIsSplitComplete (pStageData))
+		if (pEP == pEndpoint)
 		{
-			DWHCIRegisterOr (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL_COMPLETE_SPLIT);
+			if (pPrev == 0)
+			{
+				pThis->m_pFirstPending[Class] = USBEndpointGetNextPending (pEndpoint);
+			}
+			else
+			{
+				USBEndpointSetNextPending (pPrev, USBEndpointGetNextPending (pEndpoint));
+			}
+
+			if (pThis->m_pLastPending[Class] == pEndpoint)
+			{
+				pThis->m_pLastPending[Class] = pPrev;
+			}
+
+			USBEndpointSetNextPending (pEndpoint, 0);
+
+			return;
 		}
-		DWHCIRegisterOr (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL_SPLIT_ENABLE);
+
+		pPrev = pEP;
 	}
-	DWHCIRegisterWrite (&SplitControl);
+}
 
-	// set channel parameters
-	TDWHCIRegister Character;
-	DWHCIRegister (&Character, DWHCI_HOST_CHAN_CHARACTER (nChannel));
-	DWHCIRegisterRead (&Character);
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK);
-	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetMaxPacketSize (pStageData) & DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK);
+// calls the completion routine of the request, with USPI_USE_FIQ it is queued and the
+// routine is called from DWHCIDeviceSoftInterruptHandler() at IRQ level, with
+// USPI_DEFER_COMPLETION it is queued and called from DWHCIDeviceProcessCompletions(),
+// must be called with interrupts disabled
+void DWHCIDeviceCompleteRequest (TDWHCIDevice *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
 
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__MASK);
-	DWHCIRegisterOr (&Character, 1 << DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__SHIFT);	// TODO: optimize
+	DWHCIDeviceCountRequest (pThis, pURB);
 
-	if (DWHCITransferStageDataIsDirectionIn (pStageData))
+	TRACE (TraceEventComplete, USPI_TRACE_NO_CHANNEL, USBRequestGetUSBError (pURB), pURB,
+	       (u32) USBRequestGetStatus (pURB) << 31 | pURB->m_nResultLen);
+
+	if (USBCaptureIsActive (pThis->m_pCapture))
 	{
-		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN);
+		USBCaptureRequest (pThis->m_pCapture, pURB, USB_CAPTURE_COMPLETE, DWHCIDeviceGetTime ());
 	}
-	else
+
+#ifndef DWHCI_COMPLETION_QUEUE
+	DWHCIDeviceCallCompletionRoutine (pThis, pURB);
+#else
+#ifdef USPI_DEFER_COMPLETION
+	// the completion routine of a blocking request only sets a flag, the waiting task
+	// does not necessarily process the queue
+	if (   pURB->m_pCompletionRoutine == DWHCIDeviceCompletionRoutine
+	    || USBRequestIsCompleteAtIRQ (pURB))
 	{
-		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN);
+		DWHCIDeviceCallCompletionRoutine (pThis, pURB);
+
+		return;
 	}
+#endif
 
-	if (DWHCITransferStageDataGetSpeed (pStageData) == USBSpeedLow)
+	DWHCIDeviceDeferCompletion (pThis, pURB);
+#endif
+}
+
+#ifdef DWHCI_COMPLETION_QUEUE
+
+void DWHCIDeviceDeferCompletion (TDWHCIDevice *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
+
+	unsigned nIn = pThis->m_nCompletedIn;
+	if (   pThis->m_pFirstOverflow == 0
+	    && nIn - pThis->m_nCompletedOut < DWHCI_COMPLETION_QUEUE_SIZE)
 	{
-		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_LOW_SPEED_DEVICE);
+		pThis->m_pCompleted[nIn & (DWHCI_COMPLETION_QUEUE_SIZE-1)] = pURB;
+
+		DataMemBarrier ();
+
+		pThis->m_nCompletedIn = nIn + 1;
 	}
 	else
 	{
-		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_LOW_SPEED_DEVICE);
+		// keep the order of completion, until the consumer has emptied the overflow list
+		pURB->m_pNext = 0;
+
+		if (pThis->m_pFirstOverflow == 0)
+		{
+			pThis->m_pFirstOverflow = pURB;
+		}
+		else
+		{
+			pThis->m_pLastOverflow->m_pNext = pURB;
+		}
+
+		pThis->m_pLastOverflow = pURB;
 	}
 
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK);
-	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetDeviceAddress (pStageData) << DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT);
+#ifdef USPI_USE_FIQ
+	TriggerSoftInterrupt ();
+#endif
+}
 
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK);
-	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetEndpointType (pStageData) << DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT);
+#endif
 
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__MASK);
-	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetEndpointNumber (pStageData) << DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__SHIFT);
+// cancels the timeout of the request and calls its completion routine (at IRQ level)
+void DWHCIDeviceCallCompletionRoutine (TDWHCIDevice *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
 
-	TDWHCIFrameScheduler *pFrameScheduler = DWHCITransferStageDataGetFrameScheduler (pStageData);
-	if (pFrameScheduler != 0)
+	unsigned hTimer = USBRequestGetTimeoutTimer (pURB);
+	if (hTimer != 0)
 	{
-		pFrameScheduler->WaitForFrame (pFrameScheduler);
+		CancelKernelTimer (hTimer);
+		USBRequestSetTimeoutTimer (pURB, 0);
+	}
 
-		if (pFrameScheduler->IsOddFrame (pFrameScheduler))
+	USBRequestCallCompletionRoutine (pURB);
+}
+
+// removes a waiting request from its endpoint or halts the channel of an active request,
+// the request is completed with status 0 and the given error (on CHHLTD, if the channel
+// is still active)
+boolean DWHCIDeviceAbortRequest (TDWHCIDevice *pThis, TUSBRequest *pURB, TUSBError Error)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
+
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+
+	uspi_EnterCritical ();
+
+	if (USBEndpointRemoveRequest (pEndpoint, pURB))
+	{
+		if (!USBEndpointHasQueuedRequests (pEndpoint))
 		{
-			DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+			DWHCIDeviceRemovePendingEndpoint (pThis, pEndpoint);
 		}
-		else
+
+		USBRequestSetStatus (pURB, 0);
+		USBRequestSetUSBError (pURB, Error);
+
+		DWHCIDeviceCompleteRequest (pThis, pURB);
+
+		uspi_LeaveCritical ();
+
+		return TRUE;
+	}
+
+	unsigned nChannel;
+	for (nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
+	{
+		if (   (pThis->m_nChannelAllocated & (1 << nChannel))
+		    && DWHCITransferStageDataGetURB (&pThis->m_StageData[nChannel]) == pURB)
 		{
-			DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+			break;
 		}
 	}
 
-	TDWHCIRegister ChanInterruptMask;
-	DWHCIRegister (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK (nChannel));
-	DWHCIRegisterSet (&ChanInterruptMask, DWHCITransferStageDataGetStatusMask (pStageData));
-	DWHCIRegisterWrite (&ChanInterruptMask);
-	
-	DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_ENABLE);
-	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_DISABLE);
-	DWHCIRegisterWrite (&Character);
+	// the request is already being aborted
+	if (   nChannel >= pThis->m_nChannels
+	    || (pThis->m_nChannelHalting & (1 << nChannel)))
+	{
+		uspi_LeaveCritical ();
 
-	_DWHCIRegister (&ChanInterruptMask);
-	_DWHCIRegister (&Character);
-	_DWHCIRegister (&SplitControl);
-	_DWHCIRegister (&DMAAddress);
-	_DWHCIRegister (&TransferSize);
-	_DWHCIRegister (&ChanInterrupt);
+		return FALSE;
+	}
+
+	if (pThis->m_nFrameWaiting & (1 << nChannel))
+	{
+		pThis->m_nFrameWaiting &= ~(1 << nChannel);
+	}
+	else if (DWHCIDeviceHaltChannel (pThis, nChannel))
+	{
+		// the request is finished by the interrupt handler
+		USBRequestSetUSBError (pURB, Error);
+
+		pThis->m_nChannelHalting |= 1 << nChannel;
+
+		uspi_LeaveCritical ();
+
+		return TRUE;
+	}
+
+	// an interrupt of this channel, which is already latched, must be ignored
+	pThis->m_nChannelAborted |= 1 << nChannel;
+
+	DWHCIDeviceFinishAbortedStage (pThis, nChannel, Error);
+
+	uspi_LeaveCritical ();
+
+	return TRUE;
 }
 
-void DWHCIDeviceChannelInterruptHandler (TDWHCIDevice *pThis, unsigned nChannel)
+// completes the request of a halted (or waiting) channel with status 0 and the given error
+void DWHCIDeviceFinishAbortedStage (TDWHCIDevice *pThis, unsigned nChannel, TUSBError Error)
 {
 	assert (pThis != 0);
+	assert (nChannel < pThis->m_nChannels);
 
 	TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
-	TDWHCIFrameScheduler *pFrameScheduler = DWHCITransferStageDataGetFrameScheduler (pStageData);
 	TUSBRequest *pURB = DWHCITransferStageDataGetURB (pStageData);
 	assert (pURB != 0);
 
-	switch (DWHCITransferStageDataGetSubState (pStageData))
+	if (!DWHCITransferStageDataIsStatusStage (pStageData))
 	{
-	case StageSubStateWaitForChannelDisable:
-		DWHCIDeviceStartChannel (pThis, pStageData);
-		return;
+		USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+	}
 
-	case StageSubStateWaitForTransactionComplete: {
-		uspi_CleanAndInvalidateDataCacheRange (DWHCITransferStageDataGetDMAAddress (pStageData),
-						       DWHCITransferStageDataGetBytesToTransfer (pStageData));
-		DataMemBarrier ();
+	USBRequestSetStatus (pURB, 0);
+	USBRequestSetUSBError (pURB, Error);
 
-		TDWHCIRegister TransferSize;
-		DWHCIRegister (&TransferSize, DWHCI_HOST_CHAN_XFER_SIZ (nChannel));
-		DWHCIRegisterRead (&TransferSize);
+	DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+}
 
-		TDWHCIRegister ChanInterrupt;
-		DWHCIRegister (&ChanInterrupt, DWHCI_HOST_CHAN_INT (nChannel));
+// disables the channel without waiting (may be called from interrupt and timer context),
+// returns TRUE if it is still active (the CHHLTD interrupt follows then), FALSE if it is halted
+boolean DWHCIDeviceHaltChannel (TDWHCIDevice *pThis, unsigned nChannel)
+{
+	assert (pThis != 0);
+	assert (nChannel < pThis->m_nChannels);
 
-		// restart halted transaction
-		if (DWHCIRegisterRead (&ChanInterrupt) == DWHCI_HOST_CHAN_INT_HALTED)
-		{
-			DWHCIDeviceStartTransaction (pThis, pStageData);
-			return;
-		}
+	TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
 
-		assert (   !DWHCITransferStageDataIsPeriodic (pStageData)
-			||    DWHCI_HOST_CHAN_XFER_SIZ_PID (DWHCIRegisterGet (&TransferSize))
-			   != DWHCI_HOST_CHAN_XFER_SIZ_PID_MDATA);
+	TRACE (TraceEventChannelHalt, nChannel, DWHCITransferStageDataGetState (pStageData),
+	       DWHCITransferStageDataGetURB (pStageData), 0);
 
-		DWHCITransferStageDataTransactionComplete (pStageData, DWHCIRegisterRead (&ChanInterrupt),
-			DWHCI_HOST_CHAN_XFER_SIZ_PACKETS (DWHCIRegisterGet (&TransferSize)),
-			DWHCIRegisterGet (&TransferSize) & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
+	// only the halt is of interest from now on
+	TDWHCIRegister ChanInterruptMask;
+	DWHCIRegister2 (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK (nChannel), DWHCI_HOST_CHAN_INT_HALTED);
+	DWHCIRegisterWrite (&ChanInterruptMask);
 
-		_DWHCIRegister (&ChanInterrupt);
-		_DWHCIRegister (&TransferSize);
-		} break;
-	
-	default:
-		assert (0);
-		break;
-	}
-	
-	unsigned nStatus;
-	
-	switch (DWHCITransferStageDataGetState (pStageData))
+	TDWHCIRegister Character;
+	DWHCIRegister (&Character, DWHCI_HOST_CHAN_CHARACTER (nChannel));
+	DWHCIRegisterRead (&Character);
+
+	if (DWHCIRegisterIsSet (&Character, DWHCI_HOST_CHAN_CHARACTER_ENABLE))
 	{
-	case StageStateNoSplitTransfer:
-		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
-		if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+		if (DWHCITransferStageDataGetSubState (pStageData) != StageSubStateWaitForChannelDisable)
 		{
-			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
-
-			USBRequestSetStatus (pURB, 0);
+			DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_ENABLE);
+			DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_DISABLE);
+			DWHCIRegisterWrite (&Character);
 		}
-		else if (   (nStatus & (DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_NYET))
+
+		_DWHCIRegister (&Character);
+		_DWHCIRegister (&ChanInterruptMask);
+
+		return TRUE;
+	}
+
+	DWHCIRegisterSet (&ChanInterruptMask, 0);
+	DWHCIRegisterWrite (&ChanInterruptMask);
+
+	DWHCIDeviceChannelHalted (pThis, nChannel);
+
+	_DWHCIRegister (&Character);
+	_DWHCIRegister (&ChanInterruptMask);
+
+	return FALSE;
+}
+
+// packets, which have been transferred before the halt, are taken into account for the data toggle
+void DWHCIDeviceChannelHalted (TDWHCIDevice *pThis, unsigned nChannel)
+{
+	assert (pThis != 0);
+	assert (nChannel < pThis->m_nChannels);
+
+	TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
+
+	TDWHCIRegister ChanInterrupt;
+	DWHCIRegister (&ChanInterrupt, DWHCI_HOST_CHAN_INT (nChannel));
+
+	if (DWHCITransferStageDataGetSubState (pStageData) == StageSubStateWaitForTransactionComplete)
+	{
+		TDWHCIRegister TransferSize;
+		DWHCIRegister (&TransferSize, DWHCI_HOST_CHAN_XFER_SIZ (nChannel));
+		DWHCIRegisterRead (&TransferSize);
+
+		// a NAK only ends the transaction here, the packets before it are valid
+		u32 nStatus =   DWHCIRegisterRead (&ChanInterrupt)
+			      & ~(DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_NYET);
+
+		DWHCITransferStageDataTransactionComplete (pStageData, nStatus,
+			DWHCI_HOST_CHAN_XFER_SIZ_PACKETS (DWHCIRegisterGet (&TransferSize)),
+			DWHCIRegisterGet (&TransferSize) & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
+
+		_DWHCIRegister (&TransferSize);
+	}
+
+	DWHCIRegisterSetAll (&ChanInterrupt);
+	DWHCIRegisterWrite (&ChanInterrupt);
+
+	_DWHCIRegister (&ChanInterrupt);
+}
+
+void DWHCIDeviceStartTransaction (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+
+	assert (pStageData != 0);
+	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
+	assert (nChannel < pThis->m_nChannels);
+	
+	// channel must be disabled, if not already done but controller
+	TDWHCIRegister Character;
+	DWHCIRegister (&Character, DWHCI_HOST_CHAN_CHARACTER (nChannel));
+	DWHCIRegisterRead (&Character);
+	if (DWHCIRegisterIsSet (&Character, DWHCI_HOST_CHAN_CHARACTER_ENABLE))
+	{
+		DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForChannelDisable);
+
+		TRACE (TraceEventChannelDisable, nChannel, 0, 0, DWHCIRegisterGet (&Character));
+		
+		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_ENABLE);
+		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_DISABLE);
+		DWHCIRegisterWrite (&Character);
+
+		TDWHCIRegister ChanInterruptMask;
+		DWHCIRegister (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK (nChannel));
+		DWHCIRegisterSet (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_HALTED);
+		DWHCIRegisterWrite (&ChanInterruptMask);
+
+		_DWHCIRegister (&ChanInterruptMask);
+	}
+	else
+	{
+		DWHCIDeviceStartChannel (pThis, pStageData);
+	}
+
+	_DWHCIRegister (&Character);
+}
+
+void DWHCIDeviceStartChannel (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+
+	assert (pStageData != 0);
+	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
+	assert (nChannel < pThis->m_nChannels);
+	
+	// the transaction is deferred to the SOF of the (micro)frame, in which it can be started
+	TDWHCIFrameScheduler *pFrameScheduler = DWHCITransferStageDataGetFrameScheduler (pStageData);
+	if (pFrameScheduler != 0)
+	{
+		TDWHCIRegister FrameNumber;
+		DWHCIRegister (&FrameNumber, DWHCI_HOST_FRM_NUM);
+		unsigned nFrame = DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber));
+
+		_DWHCIRegister (&FrameNumber);
+
+		unsigned nFrames = pFrameScheduler->GetFramesToWait (pFrameScheduler, nFrame);
+		if (nFrames != 0)
+		{
+			DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForFrame);
+
+			DWHCIDeviceWaitForFrame (pThis, pStageData, (nFrame + nFrames) & DWHCI_MAX_FRAME_NUMBER);
+
+			return;
+		}
+	}
+
+	DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForTransactionComplete);
+
+	// reset all pending channel interrupts
+	TDWHCIRegister ChanInterrupt;
+	DWHCIRegister (&ChanInterrupt, DWHCI_HOST_CHAN_INT (nChannel));
+	DWHCIRegisterSetAll (&ChanInterrupt);
+	DWHCIRegisterWrite (&ChanInterrupt);
+	
+	// set transfer size, packet count and pid
+	TDWHCIRegister TransferSize;
+	DWHCIRegister2 (&TransferSize, DWHCI_HOST_CHAN_XFER_SIZ (nChannel), 0);
+	DWHCIRegisterOr (&TransferSize, DWHCITransferStageDataGetBytesToTransfer (pStageData) & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
+	DWHCIRegisterOr (&TransferSize, (DWHCITransferStageDataGetPacketsToTransfer (pStageData) << DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__SHIFT)
+					& DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__MASK);
+	DWHCIRegisterOr (&TransferSize, DWHCITransferStageDataGetPID (pStageData) << DWHCI_HOST_CHAN_XFER_SIZ_PID__SHIFT);
+	DWHCIRegisterWrite (&TransferSize);
+
+	// set DMA address
+	TDWHCIRegister DMAAddress;
+	DWHCIRegister2 (&DMAAddress, DWHCI_HOST_CHAN_DMA_ADDR (nChannel),
+			BUS_ADDRESS (DWHCITransferStageDataGetDMAAddress (pStageData)));
+	DWHCIRegisterWrite (&DMAAddress);
+
+	DWHCIDevicePrepareDMA (pStageData);
+	DataMemBarrier ();
+
+	// set split control
+	TDWHCIRegister SplitControl;
+	DWHCIRegister2 (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL (nChannel), 0);
+	if (DWHCITransferStageDataIsSplit (pStageData))
+	{
+		DWHCIRegisterOr (&SplitControl, DWHCITransferStageDataGetHubPortAddress (pStageData));
+		DWHCIRegisterOr (&SplitControl,    DWHCITransferStageDataGetHubAddress (pStageData)
+						<< DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__SHIFT);
+		DWHCIRegisterOr (&SplitControl,    DWHCITransferStageDataGetSplitPosition (pStageData)
+						<< DWHCI_HOST_CHAN_SPLIT_CTRL_XACT_POS__SHIFT);
+		if (DWHCITransferStageDataIsSplitComplete (pStageData))
+		{
+			DWHCIRegisterOr (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL_COMPLETE_SPLIT);
+		}
+		DWHCIRegisterOr (&SplitControl, DWHCI_HOST_CHAN_SPLIT_CTRL_SPLIT_ENABLE);
+	}
+	DWHCIRegisterWrite (&SplitControl);
+
+	// set channel parameters
+	TDWHCIRegister Character;
+	DWHCIRegister (&Character, DWHCI_HOST_CHAN_CHARACTER (nChannel));
+	DWHCIRegisterRead (&Character);
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK);
+	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetMaxPacketSize (pStageData) & DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK);
+
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__MASK);
+	DWHCIRegisterOr (&Character,    DWHCITransferStageDataGetMultiCount (pStageData)
+				     << DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__SHIFT);
+
+	if (DWHCITransferStageDataIsDirectionIn (pStageData))
+	{
+		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN);
+	}
+	else
+	{
+		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN);
+	}
+
+	if (DWHCITransferStageDataGetSpeed (pStageData) == USBSpeedLow)
+	{
+		DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_LOW_SPEED_DEVICE);
+	}
+	else
+	{
+		DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_LOW_SPEED_DEVICE);
+	}
+
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK);
+	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetDeviceAddress (pStageData) << DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT);
+
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK);
+	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetEndpointType (pStageData) << DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT);
+
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__MASK);
+	DWHCIRegisterOr (&Character, DWHCITransferStageDataGetEndpointNumber (pStageData) << DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__SHIFT);
+
+	if (pFrameScheduler != 0)
+	{
+		if (pFrameScheduler->IsOddFrame (pFrameScheduler))
+		{
+			DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+		}
+		else
+		{
+			DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+		}
+	}
+	else if (DWHCITransferStageDataIsIsochronous (pStageData))
+	{
+		// the channel is enabled in the (micro)frame before the packet is due or in this one
+		if (DWHCITransferStageDataGetIsoFrame (pStageData) & 1)
+		{
+			DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+		}
+		else
+		{
+			DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME);
+		}
+	}
+
+	TDWHCIRegister ChanInterruptMask;
+	DWHCIRegister (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK (nChannel));
+	DWHCIRegisterSet (&ChanInterruptMask, DWHCITransferStageDataGetStatusMask (pStageData));
+	DWHCIRegisterWrite (&ChanInterruptMask);
+	
+	DWHCIRegisterOr (&Character, DWHCI_HOST_CHAN_CHARACTER_ENABLE);
+	DWHCIRegisterAnd (&Character, ~DWHCI_HOST_CHAN_CHARACTER_DISABLE);
+	DWHCIRegisterWrite (&Character);
+
+	TRACE (  !DWHCITransferStageDataIsSplit (pStageData) ? TraceEventChannelStart
+	       : !DWHCITransferStageDataIsSplitComplete (pStageData) ? TraceEventStartSplit
+	       : TraceEventCompleteSplit,
+	       nChannel, DWHCITransferStageDataGetPID (pStageData), DWHCIRegisterGet (&TransferSize),
+	       DWHCITransferStageDataIsSplit (pStageData) ? DWHCIRegisterGet (&SplitControl)
+							  : DWHCIRegisterGet (&Character));
+
+	_DWHCIRegister (&ChanInterruptMask);
+	_DWHCIRegister (&Character);
+	_DWHCIRegister (&SplitControl);
+	_DWHCIRegister (&DMAAddress);
+	_DWHCIRegister (&TransferSize);
+	_DWHCIRegister (&ChanInterrupt);
+}
+
+void DWHCIDeviceChannelInterruptHandler (TDWHCIDevice *pThis, unsigned nChannel)
+{
+	assert (pThis != 0);
+
+	TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
+	TDWHCIFrameScheduler *pFrameScheduler = DWHCITransferStageDataGetFrameScheduler (pStageData);
+	TUSBRequest *pURB = DWHCITransferStageDataGetURB (pStageData);
+	assert (pURB != 0);
+
+	// the request has been aborted, while the channel was active
+	if (pThis->m_nChannelHalting & (1 << nChannel))
+	{
+		pThis->m_nChannelHalting &= ~(1 << nChannel);
+
+		if (DWHCITransferStageDataGetSubState (pStageData) == StageSubStateWaitForTransactionComplete)
+		{
+			DWHCIDeviceCompleteDMA (pStageData);
+		}
+
+		DWHCIDeviceChannelHalted (pThis, nChannel);
+
+		DWHCIDeviceFinishAbortedStage (pThis, nChannel, USBRequestGetUSBError (pURB));
+
+		return;
+	}
+
+	switch (DWHCITransferStageDataGetSubState (pStageData))
+	{
+	case StageSubStateWaitForChannelDisable:
+		DWHCIDeviceStartChannel (pThis, pStageData);
+		return;
+
+	case StageSubStateWaitForTransactionComplete: {
+		DWHCIDeviceCompleteDMA (pStageData);
+		DataMemBarrier ();
+
+		TDWHCIRegister TransferSize;
+		DWHCIRegister (&TransferSize, DWHCI_HOST_CHAN_XFER_SIZ (nChannel));
+		DWHCIRegisterRead (&TransferSize);
+
+		TDWHCIRegister ChanInterrupt;
+		DWHCIRegister (&ChanInterrupt, DWHCI_HOST_CHAN_INT (nChannel));
+
+		TRACE (TraceEventTransaction, nChannel,
+		          DWHCITransferStageDataGetState (pStageData) << 8
+			| DWHCITransferStageDataGetSubState (pStageData),
+		       DWHCIRegisterRead (&ChanInterrupt), DWHCIRegisterGet (&TransferSize));
+
+		// restart halted transaction
+		if (DWHCIRegisterRead (&ChanInterrupt) == DWHCI_HOST_CHAN_INT_HALTED)
+		{
+			DWHCIDeviceStartTransaction (pThis, pStageData);
+			return;
+		}
+
+		assert (   !DWHCITransferStageDataIsPeriodic (pStageData)
+			|| DWHCITransferStageDataIsIsochronous (pStageData)
+			||    DWHCI_HOST_CHAN_XFER_SIZ_PID (DWHCIRegisterGet (&TransferSize))
+			   != DWHCI_HOST_CHAN_XFER_SIZ_PID_MDATA);
+
+		u32 nResultLen = DWHCITransferStageDataGetResultLen (pStageData);
+
+		DWHCITransferStageDataTransactionComplete (pStageData, DWHCIRegisterRead (&ChanInterrupt),
+			DWHCI_HOST_CHAN_XFER_SIZ_PACKETS (DWHCIRegisterGet (&TransferSize)),
+			DWHCIRegisterGet (&TransferSize) & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
+
+		DWHCIDeviceCountTransaction (pThis, pStageData, DWHCIRegisterGet (&ChanInterrupt),
+					     DWHCITransferStageDataGetResultLen (pStageData) - nResultLen);
+
+		_DWHCIRegister (&ChanInterrupt);
+		_DWHCIRegister (&TransferSize);
+		} break;
+	
+	default:
+		assert (0);
+		break;
+	}
+	
+	unsigned nStatus;
+	
+	switch (DWHCITransferStageDataGetState (pStageData))
+	{
+	case StageStateNoSplitTransfer:
+		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
+		if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+		{
+			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
+
+			USBRequestSetStatus (pURB, 0);
+			USBRequestSetUSBError (pURB, DWHCIDeviceGetUSBError (nStatus));
+		}
+		else if (   (nStatus & (DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_NYET))
 			 && DWHCITransferStageDataIsPeriodic (pStageData))
 		{
-			DWHCITransferStageDataSetState (pStageData, StageStatePeriodicDelay);
+			DWHCIDeviceSchedulePeriodic (pThis, pStageData);
+
+			break;
+		}
+		else if (!DWHCITransferStageDataIsStageComplete (pStageData))
+		{
+			// the stage is too large for one channel program, continue with the next segment
+			DWHCIDeviceStartTransaction (pThis, pStageData);
+
+			break;
+		}
+		else
+		{
+			if (!DWHCITransferStageDataIsStatusStage (pStageData))
+			{
+				USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+			}
+
+			USBRequestSetStatus (pURB, 1);
+		}
+
+		DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+		break;
+
+	case StageStateStartSplit:
+		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
+		if (   (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+		    || (nStatus & DWHCI_HOST_CHAN_INT_NAK)
+		    || (nStatus & DWHCI_HOST_CHAN_INT_NYET))
+		{
+			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
+
+			USBRequestSetStatus (pURB, 0);
+			USBRequestSetUSBError (pURB, DWHCIDeviceGetUSBError (nStatus));
+
+			DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+			break;
+		}
+
+		pFrameScheduler->TransactionComplete (pFrameScheduler, nStatus);
+
+		DWHCITransferStageDataSetState (pStageData, StageStateCompleteSplit);
+		DWHCITransferStageDataSetSplitComplete (pStageData, TRUE);
+
+		if (!pFrameScheduler->CompleteSplit (pFrameScheduler))
+		{
+			goto LeaveCompleteSplit;
+		}
+		
+		DWHCIDeviceStartTransaction (pThis, pStageData);
+		break;
+		
+	case StageStateCompleteSplit:
+		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
+		if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+		{
+			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
+
+			USBRequestSetStatus (pURB, 0);
+			USBRequestSetUSBError (pURB, DWHCIDeviceGetUSBError (nStatus));
+
+			DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+			break;
+		}
+		
+		pFrameScheduler->TransactionComplete (pFrameScheduler, nStatus);
+
+		if (pFrameScheduler->CompleteSplit (pFrameScheduler))
+		{
+			DWHCIDeviceStartTransaction (pThis, pStageData);
+			break;
+		}
+
+	LeaveCompleteSplit:
+		if (!DWHCITransferStageDataIsStageComplete (pStageData))
+		{
+			if (!DWHCITransferStageDataBeginSplitCycle (pStageData))
+			{
+				USBRequestSetStatus (pURB, 0);
+				USBRequestSetUSBError (pURB, USBErrorSplit);
+
+				DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+				break;
+			}
+
+			if (!DWHCITransferStageDataIsPeriodic (pStageData))
+			{
+				DWHCITransferStageDataSetState (pStageData, StageStateStartSplit);
+				DWHCITransferStageDataSetSplitComplete (pStageData, FALSE);
+
+				pFrameScheduler->StartSplit (pFrameScheduler);
+
+				DWHCIDeviceStartTransaction (pThis, pStageData);
+			}
+			else
+			{
+				DWHCIDeviceSchedulePeriodic (pThis, pStageData);
+			}
+			break;
+		}
+
+		if (!DWHCITransferStageDataIsStatusStage (pStageData))
+		{
+			USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+		}
+		USBRequestSetStatus (pURB, 1);
+
+		DWHCIDeviceFinishStage (pThis, nChannel, pURB);
+		break;
+
+	case StageStateIsochronous:
+		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
+		DWHCITransferStageDataIsoPacketComplete (pStageData,
+							   nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK
+							 ? DWHCIDeviceGetUSBError (nStatus) : USBErrorNone);
+
+		DWHCIDeviceScheduleIsochronous (pThis, pStageData);
+		break;
+
+	default:
+		assert (0);
+		break;
+	}
+}
+
+void DWHCIDeviceInterruptHandler (void *pParam)
+{
+	TDWHCIDevice *pThis = (TDWHCIDevice *) pParam;
+	assert (pThis != 0);
+
+	DataMemBarrier ();
+
+	TDWHCIRegister IntStatus;
+	DWHCIRegister (&IntStatus, DWHCI_CORE_INT_STAT);
+	DWHCIRegisterRead (&IntStatus);
+
+	pThis->m_nChannelAborted = 0;
+
+	if (DWHCIRegisterGet (&IntStatus) & DWHCI_CORE_INT_STAT_SOF_INTR)
+	{
+		DWHCIDeviceFrameHandler (pThis);
+	}
+
+	if (DWHCIRegisterGet (&IntStatus) & DWHCI_CORE_INT_STAT_HC_INTR)
+	{
+		TDWHCIRegister AllChanInterrupt;
+		DWHCIRegister (&AllChanInterrupt, DWHCI_HOST_ALLCHAN_INT);
+		DWHCIRegisterRead (&AllChanInterrupt);
+		DWHCIRegisterWrite (&AllChanInterrupt);
+		
+		// visit the pending channels only
+		u32 nPending = DWHCIRegisterGet (&AllChanInterrupt) & ((1 << pThis->m_nChannels) - 1);
+		while (nPending != 0)
+		{
+			unsigned nChannel = __builtin_ctz (nPending);
+			nPending &= nPending - 1;
+
+			// skip channels, which have been aborted by a handler before in this loop
+			if (pThis->m_nChannelAborted & (1 << nChannel))
+			{
+				continue;
+			}
 
-			unsigned nInterval = USBEndpointGetInterval (USBRequestGetEndpoint (pURB));
+			TDWHCIRegister ChanInterruptMask;
+			DWHCIRegister2 (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK(nChannel), 0);
+			DWHCIRegisterWrite (&ChanInterruptMask);
 
-			StartKernelTimer (MSEC2HZ (nInterval), DWHCIDeviceTimerHandler, pStageData, pThis);
+			DWHCIDeviceChannelInterruptHandler (pThis, nChannel);
 
-			break;
+			_DWHCIRegister (&ChanInterruptMask);
 		}
-		else
+
+		_DWHCIRegister (&AllChanInterrupt);
+	}
+#if 0	
+	if (IntStatus.Get () & DWHCI_CORE_INT_STAT_PORT_INTR)
+	{
+		CDWHCIRegister HostPort (DWHCI_HOST_PORT);
+		HostPort.Read ();
+		
+		CLogger::Get ()->Write (FromDWHCI, LOG_DEBUG, "Port interrupt (status 0x%08X)", HostPort.Get ());
+		
+		HostPort.And (~DWHCI_HOST_PORT_ENABLE);
+		HostPort.Or (  DWHCI_HOST_PORT_CONNECT_CHANGED
+			     | DWHCI_HOST_PORT_ENABLE_CHANGED
+			     | DWHCI_HOST_PORT_OVERCURRENT_CHANGED);
+		HostPort.Write ();
+		
+		IntStatus.Or (DWHCI_CORE_INT_STAT_PORT_INTR);
+	}
+#endif
+	DWHCIRegisterWrite (&IntStatus);
+
+	DataMemBarrier ();
+	
+	_DWHCIRegister (&IntStatus);
+}
+
+void DWHCIDeviceProcessCompletions (TDWHCIDevice *pThis)
+{
+	assert (pThis != 0);
+
+#ifdef DWHCI_COMPLETION_QUEUE
+	while (1)
+	{
+		unsigned nOut = pThis->m_nCompletedOut;
+		if (nOut == pThis->m_nCompletedIn)
 		{
-			if (!DWHCITransferStageDataIsStatusStage (pStageData))
+			if (pThis->m_pFirstOverflow == 0)
 			{
-				USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+				break;
+			}
+
+			// rare case, the producer must not run while the overflow list is modified
+			uspi_EnterCritical ();
+
+			while (   pThis->m_pFirstOverflow != 0
+			       && pThis->m_nCompletedIn - nOut < DWHCI_COMPLETION_QUEUE_SIZE)
+			{
+				TUSBRequest *pURB = pThis->m_pFirstOverflow;
+				pThis->m_pFirstOverflow = pURB->m_pNext;
+				pURB->m_pNext = 0;
+
+				pThis->m_pCompleted[pThis->m_nCompletedIn & (DWHCI_COMPLETION_QUEUE_SIZE-1)] = pURB;
+				pThis->m_nCompletedIn++;
+			}
+
+			uspi_LeaveCritical ();
+
+			continue;
+		}
+
+		DataMemBarrier ();
+
+		TUSBRequest *pURB = pThis->m_pCompleted[nOut & (DWHCI_COMPLETION_QUEUE_SIZE-1)];
+		assert (pURB != 0);
+
+		DataMemBarrier ();
+
+		// free the slot before the call, the completion routine may resubmit the request
+		pThis->m_nCompletedOut = nOut + 1;
+
+		// the USB interrupt is enabled here, so that transactions are not delayed
+		DWHCIDeviceCallCompletionRoutine (pThis, pURB);
+	}
+#endif
+}
+
+#ifdef USPI_USE_FIQ
+
+// calls the completion routines of the requests, which have been completed at FIQ level
+void DWHCIDeviceSoftInterruptHandler (void *pParam)
+{
+	TDWHCIDevice *pThis = (TDWHCIDevice *) pParam;
+	assert (pThis != 0);
+
+	DWHCIDeviceProcessCompletions (pThis);
+}
+
+#endif
+
+// the request is restarted on SOF of the (micro)frame, in which it is due again,
+// the SOF interrupt is enabled only while requests are waiting
+void DWHCIDeviceSchedulePeriodic (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
+
+	DWHCITransferStageDataSetState (pStageData, StageStatePeriodicDelay);
+
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (DWHCITransferStageDataGetURB (pStageData));
+	unsigned nInterval = DWHCIDeviceGetFrameInterval (pThis, pEndpoint);
+
+	DWHCIDeviceWaitForFrame (pThis, pStageData,
+				 (DWHCIDeviceGetFrameNumber (pThis) + nInterval) & DWHCI_MAX_FRAME_NUMBER);
+}
+
+void DWHCIDeviceStartPeriodic (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
+	assert (DWHCITransferStageDataGetState (pStageData) == StageStatePeriodicDelay);
+
+	if (DWHCITransferStageDataIsSplit (pStageData))
+	{
+		DWHCITransferStageDataSetState (pStageData, StageStateStartSplit);
+		
+		DWHCITransferStageDataSetSplitComplete (pStageData, FALSE);
+		TDWHCIFrameScheduler *pFrameScheduler =
+			DWHCITransferStageDataGetFrameScheduler (pStageData);
+		assert (pFrameScheduler != 0);
+		pFrameScheduler->StartSplit (pFrameScheduler);
+	}
+	else
+	{
+		DWHCITransferStageDataSetState (pStageData, StageStateNoSplitTransfer);
+	}
+
+	DWHCIDeviceStartTransaction (pThis, pStageData);
+}
+
+// the channel is continued on SOF of the (micro)frame nDueFrame,
+// must be called with interrupts disabled
+void DWHCIDeviceWaitForFrame (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData, unsigned nDueFrame)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
+
+	DWHCITransferStageDataSetDueFrame (pStageData, nDueFrame);
+
+	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
+	assert (nChannel < pThis->m_nChannels);
+
+	TRACE (TraceEventWaitFrame, nChannel, DWHCITransferStageDataGetState (pStageData), nDueFrame, 0);
+
+	if (pThis->m_nFrameWaiting == 0)
+	{
+		DWHCIDeviceEnableFrameInterrupt (pThis, TRUE);
+	}
+
+	pThis->m_nFrameWaiting |= 1 << nChannel;
+}
+
+// the first packet of an isochronous request follows the last packet of the previous request
+// of the endpoint without a gap, if this is still possible, otherwise the stream starts anew
+void DWHCIDeviceStartIsochronous (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
+
+	DWHCITransferStageDataSetState (pStageData, StageStateIsochronous);
+
+	TUSBRequest *pURB = DWHCITransferStageDataGetURB (pStageData);
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	unsigned nInterval = DWHCIDeviceGetFrameInterval (pThis, pEndpoint);
+
+	unsigned nFrame = DWHCIDeviceGetFrameNumber (pThis);
+	unsigned nStartFrame = USBEndpointGetNextFrame (pEndpoint);
+	if (   nStartFrame == USB_ENDPOINT_NO_FRAME
+	    || ((nStartFrame - nFrame) & DWHCI_MAX_FRAME_NUMBER) > nInterval)
+	{
+		nStartFrame = (nFrame + ISO_START_DELAY) & DWHCI_MAX_FRAME_NUMBER;
+	}
+
+	USBRequestSetStartFrame (pURB, nStartFrame);
+	DWHCITransferStageDataSetIsoSchedule (pStageData, nStartFrame, nInterval);
+
+	DWHCIDeviceScheduleIsochronous (pThis, pStageData);
+}
+
+// starts the current packet of an isochronous request, so that it is transferred exactly in
+// its (micro)frame, packets, which are too late already, are skipped with USBErrorFrameOverrun,
+// completes the request, if no packet is left
+void DWHCIDeviceScheduleIsochronous (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
+	assert (DWHCITransferStageDataGetState (pStageData) == StageStateIsochronous);
+
+	unsigned nFrame = DWHCIDeviceGetFrameNumber (pThis);
+
+	while (!DWHCITransferStageDataIsStageComplete (pStageData))
+	{
+		unsigned nAhead = (DWHCITransferStageDataGetIsoFrame (pStageData) - nFrame) & DWHCI_MAX_FRAME_NUMBER;
+		if (nAhead <= DWHCI_MAX_FRAME_NUMBER / 2)
+		{
+			// ODD_FRAME holds the channel back until the (micro)frame of the packet
+			if (nAhead <= 1)
+			{
+				DWHCIDeviceStartTransaction (pThis, pStageData);
+			}
+			else
+			{
+				DWHCITransferStageDataSetSubState (pStageData, StageSubStateWaitForFrame);
+
+				DWHCIDeviceWaitForFrame (pThis, pStageData, (nFrame + nAhead - 1) & DWHCI_MAX_FRAME_NUMBER);
+			}
+
+			return;
+		}
+
+		DWHCITransferStageDataIsoPacketComplete (pStageData, USBErrorFrameOverrun);
+	}
+
+	TUSBRequest *pURB = DWHCITransferStageDataGetURB (pStageData);
+
+	// the frame after the last packet
+	USBEndpointSetNextFrame (USBRequestGetEndpoint (pURB), DWHCITransferStageDataGetIsoFrame (pStageData));
+
+	USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+	USBRequestSetStatus (pURB, 1);
+
+	DWHCIDeviceFinishStage (pThis, DWHCITransferStageDataGetChannelNumber (pStageData), pURB);
+}
+
+// called on SOF, continues the waiting channels, which are due in this (micro)frame
+void DWHCIDeviceFrameHandler (TDWHCIDevice *pThis)
+{
+	assert (pThis != 0);
+
+	TDWHCIRegister FrameNumber;
+	DWHCIRegister (&FrameNumber, DWHCI_HOST_FRM_NUM);
+	unsigned nFrame = DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber));
+
+	unsigned nWaiting = pThis->m_nFrameWaiting;
+	while (nWaiting != 0)
+	{
+		unsigned nChannel = __builtin_ctz (nWaiting);
+		nWaiting &= ~(1 << nChannel);
+
+		TDWHCITransferStageData *pStageData = &pThis->m_StageData[nChannel];
+
+		// due frame reached or passed (modulo frame number range)?
+		unsigned nDue = DWHCITransferStageDataGetDueFrame (pStageData);
+		if (((nFrame - nDue) & DWHCI_MAX_FRAME_NUMBER) <= DWHCI_MAX_FRAME_NUMBER / 2)
+		{
+			pThis->m_nFrameWaiting &= ~(1 << nChannel);
+
+			if (DWHCITransferStageDataGetState (pStageData) == StageStatePeriodicDelay)
+			{
+				DWHCIDeviceStartPeriodic (pThis, pStageData);
+			}
+			else if (DWHCITransferStageDataGetState (pStageData) == StageStateIsochronous)
+			{
+				DWHCIDeviceScheduleIsochronous (pThis, pStageData);
+			}
+			else
+			{
+				assert (DWHCITransferStageDataGetSubState (pStageData) == StageSubStateWaitForFrame);
+
+				DWHCIDeviceStartChannel (pThis, pStageData);
 			}
+		}
+	}
+
+	if (pThis->m_nFrameWaiting == 0)
+	{
+		DWHCIDeviceEnableFrameInterrupt (pThis, FALSE);
+	}
+
+	_DWHCIRegister (&FrameNumber);
+}
+
+// must be called with interrupts disabled
+void DWHCIDeviceEnableFrameInterrupt (TDWHCIDevice *pThis, boolean bEnable)
+{
+	assert (pThis != 0);
+
+	TDWHCIRegister IntMask;
+	DWHCIRegister (&IntMask, DWHCI_CORE_INT_MASK);
+	DWHCIRegisterRead (&IntMask);
+
+	if (bEnable)
+	{
+		// a stale SOF status would start the requests too early
+		TDWHCIRegister IntStatus;
+		DWHCIRegister2 (&IntStatus, DWHCI_CORE_INT_STAT, DWHCI_CORE_INT_STAT_SOF_INTR);
+		DWHCIRegisterWrite (&IntStatus);
+
+		_DWHCIRegister (&IntStatus);
+
+		DWHCIRegisterOr (&IntMask, DWHCI_CORE_INT_MASK_SOF_INTR);
+	}
+	else
+	{
+		DWHCIRegisterAnd (&IntMask, ~DWHCI_CORE_INT_MASK_SOF_INTR);
+	}
+
+	DWHCIRegisterWrite (&IntMask);
+
+	_DWHCIRegister (&IntMask);
+}
+
+void DWHCIDeviceTimeoutHandler (TKernelTimerHandle hTimer, void *pParam, void *pContext)
+{
+	TDWHCIDevice *pThis = (TDWHCIDevice *) pContext;
+	assert (pThis != 0);
+
+	TUSBRequest *pURB = (TUSBRequest *) pParam;
+	assert (pURB != 0);
+
+	DataMemBarrier ();
+
+	USBRequestSetTimeoutTimer (pURB, 0);
+
+	if (DWHCIDeviceAbortRequest (pThis, pURB, USBErrorTimeout))
+	{
+		LogWrite (FromDWHCI, LOG_WARNING, "Request timed out");
+	}
+
+	DataMemBarrier ();
+}
+
+void DWHCIDevicePrepareDMA (TDWHCITransferStageData *pStageData)
+{
+	assert (pStageData != 0);
+
+	u32 nAddress = DWHCITransferStageDataGetDMAAddress (pStageData);
+	u32 nLength = DWHCITransferStageDataGetBytesToTransfer (pStageData);
+	if (   nLength == 0
+	    || IS_DMA_COHERENT (nAddress, nLength))
+	{
+		return;
+	}
+
+	if (DWHCITransferStageDataIsDirectionIn (pStageData))
+	{
+		// dirty cache lines must not be written back over the received data
+		uspi_InvalidateDataCacheRange (nAddress, nLength);
+	}
+	else
+	{
+		uspi_CleanDataCacheRange (nAddress, nLength);
+	}
+}
+
+void DWHCIDeviceCompleteDMA (TDWHCITransferStageData *pStageData)
+{
+	assert (pStageData != 0);
+
+	u32 nAddress = DWHCITransferStageDataGetDMAAddress (pStageData);
+	u32 nLength = DWHCITransferStageDataGetBytesToTransfer (pStageData);
+	if (   nLength == 0
+	    || IS_DMA_COHERENT (nAddress, nLength)
+	    || !DWHCITransferStageDataIsDirectionIn (pStageData))
+	{
+		return;
+	}
+
+	// the CPU may have fetched cache lines speculatively during the transfer
+	uspi_InvalidateDataCacheRange (nAddress, nLength);
+}
+
+// returns the buffer of the channel from the pool, DWHCI_BOUNCE_BUFFER_SIZE bytes,
+// aligned to DMA_ALIGNMENT
+void *DWHCIDeviceGetBounceBuffer (TDWHCIDevice *pThis, unsigned nChannel)
+{
+	assert (pThis != 0);
+	assert (nChannel < pThis->m_nChannels);
+	assert (pThis->m_pBounceBuffer != 0);
 
-			USBRequestSetStatus (pURB, 1);
-		}
+	return pThis->m_pBounceBuffer + nChannel * DWHCI_BOUNCE_BUFFER_SIZE;
+}
 
-		DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
-	
-		_DWHCITransferStageData (pStageData);
+unsigned DWHCIDeviceGetFrameNumber (TDWHCIDevice *pThis)
+{
+	assert (pThis != 0);
 
-		DWHCIDeviceFreeChannel (pThis, nChannel);
+	TDWHCIRegister FrameNumber;
+	DWHCIRegister (&FrameNumber, DWHCI_HOST_FRM_NUM);
+	unsigned nFrame = DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber));
 
-		USBRequestCallCompletionRoutine (pURB);
-		break;
+	_DWHCIRegister (&FrameNumber);
 
-	case StageStateStartSplit:
-		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
-		if (   (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
-		    || (nStatus & DWHCI_HOST_CHAN_INT_NAK)
-		    || (nStatus & DWHCI_HOST_CHAN_INT_NYET))
-		{
-			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
+	return nFrame;
+}
 
-			USBRequestSetStatus (pURB, 0);
+// returns the interval of a periodic endpoint in units of the frame number,
+// which counts microframes, if the root port runs at high speed
+unsigned DWHCIDeviceGetFrameInterval (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint)
+{
+	assert (pThis != 0);
 
-			DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
+	unsigned nInterval = USBEndpointGetIntervalMicroframes (pEndpoint);
+	if (DWHCIDeviceGetPortSpeed (pThis) != USBSpeedHigh)
+	{
+		nInterval = (nInterval + 7) / 8;
+	}
 
-			_DWHCITransferStageData (pStageData);
+	// a longer interval cannot be distinguished from a past frame number after wrap around
+	if (nInterval > (DWHCI_MAX_FRAME_NUMBER+1) / 2)
+	{
+		nInterval = (DWHCI_MAX_FRAME_NUMBER+1) / 2;
+	}
 
-			DWHCIDeviceFreeChannel (pThis, nChannel);
+	return nInterval;
+}
 
-			USBRequestCallCompletionRoutine (pURB);
-			break;
-		}
+// free running 1 MHz counter of the system timer
+u32 DWHCIDeviceGetTime (void)
+{
+	TDWHCIRegister Counter;
+	DWHCIRegister (&Counter, ARM_SYSTIMER_CLO);
+	u32 nTime = DWHCIRegisterRead (&Counter);
+	_DWHCIRegister (&Counter);
 
-		pFrameScheduler->TransactionComplete (pFrameScheduler, nStatus);
+	return nTime;
+}
 
-		DWHCITransferStageDataSetState (pStageData, StageStateCompleteSplit);
-		DWHCITransferStageDataSetSplitComplete (pStageData, TRUE);
+// each packet must be located in the buffer at a 4-byte aligned offset (also used in the
+// bounce buffer) and must fit into the transactions of one (micro)frame
+boolean DWHCIDeviceCheckIsoPackets (TUSBRequest *pURB)
+{
+	assert (pURB != 0);
 
-		if (!pFrameScheduler->CompleteSplit (pFrameScheduler))
-		{
-			goto LeaveCompleteSplit;
-		}
-		
-		DWHCIDeviceStartTransaction (pThis, pStageData);
-		break;
-		
-	case StageStateCompleteSplit:
-		nStatus = DWHCITransferStageDataGetTransactionStatus (pStageData);
-		if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
-		{
-			LogWrite (FromDWHCI, LOG_ERROR, "Transaction failed (status 0x%X)", nStatus);
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+	u32 nMaxLength =   USBEndpointGetMaxPacketSize (pEndpoint)
+			 * USBEndpointGetPacketsPerMicroframe (pEndpoint);
 
-			USBRequestSetStatus (pURB, 0);
+	unsigned nPackets = USBRequestGetIsoPacketCount (pURB);
+	for (unsigned i = 0; i < nPackets; i++)
+	{
+		TUSBIsoPacket *pPacket = USBRequestGetIsoPacket (pURB, i);
+		assert (pPacket != 0);
 
-			DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
+		if (   (pPacket->nOffset & 3) != 0
+		    || pPacket->nLength > nMaxLength
+		    || pPacket->nOffset > USBRequestGetBufLen (pURB)
+		    || pPacket->nLength > USBRequestGetBufLen (pURB) - pPacket->nOffset)
+		{
+			return FALSE;
+		}
+	}
 
-			_DWHCITransferStageData (pStageData);
+	return TRUE;
+}
 
-			DWHCIDeviceFreeChannel (pThis, nChannel);
+// returns the statistics entry of the endpoint, which is created on first use,
+// or 0 if the table is full, must be called with interrupts disabled
+TUSPiEndpointStatistics *DWHCIDeviceGetEndpointStatistics (TDWHCIDevice *pThis, TUSBEndpoint *pEndpoint)
+{
+	assert (pThis != 0);
+	assert (pEndpoint != 0);
 
-			USBRequestCallCompletionRoutine (pURB);
-			break;
-		}
-		
-		pFrameScheduler->TransactionComplete (pFrameScheduler, nStatus);
+	static const u8 TypeCode[] =		// as in bmAttributes of the endpoint descriptor
+	{
+		[EndpointTypeControl]		= 0,
+		[EndpointTypeBulk]		= 2,
+		[EndpointTypeInterrupt]		= 3,
+		[EndpointTypeIsochronous]	= 1
+	};
+
+	u8 ucDeviceAddress = USBDeviceGetAddress (USBEndpointGetDevice (pEndpoint));
+	assert (ucDeviceAddress <= USB_MAX_ADDRESS);
+	u8 ucEndpointAddress = USBEndpointGetNumber (pEndpoint);
+	assert (ucEndpointAddress < DWHCI_STAT_ENDPOINTS / 2);
+	unsigned nEndpoint = ucEndpointAddress;
+	if (   USBEndpointGetType (pEndpoint) != EndpointTypeControl
+	    && USBEndpointIsDirectionIn (pEndpoint))
+	{
+		ucEndpointAddress |= 0x80;
+		nEndpoint += DWHCI_STAT_ENDPOINTS / 2;
+	}
 
-		if (pFrameScheduler->CompleteSplit (pFrameScheduler))
-		{
-			DWHCIDeviceStartTransaction (pThis, pStageData);
-			break;
-		}
+	u8 *pIndex = &pThis->m_EndpointStatisticsIndex[ucDeviceAddress][nEndpoint];
+	if (*pIndex == DWHCI_STAT_TABLE_FULL)
+	{
+		return 0;
+	}
 
-	LeaveCompleteSplit:
-		if (!DWHCITransferStageDataIsStageComplete (pStageData))
+	if (*pIndex == DWHCI_STAT_NO_ENTRY)
+	{
+		unsigned nIndex = pThis->m_nEndpointStatistics;
+		if (nIndex >= USPI_MAX_STAT_ENDPOINTS)
 		{
-			if (!DWHCITransferStageDataBeginSplitCycle (pStageData))
-			{
-				USBRequestSetStatus (pURB, 0);
+			*pIndex = DWHCI_STAT_TABLE_FULL;
 
-				DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
-
-				_DWHCITransferStageData (pStageData);
+			return 0;
+		}
 
-				DWHCIDeviceFreeChannel (pThis, nChannel);
+		TUSPiEndpointStatistics *pStat = &pThis->m_EndpointStatistics[nIndex];
+		memset (pStat, 0, sizeof *pStat);
+		pStat->ucDeviceAddress = ucDeviceAddress;
+		pStat->ucEndpointAddress = ucEndpointAddress;
+		pStat->ucType = TypeCode[USBEndpointGetType (pEndpoint)];
 
-				USBRequestCallCompletionRoutine (pURB);
-				break;
-			}
+		pThis->m_nEndpointStatistics++;
 
-			if (!DWHCITransferStageDataIsPeriodic (pStageData))
-			{
-				DWHCITransferStageDataSetState (pStageData, StageStateStartSplit);
-				DWHCITransferStageDataSetSplitComplete (pStageData, FALSE);
+		*pIndex = (u8) (nIndex + 1);
+	}
 
-				pFrameScheduler->StartSplit (pFrameScheduler);
+	return &pThis->m_EndpointStatistics[*pIndex - 1];
+}
 
-				DWHCIDeviceStartTransaction (pThis, pStageData);
-			}
-			else
-			{
-				DWHCITransferStageDataSetState (pStageData, StageStatePeriodicDelay);
+void DWHCIDeviceCountStatus (TUSPiTransferCounters *pCounters, u32 nStatus, u32 nBytes, boolean bSplitRetry)
+{
+	assert (pCounters != 0);
 
-				unsigned nInterval = USBEndpointGetInterval (USBRequestGetEndpoint (pURB));
+	pCounters->nTransactions++;
+	pCounters->nBytes += nBytes;
 
-				StartKernelTimer (MSEC2HZ (nInterval), DWHCIDeviceTimerHandler, pStageData, pThis);
-			}
-			break;
-		}
+	if (nStatus & DWHCI_HOST_CHAN_INT_NAK)
+	{
+		pCounters->nNAKs++;
+	}
 
-		DWHCIDeviceDisableChannelInterrupt (pThis, nChannel);
+	if (nStatus & DWHCI_HOST_CHAN_INT_NYET)
+	{
+		pCounters->nNYETs++;
 
-		if (!DWHCITransferStageDataIsStatusStage (pStageData))
+		if (bSplitRetry)
 		{
-			USBRequestSetResultLen (pURB, DWHCITransferStageDataGetResultLen (pStageData));
+			pCounters->nSplitRetries++;
 		}
-		USBRequestSetStatus (pURB, 1);
+	}
+
+	if (nStatus & DWHCI_HOST_CHAN_INT_XACT_ERROR)
+	{
+		pCounters->nXactErrors++;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_BABBLE_ERROR)
+	{
+		pCounters->nBabbleErrors++;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+	{
+		pCounters->nOtherErrors++;
+	}
+}
 
-		_DWHCITransferStageData (pStageData);
+// called from the channel interrupt handler after each transaction
+void DWHCIDeviceCountTransaction (TDWHCIDevice *pThis, TDWHCITransferStageData *pStageData, u32 nStatus, u32 nBytes)
+{
+	assert (pThis != 0);
+	assert (pStageData != 0);
 
-		DWHCIDeviceFreeChannel (pThis, nChannel);
+	// a NYET to a complete split lets the complete split be repeated
+	boolean bSplitRetry =    DWHCITransferStageDataIsSplit (pStageData)
+			      && DWHCITransferStageDataIsSplitComplete (pStageData);
 
-		USBRequestCallCompletionRoutine (pURB);
-		break;
+	unsigned nChannel = DWHCITransferStageDataGetChannelNumber (pStageData);
+	assert (nChannel < DWHCI_MAX_CHANNELS);
+	DWHCIDeviceCountStatus (&pThis->m_ChannelCounters[nChannel], nStatus, nBytes, bSplitRetry);
 
-	default:
-		assert (0);
-		break;
+	TUSBRequest *pURB = DWHCITransferStageDataGetURB (pStageData);
+	assert (pURB != 0);
+	TUSPiEndpointStatistics *pStat = DWHCIDeviceGetEndpointStatistics (pThis, USBRequestGetEndpoint (pURB));
+	if (pStat != 0)
+	{
+		DWHCIDeviceCountStatus (&pStat->Counters, nStatus, nBytes, bSplitRetry);
 	}
 }
 
-void DWHCIDeviceInterruptHandler (void *pParam)
+// counts the request and its latency from submit to completion
+void DWHCIDeviceCountRequest (TDWHCIDevice *pThis, TUSBRequest *pURB)
 {
-	TDWHCIDevice *pThis = (TDWHCIDevice *) pParam;
 	assert (pThis != 0);
+	assert (pURB != 0);
 
-	DataMemBarrier ();
-
-	TDWHCIRegister IntStatus;
-	DWHCIRegister (&IntStatus, DWHCI_CORE_INT_STAT);
-	DWHCIRegisterRead (&IntStatus);
+	TUSPiEndpointStatistics *pStat = DWHCIDeviceGetEndpointStatistics (pThis, USBRequestGetEndpoint (pURB));
+	if (pStat == 0)
+	{
+		return;
+	}
 
-	if (DWHCIRegisterGet (&IntStatus) & DWHCI_CORE_INT_STAT_HC_INTR)
+	pStat->nRequests++;
+	if (!USBRequestGetStatus (pURB))
 	{
-		TDWHCIRegister AllChanInterrupt;
-		DWHCIRegister (&AllChanInterrupt, DWHCI_HOST_ALLCHAN_INT);
-		DWHCIRegisterRead (&AllChanInterrupt);
-		DWHCIRegisterWrite (&AllChanInterrupt);
-		
-		unsigned nChannelMask = 1;
-		for (unsigned nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
-		{
-			if (DWHCIRegisterGet (&AllChanInterrupt) & nChannelMask)
-			{
-				TDWHCIRegister ChanInterruptMask;
-				DWHCIRegister2 (&ChanInterruptMask, DWHCI_HOST_CHAN_INT_MASK(nChannel), 0);
-				DWHCIRegisterWrite (&ChanInterruptMask);
-				
-				DWHCIDeviceChannelInterruptHandler (pThis, nChannel);
+		pStat->nFailedRequests++;
+	}
 
-				_DWHCIRegister (&ChanInterruptMask);
-			}
-			
-			nChannelMask <<= 1;
-		}
+	u32 nLatency = DWHCIDeviceGetTime () - USBRequestGetSubmitTime (pURB);
 
-		_DWHCIRegister (&AllChanInterrupt);
-	}
-#if 0	
-	if (IntStatus.Get () & DWHCI_CORE_INT_STAT_PORT_INTR)
+	unsigned nBucket = nLatency > 0 ? 31 - __builtin_clz (nLatency) : 0;
+	if (nBucket >= USPI_LATENCY_BUCKETS)
 	{
-		CDWHCIRegister HostPort (DWHCI_HOST_PORT);
-		HostPort.Read ();
-		
-		CLogger::Get ()->Write (FromDWHCI, LOG_DEBUG, "Port interrupt (status 0x%08X)", HostPort.Get ());
-		
-		HostPort.And (~DWHCI_HOST_PORT_ENABLE);
-		HostPort.Or (  DWHCI_HOST_PORT_CONNECT_CHANGED
-			     | DWHCI_HOST_PORT_ENABLE_CHANGED
-			     | DWHCI_HOST_PORT_OVERCURRENT_CHANGED);
-		HostPort.Write ();
-		
-		IntStatus.Or (DWHCI_CORE_INT_STAT_PORT_INTR);
+		nBucket = USPI_LATENCY_BUCKETS-1;
 	}
-#endif
-	DWHCIRegisterWrite (&IntStatus);
+	pStat->nLatencyHistogram[nBucket]++;
 
-	DataMemBarrier ();
-	
-	_DWHCIRegister (&IntStatus);
+	pStat->nLatencySum += nLatency;
+	if (pStat->nLatencyMax < nLatency)
+	{
+		pStat->nLatencyMax = nLatency;
+	}
 }
 
-void DWHCIDeviceTimerHandler (TKernelTimerHandle hTimer, void *pParam, void *pContext)
+TUSBError DWHCIDeviceGetUSBError (unsigned nStatus)
 {
-	TDWHCIDevice *pThis = (TDWHCIDevice *) pContext;
-	assert (pThis != 0);
-	
-	TDWHCITransferStageData *pStageData = (TDWHCITransferStageData *) pParam;
-	assert (pStageData != 0);
-	
-	DataMemBarrier ();
-
-	assert (pStageData != 0);
-	assert (DWHCITransferStageDataGetState (pStageData) == StageStatePeriodicDelay);
-
-	if (DWHCITransferStageDataIsSplit (pStageData))
+	if (nStatus & DWHCI_HOST_CHAN_INT_STALL)
 	{
-		DWHCITransferStageDataSetState (pStageData, StageStateStartSplit);
-		
-		DWHCITransferStageDataSetSplitComplete (pStageData, FALSE);
-		TDWHCIFrameScheduler *pFrameScheduler =
-			DWHCITransferStageDataGetFrameScheduler (pStageData);
-		assert (pFrameScheduler != 0);
-		pFrameScheduler->StartSplit (pFrameScheduler);
+		return USBErrorStall;
 	}
-	else
+	else if (nStatus & DWHCI_HOST_CHAN_INT_XACT_ERROR)
 	{
-		DWHCITransferStageDataSetState (pStageData, StageStateNoSplitTransfer);
+		return USBErrorTransaction;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_BABBLE_ERROR)
+	{
+		return USBErrorBabble;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_FRAME_OVERRUN)
+	{
+		return USBErrorFrameOverrun;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_DATA_TOGGLE_ERROR)
+	{
+		return USBErrorDataToggle;
+	}
+	else if (nStatus & DWHCI_HOST_CHAN_INT_AHB_ERROR)
+	{
+		return USBErrorHostBus;
+	}
+	else if (nStatus & (DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_NYET))
+	{
+		return USBErrorSplit;			// in start split
 	}
 
-	DWHCIDeviceStartTransaction (pThis, pStageData);
+	return USBErrorUnknown;
+}
 
-	DataMemBarrier ();
+TDWHCIChannelClass DWHCIDeviceGetChannelClass (TUSBEndpoint *pEndpoint)
+{
+	switch (USBEndpointGetType (pEndpoint))
+	{
+	case EndpointTypeControl:
+		return DWHCIChannelClassControl;
+
+	case EndpointTypeBulk:
+		return DWHCIChannelClassBulk;
+
+	default:
+		return DWHCIChannelClassPeriodic;
+	}
 }
 
-unsigned DWHCIDeviceAllocateChannel (TDWHCIDevice *pThis)
+// periodic transfers prefer the reserved channels, but can use all others too,
+// the highest free channel is found with a single CLZ instruction
+unsigned DWHCIDeviceAllocateChannel (TDWHCIDevice *pThis, TDWHCIChannelClass Class)
 {
 	assert (pThis != 0);
+	assert (Class < DWHCIChannelClassUnknown);
 
 	uspi_EnterCritical ();
 
-	unsigned nChannelMask = 1;
-	for (unsigned nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
+	u32 nFree = ~pThis->m_nChannelAllocated & ((1 << pThis->m_nChannels) - 1);
+	if (Class != DWHCIChannelClassPeriodic)
 	{
-		if (!(pThis->m_nChannelAllocated & nChannelMask))
-		{
-			pThis->m_nChannelAllocated |= nChannelMask;
+		nFree &= ~pThis->m_nChannelReserved;
+	}
 
-			uspi_LeaveCritical ();
-			
-			return nChannel;
-		}
-		
-		nChannelMask <<= 1;
+	if (nFree == 0)
+	{
+		uspi_LeaveCritical ();
+
+		return DWHCI_MAX_CHANNELS;
 	}
-	
+
+	unsigned nChannel = 31 - __builtin_clz (nFree);
+
+	pThis->m_nChannelAllocated |= 1 << nChannel;
+	pThis->m_ChannelClass[nChannel] = (u8) Class;
+
+	TDWHCIChannelStatistics *pStatistics = &pThis->m_ChannelStatistics[Class];
+	pStatistics->nAllocations++;
+	if (++pStatistics->nInUse > pStatistics->nMaxInUse)
+	{
+		pStatistics->nMaxInUse = pStatistics->nInUse;
+	}
+
 	uspi_LeaveCritical ();
-	
-	return DWHCI_MAX_CHANNELS;
+
+	return nChannel;
 }
 
 void DWHCIDeviceFreeChannel (TDWHCIDevice *pThis, unsigned nChannel)
@@ -1277,10 +2699,60 @@ void DWHCIDeviceFreeChannel (TDWHCIDevice *pThis, unsigned nChannel)
 	
 	assert (pThis->m_nChannelAllocated & nChannelMask);
 	pThis->m_nChannelAllocated &= ~nChannelMask;
+
+	TDWHCIChannelStatistics *pStatistics = &pThis->m_ChannelStatistics[pThis->m_ChannelClass[nChannel]];
+	assert (pStatistics->nInUse > 0);
+	pStatistics->nInUse--;
 	
 	uspi_LeaveCritical ();
 }
 
+void DWHCIDeviceGetChannelStatistics (TDWHCIDevice *pThis, TDWHCIChannelClass Class,
+				      TDWHCIChannelStatistics *pStatistics)
+{
+	assert (pThis != 0);
+	assert (Class < DWHCIChannelClassUnknown);
+	assert (pStatistics != 0);
+
+	uspi_EnterCritical ();
+
+	*pStatistics = pThis->m_ChannelStatistics[Class];
+
+	uspi_LeaveCritical ();
+}
+
+void DWHCIDeviceGetHostStatistics (TDWHCIDevice *pThis, TUSPiHostStatistics *pStatistics)
+{
+	assert (pThis != 0);
+	assert (pStatistics != 0);
+
+#if USPI_MAX_CHANNELS < DWHCI_MAX_CHANNELS
+	#error USPI_MAX_CHANNELS is too small
+#endif
+
+	uspi_EnterCritical ();
+
+	pStatistics->nChannels = pThis->m_nChannels;
+	memcpy (pStatistics->Channel, pThis->m_ChannelCounters, sizeof pThis->m_ChannelCounters);
+
+	pStatistics->nChannelAllocations = 0;
+	pStatistics->nChannelAllocationFailures = 0;
+	for (unsigned nClass = 0; nClass < DWHCIChannelClassUnknown; nClass++)
+	{
+		pStatistics->nChannelAllocations += pThis->m_ChannelStatistics[nClass].nAllocations;
+		pStatistics->nChannelAllocationFailures += pThis->m_ChannelStatistics[nClass].nDeferred;
+	}
+
+	pStatistics->nBouncedStages = pThis->m_BounceStatistics.nStages;
+	pStatistics->nBouncedBytes = pThis->m_BounceStatistics.nBytes;
+
+	pStatistics->nEndpoints = pThis->m_nEndpointStatistics;
+	memcpy (pStatistics->Endpoint, pThis->m_EndpointStatistics,
+		pThis->m_nEndpointStatistics * sizeof (TUSPiEndpointStatistics));
+
+	uspi_LeaveCritical ();
+}
+
 boolean DWHCIDeviceWaitForBit (TDWHCIDevice *pThis, TDWHCIRegister *pRegister, u32 nMask, boolean bWaitUntilSet, unsigned nMsTimeout)
 {
 	assert (pThis != 0);
@@ -22,8 +22,6 @@
 #include <uspi/assert.h>
 #include <uspios.h>
 
-#define uFRAME			125		// micro seconds
-
 typedef enum
 {
 	StateStartSplit,
@@ -46,10 +44,11 @@ void DWHCIFrameSchedulerNonPeriodic (TDWHCIFrameSchedulerNonPeriodic *pThis)
 	pBase->StartSplit = DWHCIFrameSchedulerNonPeriodicStartSplit;
 	pBase->CompleteSplit = DWHCIFrameSchedulerNonPeriodicCompleteSplit;
 	pBase->TransactionComplete = DWHCIFrameSchedulerNonPeriodicTransactionComplete;
-	pBase->WaitForFrame = DWHCIFrameSchedulerNonPeriodicWaitForFrame;
+	pBase->GetFramesToWait = DWHCIFrameSchedulerNonPeriodicGetFramesToWait;
 	pBase->IsOddFrame = DWHCIFrameSchedulerNonPeriodicIsOddFrame;
 
 	pThis->m_nState = StateUnknown;
+	pThis->m_nDelay = 0;
 }
 
 void _DWHCIFrameSchedulerNonPeriodic (TDWHCIFrameScheduler *pBase)
@@ -85,7 +84,7 @@ boolean DWHCIFrameSchedulerNonPeriodicCompleteSplit (TDWHCIFrameScheduler *pBase
 
 	case StateCompleteSplit:
 	case StateCompleteRetry:
-		usDelay (5 * uFRAME);
+		pThis->m_nDelay = 5;
 		bResult = TRUE;
 		break;
 
@@ -134,7 +133,7 @@ void DWHCIFrameSchedulerNonPeriodicTransactionComplete (TDWHCIFrameScheduler *pB
 		{
 			if (pThis->m_nTries-- == 0)
 			{
-				usDelay (5 * uFRAME);
+				pThis->m_nDelay = 5;
 				pThis->m_nState = StateCompleteSplitFailed;
 			}
 			else
@@ -155,8 +154,16 @@ void DWHCIFrameSchedulerNonPeriodicTransactionComplete (TDWHCIFrameScheduler *pB
 	}
 }
 
-void DWHCIFrameSchedulerNonPeriodicWaitForFrame (TDWHCIFrameScheduler *pBase)
+unsigned DWHCIFrameSchedulerNonPeriodicGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame)
 {
+	TDWHCIFrameSchedulerNonPeriodic *pThis = (TDWHCIFrameSchedulerNonPeriodic *) pBase;
+	assert (pThis != 0);
+
+	// split transactions are used with a high-speed root port only, so this counts microframes
+	unsigned nDelay = pThis->m_nDelay;
+	pThis->m_nDelay = 0;
+
+	return nDelay;
 }
 
 boolean DWHCIFrameSchedulerNonPeriodicIsOddFrame (TDWHCIFrameScheduler *pBase)
@@ -18,7 +18,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <uspi/dwhciframeschednsplit.h>
-#include <uspi/dwhciregister.h>
+#include <uspi/dwhci.h>
 #include <uspi/assert.h>
 
 #define FRAME_UNSET	(DWHCI_MAX_FRAME_NUMBER+1)
@@ -33,12 +33,12 @@ void DWHCIFrameSchedulerNoSplit (TDWHCIFrameSchedulerNoSplit *pThis, boolean bIs
 	pBase->StartSplit = DWHCIFrameSchedulerNoSplitStartSplit;
 	pBase->CompleteSplit = DWHCIFrameSchedulerNoSplitCompleteSplit;
 	pBase->TransactionComplete = DWHCIFrameSchedulerNoSplitTransactionComplete;
-	pBase->WaitForFrame = DWHCIFrameSchedulerNoSplitWaitForFrame;
+	pBase->GetFramesToWait = DWHCIFrameSchedulerNoSplitGetFramesToWait;
 	pBase->IsOddFrame = DWHCIFrameSchedulerNoSplitIsOddFrame;
 
 	pThis->m_bIsPeriodic = bIsPeriodic;
 	pThis->m_nNextFrame = FRAME_UNSET;
-
+	pThis->m_bWaiting = FALSE;
 }
 
 void _DWHCIFrameSchedulerNoSplit (TDWHCIFrameScheduler *pBase)
@@ -61,25 +61,30 @@ void DWHCIFrameSchedulerNoSplitTransactionComplete (TDWHCIFrameScheduler *pBase,
 	assert (0);
 }
 
-void DWHCIFrameSchedulerNoSplitWaitForFrame (TDWHCIFrameScheduler *pBase)
+unsigned DWHCIFrameSchedulerNoSplitGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame)
 {
 	TDWHCIFrameSchedulerNoSplit *pThis = (TDWHCIFrameSchedulerNoSplit *) pBase;
 	assert (pThis != 0);
 
-	TDWHCIRegister FrameNumber;
-	DWHCIRegister (&FrameNumber, DWHCI_HOST_FRM_NUM);
+	if (pThis->m_bIsPeriodic)
+	{
+		pThis->m_nNextFrame = (nFrame+1) & DWHCI_MAX_FRAME_NUMBER;
 
-	pThis->m_nNextFrame = (DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber))+1) & DWHCI_MAX_FRAME_NUMBER;
+		return 0;
+	}
 
-	if (!pThis->m_bIsPeriodic)
+	// a non-periodic transaction is started at the beginning of the next frame
+	if (!pThis->m_bWaiting)
 	{
-		while ((DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber)) & DWHCI_MAX_FRAME_NUMBER) != pThis->m_nNextFrame)
-		{
-			// do nothing
-		}
+		pThis->m_nNextFrame = (nFrame+1) & DWHCI_MAX_FRAME_NUMBER;
+		pThis->m_bWaiting = TRUE;
+
+		return 1;
 	}
 
-	_DWHCIRegister (&FrameNumber);
+	pThis->m_bWaiting = FALSE;
+
+	return 0;
 }
 
 boolean DWHCIFrameSchedulerNoSplitIsOddFrame (TDWHCIFrameScheduler *pBase)
@@ -18,13 +18,11 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <uspi/dwhciframeschedper.h>
-#include <uspi/dwhciregister.h>
 #include <uspi/dwhci.h>
+#include <uspi/usbtranslator.h>
 #include <uspi/assert.h>
 #include <uspios.h>
 
-#define uFRAME			125		// micro seconds
-
 #define FRAME_UNSET		8
 
 typedef enum
@@ -39,7 +37,7 @@ typedef enum
 }
 TFrameSchedulerState;
 
-void DWHCIFrameSchedulerPeriodic (TDWHCIFrameSchedulerPeriodic *pThis)
+void DWHCIFrameSchedulerPeriodic (TDWHCIFrameSchedulerPeriodic *pThis, unsigned nStartMicroframe)
 {
 	assert (pThis != 0);
 
@@ -49,11 +47,15 @@ void DWHCIFrameSchedulerPeriodic (TDWHCIFrameSchedulerPeriodic *pThis)
 	pBase->StartSplit = DWHCIFrameSchedulerPeriodicStartSplit;
 	pBase->CompleteSplit = DWHCIFrameSchedulerPeriodicCompleteSplit;
 	pBase->TransactionComplete = DWHCIFrameSchedulerPeriodicTransactionComplete;
-	pBase->WaitForFrame = DWHCIFrameSchedulerPeriodicWaitForFrame;
+	pBase->GetFramesToWait = DWHCIFrameSchedulerPeriodicGetFramesToWait;
 	pBase->IsOddFrame = DWHCIFrameSchedulerPeriodicIsOddFrame;
 
 	pThis->m_nState = StateUnknown;
+	pThis->m_nStartFrame = nStartMicroframe != USB_TT_NO_MICROFRAME ? nStartMicroframe : FRAME_UNSET;
 	pThis->m_nNextFrame = FRAME_UNSET;
+	pThis->m_nDelay = 0;
+
+	assert (pThis->m_nStartFrame != 6);
 }
 
 void _DWHCIFrameSchedulerPeriodic (TDWHCIFrameScheduler *pBase)
@@ -70,7 +72,7 @@ void DWHCIFrameSchedulerPeriodicStartSplit (TDWHCIFrameScheduler *pBase)
 	assert (pThis != 0);
 
 	pThis->m_nState = StateStartSplit;
-	pThis->m_nNextFrame = FRAME_UNSET;
+	pThis->m_nNextFrame = pThis->m_nStartFrame;
 }
 
 boolean DWHCIFrameSchedulerPeriodicCompleteSplit (TDWHCIFrameScheduler *pBase)
@@ -130,7 +132,7 @@ void DWHCIFrameSchedulerPeriodicTransactionComplete (TDWHCIFrameScheduler *pBase
 			{
 				pThis->m_nState = StateCompleteSplitFailed;
 
-				usDelay (8 * uFRAME);
+				pThis->m_nDelay = 8;
 			}
 			else
 			{
@@ -139,7 +141,7 @@ void DWHCIFrameSchedulerPeriodicTransactionComplete (TDWHCIFrameScheduler *pBase
 		}
 		else if (nStatus & DWHCI_HOST_CHAN_INT_NAK)
 		{
-			usDelay (5 * uFRAME);
+			pThis->m_nDelay = 5;
 			pThis->m_nState = StateCompleteSplitFailed;
 		}
 		else
@@ -155,29 +157,30 @@ void DWHCIFrameSchedulerPeriodicTransactionComplete (TDWHCIFrameScheduler *pBase
 	}
 }
 
-void DWHCIFrameSchedulerPeriodicWaitForFrame (TDWHCIFrameScheduler *pBase)
+unsigned DWHCIFrameSchedulerPeriodicGetFramesToWait (TDWHCIFrameScheduler *pBase, unsigned nFrame)
 {
 	TDWHCIFrameSchedulerPeriodic *pThis = (TDWHCIFrameSchedulerPeriodic *) pBase;
 	assert (pThis != 0);
 
-	TDWHCIRegister FrameNumber;
-	DWHCIRegister (&FrameNumber, DWHCI_HOST_FRM_NUM);
+	// split transactions are used with a high-speed root port only, so this counts microframes
+	if (pThis->m_nDelay != 0)
+	{
+		unsigned nDelay = pThis->m_nDelay;
+		pThis->m_nDelay = 0;
+
+		return nDelay;
+	}
 
 	if (pThis->m_nNextFrame == FRAME_UNSET)
 	{
-		pThis->m_nNextFrame = (DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber)) + 1) & 7;
+		pThis->m_nNextFrame = (nFrame + 1) & 7;
 		if (pThis->m_nNextFrame == 6)
 		{
 			pThis->m_nNextFrame++;
 		}
 	}
 
-	while ((DWHCI_HOST_FRM_NUM_NUMBER (DWHCIRegisterRead (&FrameNumber)) & 7) != pThis->m_nNextFrame)
-	{
-		// do nothing
-	}
-
-	_DWHCIRegister (&FrameNumber);
+	return (pThis->m_nNextFrame - nFrame) & 7;
 }
 
 boolean DWHCIFrameSchedulerPeriodicIsOddFrame (TDWHCIFrameScheduler *pBase)
@@ -45,7 +45,11 @@ void _DWHCIRegister (TDWHCIRegister *pThis)
 u32 DWHCIRegisterRead (TDWHCIRegister *pThis)
 {
 	assert (pThis != 0);
+#ifndef USPI_MMIO_BACKEND
 	pThis->m_nBuffer = *(volatile u32 *) pThis->m_nAddress;
+#else
+	pThis->m_nBuffer = MMIORead (pThis->m_nAddress);
+#endif
 	pThis->m_bValid = TRUE;
 	
 	return pThis->m_nBuffer;
@@ -55,7 +59,11 @@ void DWHCIRegisterWrite (TDWHCIRegister *pThis)
 {
 	assert (pThis != 0);
 	assert (pThis->m_bValid);
+#ifndef USPI_MMIO_BACKEND
 	*(volatile u32 *) pThis->m_nAddress = pThis->m_nBuffer;
+#else
+	MMIOWrite (pThis->m_nAddress, pThis->m_nBuffer);
+#endif
 }
 
 u32 DWHCIRegisterGet (TDWHCIRegister *pThis)
@@ -19,9 +19,20 @@
 //
 #include <uspi/dwhcixferstagedata.h>
 #include <uspi/dwhci.h>
+#include <uspi/synchronize.h>
+#include <uspi/util.h>
 #include <uspios.h>
 #include <uspi/assert.h>
 
+// limits of the transfer size register of a channel, larger stages are transferred in segments
+#define MAX_BYTES_PER_SEGMENT	DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK
+#define MAX_PACKETS_PER_SEGMENT	(DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__MASK >> DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__SHIFT)
+
+static void DWHCITransferStageDataSetupSegment (TDWHCITransferStageData *pThis);
+static void DWHCITransferStageDataFillBounceBuffer (TDWHCITransferStageData *pThis);
+static void DWHCITransferStageDataFlushBounceBuffer (TDWHCITransferStageData *pThis);
+static void DWHCITransferStageDataSetupIsoPacket (TDWHCITransferStageData *pThis);
+
 void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel, TUSBRequest *pURB, boolean bIn, boolean bStatusStage)
 {
 	assert (pThis != 0);
@@ -31,10 +42,18 @@ void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel,
 	pThis->m_bIn = bIn;
 	pThis->m_bStatusStage = bStatusStage;
 	pThis->m_bSplitComplete = FALSE;
+	pThis->m_nIsoPacket = 0;
+	pThis->m_nIsoStartFrame = 0;
+	pThis->m_nIsoInterval = 1;
 	pThis->m_nTotalBytesTransfered = 0;
 	pThis->m_nState = 0;
 	pThis->m_nSubState = 0;
 	pThis->m_nTransactionStatus = 0;
+	pThis->m_nDueFrame = 0;
+	pThis->m_pBounceBuffer = 0;
+	pThis->m_nBounceSize = 0;
+	pThis->m_nBounceOffset = 0;
+	pThis->m_pBounceData = 0;
 	pThis->m_bFrameSchedulerUsed = FALSE;
 
 	assert (pThis->m_pURB != 0);
@@ -50,7 +69,20 @@ void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel,
 	pThis->m_bSplitTransaction =    USBDeviceGetHubAddress (pThis->m_pDevice) != 0
 				     && pThis->m_Speed != USBSpeedHigh;
 
-	if (!bStatusStage)
+	pThis->m_bIsochronous = USBEndpointGetType (pThis->m_pEndpoint) == EndpointTypeIsochronous;
+
+	if (pThis->m_bIsochronous)
+	{
+		assert (!bStatusStage);
+		assert (!pThis->m_bSplitTransaction);		// not supported
+
+		pThis->m_nTransferSize = USBRequestGetBufLen (pURB);
+		pThis->m_nPackets = USBRequestGetIsoPacketCount (pURB);	// descriptors left
+		assert (pThis->m_nPackets > 0);
+
+		DWHCITransferStageDataSetupIsoPacket (pThis);
+	}
+	else if (!bStatusStage)
 	{
 		if (USBEndpointGetNextPID (pThis->m_pEndpoint, bStatusStage) == USBPIDSetup)
 		{
@@ -80,8 +112,7 @@ void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel,
 		}
 		else
 		{
-			pThis->m_nBytesPerTransaction = pThis->m_nTransferSize;
-			pThis->m_nPacketsPerTransaction = pThis->m_nPackets;
+			DWHCITransferStageDataSetupSegment (pThis);
 		}
 	}
 	else
@@ -95,13 +126,13 @@ void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel,
 	}
 
 	assert (pThis->m_pBufferPointer != 0);
-	assert (((uintptr) pThis->m_pBufferPointer & 3) == 0);
 
 	if (pThis->m_bSplitTransaction)
 	{
 		if (DWHCITransferStageDataIsPeriodic (pThis))
 		{
-			DWHCIFrameSchedulerPeriodic (&pThis->m_FrameScheduler.Periodic);
+			DWHCIFrameSchedulerPeriodic (&pThis->m_FrameScheduler.Periodic,
+						     USBEndpointGetStartSplitMicroframe (pThis->m_pEndpoint));
 		}
 		else
 		{
@@ -110,7 +141,7 @@ void DWHCITransferStageData (TDWHCITransferStageData *pThis, unsigned nChannel,
 
 		pThis->m_bFrameSchedulerUsed = TRUE;
 	}
-	else
+	else if (!pThis->m_bIsochronous)		// scheduled by the frame number of each packet
 	{
 		if (   USBDeviceGetHubAddress (pThis->m_pDevice) == 0
 		    && pThis->m_Speed != USBSpeedHigh)
@@ -132,6 +163,28 @@ void _DWHCITransferStageData (TDWHCITransferStageData *pThis)
 		pThis->m_FrameScheduler.Base._DWHCIFrameScheduler (&pThis->m_FrameScheduler.Base);
 	}
 
+	if (   pThis->m_pBounceBuffer != 0
+	    && pThis->m_bIn)
+	{
+		u8 *pBuffer = (u8 *) USBRequestGetBuffer (pThis->m_pURB);
+
+		if (pThis->m_bIsochronous)
+		{
+			for (unsigned i = 0; i < pThis->m_nIsoPacket; i++)
+			{
+				TUSBIsoPacket *pPacket = USBRequestGetIsoPacket (pThis->m_pURB, i);
+				memcpy (pBuffer + pPacket->nOffset, (u8 *) pThis->m_pBounceBuffer + pPacket->nOffset,
+					pPacket->nActualLength);
+			}
+		}
+		else
+		{
+			DWHCITransferStageDataFlushBounceBuffer (pThis);
+		}
+	}
+
+	pThis->m_pBounceBuffer = 0;
+	pThis->m_pBounceData = 0;
 	pThis->m_pBufferPointer = 0;
 
 	pThis->m_pEndpoint = 0;
@@ -154,6 +207,20 @@ void DWHCITransferStageDataTransactionComplete (TDWHCITransferStageData *pThis,
 
 	pThis->m_nTransactionStatus = nStatus;
 
+	if (pThis->m_bIsochronous)
+	{
+		// no handshake and no data toggle, an error does only affect this packet
+		if (!(nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK))
+		{
+			u32 nBytesTransfered = pThis->m_nBytesPerTransaction - nBytesLeft;
+
+			USBRequestGetIsoPacket (pThis->m_pURB, pThis->m_nIsoPacket)->nActualLength = nBytesTransfered;
+			pThis->m_nTotalBytesTransfered += nBytesTransfered;
+		}
+
+		return;
+	}
+
 	if (  nStatus
 	    & (  DWHCI_HOST_CHAN_INT_ERROR_MASK
 	       | DWHCI_HOST_CHAN_INT_NAK
@@ -175,6 +242,14 @@ void DWHCITransferStageDataTransactionComplete (TDWHCITransferStageData *pThis,
 	
 	pThis->m_nTotalBytesTransfered += nBytesTransfered;
 	pThis->m_pBufferPointer = (u8 *) pThis->m_pBufferPointer + nBytesTransfered;
+
+	// the next part of the stage is bounced, when the bounce buffer has been used up
+	if (   pThis->m_pBounceBuffer != 0
+	    && pThis->m_nTotalBytesTransfered - pThis->m_nBounceOffset >= pThis->m_nBounceSize)
+	{
+		DWHCITransferStageDataFlushBounceBuffer (pThis);
+		DWHCITransferStageDataFillBounceBuffer (pThis);
+	}
 	
 	if (   !pThis->m_bSplitTransaction
 	    || pThis->m_bSplitComplete)
@@ -185,6 +260,21 @@ void DWHCITransferStageDataTransactionComplete (TDWHCITransferStageData *pThis,
 	assert (nPacketsTransfered <= pThis->m_nPackets);
 	pThis->m_nPackets -= nPacketsTransfered;
 
+	if (!pThis->m_bSplitTransaction)
+	{
+		// a short packet completes the stage, otherwise the next segment follows (if any)
+		if (nBytesLeft > 0)
+		{
+			pThis->m_nPackets = 0;
+		}
+		else
+		{
+			DWHCITransferStageDataSetupSegment (pThis);
+		}
+
+		return;
+	}
+
 	// if (pThis->m_nTotalBytesTransfered > pThis->m_nTransferSize) this will be false:
 	if (pThis->m_nTransferSize - pThis->m_nTotalBytesTransfered < pThis->m_nBytesPerTransaction)
 	{
@@ -225,11 +315,129 @@ unsigned DWHCITransferStageDataGetSubState (TDWHCITransferStageData *pThis)
 	return pThis->m_nSubState;
 }
 
+void DWHCITransferStageDataSetDueFrame (TDWHCITransferStageData *pThis, unsigned nFrame)
+{
+	assert (pThis != 0);
+	pThis->m_nDueFrame = nFrame;
+}
+
+unsigned DWHCITransferStageDataGetDueFrame (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nDueFrame;
+}
+
 boolean DWHCITransferStageDataBeginSplitCycle (TDWHCITransferStageData *pThis)
 {
 	return TRUE;
 }
 
+boolean DWHCITransferStageDataIsIsochronous (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bIsochronous;
+}
+
+void DWHCITransferStageDataSetIsoSchedule (TDWHCITransferStageData *pThis, unsigned nStartFrame, unsigned nInterval)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bIsochronous);
+	assert (nInterval > 0);
+
+	pThis->m_nIsoStartFrame = nStartFrame;
+	pThis->m_nIsoInterval = nInterval;
+}
+
+unsigned DWHCITransferStageDataGetIsoFrame (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bIsochronous);
+
+	return (pThis->m_nIsoStartFrame + pThis->m_nIsoPacket * pThis->m_nIsoInterval) & DWHCI_MAX_FRAME_NUMBER;
+}
+
+void DWHCITransferStageDataIsoPacketComplete (TDWHCITransferStageData *pThis, TUSBError Error)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bIsochronous);
+	assert (pThis->m_nPackets > 0);
+
+	USBRequestGetIsoPacket (pThis->m_pURB, pThis->m_nIsoPacket)->Error = Error;
+
+	pThis->m_nIsoPacket++;
+	if (--pThis->m_nPackets > 0)
+	{
+		DWHCITransferStageDataSetupIsoPacket (pThis);
+	}
+}
+
+u32 DWHCITransferStageDataGetBounceSize (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pBounceBuffer == 0);
+
+	if (   pThis->m_bStatusStage
+	    || pThis->m_nTransferSize == 0)
+	{
+		return 0;
+	}
+
+	// the controller requires 4-byte aligned buffers, the invalidation of an IN buffer
+	// must not affect other data in the same cache lines
+	uintptr nAddress = (uintptr) (pThis->m_bIsochronous ? USBRequestGetBuffer (pThis->m_pURB)
+							    : pThis->m_pBufferPointer);
+	if (   (nAddress & 3) == 0
+	    && (   !pThis->m_bIn
+		|| IS_DMA_COHERENT (nAddress, pThis->m_nTransferSize)
+		|| ((nAddress | pThis->m_nTransferSize) & (DMA_ALIGNMENT - 1)) == 0))
+	{
+		return 0;
+	}
+
+	return pThis->m_nTransferSize;
+}
+
+void DWHCITransferStageDataSetBounceBuffer (TDWHCITransferStageData *pThis, void *pBuffer, u32 nSize)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pBounceBuffer == 0);
+	assert (pBuffer != 0);
+	assert (((uintptr) pBuffer & (DMA_ALIGNMENT - 1)) == 0);
+	assert (pThis->m_nTotalBytesTransfered == 0);
+
+	pThis->m_pBounceBuffer = pBuffer;
+
+	if (pThis->m_bIsochronous)
+	{
+		assert (pThis->m_nTransferSize <= nSize);
+		pThis->m_nBounceSize = nSize;
+		pThis->m_pBounceData = USBRequestGetBuffer (pThis->m_pURB);
+
+		if (!pThis->m_bIn)
+		{
+			memcpy (pBuffer, pThis->m_pBounceData, pThis->m_nTransferSize);
+		}
+
+		assert (pThis->m_nIsoPacket == 0);
+		DWHCITransferStageDataSetupIsoPacket (pThis);
+
+		return;
+	}
+
+	// a part ends at a packet boundary
+	assert (pThis->m_nMaxPacketSize > 0);
+	assert (nSize >= pThis->m_nMaxPacketSize);
+	pThis->m_nBounceSize = nSize - nSize % pThis->m_nMaxPacketSize;
+	pThis->m_pBounceData = pThis->m_pBufferPointer;
+
+	DWHCITransferStageDataFillBounceBuffer (pThis);
+
+	if (!pThis->m_bSplitTransaction)
+	{
+		DWHCITransferStageDataSetupSegment (pThis);
+	}
+}
+
 unsigned DWHCITransferStageDataGetChannelNumber (TDWHCITransferStageData *pThis)
 {
 	assert (pThis != 0);
@@ -274,6 +482,10 @@ u8 DWHCITransferStageDataGetEndpointType (TDWHCITransferStageData *pThis)
 		nEndpointType = DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_INTERRUPT;
 		break;
 
+	case EndpointTypeIsochronous:
+		nEndpointType = DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO;
+		break;
+
 	default:
 		assert (0);
 		break;
@@ -295,6 +507,30 @@ u32 DWHCITransferStageDataGetMaxPacketSize (TDWHCITransferStageData *pThis)
 	return pThis->m_nMaxPacketSize;
 }
 
+unsigned DWHCITransferStageDataGetMultiCount (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+
+	if (   pThis->m_bSplitTransaction
+	    || !DWHCITransferStageDataIsPeriodic (pThis))
+	{
+		return 1;
+	}
+
+	// a high-bandwidth endpoint transfers up to 3 packets per microframe,
+	// but more than the packets of this transaction must not be requested
+	unsigned nMultiCount = USBEndpointGetPacketsPerMicroframe (pThis->m_pEndpoint);
+	if (   pThis->m_nPacketsPerTransaction > 0
+	    && nMultiCount > pThis->m_nPacketsPerTransaction)
+	{
+		nMultiCount = pThis->m_nPacketsPerTransaction;
+	}
+
+	assert (1 <= nMultiCount && nMultiCount <= 3);
+
+	return nMultiCount;
+}
+
 TUSBSpeed DWHCITransferStageDataGetSpeed (TDWHCITransferStageData *pThis)
 {
 	assert (pThis != 0);
@@ -307,6 +543,24 @@ u8 DWHCITransferStageDataGetPID (TDWHCITransferStageData *pThis)
 	assert (pThis->m_pEndpoint != 0);
 	
 	u8 ucPID = 0;
+
+	if (pThis->m_bIsochronous)
+	{
+		// see USB 2.0 spec chapter 5.9.2 for high-bandwidth isochronous transfers
+		if (   pThis->m_Speed != USBSpeedHigh
+		    || pThis->m_nPacketsPerTransaction == 1)
+		{
+			return DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA0;
+		}
+
+		if (!pThis->m_bIn)
+		{
+			return DWHCI_HOST_CHAN_XFER_SIZ_PID_MDATA;
+		}
+
+		return   pThis->m_nPacketsPerTransaction == 2
+		       ? DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA1 : DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA2;
+	}
 	
 	switch (USBEndpointGetNextPID (pThis->m_pEndpoint, pThis->m_bStatusStage))
 	{
@@ -346,6 +600,7 @@ u32 DWHCITransferStageDataGetDMAAddress (TDWHCITransferStageData *pThis)
 {
 	assert (pThis != 0);
 	assert (pThis->m_pBufferPointer != 0);
+	assert (((uintptr) pThis->m_pBufferPointer & 3) == 0);
 
 	return (u32) (uintptr) pThis->m_pBufferPointer;
 }
@@ -403,19 +658,12 @@ u8 DWHCITransferStageDataGetSplitPosition (TDWHCITransferStageData *pThis)
 u32 DWHCITransferStageDataGetStatusMask (TDWHCITransferStageData *pThis)
 {
 	assert (pThis != 0);
-	u32 nMask =   DWHCI_HOST_CHAN_INT_XFER_COMPLETE
-		    | DWHCI_HOST_CHAN_INT_HALTED
-		    | DWHCI_HOST_CHAN_INT_ERROR_MASK;
-		    
-	if (   pThis->m_bSplitTransaction
-	    || DWHCITransferStageDataIsPeriodic (pThis))
-	{
-		nMask |=   DWHCI_HOST_CHAN_INT_ACK
-			 | DWHCI_HOST_CHAN_INT_NAK
-			 | DWHCI_HOST_CHAN_INT_NYET;
-	}
-	
-	return	nMask;
+
+	// in DMA mode the channel halts at the end of each transaction, the handshake (ACK, NAK,
+	// NYET) is read from the channel interrupt register then and must not interrupt on its own
+	return	  DWHCI_HOST_CHAN_INT_XFER_COMPLETE
+		| DWHCI_HOST_CHAN_INT_HALTED
+		| DWHCI_HOST_CHAN_INT_ERROR_MASK;
 }
 
 u32 DWHCITransferStageDataGetTransactionStatus (TDWHCITransferStageData *pThis)
@@ -459,3 +707,108 @@ TDWHCIFrameScheduler *DWHCITransferStageDataGetFrameScheduler (TDWHCITransferSta
 
 	return &pThis->m_FrameScheduler.Base;
 }
+
+// the next segment takes as many packets, as the transfer size register of the channel allows
+static void DWHCITransferStageDataSetupSegment (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (!pThis->m_bSplitTransaction);
+	assert (pThis->m_nMaxPacketSize > 0);
+
+	unsigned nMaxPackets = MAX_BYTES_PER_SEGMENT / pThis->m_nMaxPacketSize;
+	if (nMaxPackets > MAX_PACKETS_PER_SEGMENT)
+	{
+		nMaxPackets = MAX_PACKETS_PER_SEGMENT;
+	}
+
+	// a segment starts at the begin of the bounce buffer and must fit into it
+	if (   pThis->m_pBounceBuffer != 0
+	    && nMaxPackets > pThis->m_nBounceSize / pThis->m_nMaxPacketSize)
+	{
+		nMaxPackets = pThis->m_nBounceSize / pThis->m_nMaxPacketSize;
+	}
+
+	pThis->m_nPacketsPerTransaction = pThis->m_nPackets;
+	if (pThis->m_nPacketsPerTransaction > nMaxPackets)
+	{
+		pThis->m_nPacketsPerTransaction = nMaxPackets;
+	}
+
+	assert (pThis->m_nTotalBytesTransfered <= pThis->m_nTransferSize);
+	pThis->m_nBytesPerTransaction = pThis->m_nTransferSize - pThis->m_nTotalBytesTransfered;
+	if (pThis->m_nBytesPerTransaction > nMaxPackets * pThis->m_nMaxPacketSize)
+	{
+		pThis->m_nBytesPerTransaction = nMaxPackets * pThis->m_nMaxPacketSize;
+	}
+}
+
+// the bounce buffer takes the next part of the stage, which starts at the current position
+static void DWHCITransferStageDataFillBounceBuffer (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pBounceBuffer != 0);
+	assert (!pThis->m_bIsochronous);
+
+	pThis->m_nBounceOffset = pThis->m_nTotalBytesTransfered;
+
+	if (!pThis->m_bIn)
+	{
+		assert (pThis->m_nBounceOffset <= pThis->m_nTransferSize);
+		u32 nBytes = pThis->m_nTransferSize - pThis->m_nBounceOffset;
+		if (nBytes > pThis->m_nBounceSize)
+		{
+			nBytes = pThis->m_nBounceSize;
+		}
+
+		memcpy (pThis->m_pBounceBuffer, (u8 *) pThis->m_pBounceData + pThis->m_nBounceOffset, nBytes);
+	}
+
+	pThis->m_pBufferPointer = pThis->m_pBounceBuffer;
+}
+
+// copies the received data of the current part back to the buffer of the URB
+static void DWHCITransferStageDataFlushBounceBuffer (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pBounceBuffer != 0);
+	assert (!pThis->m_bIsochronous);
+
+	if (!pThis->m_bIn)
+	{
+		return;
+	}
+
+	u32 nResultLen = DWHCITransferStageDataGetResultLen (pThis);
+	if (nResultLen > pThis->m_nBounceOffset)
+	{
+		memcpy ((u8 *) pThis->m_pBounceData + pThis->m_nBounceOffset, pThis->m_pBounceBuffer,
+			nResultLen - pThis->m_nBounceOffset);
+	}
+}
+
+// the current packet descriptor is transferred with one transaction in its (micro)frame
+static void DWHCITransferStageDataSetupIsoPacket (TDWHCITransferStageData *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bIsochronous);
+
+	TUSBIsoPacket *pPacket = USBRequestGetIsoPacket (pThis->m_pURB, pThis->m_nIsoPacket);
+	assert (pPacket != 0);
+	assert (pPacket->nOffset + pPacket->nLength <= pThis->m_nTransferSize);
+
+	pPacket->nActualLength = 0;
+	pPacket->Error = USBErrorNone;
+
+	assert ((pPacket->nOffset & 3) == 0);
+	pThis->m_pBufferPointer =   (u8 *) (  pThis->m_pBounceBuffer != 0
+					    ? pThis->m_pBounceBuffer : USBRequestGetBuffer (pThis->m_pURB))
+				  + pPacket->nOffset;
+	pThis->m_nBytesPerTransaction = pPacket->nLength;
+
+	pThis->m_nPacketsPerTransaction = (pPacket->nLength + pThis->m_nMaxPacketSize - 1) / pThis->m_nMaxPacketSize;
+	if (pThis->m_nPacketsPerTransaction == 0)
+	{
+		pThis->m_nPacketsPerTransaction = 1;
+	}
+	assert (pThis->m_nPacketsPerTransaction <= USBEndpointGetPacketsPerMicroframe (pThis->m_pEndpoint));
+}
@@ -20,21 +20,49 @@
 #include <uspi/synchronize.h>
 #include <uspi/types.h>
 #include <uspi/assert.h>
-
-#ifndef AARCH64
+#include <uspios.h>
+
+// with USPI_USE_FIQ a critical section disables FIQ too
+#ifndef USPI_USE_FIQ
+#ifdef USPI_HOSTSIM
+	#define	EnableInterrupts()	SimEnableInterrupts ()
+	#define	DisableInterrupts()	SimDisableInterrupts ()
+#elif !defined (AARCH64)
 	#define	EnableInterrupts()	__asm volatile ("cpsie i")
 	#define	DisableInterrupts()	__asm volatile ("cpsid i")
 #else
 	#define	EnableInterrupts()	__asm volatile ("msr DAIFClr, #2")
 	#define	DisableInterrupts()	__asm volatile ("msr DAIFSet, #2")
 #endif
+	#define	INTERRUPT_BITS		0x80		// I
+#else
+#ifdef USPI_HOSTSIM
+	#define	EnableInterrupts()	do { SimEnableFIQ (); SimEnableInterrupts (); } while (0)
+	#define	DisableInterrupts()	do { SimDisableInterrupts (); SimDisableFIQ (); } while (0)
+	#define	EnableFIQ()		SimEnableFIQ ()
+#elif !defined (AARCH64)
+	#define	EnableInterrupts()	__asm volatile ("cpsie if")
+	#define	DisableInterrupts()	__asm volatile ("cpsid if")
+	#define	EnableFIQ()		__asm volatile ("cpsie f")
+#else
+	#define	EnableInterrupts()	__asm volatile ("msr DAIFClr, #3")
+	#define	DisableInterrupts()	__asm volatile ("msr DAIFSet, #3")
+	#define	EnableFIQ()		__asm volatile ("msr DAIFClr, #1")
+#endif
+	#define	INTERRUPT_BITS		0xC0		// I and F
+#endif
 
 static volatile unsigned s_nCriticalLevel = 0;
-static volatile boolean s_bWereEnabled;
+static volatile u32 s_nWereDisabled;			// INTERRUPT_BITS before the outermost level
 
 void uspi_EnterCritical (void)
 {
-#ifndef AARCH64
+#ifdef USPI_HOSTSIM
+	u32 nFlags = SimInterruptsEnabled () ? 0 : 0x80;
+#ifdef USPI_USE_FIQ
+	nFlags |= SimFIQEnabled () ? 0 : 0x40;
+#endif
+#elif !defined (AARCH64)
 	u32 nFlags;
 	asm volatile ("mrs %0, cpsr" : "=r" (nFlags));
 #else
@@ -46,7 +74,7 @@ void uspi_EnterCritical (void)
 
 	if (s_nCriticalLevel++ == 0)
 	{
-		s_bWereEnabled = nFlags & 0x80 ? FALSE : TRUE;
+		s_nWereDisabled = nFlags & INTERRUPT_BITS;
 	}
 
 	DataMemBarrier ();
@@ -59,14 +87,67 @@ void uspi_LeaveCritical (void)
 	assert (s_nCriticalLevel > 0);
 	if (--s_nCriticalLevel == 0)
 	{
-		if (s_bWereEnabled)
+		if (s_nWereDisabled == 0)
 		{
 			EnableInterrupts ();
 		}
+#ifdef USPI_USE_FIQ
+		else if (!(s_nWereDisabled & 0x40))
+		{
+			EnableFIQ ();		// at IRQ level
+		}
+#endif
 	}
 }
 
-#ifndef AARCH64
+void uspi_WaitForInterrupt (void)
+{
+	// interrupts are enabled for a moment, this must not break an enclosing critical section
+	assert (s_nCriticalLevel == 1);
+	assert (s_nWereDisabled == 0);
+
+	DataSyncBarrier ();
+
+	// an interrupt, which is pending, terminates WFI, even if interrupts are disabled
+#ifdef USPI_HOSTSIM
+	SimIdle ();
+#elif !defined (AARCH64)
+#if RASPPI == 1
+	__asm volatile ("mcr p15, 0, %0, c7, c0, 4" : : "r" (0) : "memory");
+#else
+	__asm volatile ("wfi" ::: "memory");
+#endif
+#else
+	__asm volatile ("wfi" ::: "memory");
+#endif
+
+	EnableInterrupts ();		// the interrupt is handled here
+#ifdef AARCH64
+	__asm volatile ("isb" ::: "memory");
+#endif
+	DisableInterrupts ();
+
+	DataMemBarrier ();
+}
+
+#ifdef USPI_HOSTSIM
+
+void uspi_CleanAndInvalidateDataCacheRange (u64 nAddress, u64 nLength)
+{
+	SimCacheMaintenance (nAddress, nLength, SIM_CACHE_CLEAN | SIM_CACHE_INVALIDATE);
+}
+
+void uspi_CleanDataCacheRange (u64 nAddress, u64 nLength)
+{
+	SimCacheMaintenance (nAddress, nLength, SIM_CACHE_CLEAN);
+}
+
+void uspi_InvalidateDataCacheRange (u64 nAddress, u64 nLength)
+{
+	SimCacheMaintenance (nAddress, nLength, SIM_CACHE_INVALIDATE);
+}
+
+#elif !defined (AARCH64)
 
 #if RASPPI == 1
 
@@ -100,6 +181,43 @@ void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength)
 	}
 }
 
+void uspi_CleanDataCacheRange (u32 nAddress, u32 nLength)
+{
+	nLength += DATA_CACHE_LINE_LENGTH;
+
+	while (1)
+	{
+		asm volatile ("mcr p15, 0, %0, c7, c10,  1" : : "r" (nAddress) : "memory");
+
+		if (nLength < DATA_CACHE_LINE_LENGTH)
+		{
+			break;
+		}
+
+		nAddress += DATA_CACHE_LINE_LENGTH;
+		nLength  -= DATA_CACHE_LINE_LENGTH;
+	}
+}
+
+void uspi_InvalidateDataCacheRange (u32 nAddress, u32 nLength)
+{
+	u32 nEnd = nAddress + nLength;
+	u32 nLine = nAddress & ~(u32) (DATA_CACHE_LINE_LENGTH - 1);
+
+	for (; nLine < nEnd; nLine += DATA_CACHE_LINE_LENGTH)
+	{
+		if (   nLine < nAddress
+		    || nLine + DATA_CACHE_LINE_LENGTH > nEnd)
+		{
+			asm volatile ("mcr p15, 0, %0, c7, c14,  1" : : "r" (nLine) : "memory");
+		}
+		else
+		{
+			asm volatile ("mcr p15, 0, %0, c7, c6,  1" : : "r" (nLine) : "memory");
+		}
+	}
+}
+
 #else	// #if RASPPI == 1
 
 //
@@ -137,6 +255,43 @@ void uspi_CleanAndInvalidateDataCacheRange (u32 nAddress, u32 nLength)
 	}
 }
 
+void uspi_CleanDataCacheRange (u32 nAddress, u32 nLength)
+{
+	nLength += DATA_CACHE_LINE_LENGTH_MIN;
+
+	while (1)
+	{
+		__asm volatile ("mcr p15, 0, %0, c7, c10,  1" : : "r" (nAddress) : "memory");	// DCCMVAC
+
+		if (nLength < DATA_CACHE_LINE_LENGTH_MIN)
+		{
+			break;
+		}
+
+		nAddress += DATA_CACHE_LINE_LENGTH_MIN;
+		nLength  -= DATA_CACHE_LINE_LENGTH_MIN;
+	}
+}
+
+void uspi_InvalidateDataCacheRange (u32 nAddress, u32 nLength)
+{
+	u32 nEnd = nAddress + nLength;
+	u32 nLine = nAddress & ~(u32) (DATA_CACHE_LINE_LENGTH_MIN - 1);
+
+	for (; nLine < nEnd; nLine += DATA_CACHE_LINE_LENGTH_MIN)
+	{
+		if (   nLine < nAddress
+		    || nLine + DATA_CACHE_LINE_LENGTH_MIN > nEnd)
+		{
+			__asm volatile ("mcr p15, 0, %0, c7, c14,  1" : : "r" (nLine) : "memory");	// DCCIMVAC
+		}
+		else
+		{
+			__asm volatile ("mcr p15, 0, %0, c7, c6,  1" : : "r" (nLine) : "memory");	// DCIMVAC
+		}
+	}
+}
+
 #endif	// #if RASPPI == 1
 
 #else	// #ifndef AARCH64
@@ -174,4 +329,41 @@ void uspi_CleanAndInvalidateDataCacheRange (u64 nAddress, u64 nLength)
 	}
 }
 
+void uspi_CleanDataCacheRange (u64 nAddress, u64 nLength)
+{
+	nLength += DATA_CACHE_LINE_LENGTH_MIN;
+
+	while (1)
+	{
+		asm volatile ("dc cvac, %0" : : "r" (nAddress) : "memory");
+
+		if (nLength < DATA_CACHE_LINE_LENGTH_MIN)
+		{
+			break;
+		}
+
+		nAddress += DATA_CACHE_LINE_LENGTH_MIN;
+		nLength  -= DATA_CACHE_LINE_LENGTH_MIN;
+	}
+}
+
+void uspi_InvalidateDataCacheRange (u64 nAddress, u64 nLength)
+{
+	u64 nEnd = nAddress + nLength;
+	u64 nLine = nAddress & ~(u64) (DATA_CACHE_LINE_LENGTH_MIN - 1);
+
+	for (; nLine < nEnd; nLine += DATA_CACHE_LINE_LENGTH_MIN)
+	{
+		if (   nLine < nAddress
+		    || nLine + DATA_CACHE_LINE_LENGTH_MIN > nEnd)
+		{
+			asm volatile ("dc civac, %0" : : "r" (nLine) : "memory");
+		}
+		else
+		{
+			asm volatile ("dc ivac, %0" : : "r" (nLine) : "memory");
+		}
+	}
+}
+
 #endif	// #ifndef AARCH64
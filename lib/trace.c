@@ -0,0 +1,150 @@
+//
+// trace.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspi/trace.h>
+#include <uspi/synchronize.h>
+#include <uspi/bcm2835.h>
+#include <uspi/util.h>
+#include <uspi/assert.h>
+
+#ifdef USPI_TRACE
+
+#if (USPI_TRACE_EVENTS & (USPI_TRACE_EVENTS-1)) != 0
+	#error USPI_TRACE_EVENTS must be a power of 2
+#endif
+
+static TUSPiTraceEvent s_Event[USPI_TRACE_EVENTS];
+static unsigned s_nNextEvent = 0;		// number of recorded events, wraps around
+
+// the generic timer is used, where available, because it can be read in a few cycles
+#if defined (USPI_HOSTSIM) || RASPPI == 1
+
+#define TRACE_CLOCK_RATE	1000000
+
+static inline u32 TraceGetClock (void)
+{
+#ifndef USPI_MMIO_BACKEND
+	return *(volatile u32 *) ARM_SYSTIMER_CLO;
+#else
+	return MMIORead (ARM_SYSTIMER_CLO);
+#endif
+}
+
+#elif !defined (AARCH64)
+
+static inline u32 TraceGetClock (void)
+{
+	u32 nLow, nHigh;
+	asm volatile ("mrrc p15, 1, %0, %1, c14" : "=r" (nLow), "=r" (nHigh));
+
+	return nLow;
+}
+
+static u32 TraceGetClockRate (void)
+{
+	u32 nRate;
+	asm volatile ("mrc p15, 0, %0, c14, c0, 0" : "=r" (nRate));
+
+	return nRate;
+}
+
+#else
+
+static inline u32 TraceGetClock (void)
+{
+	u64 nCount;
+	asm volatile ("mrs %0, cntvct_el0" : "=r" (nCount));
+
+	return (u32) nCount;
+}
+
+static u32 TraceGetClockRate (void)
+{
+	u64 nRate;
+	asm volatile ("mrs %0, cntfrq_el0" : "=r" (nRate));
+
+	return (u32) nRate;
+}
+
+#endif
+
+#ifdef TRACE_CLOCK_RATE
+	#define TraceGetClockRate()	TRACE_CLOCK_RATE
+#endif
+
+void uspi_Trace (unsigned nEvent, unsigned nChannel, unsigned nParam, u32 nParam1, u32 nParam2)
+{
+	// the caller has disabled interrupts, so that there is only one writer at a time
+	TUSPiTraceEvent *pEvent = &s_Event[s_nNextEvent++ & (USPI_TRACE_EVENTS-1)];
+
+	pEvent->nTime = TraceGetClock ();
+	pEvent->ucEvent = (u8) nEvent;
+	pEvent->ucChannel = (u8) nChannel;
+	pEvent->usParam = (u16) nParam;
+	pEvent->nParam1 = nParam1;
+	pEvent->nParam2 = nParam2;
+}
+
+unsigned uspi_TraceDump (void *pBuffer, unsigned nBufSize)
+{
+	if (   pBuffer == 0
+	    || nBufSize < sizeof (TUSPiTraceHeader))
+	{
+		return 0;
+	}
+
+	TUSPiTraceHeader *pHeader = (TUSPiTraceHeader *) pBuffer;
+	TUSPiTraceEvent *pEvents = (TUSPiTraceEvent *) (pHeader + 1);
+
+	unsigned nMaxEvents = (nBufSize - sizeof (TUSPiTraceHeader)) / sizeof (TUSPiTraceEvent);
+
+	uspi_EnterCritical ();
+
+	unsigned nEvents = s_nNextEvent < USPI_TRACE_EVENTS ? s_nNextEvent : USPI_TRACE_EVENTS;
+	if (nEvents > nMaxEvents)
+	{
+		nEvents = nMaxEvents;
+	}
+
+	unsigned nFirst = s_nNextEvent - nEvents;
+	for (unsigned i = 0; i < nEvents; i++)
+	{
+		pEvents[i] = s_Event[(nFirst + i) & (USPI_TRACE_EVENTS-1)];
+	}
+
+	pHeader->nMagic = USPI_TRACE_MAGIC;
+	pHeader->usVersion = USPI_TRACE_VERSION;
+	pHeader->usEventSize = sizeof (TUSPiTraceEvent);
+	pHeader->nClockRate = TraceGetClockRate ();
+	pHeader->nEvents = nEvents;
+	pHeader->nLost = nFirst;
+
+	uspi_LeaveCritical ();
+
+	return sizeof (TUSPiTraceHeader) + nEvents * sizeof (TUSPiTraceEvent);
+}
+
+#else
+
+unsigned uspi_TraceDump (void *pBuffer, unsigned nBufSize)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,517 @@
+//
+// usbcapture.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspi/usbcapture.h>
+#include <uspi/usbendpoint.h>
+#include <uspi/usbdevice.h>
+#include <uspi/synchronize.h>
+#include <uspi/macros.h>
+#include <uspi/util.h>
+#include <uspi/assert.h>
+
+typedef struct TPCAPFileHeader
+{
+	u32	nMagic;
+#define PCAP_MAGIC		0xA1B2C3D4		// microsecond time stamps
+	u16	usVersionMajor;
+#define PCAP_VERSION_MAJOR	2
+	u16	usVersionMinor;
+#define PCAP_VERSION_MINOR	4
+	s32	nThisZone;
+	u32	nSigFigs;
+	u32	nSnapLen;
+#define PCAP_SNAP_LEN		0x40000
+	u32	nLinkType;
+}
+PACKED TPCAPFileHeader;
+
+typedef struct TPCAPRecordHeader
+{
+	u32	nSeconds;
+	u32	nMicroSeconds;
+	u32	nInclLen;				// in the file
+	u32	nOrigLen;				// on the wire
+}
+PACKED TPCAPRecordHeader;
+
+typedef struct TUSBMonPacket				// struct usbmon_packet of Linux
+{
+	u64	nID;					// URB address
+	u8	ucType;					// 'S', 'C' or 'E'
+	u8	ucTransferType;
+#define USBMON_XFER_ISO		0
+#define USBMON_XFER_INTERRUPT	1
+#define USBMON_XFER_CONTROL	2
+#define USBMON_XFER_BULK	3
+	u8	ucEndpoint;				// bit 7 set for IN
+	u8	ucDevice;
+	u16	usBus;
+	u8	ucFlagSetup;				// 0 if Setup[] is valid
+	u8	ucFlagData;				// 0 if data is present
+	s64	nSeconds;
+	s32	nMicroSeconds;
+	s32	nStatus;				// Linux error number
+	u32	nLength;				// of the request
+	u32	nCapturedLength;			// payload following
+	union
+	{
+		u8	Setup[8];
+		struct
+		{
+			s32	nErrorCount;
+			s32	nDescriptors;
+		}
+		Iso;
+	}
+	s;
+	s32	nInterval;
+	s32	nStartFrame;
+	u32	nTransferFlags;
+	u32	nDescriptors;				// isochronous descriptors following
+}
+PACKED TUSBMonPacket;
+
+typedef struct TUSBMonIsoDescriptor
+{
+	s32	nStatus;
+	u32	nOffset;
+	u32	nLength;
+	u32	nPad;
+}
+PACKED TUSBMonIsoDescriptor;
+
+// Linux error numbers
+#define LINUX_EINPROGRESS	115
+#define LINUX_ENOENT		2
+#define LINUX_EIO		5
+#define LINUX_ENOSPC		28
+#define LINUX_EPIPE		32
+#define LINUX_ECOMM		70
+#define LINUX_EPROTO		71
+#define LINUX_EOVERFLOW		75
+#define LINUX_EILSEQ		84
+#define LINUX_ETIMEDOUT		110
+
+static TUSBCapture s_Capture;			// zero-initialized: not active
+
+static unsigned USBCaptureGetFree (TUSBCapture *pThis);
+static unsigned USBCaptureWrite (TUSBCapture *pThis, unsigned nPos, const void *pData, unsigned nLength);
+static void USBCaptureCopyOut (TUSBCapture *pThis, unsigned nPos, void *pBuffer, unsigned nLength);
+static s32 USBCaptureGetStatus (TUSBError Error);
+
+TUSBCapture *USBCaptureGet (void)
+{
+	return &s_Capture;
+}
+
+boolean USBCaptureStart (TUSBCapture *pThis, void *pBuffer, unsigned nSize, unsigned nSnapLen)
+{
+	assert (pThis != 0);
+
+	if (   pBuffer == 0
+	    || nSize < sizeof (TPCAPRecordHeader) + sizeof (TUSBMonPacket) + 1)
+	{
+		return FALSE;
+	}
+
+	uspi_EnterCritical ();
+
+	pThis->m_pBuffer = (u8 *) pBuffer;
+	pThis->m_nSize = nSize;
+	pThis->m_nSnapLen = nSnapLen;
+	pThis->m_nIn = 0;
+	pThis->m_nOut = 0;
+	pThis->m_bHeaderRead = FALSE;
+	pThis->m_nRecords = 0;
+	pThis->m_nDropped = 0;
+	pThis->m_bActive = TRUE;
+
+	uspi_LeaveCritical ();
+
+	return TRUE;
+}
+
+void USBCaptureStop (TUSBCapture *pThis)
+{
+	assert (pThis != 0);
+
+	pThis->m_bActive = FALSE;
+
+	DataMemBarrier ();
+}
+
+boolean USBCaptureIsActive (TUSBCapture *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bActive;
+}
+
+void USBCaptureRequest (TUSBCapture *pThis, TUSBRequest *pURB, char chEvent, u32 nTime)
+{
+	assert (pThis != 0);
+
+	if (!pThis->m_bActive)
+	{
+		return;
+	}
+
+	assert (pURB != 0);
+	TUSBEndpoint *pEndpoint = USBRequestGetEndpoint (pURB);
+	assert (pEndpoint != 0);
+	TUSBDevice *pDevice = USBEndpointGetDevice (pEndpoint);
+	assert (pDevice != 0);
+
+	if (nTime < pThis->m_nLastTime)
+	{
+		pThis->m_nTimeHigh += 1ULL << 32;
+	}
+	pThis->m_nLastTime = nTime;
+	u64 nTime64 = pThis->m_nTimeHigh | nTime;
+
+	TUSBMonPacket Packet;
+	memset (&Packet, 0, sizeof Packet);
+
+	Packet.nID = (u64) (uintptr) pURB;
+	Packet.ucType = (u8) chEvent;
+	Packet.ucDevice = USBDeviceGetAddress (pDevice);
+	Packet.usBus = USB_CAPTURE_BUS;
+	Packet.ucFlagSetup = '-';
+	Packet.nSeconds = nTime64 / 1000000;
+	Packet.nMicroSeconds = nTime64 % 1000000;
+
+	boolean bIn = USBEndpointIsDirectionIn (pEndpoint);
+	switch (USBEndpointGetType (pEndpoint))
+	{
+	case EndpointTypeControl: {
+		Packet.ucTransferType = USBMON_XFER_CONTROL;
+
+		TSetupData *pSetup = USBRequestGetSetupData (pURB);
+		assert (pSetup != 0);
+		bIn = pSetup->bmRequestType & REQUEST_IN ? TRUE : FALSE;
+
+		if (chEvent != USB_CAPTURE_COMPLETE)
+		{
+			Packet.ucFlagSetup = 0;
+			memcpy (Packet.s.Setup, pSetup, sizeof Packet.s.Setup);
+		}
+		} break;
+
+	case EndpointTypeBulk:
+		Packet.ucTransferType = USBMON_XFER_BULK;
+		break;
+
+	case EndpointTypeInterrupt:
+	case EndpointTypeIsochronous:
+		Packet.ucTransferType =   USBEndpointGetType (pEndpoint) == EndpointTypeInterrupt
+					? USBMON_XFER_INTERRUPT : USBMON_XFER_ISO;
+		Packet.nInterval =   USBDeviceGetSpeed (pDevice) == USBSpeedHigh
+				   ? USBEndpointGetIntervalMicroframes (pEndpoint)
+				   : USBEndpointGetInterval (pEndpoint);
+		break;
+
+	default:
+		assert (0);
+		break;
+	}
+
+	Packet.ucEndpoint = USBEndpointGetNumber (pEndpoint) | (bIn ? 0x80 : 0);
+
+	u32 nDataLength;
+	if (chEvent == USB_CAPTURE_COMPLETE)
+	{
+		Packet.nStatus =   USBRequestGetStatus (pURB)
+				 ? 0 : USBCaptureGetStatus (USBRequestGetUSBError (pURB));
+		Packet.nLength = USBRequestGetResultLength (pURB);
+		if (   Packet.ucTransferType == USBMON_XFER_CONTROL
+		    && USBRequestGetSetupData (pURB)->wLength == 0)
+		{
+			Packet.nLength = 0;		// result length of the setup stage
+		}
+		nDataLength = bIn ? Packet.nLength : 0;
+	}
+	else
+	{
+		Packet.nStatus =   chEvent == USB_CAPTURE_SUBMIT
+				 ? -LINUX_EINPROGRESS : USBCaptureGetStatus (USBRequestGetUSBError (pURB));
+		Packet.nLength = USBRequestGetBufLen (pURB);
+		nDataLength = bIn ? 0 : Packet.nLength;
+	}
+
+	unsigned nDescriptors = 0;
+	if (Packet.ucTransferType == USBMON_XFER_ISO)
+	{
+		nDescriptors = USBRequestGetIsoPacketCount (pURB);
+
+		Packet.s.Iso.nDescriptors = nDescriptors;
+		Packet.nDescriptors = nDescriptors;
+		Packet.nStartFrame = USBRequestGetStartFrame (pURB);
+
+		// the packets are located at their offsets in the buffer
+		if (nDataLength > 0)
+		{
+			nDataLength = USBRequestGetBufLen (pURB);
+		}
+	}
+
+	if (   nDataLength == 0
+	    && Packet.nLength > 0)
+	{
+		Packet.ucFlagData = bIn ? '<' : '>';	// data is transferred in the other event
+	}
+
+	u32 nCaptured = nDataLength < pThis->m_nSnapLen ? nDataLength : pThis->m_nSnapLen;
+	Packet.nCapturedLength = nCaptured;
+
+	TPCAPRecordHeader Record;
+	Record.nSeconds = Packet.nSeconds;
+	Record.nMicroSeconds = Packet.nMicroSeconds;
+	Record.nInclLen = sizeof Packet + nDescriptors * sizeof (TUSBMonIsoDescriptor) + nCaptured;
+	Record.nOrigLen = Record.nInclLen - nCaptured + nDataLength;
+
+	if (sizeof Record + Record.nInclLen > USBCaptureGetFree (pThis))
+	{
+		pThis->m_nDropped++;
+
+		return;
+	}
+
+	unsigned nPos = pThis->m_nIn;
+	nPos = USBCaptureWrite (pThis, nPos, &Record, sizeof Record);
+	nPos = USBCaptureWrite (pThis, nPos, &Packet, sizeof Packet);
+
+	u32 nErrorCount = 0;
+	for (unsigned i = 0; i < nDescriptors; i++)
+	{
+		TUSBIsoPacket *pIsoPacket = USBRequestGetIsoPacket (pURB, i);
+		assert (pIsoPacket != 0);
+
+		TUSBMonIsoDescriptor Desc;
+		Desc.nOffset = pIsoPacket->nOffset;
+		Desc.nPad = 0;
+
+		if (chEvent == USB_CAPTURE_COMPLETE)
+		{
+			Desc.nStatus = USBCaptureGetStatus (pIsoPacket->Error);
+			Desc.nLength = pIsoPacket->nActualLength;
+
+			if (Desc.nStatus != 0)
+			{
+				nErrorCount++;
+			}
+		}
+		else
+		{
+			Desc.nStatus = -LINUX_EINPROGRESS;
+			Desc.nLength = pIsoPacket->nLength;
+		}
+
+		nPos = USBCaptureWrite (pThis, nPos, &Desc, sizeof Desc);
+	}
+
+	if (nErrorCount > 0)
+	{
+		// patch the error count in the ring
+		Packet.s.Iso.nErrorCount = nErrorCount;
+		USBCaptureWrite (pThis, (pThis->m_nIn + sizeof Record) % pThis->m_nSize,
+				 &Packet, sizeof Packet);
+	}
+
+	nPos = USBCaptureWrite (pThis, nPos, USBRequestGetBuffer (pURB), nCaptured);
+
+	DataMemBarrier ();
+
+	pThis->m_nIn = nPos;
+	pThis->m_nRecords++;
+}
+
+unsigned USBCaptureRead (TUSBCapture *pThis, void *pBuffer, unsigned nBufSize)
+{
+	assert (pThis != 0);
+	assert (pBuffer != 0);
+
+	u8 *pTo = (u8 *) pBuffer;
+	unsigned nResult = 0;
+
+	if (pThis->m_pBuffer == 0)
+	{
+		return 0;
+	}
+
+	if (!pThis->m_bHeaderRead)
+	{
+		if (nBufSize < sizeof (TPCAPFileHeader))
+		{
+			return 0;
+		}
+
+		TPCAPFileHeader Header;
+		Header.nMagic = PCAP_MAGIC;
+		Header.usVersionMajor = PCAP_VERSION_MAJOR;
+		Header.usVersionMinor = PCAP_VERSION_MINOR;
+		Header.nThisZone = 0;
+		Header.nSigFigs = 0;
+		Header.nSnapLen = PCAP_SNAP_LEN;
+		Header.nLinkType = USB_CAPTURE_LINKTYPE;
+
+		memcpy (pTo, &Header, sizeof Header);
+		nResult = sizeof Header;
+
+		pThis->m_bHeaderRead = TRUE;
+	}
+
+	unsigned nIn = pThis->m_nIn;
+
+	DataMemBarrier ();
+
+	unsigned nOut = pThis->m_nOut;
+	boolean bRecordRead = FALSE;
+	while (nOut != nIn)
+	{
+		TPCAPRecordHeader Record;
+		USBCaptureCopyOut (pThis, nOut, &Record, sizeof Record);
+
+		unsigned nLength = sizeof Record + Record.nInclLen;
+		unsigned nCopy = nLength;
+		if (nResult + nLength > nBufSize)
+		{
+			// a record, which does not fit into the empty buffer, is truncated,
+			// otherwise it would remain in the ring forever
+			if (   bRecordRead
+			    || nBufSize - nResult < sizeof Record + sizeof (TUSBMonPacket))
+			{
+				break;
+			}
+
+			nCopy = nBufSize - nResult;
+		}
+
+		USBCaptureCopyOut (pThis, nOut, pTo + nResult, nCopy);
+
+		if (nCopy < nLength)
+		{
+			// the headers must describe the truncated record, iso descriptors,
+			// which do not fit completely, are omitted
+			TUSBMonPacket Packet;
+			USBCaptureCopyOut (pThis, (nOut + sizeof Record) % pThis->m_nSize, &Packet, sizeof Packet);
+
+			unsigned nAvail = nCopy - sizeof Record - sizeof Packet;
+			if (Packet.nDescriptors * sizeof (TUSBMonIsoDescriptor) > nAvail)
+			{
+				Packet.nDescriptors = nAvail / sizeof (TUSBMonIsoDescriptor);
+				Packet.s.Iso.nDescriptors = Packet.nDescriptors;
+				Packet.nCapturedLength = 0;
+
+				nCopy =   sizeof Record + sizeof Packet
+					+ Packet.nDescriptors * sizeof (TUSBMonIsoDescriptor);
+			}
+			else
+			{
+				Packet.nCapturedLength = nAvail - Packet.nDescriptors * sizeof (TUSBMonIsoDescriptor);
+			}
+
+			Record.nInclLen = nCopy - sizeof Record;
+
+			memcpy (pTo + nResult, &Record, sizeof Record);
+			memcpy (pTo + nResult + sizeof Record, &Packet, sizeof Packet);
+		}
+
+		nResult += nCopy;
+		nOut = (nOut + nLength) % pThis->m_nSize;
+		bRecordRead = TRUE;
+	}
+
+	DataMemBarrier ();
+
+	pThis->m_nOut = nOut;
+
+	return nResult;
+}
+
+unsigned USBCaptureGetDropped (TUSBCapture *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nDropped;
+}
+
+// copies from the ring, nPos is the position of the first byte
+static void USBCaptureCopyOut (TUSBCapture *pThis, unsigned nPos, void *pBuffer, unsigned nLength)
+{
+	assert (pThis != 0);
+	assert (nPos < pThis->m_nSize);
+	assert (nLength < pThis->m_nSize);
+
+	unsigned nFirst = pThis->m_nSize - nPos;
+	if (nFirst >= nLength)
+	{
+		memcpy (pBuffer, pThis->m_pBuffer + nPos, nLength);
+	}
+	else
+	{
+		memcpy (pBuffer, pThis->m_pBuffer + nPos, nFirst);
+		memcpy ((u8 *) pBuffer + nFirst, pThis->m_pBuffer, nLength - nFirst);
+	}
+}
+
+static unsigned USBCaptureGetFree (TUSBCapture *pThis)
+{
+	assert (pThis != 0);
+
+	unsigned nIn = pThis->m_nIn;
+	unsigned nOut = pThis->m_nOut;
+
+	return nOut > nIn ? nOut - nIn - 1 : pThis->m_nSize - (nIn - nOut) - 1;
+}
+
+// returns the position after the data
+static unsigned USBCaptureWrite (TUSBCapture *pThis, unsigned nPos, const void *pData, unsigned nLength)
+{
+	assert (pThis != 0);
+	assert (nPos < pThis->m_nSize);
+
+	unsigned nFirst = pThis->m_nSize - nPos;
+	if (nFirst >= nLength)
+	{
+		memcpy (pThis->m_pBuffer + nPos, pData, nLength);
+	}
+	else
+	{
+		memcpy (pThis->m_pBuffer + nPos, pData, nFirst);
+		memcpy (pThis->m_pBuffer, (const u8 *) pData + nFirst, nLength - nFirst);
+	}
+
+	return (nPos + nLength) % pThis->m_nSize;
+}
+
+static s32 USBCaptureGetStatus (TUSBError Error)
+{
+	switch (Error)
+	{
+	case USBErrorNone:		return 0;
+	case USBErrorStall:		return -LINUX_EPIPE;
+	case USBErrorTransaction:	return -LINUX_EPROTO;
+	case USBErrorBabble:		return -LINUX_EOVERFLOW;
+	case USBErrorFrameOverrun:	return -LINUX_ECOMM;
+	case USBErrorDataToggle:	return -LINUX_EILSEQ;
+	case USBErrorSplit:		return -LINUX_EPROTO;
+	case USBErrorTimeout:		return -LINUX_ETIMEDOUT;
+	case USBErrorCancelled:		return -LINUX_ENOENT;
+	case USBErrorBandwidth:		return -LINUX_ENOSPC;
+	default:			return -LINUX_EIO;
+	}
+}
@@ -53,6 +53,7 @@ void USBDevice (TUSBDevice *pThis, struct TDWHCIDevice *pHost, TUSBSpeed Speed,
 	pThis->m_bSplitTransfer = bSplitTransfer;
 	pThis->m_ucHubAddress = ucHubAddress;
 	pThis->m_ucHubPortNumber = ucHubPortNumber;
+	pThis->m_pTT = 0;
 	pThis->m_pDeviceDesc = 0;
 	pThis->m_pConfigDesc = 0;
 	pThis->m_pConfigParser = 0;
@@ -517,6 +518,19 @@ u8 USBDeviceGetHubPortNumber (TUSBDevice *pThis)
 	return pThis->m_ucHubPortNumber;
 }
 
+void USBDeviceSetTT (TUSBDevice *pThis, struct TUSBTransactionTranslator *pTT)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bSplitTransfer);
+	pThis->m_pTT = pTT;
+}
+
+struct TUSBTransactionTranslator *USBDeviceGetTT (TUSBDevice *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_pTT;
+}
+
 struct TUSBEndpoint *USBDeviceGetEndpoint0 (TUSBDevice *pThis)
 {
 	assert (pThis != 0);
@@ -39,6 +39,7 @@ TUSBFunction *USBDeviceFactoryGetDevice (TUSBFunction *pParent, TString *pName)
 	TUSBFunction *pResult = 0;
 
 	if (   StringCompare (pName, "int9-0-2") == 0
+	    || StringCompare (pName, "int9-0-1") == 0		// multi-TT hub, single TT setting
 	    || StringCompare (pName, "int9-0-0") == 0)
 	{
 		TUSBStandardHub *pDevice = (TUSBStandardHub *) malloc (sizeof (TUSBStandardHub));
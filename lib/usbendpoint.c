@@ -18,8 +18,11 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <uspi/usbendpoint.h>
+#include <uspi/usbrequest.h>
 #include <uspi/assert.h>
 
+static void USBEndpointInitQueue (TUSBEndpoint *pThis);
+
 void USBEndpoint (TUSBEndpoint *pThis, TUSBDevice *pDevice)
 {
 	assert (pThis != 0);
@@ -28,9 +31,13 @@ void USBEndpoint (TUSBEndpoint *pThis, TUSBDevice *pDevice)
 	pThis->m_Type = EndpointTypeControl;
 	pThis->m_bDirectionIn = FALSE;
 	pThis->m_nMaxPacketSize = USB_DEFAULT_MAX_PACKET_SIZE;
+	pThis->m_nPacketsPerMicroframe = 1;
 	pThis->m_nInterval = 1;
+	pThis->m_nIntervalMicroframes = 8;
 	pThis->m_NextPID = USBPIDSetup;
 
+	USBEndpointInitQueue (pThis);
+
 	assert (pThis->m_pDevice != 0);
 }
 
@@ -38,7 +45,11 @@ void USBEndpoint2 (TUSBEndpoint *pThis, TUSBDevice *pDevice, const TUSBEndpointD
 {
 	assert (pThis != 0);
 	pThis->m_pDevice = pDevice;
+	pThis->m_nPacketsPerMicroframe = 1;
 	pThis->m_nInterval = 1;
+	pThis->m_nIntervalMicroframes = 8;
+
+	USBEndpointInitQueue (pThis);
 
 	assert (pThis->m_pDevice != 0);
 
@@ -58,6 +69,11 @@ void USBEndpoint2 (TUSBEndpoint *pThis, TUSBDevice *pDevice, const TUSBEndpointD
 		pThis->m_NextPID = USBPIDData0;
 		break;
 
+	case 1:
+		pThis->m_Type = EndpointTypeIsochronous;
+		pThis->m_NextPID = USBPIDData0;		// not toggled
+		break;
+
 	default:
 		assert (0);	// endpoint configuration should be checked by function driver
 		return;
@@ -65,9 +81,10 @@ void USBEndpoint2 (TUSBEndpoint *pThis, TUSBDevice *pDevice, const TUSBEndpointD
 	
 	pThis->m_ucNumber       = pDesc->bEndpointAddress & 0x0F;
 	pThis->m_bDirectionIn   = pDesc->bEndpointAddress & 0x80 ? TRUE : FALSE;
-	pThis->m_nMaxPacketSize = pDesc->wMaxPacketSize;
+	pThis->m_nMaxPacketSize = pDesc->wMaxPacketSize & 0x7FF;
 	
-	if (pThis->m_Type == EndpointTypeInterrupt)
+	if (   pThis->m_Type == EndpointTypeInterrupt
+	    || pThis->m_Type == EndpointTypeIsochronous)
 	{
 		u8 ucInterval = pDesc->bInterval;
 		if (ucInterval < 1)
@@ -76,9 +93,11 @@ void USBEndpoint2 (TUSBEndpoint *pThis, TUSBDevice *pDevice, const TUSBEndpointD
 		}
 
 		// see USB 2.0 spec chapter 9.6.6
-		if (USBDeviceGetSpeed (pThis->m_pDevice) != USBSpeedHigh)
+		if (   pThis->m_Type == EndpointTypeInterrupt
+		    && USBDeviceGetSpeed (pThis->m_pDevice) != USBSpeedHigh)
 		{
 			pThis->m_nInterval = ucInterval;
+			pThis->m_nIntervalMicroframes = ucInterval * 8;
 		}
 		else
 		{
@@ -89,11 +108,29 @@ void USBEndpoint2 (TUSBEndpoint *pThis, TUSBDevice *pDevice, const TUSBEndpointD
 
 			unsigned nValue = 1 << (ucInterval - 1);
 
-			pThis->m_nInterval = nValue / 8;
-
-			if (pThis->m_nInterval < 1)
+			if (USBDeviceGetSpeed (pThis->m_pDevice) != USBSpeedHigh)
+			{
+				// full-speed isochronous endpoint, interval in frames
+				pThis->m_nInterval = nValue;
+				pThis->m_nIntervalMicroframes = nValue * 8;
+			}
+			else
 			{
-				pThis->m_nInterval = 1;
+				// high-bandwidth endpoint with additional transactions per microframe
+				unsigned nAdditional = (pDesc->wMaxPacketSize >> 11) & 3;
+				if (nAdditional < 3)
+				{
+					pThis->m_nPacketsPerMicroframe = nAdditional + 1;
+				}
+
+				pThis->m_nIntervalMicroframes = nValue;
+
+				pThis->m_nInterval = nValue / 8;
+
+				if (pThis->m_nInterval < 1)
+				{
+					pThis->m_nInterval = 1;
+				}
 			}
 		}
 	}
@@ -112,13 +149,31 @@ void USBEndpointCopy (TUSBEndpoint *pThis, TUSBEndpoint *pEndpoint, TUSBDevice *
 	pThis->m_Type		 = pEndpoint->m_Type;
 	pThis->m_bDirectionIn	 = pEndpoint->m_bDirectionIn;
 	pThis->m_nMaxPacketSize  = pEndpoint->m_nMaxPacketSize;
+	pThis->m_nPacketsPerMicroframe = pEndpoint->m_nPacketsPerMicroframe;
 	pThis->m_nInterval       = pEndpoint->m_nInterval;
+	pThis->m_nIntervalMicroframes = pEndpoint->m_nIntervalMicroframes;
 	pThis->m_NextPID	 = pEndpoint->m_NextPID;
+
+	USBEndpointInitQueue (pThis);
 }
 
 void _USBEndpoint (TUSBEndpoint *pThis)
 {
 	assert (pThis != 0);
+	assert (pThis->m_pFirstRequest == 0);
+	assert (!pThis->m_bActive);
+
+	if (pThis->m_nStartSplitMicroframe != USB_TT_NO_MICROFRAME)
+	{
+		TUSBTransactionTranslator *pTT = USBDeviceGetTT (pThis->m_pDevice);
+		assert (pTT != 0);
+
+		USBTransactionTranslatorRelease (pTT, pThis->m_nStartSplitMicroframe,
+						 USBDeviceGetSpeed (pThis->m_pDevice), pThis->m_nMaxPacketSize);
+
+		pThis->m_nStartSplitMicroframe = USB_TT_NO_MICROFRAME;
+	}
+
 	pThis->m_pDevice = 0;
 }
 
@@ -159,14 +214,30 @@ u32 USBEndpointGetMaxPacketSize (TUSBEndpoint *pThis)
 	return pThis->m_nMaxPacketSize;
 }
 
+unsigned USBEndpointGetPacketsPerMicroframe (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nPacketsPerMicroframe;
+}
+
 unsigned USBEndpointGetInterval (TUSBEndpoint *pThis)
 {
 	assert (pThis != 0);
-	assert (pThis->m_Type == EndpointTypeInterrupt);
+	assert (   pThis->m_Type == EndpointTypeInterrupt
+		|| pThis->m_Type == EndpointTypeIsochronous);
 
 	return pThis->m_nInterval;
 }
 
+unsigned USBEndpointGetIntervalMicroframes (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	assert (   pThis->m_Type == EndpointTypeInterrupt
+		|| pThis->m_Type == EndpointTypeIsochronous);
+
+	return pThis->m_nIntervalMicroframes;
+}
+
 TUSBPID USBEndpointGetNextPID (TUSBEndpoint *pThis, boolean bStatusStage)
 {
 	assert (pThis != 0);
@@ -225,7 +296,175 @@ void USBEndpointSkipPID (TUSBEndpoint *pThis, unsigned nPackets, boolean bStatus
 void USBEndpointResetPID (TUSBEndpoint *pThis)
 {
 	assert (pThis != 0);
+
+	if (pThis->m_Type == EndpointTypeControl)
+	{
+		pThis->m_NextPID = USBPIDSetup;		// after an aborted control transfer
+
+		return;
+	}
+
 	assert (pThis->m_Type == EndpointTypeBulk);
 
 	pThis->m_NextPID = USBPIDData0;
 }
+
+void USBEndpointEnqueueRequest (TUSBEndpoint *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
+
+	pURB->m_pNext = 0;
+
+	if (pThis->m_pFirstRequest == 0)
+	{
+		pThis->m_pFirstRequest = pURB;
+	}
+	else
+	{
+		assert (pThis->m_pLastRequest != 0);
+		pThis->m_pLastRequest->m_pNext = pURB;
+	}
+
+	pThis->m_pLastRequest = pURB;
+}
+
+TUSBRequest *USBEndpointDequeueRequest (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+
+	TUSBRequest *pURB = pThis->m_pFirstRequest;
+	if (pURB != 0)
+	{
+		pThis->m_pFirstRequest = pURB->m_pNext;
+		if (pThis->m_pFirstRequest == 0)
+		{
+			pThis->m_pLastRequest = 0;
+		}
+
+		pURB->m_pNext = 0;
+	}
+
+	return pURB;
+}
+
+boolean USBEndpointRemoveRequest (TUSBEndpoint *pThis, TUSBRequest *pURB)
+{
+	assert (pThis != 0);
+	assert (pURB != 0);
+
+	TUSBRequest *pPrev = 0;
+	for (TUSBRequest *pRequest = pThis->m_pFirstRequest; pRequest != 0; pRequest = pRequest->m_pNext)
+	{
+		if (pRequest == pURB)
+		{
+			if (pPrev == 0)
+			{
+				pThis->m_pFirstRequest = pURB->m_pNext;
+			}
+			else
+			{
+				pPrev->m_pNext = pURB->m_pNext;
+			}
+
+			if (pThis->m_pLastRequest == pURB)
+			{
+				pThis->m_pLastRequest = pPrev;
+			}
+
+			pURB->m_pNext = 0;
+
+			return TRUE;
+		}
+
+		pPrev = pRequest;
+	}
+
+	return FALSE;
+}
+
+boolean USBEndpointHasQueuedRequests (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_pFirstRequest != 0;
+}
+
+void USBEndpointSetActive (TUSBEndpoint *pThis, boolean bActive)
+{
+	assert (pThis != 0);
+	pThis->m_bActive = bActive;
+}
+
+boolean USBEndpointIsActive (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bActive;
+}
+
+void USBEndpointSetNextPending (TUSBEndpoint *pThis, TUSBEndpoint *pEndpoint)
+{
+	assert (pThis != 0);
+	pThis->m_pNextPending = pEndpoint;
+}
+
+TUSBEndpoint *USBEndpointGetNextPending (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_pNextPending;
+}
+
+boolean USBEndpointReserveBandwidth (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+
+	if (   pThis->m_Type != EndpointTypeInterrupt
+	    || pThis->m_nStartSplitMicroframe != USB_TT_NO_MICROFRAME)
+	{
+		return TRUE;
+	}
+
+	assert (pThis->m_pDevice != 0);
+	TUSBTransactionTranslator *pTT = USBDeviceGetTT (pThis->m_pDevice);
+	if (pTT == 0)
+	{
+		return TRUE;
+	}
+
+	pThis->m_nStartSplitMicroframe =
+		USBTransactionTranslatorReserve (pTT, USBDeviceGetSpeed (pThis->m_pDevice),
+						 pThis->m_nMaxPacketSize);
+
+	return pThis->m_nStartSplitMicroframe != USB_TT_NO_MICROFRAME;
+}
+
+unsigned USBEndpointGetStartSplitMicroframe (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nStartSplitMicroframe;
+}
+
+void USBEndpointSetNextFrame (TUSBEndpoint *pThis, unsigned nFrame)
+{
+	assert (pThis != 0);
+	assert (pThis->m_Type == EndpointTypeIsochronous);
+
+	pThis->m_nNextFrame = nFrame;
+}
+
+unsigned USBEndpointGetNextFrame (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nNextFrame;
+}
+
+static void USBEndpointInitQueue (TUSBEndpoint *pThis)
+{
+	assert (pThis != 0);
+
+	pThis->m_pFirstRequest = 0;
+	pThis->m_pLastRequest = 0;
+	pThis->m_bActive = FALSE;
+	pThis->m_pNextPending = 0;
+	pThis->m_nStartSplitMicroframe = USB_TT_NO_MICROFRAME;
+	pThis->m_nNextFrame = USB_ENDPOINT_NO_FRAME;
+}
@@ -21,6 +21,7 @@
 #include <uspi/usbhid.h>
 #include <uspi/usbhostcontroller.h>
 #include <uspi/devicenameservice.h>
+#include <uspi/synchronize.h>
 #include <uspi/macros.h>
 #include <uspi/assert.h>
 #include <uspios.h>
@@ -39,6 +40,8 @@ static const char FromUSBKbd[] = "usbkbd";
 static void USBKeyboardDeviceGenerateKeyEvent (TUSBKeyboardDevice *pThis, u8 ucPhyCode);
 static boolean USBKeyboardDeviceStartRequest (TUSBKeyboardDevice *pThis);
 static void USBKeyboardDeviceCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext);
+static boolean USBKeyboardDeviceStartLEDRequest (TUSBKeyboardDevice *pThis, u8 ucLEDMask);
+static void USBKeyboardDeviceLEDCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext);
 static u8 USBKeyboardDeviceGetModifiers (TUSBKeyboardDevice *pThis);
 static u8 USBKeyboardDeviceGetKeyCode (TUSBKeyboardDevice *pThis);
 #ifdef REPEAT_ENABLE
@@ -61,17 +64,56 @@ void USBKeyboardDevice (TUSBKeyboardDevice *pThis, TUSBFunction *pDevice)
 	pThis->m_ucLastPhyCode = 0;
 	pThis->m_hTimer = 0;
 	pThis->m_ucLastLEDStatus = 0;
+	pThis->m_bLEDRequestActive = FALSE;
+	pThis->m_nLEDMaskPending = -1;
 
 	KeyMap (&pThis->m_KeyMap);
 
 	pThis->m_pReportBuffer = malloc (BOOT_REPORT_SIZE);
 	assert (pThis->m_pReportBuffer != 0);
+
+	pThis->m_pLEDSetupData = (TSetupData *) malloc (sizeof (TSetupData));
+	assert (pThis->m_pLEDSetupData != 0);
+
+	pThis->m_pLEDBuffer = (u8 *) malloc (1);
+	assert (pThis->m_pLEDBuffer != 0);
 }
 
 void _CUSBKeyboardDevice (TUSBKeyboardDevice *pThis)
 {
 	assert (pThis != 0);
 
+	// the controller must not access the LED buffers any more, when they are freed
+	uspi_EnterCritical ();
+
+	if (pThis->m_bLEDRequestActive)
+	{
+		pThis->m_nLEDMaskPending = -1;		// the completion routine must not restart it
+
+		USBRequestCancel (&pThis->m_LEDURB);
+
+		// the request completes, when the channel has been halted (with USPI_USE_FIQ
+		// the completion routine is called from the soft interrupt)
+		while (pThis->m_bLEDRequestActive)
+		{
+			uspi_WaitForInterrupt ();
+		}
+	}
+
+	uspi_LeaveCritical ();
+
+	if (pThis->m_pLEDBuffer != 0)
+	{
+		free (pThis->m_pLEDBuffer);
+		pThis->m_pLEDBuffer = 0;
+	}
+
+	if (pThis->m_pLEDSetupData != 0)
+	{
+		free (pThis->m_pLEDSetupData);
+		pThis->m_pLEDSetupData = 0;
+	}
+
 	if (pThis->m_pReportBuffer != 0)
 	{
 		free (pThis->m_pReportBuffer);
@@ -201,17 +243,74 @@ void USBKeyboardDeviceSetLEDs (TUSBKeyboardDevice *pThis, u8 ucLEDMask)
 {
 	assert (pThis != 0);
 
-	u8 LEDs[1] ALIGN(4) = {ucLEDMask};	// DMA buffer
+	uspi_EnterCritical ();
 
-	if (DWHCIDeviceControlMessage (USBFunctionGetHost (&pThis->m_USBFunction),
-				       USBFunctionGetEndpoint0 (&pThis->m_USBFunction),
-				       REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_INTERFACE,
-				       SET_REPORT, (REPORT_TYPE_OUTPUT << 8) | 0,
-				       USBFunctionGetInterfaceNumber (&pThis->m_USBFunction),
-				       LEDs, sizeof LEDs) < 0)
+	if (pThis->m_bLEDRequestActive)
+	{
+		pThis->m_nLEDMaskPending = ucLEDMask;	// sent from the completion routine
+
+		uspi_LeaveCritical ();
+
+		return;
+	}
+
+	pThis->m_bLEDRequestActive = TRUE;
+
+	uspi_LeaveCritical ();
+
+	if (!USBKeyboardDeviceStartLEDRequest (pThis, ucLEDMask))
+	{
+		pThis->m_bLEDRequestActive = FALSE;
+
+		LogWrite (FromUSBKbd, LOG_WARNING, "Cannot set LEDs");
+	}
+}
+
+boolean USBKeyboardDeviceStartLEDRequest (TUSBKeyboardDevice *pThis, u8 ucLEDMask)
+{
+	assert (pThis != 0);
+
+	assert (pThis->m_pLEDSetupData != 0);
+	pThis->m_pLEDSetupData->bmRequestType = REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_INTERFACE;
+	pThis->m_pLEDSetupData->bRequest      = SET_REPORT;
+	pThis->m_pLEDSetupData->wValue	      = (REPORT_TYPE_OUTPUT << 8) | 0;
+	pThis->m_pLEDSetupData->wIndex	      = USBFunctionGetInterfaceNumber (&pThis->m_USBFunction);
+	pThis->m_pLEDSetupData->wLength	      = 1;
+
+	assert (pThis->m_pLEDBuffer != 0);
+	pThis->m_pLEDBuffer[0] = ucLEDMask;
+
+	USBRequest (&pThis->m_LEDURB, USBFunctionGetEndpoint0 (&pThis->m_USBFunction),
+		    pThis->m_pLEDBuffer, 1, pThis->m_pLEDSetupData);
+	USBRequestSetCompletionRoutine (&pThis->m_LEDURB, USBKeyboardDeviceLEDCompletionRoutine, 0, pThis);
+	USBRequestSetCompleteAtIRQ (&pThis->m_LEDURB, TRUE);	// not reported to the application
+
+	return DWHCIDeviceSubmitAsyncRequest (USBFunctionGetHost (&pThis->m_USBFunction), &pThis->m_LEDURB);
+}
+
+void USBKeyboardDeviceLEDCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext)
+{
+	TUSBKeyboardDevice *pThis = (TUSBKeyboardDevice *) pContext;
+	assert (pThis != 0);
+
+	assert (pURB != 0);
+	assert (&pThis->m_LEDURB == pURB);
+
+	if (USBRequestGetStatus (pURB) == 0)
 	{
 		LogWrite (FromUSBKbd, LOG_WARNING, "Cannot set LEDs");
 	}
+
+	_USBRequest (&pThis->m_LEDURB);
+
+	int nLEDMask = pThis->m_nLEDMaskPending;
+	pThis->m_nLEDMaskPending = -1;
+
+	if (   nLEDMask < 0
+	    || !USBKeyboardDeviceStartLEDRequest (pThis, (u8) nLEDMask))
+	{
+		pThis->m_bLEDRequestActive = FALSE;
+	}
 }
 
 void USBKeyboardDeviceGenerateKeyEvent (TUSBKeyboardDevice *pThis, u8 ucPhyCode)
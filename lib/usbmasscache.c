@@ -0,0 +1,687 @@
+//
+// usbmasscache.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspi/usbmasscache.h>
+#include <uspi/dwhcidevice.h>
+#include <uspi/synchronize.h>
+#include <uspi/util.h>
+#include <uspi/assert.h>
+#include <uspios.h>
+
+static const char FromUmsc[] = "umsc";
+
+static int USBMassStorageCacheDeviceRead (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+					  void *pBuffer, unsigned nCount);
+static int USBMassStorageCacheFill (TUSBMassStorageCache *pThis, unsigned long long ullPage,
+				    unsigned nPages);
+static void USBMassStorageCachePrefetch (TUSBMassStorageCache *pThis, unsigned long long ullPage,
+					 unsigned nPages);
+static void USBMassStorageCachePrefetchCompletionRoutine (int nResult, void *pParam);
+static void USBMassStorageCacheCollect (TUSBMassStorageCache *pThis, boolean bWait);
+static void USBMassStorageCacheUpdate (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+				       const void *pBuffer, unsigned nCount);
+static TUSBMassStorageCachePage *USBMassStorageCacheLookup (TUSBMassStorageCache *pThis,
+							    unsigned long long ullPage);
+static TUSBMassStorageCachePage *USBMassStorageCacheAllocate (TUSBMassStorageCache *pThis,
+							      unsigned long long ullPage);
+static void USBMassStorageCacheRemove (TUSBMassStorageCache *pThis, TUSBMassStorageCachePage *pPage);
+static void USBMassStorageCacheUnlink (TUSBMassStorageCachePage *pPage);
+static void USBMassStorageCacheInsert (TUSBMassStorageCachePage *pPage, TUSBMassStorageCachePage *pAfter);
+
+boolean USBMassStorageCache (TUSBMassStorageCache *pThis, TUSBBulkOnlyMassStorageDevice *pDevice,
+			     unsigned nSize)
+{
+	assert (pThis != 0);
+	assert (pDevice != 0);
+
+	pThis->m_pDevice = pDevice;
+	pThis->m_pPage = 0;
+	pThis->m_ppHash = 0;
+	pThis->m_pMemory = 0;
+	pThis->m_ullNextOffset = 0;
+	pThis->m_bSequential = FALSE;
+	pThis->m_nReadAhead = UMSC_MIN_READ_AHEAD;
+	pThis->m_nPrefetchPages = 0;
+	memset (&pThis->m_Statistics, 0, sizeof pThis->m_Statistics);
+
+	unsigned nBlockSize = USBBulkOnlyMassStorageDeviceGetBlockSize (pDevice);
+	pThis->m_nPageSize = nBlockSize > UMSC_PAGE_SIZE ? nBlockSize : UMSC_PAGE_SIZE;
+	for (pThis->m_nPageShift = 0; (1U << pThis->m_nPageShift) < pThis->m_nPageSize; pThis->m_nPageShift++)
+	{
+		// just count
+	}
+
+	pThis->m_ullDevicePages =   (USBBulkOnlyMassStorageDeviceGetCapacity (pDevice) * nBlockSize)
+				  >> pThis->m_nPageShift;
+
+	unsigned nPages = nSize >> pThis->m_nPageShift;
+	if (nPages < UMSC_MIN_PAGES)
+	{
+		return FALSE;
+	}
+
+	// the read buffers hold the missing pages of a request and the read-ahead
+	pThis->m_nMaxRead = nPages / 8;
+	if (pThis->m_nMaxRead < UMSC_MIN_READ_AHEAD)
+	{
+		pThis->m_nMaxRead = UMSC_MIN_READ_AHEAD;
+	}
+	else if (pThis->m_nMaxRead > UMSC_MAX_READ_AHEAD)
+	{
+		pThis->m_nMaxRead = UMSC_MAX_READ_AHEAD;
+	}
+	pThis->m_nPages = nPages - 2 * pThis->m_nMaxRead;
+
+	pThis->m_pMemory = malloc ((nPages << pThis->m_nPageShift) + DMA_ALIGNMENT);
+	pThis->m_pPage = (TUSBMassStorageCachePage *) malloc (pThis->m_nPages * sizeof (TUSBMassStorageCachePage));
+
+	for (pThis->m_nHashMask = 1; pThis->m_nHashMask < pThis->m_nPages; pThis->m_nHashMask <<= 1)
+	{
+		// just count
+	}
+	pThis->m_ppHash = (TUSBMassStorageCachePage **) malloc (pThis->m_nHashMask * sizeof (TUSBMassStorageCachePage *));
+	pThis->m_nHashMask--;
+
+	if (   pThis->m_pMemory == 0
+	    || pThis->m_pPage == 0
+	    || pThis->m_ppHash == 0)
+	{
+		return FALSE;
+	}
+
+	memset (pThis->m_ppHash, 0, (pThis->m_nHashMask+1) * sizeof (TUSBMassStorageCachePage *));
+
+	pThis->m_pReadBuffer = (u8 *) (  ((uintptr) pThis->m_pMemory + DMA_ALIGNMENT - 1)
+				       & ~(uintptr) (DMA_ALIGNMENT - 1));
+	pThis->m_pPrefetchBuffer = pThis->m_pReadBuffer + (pThis->m_nMaxRead << pThis->m_nPageShift);
+	u8 *pData = pThis->m_pPrefetchBuffer + (pThis->m_nMaxRead << pThis->m_nPageShift);
+
+	pThis->m_LRU.pPrev = &pThis->m_LRU;
+	pThis->m_LRU.pNext = &pThis->m_LRU;
+
+	for (unsigned i = 0; i < pThis->m_nPages; i++)
+	{
+		TUSBMassStorageCachePage *pPage = &pThis->m_pPage[i];
+
+		pPage->ullPage = 0;
+		pPage->bValid = FALSE;
+		pPage->bPrefetched = FALSE;
+		pPage->bPending = FALSE;
+		pPage->pData = pData + (i << pThis->m_nPageShift);
+		pPage->pHashNext = 0;
+
+		USBMassStorageCacheInsert (pPage, &pThis->m_LRU);
+	}
+
+	LogWrite (FromUmsc, LOG_DEBUG, "Cache has %u pages of %u bytes (read-ahead max. %u pages)",
+		  pThis->m_nPages, pThis->m_nPageSize, pThis->m_nMaxRead);
+
+	return TRUE;
+}
+
+void _USBMassStorageCache (TUSBMassStorageCache *pThis)
+{
+	assert (pThis != 0);
+
+	USBMassStorageCacheCollect (pThis, TRUE);	// the read-ahead writes into the memory
+
+	if (pThis->m_ppHash != 0)
+	{
+		free (pThis->m_ppHash);
+		pThis->m_ppHash = 0;
+	}
+
+	if (pThis->m_pPage != 0)
+	{
+		free (pThis->m_pPage);
+		pThis->m_pPage = 0;
+	}
+
+	if (pThis->m_pMemory != 0)
+	{
+		free (pThis->m_pMemory);
+		pThis->m_pMemory = 0;
+	}
+
+	pThis->m_pDevice = 0;
+}
+
+int USBMassStorageCacheRead (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+			     void *pBuffer, unsigned nCount)
+{
+	assert (pThis != 0);
+
+	// a stream is detected, if three requests follow each other
+	boolean bSequential = ullOffset == pThis->m_ullNextOffset;
+	boolean bStream = bSequential && pThis->m_bSequential;
+	pThis->m_bSequential = bSequential;
+	pThis->m_ullNextOffset = ullOffset + nCount;
+	if (!bSequential)
+	{
+		pThis->m_nReadAhead = UMSC_MIN_READ_AHEAD;
+	}
+
+	unsigned long long ullPage = ullOffset >> pThis->m_nPageShift;
+	unsigned long long ullEndPage = (ullOffset + nCount + pThis->m_nPageSize-1) >> pThis->m_nPageShift;
+
+	// large requests do not profit from the cache, invalid requests are rejected by the device
+	if (   pBuffer == 0
+	    || nCount == 0
+	    || ((ullOffset | nCount) & (USBBulkOnlyMassStorageDeviceGetBlockSize (pThis->m_pDevice)-1)) != 0
+	    || ullEndPage - ullPage > pThis->m_nMaxRead
+	    || ullEndPage > pThis->m_ullDevicePages)
+	{
+		pThis->m_Statistics.nBypasses++;
+
+		return USBMassStorageCacheDeviceRead (pThis, ullOffset, pBuffer, nCount);
+	}
+
+	USBMassStorageCacheCollect (pThis, FALSE);
+
+	u8 *pTo = (u8 *) pBuffer;
+	unsigned nPageOffset = (unsigned) ullOffset & (pThis->m_nPageSize-1);
+	unsigned nRemaining = nCount;
+
+	while (nRemaining > 0)
+	{
+		assert (ullPage < ullEndPage);
+		TUSBMassStorageCachePage *pPage = USBMassStorageCacheLookup (pThis, ullPage);
+		if (   pPage != 0
+		    && pPage->bPending)
+		{
+			// the page is removed, if the read-ahead failed
+			USBMassStorageCacheCollect (pThis, TRUE);
+
+			continue;
+		}
+
+		if (pPage != 0)
+		{
+			pThis->m_Statistics.nHits++;
+			if (pPage->bPrefetched)
+			{
+				pPage->bPrefetched = FALSE;
+				pThis->m_Statistics.nPrefetchHits++;
+			}
+
+			// most recently used
+			USBMassStorageCacheUnlink (pPage);
+			USBMassStorageCacheInsert (pPage, &pThis->m_LRU);
+
+			unsigned nBytes = pThis->m_nPageSize - nPageOffset;
+			if (nBytes > nRemaining)
+			{
+				nBytes = nRemaining;
+			}
+
+			memcpy (pTo, pPage->pData + nPageOffset, nBytes);
+
+			pTo += nBytes;
+			nRemaining -= nBytes;
+			nPageOffset = 0;
+			ullPage++;
+
+			continue;
+		}
+
+		// the pages are allocated, after the read-ahead has been collected
+		if (pThis->m_nPrefetchPages != 0)
+		{
+			USBMassStorageCacheCollect (pThis, TRUE);
+
+			continue;
+		}
+
+		// the missing pages of the request are read with one command
+		unsigned nMissing = 1;
+		while (   ullPage + nMissing < ullEndPage
+		       && USBMassStorageCacheLookup (pThis, ullPage + nMissing) == 0)
+		{
+			nMissing++;
+		}
+
+		if (USBMassStorageCacheFill (pThis, ullPage, nMissing) < 0)
+		{
+			return -1;
+		}
+
+		unsigned nBytes = (nMissing << pThis->m_nPageShift) - nPageOffset;
+		if (nBytes > nRemaining)
+		{
+			nBytes = nRemaining;
+		}
+
+		memcpy (pTo, pThis->m_pReadBuffer + nPageOffset, nBytes);
+
+		pTo += nBytes;
+		nRemaining -= nBytes;
+		nPageOffset = 0;
+		ullPage += nMissing;
+	}
+
+	// a stream is continued in advance with a growing read-ahead window, which is filled up
+	// by a read queued to the device, when less than half of it is left in the cache
+	if (   bStream
+	    && pThis->m_nPrefetchPages == 0)
+	{
+		// the pages left are not replaced by the read-ahead, they become the most recently used
+		unsigned nAhead = 0;
+		TUSBMassStorageCachePage *pPage;
+		while (   nAhead < pThis->m_nReadAhead
+		       && ullEndPage + nAhead < pThis->m_ullDevicePages
+		       && (pPage = USBMassStorageCacheLookup (pThis, ullEndPage + nAhead)) != 0)
+		{
+			USBMassStorageCacheUnlink (pPage);
+			USBMassStorageCacheInsert (pPage, &pThis->m_LRU);
+
+			nAhead++;
+		}
+
+		if (   nAhead <= pThis->m_nReadAhead / 2
+		    && ullEndPage + nAhead < pThis->m_ullDevicePages)
+		{
+			USBMassStorageCachePrefetch (pThis, ullEndPage + nAhead, pThis->m_nReadAhead - nAhead);
+
+			if (pThis->m_nReadAhead < pThis->m_nMaxRead)
+			{
+				pThis->m_nReadAhead *= 2;
+				if (pThis->m_nReadAhead > pThis->m_nMaxRead)
+				{
+					pThis->m_nReadAhead = pThis->m_nMaxRead;
+				}
+			}
+		}
+	}
+
+	return (int) nCount;
+}
+
+int USBMassStorageCacheWrite (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+			      const void *pBuffer, unsigned nCount)
+{
+	assert (pThis != 0);
+
+	if (USBBulkOnlyMassStorageDeviceSeek (pThis->m_pDevice, ullOffset) != ullOffset)
+	{
+		return -1;
+	}
+
+	int nResult = USBBulkOnlyMassStorageDeviceWrite (pThis->m_pDevice, pBuffer, nCount);
+
+	// the contents of the device is unknown after a failed write
+	USBMassStorageCacheUpdate (pThis, ullOffset, nResult == (int) nCount ? pBuffer : 0, nCount);
+
+	return nResult;
+}
+
+void USBMassStorageCacheInvalidate (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+				    unsigned nCount)
+{
+	assert (pThis != 0);
+
+	USBMassStorageCacheUpdate (pThis, ullOffset, 0, nCount);
+}
+
+void USBMassStorageCacheGetStatistics (TUSBMassStorageCache *pThis, TUSPiCacheStatistics *pStatistics)
+{
+	assert (pThis != 0);
+	assert (pStatistics != 0);
+
+	*pStatistics = pThis->m_Statistics;
+}
+
+int USBMassStorageCacheDeviceRead (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+				   void *pBuffer, unsigned nCount)
+{
+	assert (pThis != 0);
+
+	if (USBBulkOnlyMassStorageDeviceSeek (pThis->m_pDevice, ullOffset) != ullOffset)
+	{
+		return -1;
+	}
+
+	return USBBulkOnlyMassStorageDeviceRead (pThis->m_pDevice, pBuffer, nCount);
+}
+
+// reads nPages requested pages into the read buffer and the cache
+int USBMassStorageCacheFill (TUSBMassStorageCache *pThis, unsigned long long ullPage, unsigned nPages)
+{
+	assert (pThis != 0);
+	assert (nPages > 0);
+	assert (nPages <= pThis->m_nMaxRead);
+	assert (pThis->m_nPrefetchPages == 0);
+
+	unsigned nCount = nPages << pThis->m_nPageShift;
+	if (USBMassStorageCacheDeviceRead (pThis, ullPage << pThis->m_nPageShift,
+					   pThis->m_pReadBuffer, nCount) != (int) nCount)
+	{
+		return -1;
+	}
+
+	for (unsigned i = 0; i < nPages; i++)
+	{
+		TUSBMassStorageCachePage *pPage = USBMassStorageCacheAllocate (pThis, ullPage + i);
+		assert (pPage != 0);
+
+		memcpy (pPage->pData, pThis->m_pReadBuffer + (i << pThis->m_nPageShift), pThis->m_nPageSize);
+	}
+
+	pThis->m_Statistics.nMisses += nPages;
+
+	return 0;
+}
+
+// queues the read of up to nPages pages from ullPage on into the prefetch buffer, the read-ahead
+// stops before a cached page, its pages are allocated and pending until it is collected
+void USBMassStorageCachePrefetch (TUSBMassStorageCache *pThis, unsigned long long ullPage, unsigned nPages)
+{
+	assert (pThis != 0);
+	assert (pThis->m_nPrefetchPages == 0);
+
+	if (nPages > pThis->m_nMaxRead)
+	{
+		nPages = pThis->m_nMaxRead;
+	}
+
+	if (nPages > pThis->m_ullDevicePages - ullPage)
+	{
+		nPages = (unsigned) (pThis->m_ullDevicePages - ullPage);
+	}
+
+	for (unsigned i = 0; i < nPages; i++)
+	{
+		if (USBMassStorageCacheLookup (pThis, ullPage + i) != 0)
+		{
+			nPages = i;
+
+			break;
+		}
+	}
+
+	if (nPages == 0)
+	{
+		return;
+	}
+
+	pThis->m_ullPrefetchPage = ullPage;
+	pThis->m_nPrefetchPages = nPages;
+	pThis->m_bPrefetchDone = 0;
+
+	for (unsigned i = 0; i < nPages; i++)
+	{
+		TUSBMassStorageCachePage *pPage = USBMassStorageCacheAllocate (pThis, ullPage + i);
+		assert (pPage != 0);
+
+		pPage->bPending = TRUE;
+	}
+
+	if (!USBBulkOnlyMassStorageDeviceReadAsync (pThis->m_pDevice, ullPage << pThis->m_nPageShift,
+						    pThis->m_pPrefetchBuffer, nPages << pThis->m_nPageShift,
+						    USBMassStorageCachePrefetchCompletionRoutine, pThis))
+	{
+		// the queue is full, the pages are removed again
+		pThis->m_nPrefetchResult = -1;
+		pThis->m_bPrefetchDone = 1;
+
+		USBMassStorageCacheCollect (pThis, FALSE);
+	}
+}
+
+void USBMassStorageCachePrefetchCompletionRoutine (int nResult, void *pParam)
+{
+	TUSBMassStorageCache *pThis = (TUSBMassStorageCache *) pParam;
+	assert (pThis != 0);
+
+	pThis->m_nPrefetchResult = nResult;
+
+	DataMemBarrier ();
+
+	pThis->m_bPrefetchDone = 1;
+
+#ifdef USPI_WAIT_HOOK
+	SignalCompletion (&pThis->m_bPrefetchDone);
+#endif
+}
+
+// takes the data of a completed read-ahead into its pending pages or removes them on failure,
+// waits for the completion, if bWait is TRUE, returns immediately otherwise
+void USBMassStorageCacheCollect (TUSBMassStorageCache *pThis, boolean bWait)
+{
+	assert (pThis != 0);
+
+	if (pThis->m_nPrefetchPages == 0)
+	{
+		return;
+	}
+
+	if (!pThis->m_bPrefetchDone)
+	{
+		if (!bWait)
+		{
+			return;
+		}
+
+#ifdef USPI_DEFER_COMPLETION
+		// the commands are chained at interrupt level, but the completion routine
+		// is called from the completion queue
+		USBBulkOnlyMassStorageDeviceWaitAsync (pThis->m_pDevice);
+
+		TDWHCIDevice *pHost = USBFunctionGetHost (&pThis->m_pDevice->m_USBFunction);
+		assert (pHost != 0);
+
+		while (!pThis->m_bPrefetchDone)
+		{
+			DWHCIDeviceProcessCompletions (pHost);
+		}
+#elif defined (USPI_WAIT_HOOK)
+		while (!pThis->m_bPrefetchDone)
+		{
+			WaitForCompletion (&pThis->m_bPrefetchDone);
+		}
+#else
+		uspi_EnterCritical ();
+
+		while (!pThis->m_bPrefetchDone)
+		{
+			uspi_WaitForInterrupt ();
+		}
+
+		uspi_LeaveCritical ();
+#endif
+	}
+
+	DataMemBarrier ();
+
+	unsigned nPages = pThis->m_nPrefetchPages;
+	boolean bOK = pThis->m_nPrefetchResult == (int) (nPages << pThis->m_nPageShift);
+
+	for (unsigned i = 0; i < nPages; i++)
+	{
+		TUSBMassStorageCachePage *pPage = USBMassStorageCacheLookup (pThis, pThis->m_ullPrefetchPage + i);
+		assert (pPage != 0);
+		assert (pPage->bPending);
+
+		pPage->bPending = FALSE;
+
+		if (!bOK)
+		{
+			USBMassStorageCacheRemove (pThis, pPage);
+
+			continue;
+		}
+
+		memcpy (pPage->pData, pThis->m_pPrefetchBuffer + (i << pThis->m_nPageShift), pThis->m_nPageSize);
+		pPage->bPrefetched = TRUE;
+	}
+
+	if (bOK)
+	{
+		pThis->m_Statistics.nPrefetches += nPages;
+	}
+
+	pThis->m_nPrefetchPages = 0;
+}
+
+// copies the written data into the cached pages of the range or removes them (pBuffer == 0)
+void USBMassStorageCacheUpdate (TUSBMassStorageCache *pThis, unsigned long long ullOffset,
+				const void *pBuffer, unsigned nCount)
+{
+	assert (pThis != 0);
+
+	USBMassStorageCacheCollect (pThis, TRUE);		// the pages are modified
+
+	unsigned long long ullEnd = ullOffset + nCount;
+	unsigned long long ullFirstPage = ullOffset >> pThis->m_nPageShift;
+	unsigned long long ullEndPage = (ullEnd + pThis->m_nPageSize-1) >> pThis->m_nPageShift;
+
+	// look at the pages of the range or at all cached pages, whatever is less
+	boolean bScan = ullEndPage - ullFirstPage > pThis->m_nPages;
+	unsigned nPages = bScan ? pThis->m_nPages : (unsigned) (ullEndPage - ullFirstPage);
+
+	for (unsigned i = 0; i < nPages; i++)
+	{
+		TUSBMassStorageCachePage *pPage;
+		if (bScan)
+		{
+			pPage = &pThis->m_pPage[i];
+			if (   !pPage->bValid
+			    || pPage->ullPage < ullFirstPage
+			    || pPage->ullPage >= ullEndPage)
+			{
+				continue;
+			}
+		}
+		else
+		{
+			pPage = USBMassStorageCacheLookup (pThis, ullFirstPage + i);
+			if (pPage == 0)
+			{
+				continue;
+			}
+		}
+
+		if (pBuffer == 0)
+		{
+			USBMassStorageCacheRemove (pThis, pPage);
+
+			continue;
+		}
+
+		unsigned long long ullPageStart = pPage->ullPage << pThis->m_nPageShift;
+		unsigned long long ullStart = ullOffset > ullPageStart ? ullOffset : ullPageStart;
+		unsigned long long ullStop = ullPageStart + pThis->m_nPageSize;
+		if (ullStop > ullEnd)
+		{
+			ullStop = ullEnd;
+		}
+
+		memcpy (pPage->pData + (unsigned) (ullStart - ullPageStart),
+			(const u8 *) pBuffer + (unsigned) (ullStart - ullOffset),
+			(unsigned) (ullStop - ullStart));
+	}
+}
+
+TUSBMassStorageCachePage *USBMassStorageCacheLookup (TUSBMassStorageCache *pThis, unsigned long long ullPage)
+{
+	assert (pThis != 0);
+
+	TUSBMassStorageCachePage *pPage = pThis->m_ppHash[(unsigned) ullPage & pThis->m_nHashMask];
+	while (   pPage != 0
+	       && pPage->ullPage != ullPage)
+	{
+		pPage = pPage->pHashNext;
+	}
+
+	return pPage;
+}
+
+// takes the least recently used page for ullPage, the page becomes the most recently used one
+TUSBMassStorageCachePage *USBMassStorageCacheAllocate (TUSBMassStorageCache *pThis, unsigned long long ullPage)
+{
+	assert (pThis != 0);
+	assert (USBMassStorageCacheLookup (pThis, ullPage) == 0);
+
+	TUSBMassStorageCachePage *pPage = pThis->m_LRU.pPrev;
+	assert (pPage != &pThis->m_LRU);
+	assert (!pPage->bPending);
+
+	if (pPage->bValid)
+	{
+		USBMassStorageCacheRemove (pThis, pPage);
+
+		pThis->m_Statistics.nEvictions++;
+	}
+
+	pPage->ullPage = ullPage;
+	pPage->bValid = TRUE;
+	pPage->bPrefetched = FALSE;
+	pPage->bPending = FALSE;
+
+	TUSBMassStorageCachePage **ppHead = &pThis->m_ppHash[(unsigned) ullPage & pThis->m_nHashMask];
+	pPage->pHashNext = *ppHead;
+	*ppHead = pPage;
+
+	USBMassStorageCacheUnlink (pPage);
+	USBMassStorageCacheInsert (pPage, &pThis->m_LRU);
+
+	return pPage;
+}
+
+// the page becomes invalid and is reused first
+void USBMassStorageCacheRemove (TUSBMassStorageCache *pThis, TUSBMassStorageCachePage *pPage)
+{
+	assert (pThis != 0);
+	assert (pPage != 0);
+	assert (pPage->bValid);
+
+	TUSBMassStorageCachePage **ppPage = &pThis->m_ppHash[(unsigned) pPage->ullPage & pThis->m_nHashMask];
+	while (*ppPage != pPage)
+	{
+		assert (*ppPage != 0);
+		ppPage = &(*ppPage)->pHashNext;
+	}
+	*ppPage = pPage->pHashNext;
+
+	pPage->pHashNext = 0;
+	pPage->bValid = FALSE;
+	pPage->bPrefetched = FALSE;
+	pPage->bPending = FALSE;
+
+	USBMassStorageCacheUnlink (pPage);
+	USBMassStorageCacheInsert (pPage, pThis->m_LRU.pPrev);
+}
+
+void USBMassStorageCacheUnlink (TUSBMassStorageCachePage *pPage)
+{
+	assert (pPage != 0);
+
+	pPage->pPrev->pNext = pPage->pNext;
+	pPage->pNext->pPrev = pPage->pPrev;
+}
+
+void USBMassStorageCacheInsert (TUSBMassStorageCachePage *pPage, TUSBMassStorageCachePage *pAfter)
+{
+	assert (pPage != 0);
+	assert (pAfter != 0);
+
+	pPage->pPrev = pAfter;
+	pPage->pNext = pAfter->pNext;
+	pAfter->pNext->pPrev = pPage;
+	pAfter->pNext = pPage;
+}
@@ -20,6 +20,7 @@
 #include <uspi/usbmassdevice.h>
 #include <uspi/usbhostcontroller.h>
 #include <uspi/devicenameservice.h>
+#include <uspi/synchronize.h>
 #include <uspi/util.h>
 #include <uspi/macros.h>
 #include <uspi/assert.h>
@@ -94,6 +95,32 @@ typedef struct TSCSIInquiryResponse
 			ProductRevisionLevel[4];
 }
 PACKED TSCSIInquiryResponse;
+#define SCSI_VERSION_SPC3	5				// vital product data is available
+
+#define SCSI_INQUIRY_EVPD	0x01
+
+typedef struct TSCSIVPDHeader
+{
+	unsigned char	PeripheralDeviceType,
+			PageCode;
+#define SCSI_VPD_SUPPORTED_PAGES	0x00
+#define SCSI_VPD_BLOCK_LIMITS		0xB0
+	unsigned short	PageLength;				// big endian
+}
+PACKED TSCSIVPDHeader;
+
+typedef struct TSCSIBlockLimitsVPD				// first part of the page
+{
+	TSCSIVPDHeader	Header;
+	unsigned char	WSNZ,
+			MaximumCompareAndWriteLength;
+	unsigned short	OptimalTransferLengthGranularity;	// big endian
+	unsigned int	MaximumTransferLength;			// blocks, big endian, 0: no limit
+	unsigned int	OptimalTransferLength;			// blocks, big endian, 0: not reported
+}
+PACKED TSCSIBlockLimitsVPD;
+
+#define SCSI_VPD_MAX_SIZE	64
 
 typedef struct TSCSITestUnitReady
 {
@@ -159,6 +186,29 @@ typedef struct TSCSIReadCapacityResponse
 }
 PACKED TSCSIReadCapacityResponse;
 
+typedef struct TSCSIReadCapacity16
+{
+	unsigned char	OperationCode,
+#define SCSI_OP_SERVICE_ACTION_IN16	0x9E
+			ServiceAction;
+#define SCSI_SA_READ_CAPACITY16		0x10
+	unsigned long long LogicalBlockAddress;			// set to 0
+	unsigned int	AllocationLength;			// big endian
+	unsigned char	PartialMediumIndicator	: 1,		// set to 0
+			Reserved		: 7;
+	unsigned char	Control;
+}
+PACKED TSCSIReadCapacity16;
+
+typedef struct TSCSIReadCapacityResponse16
+{
+	unsigned long long ReturnedLogicalBlockAddress;		// big endian
+	unsigned int	BlockLengthInBytes;			// big endian
+	unsigned char	Reserved[20];
+}
+PACKED TSCSIReadCapacityResponse16;
+#define SCSI_READ_CAPACITY16_MIN_RESPONSE	12
+
 typedef struct TSCSIRead10
 {
 	unsigned char	OperationCode,
@@ -184,16 +234,95 @@ typedef struct TSCSIWrite10
 }
 PACKED TSCSIWrite10;
 
+// used, if the block address or count do not fit into a 10-byte command block
+
+typedef struct TSCSIRead16
+{
+	unsigned char	OperationCode,
+#define SCSI_OP_READ16		0x88
+			Flags;
+	unsigned long long LogicalBlockAddress;			// big endian
+	unsigned int	TransferLength;				// block count, big endian
+	unsigned char	GroupNumber,
+			Control;
+}
+PACKED TSCSIRead16;
+
+typedef struct TSCSIWrite16
+{
+	unsigned char	OperationCode,
+#define SCSI_OP_WRITE16		0x8A
+			Flags;
+	unsigned long long LogicalBlockAddress;			// big endian
+	unsigned int	TransferLength;				// block count, big endian
+	unsigned char	GroupNumber,
+			Control;
+}
+PACKED TSCSIWrite16;
+
+typedef struct TSCSISynchronizeCache10
+{
+	unsigned char	OperationCode,
+#define SCSI_OP_SYNCHRONIZE_CACHE10	0x35
+			Flags;
+	unsigned int	LogicalBlockAddress;			// set to 0
+	unsigned char	GroupNumber;
+	unsigned short	NumberOfBlocks;				// 0: up to the end of the medium
+	unsigned char	Control;
+}
+PACKED TSCSISynchronizeCache10;
+
+typedef struct TSCSISynchronizeCache16
+{
+	unsigned char	OperationCode,
+#define SCSI_OP_SYNCHRONIZE_CACHE16	0x91
+			Flags;
+	unsigned long long LogicalBlockAddress;			// set to 0
+	unsigned int	NumberOfBlocks;				// 0: up to the end of the medium
+	unsigned char	GroupNumber,
+			Control;
+}
+PACKED TSCSISynchronizeCache16;
+
+#define SCSI_MAX_CMDBLK_LEN	16
+
 static unsigned s_nDeviceNumber = 1;
 
 static const char FromUmsd[] = "umsd";
 
 int USBBulkOnlyMassStorageDeviceTryRead (TUSBBulkOnlyMassStorageDevice *pThis, void *pBuffer, unsigned nCount);
 int USBBulkOnlyMassStorageDeviceTryWrite (TUSBBulkOnlyMassStorageDevice *pThis, const void *pBuffer, unsigned nCount);
+int USBBulkOnlyMassStorageDeviceTryFlush (TUSBBulkOnlyMassStorageDevice *pThis);
 int USBBulkOnlyMassStorageDeviceCommand (TUSBBulkOnlyMassStorageDevice *pThis,
 					 void *pCmdBlk, unsigned nCmdBlkLen,
 					 void *pBuffer, unsigned nBufLen, boolean bIn);
 int USBBulkOnlyMassStorageDeviceReset (TUSBBulkOnlyMassStorageDevice *pThis);
+int USBBulkOnlyMassStorageDeviceInquiryVPD (TUSBBulkOnlyMassStorageDevice *pThis, u8 ucPage, void *pBuffer);
+unsigned USBBulkOnlyMassStorageDeviceGetBlockLimit (TUSBBulkOnlyMassStorageDevice *pThis);
+int USBBulkOnlyMassStorageDeviceTransferSplit (TUSBBulkOnlyMassStorageDevice *pThis, TUSBMassStorageOp Op,
+					       void *pBuffer, unsigned nCount);
+unsigned USBBulkOnlyMassStorageDeviceInitReadWrite (TUSBBulkOnlyMassStorageDevice *pThis, void *pCmdBlk,
+						    unsigned long long ullOffset, unsigned nCount, boolean bIn);
+unsigned USBBulkOnlyMassStorageDeviceInitFlush (TUSBBulkOnlyMassStorageDevice *pThis, void *pCmdBlk);
+void USBBulkOnlyMassStorageDeviceInitCBW (TUSBBulkOnlyMassStorageDevice *pThis, TCBW *pCBW,
+					  const void *pCmdBlk, unsigned nCmdBlkLen, unsigned nBufLen, boolean bIn);
+boolean USBBulkOnlyMassStorageDeviceCheckCSW (TUSBBulkOnlyMassStorageDevice *pThis, const TCSW *pCSW);
+boolean USBBulkOnlyMassStorageDeviceQueue (TUSBBulkOnlyMassStorageDevice *pThis, TUSBMassStorageOp Op,
+					   unsigned long long ullOffset, void *pBuffer, unsigned nCount,
+					   TUSBMassStorageCompletionRoutine *pRoutine, void *pParam);
+void USBBulkOnlyMassStorageDeviceAsyncStart (TUSBBulkOnlyMassStorageDevice *pThis);
+void USBBulkOnlyMassStorageDeviceAsyncFailed (TUSBBulkOnlyMassStorageDevice *pThis);
+void USBBulkOnlyMassStorageDeviceAsyncComplete (TUSBBulkOnlyMassStorageDevice *pThis, int nResult);
+boolean USBBulkOnlyMassStorageDeviceAsyncSubmit (TUSBBulkOnlyMassStorageDevice *pThis,
+						 TUSBMassStorageAsyncState State, TUSBEndpoint *pEndpoint,
+						 void *pBuffer, unsigned nBufLen, boolean bControl);
+static void USBBulkOnlyMassStorageDeviceCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext);
+static void USBBulkOnlyMassStorageDeviceSplitCompletionRoutine (int nResult, void *pParam);
+#ifdef USPI_DEFER_COMPLETION
+static void USBBulkOnlyMassStorageDeviceDeferredCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext);
+static boolean USBBulkOnlyMassStorageDeviceRoutinesPending (TUSBMassStorageAsyncData *pAsync);
+#endif
+void USBBulkOnlyMassStorageDeviceFreeAsync (TUSBMassStorageAsyncData *pAsync);
 
 void USBBulkOnlyMassStorageDevice (TUSBBulkOnlyMassStorageDevice *pThis, TUSBFunction *pDevice)
 {
@@ -205,14 +334,65 @@ void USBBulkOnlyMassStorageDevice (TUSBBulkOnlyMassStorageDevice *pThis, TUSBFun
 	pThis->m_pEndpointIn = 0;
 	pThis->m_pEndpointOut = 0;
 	pThis->m_nCWBTag = 0;
-	pThis->m_nBlockCount = 0;
+	pThis->m_ullBlockCount = 0;
+	pThis->m_nBlockSize = UMSD_BLOCK_SIZE;
+	pThis->m_nBlockShift = 9;
+	pThis->m_nMaxTransfer = UMSD_MAX_TRANSFER_SIZE;
 	pThis->m_ullOffset = 0;
+	pThis->m_WritePolicy = UMSDWriteFUA;
+
+	pThis->m_nAsyncIn = 0;
+	pThis->m_nAsyncOut = 0;
+	pThis->m_bAsyncIdle = TRUE;
+	pThis->m_bAsyncShutdown = FALSE;
+	pThis->m_bAsyncStarting = FALSE;
+	pThis->m_bAsyncStartCompleted = FALSE;
+	pThis->m_nAsyncStartResult = 0;
+	pThis->m_AsyncState = UMSDAsyncIdle;
+
+	void *pBlock = malloc (sizeof (TUSBMassStorageAsyncData) + DMA_ALIGNMENT - 1);
+	assert (pBlock != 0);
+	pThis->m_pAsync = (TUSBMassStorageAsyncData *) (  ((uintptr) pBlock + DMA_ALIGNMENT - 1)
+							& ~(uintptr) (DMA_ALIGNMENT - 1));
+	pThis->m_pAsync->pBlock = pBlock;
+
+#ifdef USPI_DEFER_COMPLETION
+	pThis->m_pAsync->bOrphaned = FALSE;
+	for (unsigned i = 0; i < UMSD_ASYNC_QUEUE_SIZE; i++)
+	{
+		pThis->m_pAsync->Queue[i].bRoutinePending = FALSE;
+	}
+#endif
+
+	assert (sizeof (TCBW) == UMSD_CBW_SIZE);
+	assert (sizeof (TCSW) == UMSD_CSW_SIZE);
 }
 
 void _USBBulkOnlyMassStorageDevice (TUSBBulkOnlyMassStorageDevice *pThis)
 {
 	assert (pThis != 0);
 
+	// the active command is cancelled and the queued commands fail,
+	// before the request, its endpoints and buffers are freed
+	uspi_EnterCritical ();
+
+	pThis->m_bAsyncShutdown = TRUE;
+
+	if (!pThis->m_bAsyncIdle)
+	{
+		USBRequestCancel (&pThis->m_AsyncURB);
+
+		while (!pThis->m_bAsyncIdle)
+		{
+			uspi_WaitForInterrupt ();
+		}
+	}
+
+	uspi_LeaveCritical ();
+
+	USBBulkOnlyMassStorageDeviceFreeAsync (pThis->m_pAsync);
+	pThis->m_pAsync = 0;
+
 	if (pThis->m_pEndpointOut != 0)
 	{
 		_USBEndpoint (pThis->m_pEndpointOut);
@@ -299,7 +479,7 @@ boolean USBBulkOnlyMassStorageDeviceConfigure (TUSBFunction *pUSBFunction)
 	SCSIInquiry.AllocationLength	  = sizeof (TSCSIInquiryResponse);
 	SCSIInquiry.Control		  = SCSI_CONTROL;
 
-	TSCSIInquiryResponse SCSIInquiryResponse;
+	TSCSIInquiryResponse SCSIInquiryResponse ALIGN (4);		// DMA buffer
 	if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIInquiry, sizeof SCSIInquiry,
 						 &SCSIInquiryResponse, sizeof SCSIInquiryResponse,
 						 TRUE) != (int) sizeof SCSIInquiryResponse)
@@ -338,7 +518,7 @@ boolean USBBulkOnlyMassStorageDeviceConfigure (TUSBFunction *pUSBFunction)
 		SCSIRequestSense.AllocationLength = sizeof (TSCSIRequestSenseResponse7x);
 		SCSIRequestSense.Control	  = SCSI_CONTROL;
 
-		TSCSIRequestSenseResponse7x SCSIRequestSenseResponse7x;
+		TSCSIRequestSenseResponse7x SCSIRequestSenseResponse7x ALIGN (4);	// DMA buffer
 		if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIRequestSense, sizeof SCSIRequestSense,
 							 &SCSIRequestSenseResponse7x, sizeof SCSIRequestSenseResponse7x,
 							 TRUE) < 0)
@@ -368,7 +548,7 @@ boolean USBBulkOnlyMassStorageDeviceConfigure (TUSBFunction *pUSBFunction)
 	SCSIReadCapacity.Reserved3		= 0;
 	SCSIReadCapacity.Control		= SCSI_CONTROL;
 
-	TSCSIReadCapacityResponse SCSIReadCapacityResponse;
+	TSCSIReadCapacityResponse SCSIReadCapacityResponse ALIGN (4);	// DMA buffer
 	if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIReadCapacity, sizeof SCSIReadCapacity,
 						 &SCSIReadCapacityResponse, sizeof SCSIReadCapacityResponse,
 						 TRUE) != (int) sizeof SCSIReadCapacityResponse)
@@ -379,24 +559,70 @@ boolean USBBulkOnlyMassStorageDeviceConfigure (TUSBFunction *pUSBFunction)
 	}
 
 	unsigned nBlockSize = uspi_le2be32 (SCSIReadCapacityResponse.BlockLengthInBytes);
-	if (nBlockSize != UMSD_BLOCK_SIZE)
+	unsigned long long ullLastBlock = uspi_le2be32 (SCSIReadCapacityResponse.ReturnedLogicalBlockAddress);
+	if (ullLastBlock == (u32) -1)
+	{
+		// the capacity does not fit into 32 bits
+		TSCSIReadCapacity16 SCSIReadCapacity16;
+		memset (&SCSIReadCapacity16, 0, sizeof SCSIReadCapacity16);
+		SCSIReadCapacity16.OperationCode	= SCSI_OP_SERVICE_ACTION_IN16;
+		SCSIReadCapacity16.ServiceAction	= SCSI_SA_READ_CAPACITY16;
+		SCSIReadCapacity16.AllocationLength	= uspi_le2be32 (sizeof (TSCSIReadCapacityResponse16));
+		SCSIReadCapacity16.Control		= SCSI_CONTROL;
+
+		TSCSIReadCapacityResponse16 SCSIReadCapacityResponse16 ALIGN (4);	// DMA buffer
+		if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIReadCapacity16, sizeof SCSIReadCapacity16,
+							 &SCSIReadCapacityResponse16, sizeof SCSIReadCapacityResponse16,
+							 TRUE) < SCSI_READ_CAPACITY16_MIN_RESPONSE)
+		{
+			LogWrite (FromUmsd, LOG_ERROR, "Read capacity (16) failed");
+
+			return FALSE;
+		}
+
+		nBlockSize = uspi_le2be32 (SCSIReadCapacityResponse16.BlockLengthInBytes);
+		ullLastBlock = uspi_le2be64 (SCSIReadCapacityResponse16.ReturnedLogicalBlockAddress);
+	}
+
+	if (   nBlockSize < UMSD_BLOCK_SIZE
+	    || nBlockSize > UMSD_MAX_BLOCK_SIZE
+	    || (nBlockSize & (nBlockSize-1)) != 0)
 	{
 		LogWrite (FromUmsd, LOG_ERROR, "Unsupported block size: %u", nBlockSize);
 
 		return FALSE;
 	}
 
-	pThis->m_nBlockCount = uspi_le2be32 (SCSIReadCapacityResponse.ReturnedLogicalBlockAddress);
-	if (pThis->m_nBlockCount == (u32) -1)
+	pThis->m_nBlockSize = nBlockSize;
+	pThis->m_nBlockShift = 9;
+	while ((1U << pThis->m_nBlockShift) < nBlockSize)
 	{
-		LogWrite (FromUmsd, LOG_ERROR, "Unsupported disk size > 2TB");
+		pThis->m_nBlockShift++;
+	}
 
-		return FALSE;
+	pThis->m_ullBlockCount = ullLastBlock + 1;
+
+	LogWrite (FromUmsd, LOG_DEBUG, "Capacity is %u MByte (%u bytes per block)",
+		  (unsigned) ((pThis->m_ullBlockCount << pThis->m_nBlockShift) >> 20), nBlockSize);
+
+	unsigned nMaxBlocks = UMSD_MAX_TRANSFER_SIZE >> pThis->m_nBlockShift;
+	if (   pThis->m_ullBlockCount <= 0x100000000ULL
+	    && nMaxBlocks > 0xFFFF)
+	{
+		nMaxBlocks = 0xFFFF;			// use 10-byte commands only
 	}
 
-	pThis->m_nBlockCount++;
+	if (SCSIInquiryResponse.ANSIApprovedVersion >= SCSI_VERSION_SPC3)
+	{
+		unsigned nLimit = USBBulkOnlyMassStorageDeviceGetBlockLimit (pThis);
+		if (   nLimit != 0
+		    && nLimit < nMaxBlocks)
+		{
+			nMaxBlocks = nLimit;
+		}
+	}
 
-	LogWrite (FromUmsd, LOG_DEBUG, "Capacity is %u MByte", pThis->m_nBlockCount / (0x100000 / UMSD_BLOCK_SIZE));
+	pThis->m_nMaxTransfer = nMaxBlocks << pThis->m_nBlockShift;
 
 	TString DeviceName;
 	String (&DeviceName);
@@ -412,6 +638,13 @@ int USBBulkOnlyMassStorageDeviceRead (TUSBBulkOnlyMassStorageDevice *pThis, void
 {
 	assert (pThis != 0);
 
+	USBBulkOnlyMassStorageDeviceWaitAsync (pThis);
+
+	if (nCount > pThis->m_nMaxTransfer)
+	{
+		return USBBulkOnlyMassStorageDeviceTransferSplit (pThis, UMSDOpRead, pBuffer, nCount);
+	}
+
 	unsigned nTries = 4;
 
 	int nResult;
@@ -439,6 +672,13 @@ int USBBulkOnlyMassStorageDeviceWrite (TUSBBulkOnlyMassStorageDevice *pThis, con
 {
 	assert (pThis != 0);
 
+	USBBulkOnlyMassStorageDeviceWaitAsync (pThis);
+
+	if (nCount > pThis->m_nMaxTransfer)
+	{
+		return USBBulkOnlyMassStorageDeviceTransferSplit (pThis, UMSDOpWrite, (void *) pBuffer, nCount);
+	}
+
 	unsigned nTries = 4;
 
 	int nResult;
@@ -462,6 +702,123 @@ int USBBulkOnlyMassStorageDeviceWrite (TUSBBulkOnlyMassStorageDevice *pThis, con
 	return nResult;
 }
 
+boolean USBBulkOnlyMassStorageDeviceReadAsync (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset,
+					       void *pBuffer, unsigned nCount,
+					       TUSBMassStorageCompletionRoutine *pRoutine, void *pParam)
+{
+	return USBBulkOnlyMassStorageDeviceQueue (pThis, UMSDOpRead, ullOffset, pBuffer, nCount, pRoutine, pParam);
+}
+
+boolean USBBulkOnlyMassStorageDeviceWriteAsync (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset,
+						const void *pBuffer, unsigned nCount,
+						TUSBMassStorageCompletionRoutine *pRoutine, void *pParam)
+{
+	return USBBulkOnlyMassStorageDeviceQueue (pThis, UMSDOpWrite, ullOffset, (void *) pBuffer, nCount, pRoutine, pParam);
+}
+
+boolean USBBulkOnlyMassStorageDeviceFlushAsync (TUSBBulkOnlyMassStorageDevice *pThis,
+						TUSBMassStorageCompletionRoutine *pRoutine, void *pParam)
+{
+	return USBBulkOnlyMassStorageDeviceQueue (pThis, UMSDOpFlush, 0, 0, 0, pRoutine, pParam);
+}
+
+void USBBulkOnlyMassStorageDeviceWaitAsync (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	// the commands are chained at interrupt level, also with USPI_DEFER_COMPLETION
+#ifdef USPI_WAIT_HOOK
+	while (!pThis->m_bAsyncIdle)
+	{
+		WaitForCompletion (&pThis->m_bAsyncIdle);
+	}
+#else
+	uspi_EnterCritical ();
+
+	while (!pThis->m_bAsyncIdle)
+	{
+		uspi_WaitForInterrupt ();
+	}
+
+	uspi_LeaveCritical ();
+#endif
+
+	DataMemBarrier ();
+}
+
+int USBBulkOnlyMassStorageDeviceFlush (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	USBBulkOnlyMassStorageDeviceWaitAsync (pThis);
+
+	if (pThis->m_WritePolicy == UMSDWriteFUA)
+	{
+		return 0;			// nothing has been cached
+	}
+
+	unsigned nTries = 4;
+
+	int nResult;
+
+	do
+	{
+		nResult = USBBulkOnlyMassStorageDeviceTryFlush (pThis);
+
+		if (nResult != 0)
+		{
+			int nStatus = USBBulkOnlyMassStorageDeviceReset (pThis);
+			if (nStatus != 0)
+			{
+				return nStatus;
+			}
+		}
+	}
+	while (   nResult != 0
+	       && --nTries > 0);
+
+	return nResult;
+}
+
+boolean USBBulkOnlyMassStorageDeviceSetWritePolicy (TUSBBulkOnlyMassStorageDevice *pThis,
+						    TUSBMassStorageWritePolicy Policy)
+{
+	assert (pThis != 0);
+
+	if (Policy >= UMSDWritePolicyUnknown)
+	{
+		return FALSE;
+	}
+
+	if (Policy == pThis->m_WritePolicy)
+	{
+		return TRUE;
+	}
+
+	// write back the data cached with the old policy
+	if (USBBulkOnlyMassStorageDeviceFlush (pThis) != 0)
+	{
+		return FALSE;
+	}
+
+	if (Policy != UMSDWriteFUA)
+	{
+		// check, if the device supports SYNCHRONIZE CACHE
+		if (USBBulkOnlyMassStorageDeviceTryFlush (pThis) != 0)
+		{
+			LogWrite (FromUmsd, LOG_WARNING, "Device does not support SYNCHRONIZE CACHE");
+
+			USBBulkOnlyMassStorageDeviceReset (pThis);
+
+			return FALSE;
+		}
+	}
+
+	pThis->m_WritePolicy = Policy;
+
+	return TRUE;
+}
+
 unsigned long long USBBulkOnlyMassStorageDeviceSeek (TUSBBulkOnlyMassStorageDevice *pThis, unsigned long long ullOffset)
 {
 	assert (pThis != 0);
@@ -471,11 +828,18 @@ unsigned long long USBBulkOnlyMassStorageDeviceSeek (TUSBBulkOnlyMassStorageDevi
 	return pThis->m_ullOffset;
 }
 
-unsigned USBBulkOnlyMassStorageDeviceGetCapacity (TUSBBulkOnlyMassStorageDevice *pThis)
+unsigned long long USBBulkOnlyMassStorageDeviceGetCapacity (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	return pThis->m_ullBlockCount;
+}
+
+unsigned USBBulkOnlyMassStorageDeviceGetBlockSize (TUSBBulkOnlyMassStorageDevice *pThis)
 {
 	assert (pThis != 0);
 
-	return pThis->m_nBlockCount;
+	return pThis->m_nBlockSize;
 }
 
 int USBBulkOnlyMassStorageDeviceTryRead (TUSBBulkOnlyMassStorageDevice *pThis, void *pBuffer, unsigned nCount)
@@ -484,30 +848,15 @@ int USBBulkOnlyMassStorageDeviceTryRead (TUSBBulkOnlyMassStorageDevice *pThis, v
 
 	assert (pBuffer != 0);
 
-	if (   (pThis->m_ullOffset & UMSD_BLOCK_MASK) != 0
-	    || pThis->m_ullOffset > UMSD_MAX_OFFSET)
-	{
-		return -1;
-	}
-	unsigned nBlockAddress = (unsigned) (pThis->m_ullOffset >> UMSD_BLOCK_SHIFT);
-
-	if ((nCount & UMSD_BLOCK_MASK) != 0)
+	u8 CmdBlk[SCSI_MAX_CMDBLK_LEN];
+	unsigned nCmdBlkLen = USBBulkOnlyMassStorageDeviceInitReadWrite (pThis, CmdBlk, pThis->m_ullOffset,
+									 nCount, TRUE);
+	if (nCmdBlkLen == 0)
 	{
 		return -1;
 	}
-	unsigned short usTransferLength = (unsigned short) (nCount >> UMSD_BLOCK_SHIFT);
-
-	//LogWrite (FromUmsd, LOG_DEBUG, "TryRead %u/0x%X/%u", nBlockAddress, (unsigned) pBuffer, (unsigned) usTransferLength);
-
-	TSCSIRead10 SCSIRead;
-	SCSIRead.OperationCode		= SCSI_OP_READ;
-	SCSIRead.Reserved1		= 0;
-	SCSIRead.LogicalBlockAddress	= uspi_le2be32 (nBlockAddress);
-	SCSIRead.Reserved2		= 0;
-	SCSIRead.TransferLength		= uspi_le2be16 (usTransferLength);
-	SCSIRead.Control		= SCSI_CONTROL;
 
-	if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIRead, sizeof SCSIRead,
+	if (USBBulkOnlyMassStorageDeviceCommand (pThis, CmdBlk, nCmdBlkLen,
 						 pBuffer, nCount,
 						 TRUE) != (int) nCount)
 	{
@@ -525,39 +874,148 @@ int USBBulkOnlyMassStorageDeviceTryWrite (TUSBBulkOnlyMassStorageDevice *pThis,
 
 	assert (pBuffer != 0);
 
-	if (   (pThis->m_ullOffset & UMSD_BLOCK_MASK) != 0
-	    || pThis->m_ullOffset > UMSD_MAX_OFFSET)
+	u8 CmdBlk[SCSI_MAX_CMDBLK_LEN];
+	unsigned nCmdBlkLen = USBBulkOnlyMassStorageDeviceInitReadWrite (pThis, CmdBlk, pThis->m_ullOffset,
+									 nCount, FALSE);
+	if (nCmdBlkLen == 0)
 	{
 		return -1;
 	}
-	unsigned nBlockAddress = (unsigned) (pThis->m_ullOffset >> UMSD_BLOCK_SHIFT);
 
-	if ((nCount & UMSD_BLOCK_MASK) != 0)
+	if (USBBulkOnlyMassStorageDeviceCommand (pThis, CmdBlk, nCmdBlkLen,
+						 (void *) pBuffer, nCount,
+						 FALSE) < 0)
+	{
+		LogWrite (FromUmsd, LOG_ERROR, "TryWrite failed");
+
+		return -1;
+	}
+
+	if (   pThis->m_WritePolicy == UMSDWriteThrough
+	    && USBBulkOnlyMassStorageDeviceTryFlush (pThis) != 0)
 	{
 		return -1;
 	}
-	unsigned short usTransferLength = (unsigned short) (nCount >> UMSD_BLOCK_SHIFT);
 
-	//LogWrite (FromUmsd, LOG_DEBUG, "TryWrite %u/0x%X/%u", nBlockAddress, (unsigned) pBuffer, (unsigned) usTransferLength);
+	return nCount;
+}
+
+int USBBulkOnlyMassStorageDeviceTryFlush (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
 
-	TSCSIWrite10 SCSIWrite;
-	SCSIWrite.OperationCode		= SCSI_OP_WRITE;
-	SCSIWrite.Flags			= SCSI_WRITE_FUA;
-	SCSIWrite.LogicalBlockAddress	= uspi_le2be32 (nBlockAddress);
-	SCSIWrite.Reserved		= 0;
-	SCSIWrite.TransferLength	= uspi_le2be16 (usTransferLength);
-	SCSIWrite.Control		= SCSI_CONTROL;
+	u8 CmdBlk[SCSI_MAX_CMDBLK_LEN];
+	unsigned nCmdBlkLen = USBBulkOnlyMassStorageDeviceInitFlush (pThis, CmdBlk);
 
-	if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIWrite, sizeof SCSIWrite,
-						 (void *) pBuffer, nCount,
-						 FALSE) < 0)
+	if (USBBulkOnlyMassStorageDeviceCommand (pThis, CmdBlk, nCmdBlkLen, 0, 0, FALSE) < 0)
 	{
-		LogWrite (FromUmsd, LOG_ERROR, "TryWrite failed");
+		LogWrite (FromUmsd, LOG_ERROR, "TryFlush failed");
 
 		return -1;
 	}
 
-	return nCount;
+	return 0;
+}
+
+// returns the length of the command block or 0, if the parameters are invalid
+unsigned USBBulkOnlyMassStorageDeviceInitReadWrite (TUSBBulkOnlyMassStorageDevice *pThis, void *pCmdBlk,
+						    unsigned long long ullOffset, unsigned nCount, boolean bIn)
+{
+	assert (pThis != 0);
+	assert (pCmdBlk != 0);
+
+	unsigned nBlockMask = pThis->m_nBlockSize-1;
+	if (   (ullOffset & nBlockMask) != 0
+	    || (nCount & nBlockMask) != 0)
+	{
+		return 0;
+	}
+
+	unsigned long long ullBlockAddress = ullOffset >> pThis->m_nBlockShift;
+	unsigned nBlocks = nCount >> pThis->m_nBlockShift;
+	if (   ullBlockAddress >= pThis->m_ullBlockCount
+	    || nBlocks > pThis->m_ullBlockCount - ullBlockAddress)
+	{
+		return 0;
+	}
+
+	if (   ullBlockAddress + nBlocks <= 0x100000000ULL
+	    && nBlocks <= 0xFFFF)
+	{
+		if (bIn)
+		{
+			//LogWrite (FromUmsd, LOG_DEBUG, "Read %u/%u", (unsigned) ullBlockAddress, nBlocks);
+
+			TSCSIRead10 *pSCSIRead = (TSCSIRead10 *) pCmdBlk;
+			pSCSIRead->OperationCode	= SCSI_OP_READ;
+			pSCSIRead->Reserved1		= 0;
+			pSCSIRead->LogicalBlockAddress	= uspi_le2be32 ((u32) ullBlockAddress);
+			pSCSIRead->Reserved2		= 0;
+			pSCSIRead->TransferLength	= uspi_le2be16 ((u16) nBlocks);
+			pSCSIRead->Control		= SCSI_CONTROL;
+
+			return sizeof (TSCSIRead10);
+		}
+
+		//LogWrite (FromUmsd, LOG_DEBUG, "Write %u/%u", (unsigned) ullBlockAddress, nBlocks);
+
+		TSCSIWrite10 *pSCSIWrite = (TSCSIWrite10 *) pCmdBlk;
+		pSCSIWrite->OperationCode	= SCSI_OP_WRITE;
+		pSCSIWrite->Flags		= pThis->m_WritePolicy == UMSDWriteFUA ? SCSI_WRITE_FUA : 0;
+		pSCSIWrite->LogicalBlockAddress	= uspi_le2be32 ((u32) ullBlockAddress);
+		pSCSIWrite->Reserved		= 0;
+		pSCSIWrite->TransferLength	= uspi_le2be16 ((u16) nBlocks);
+		pSCSIWrite->Control		= SCSI_CONTROL;
+
+		return sizeof (TSCSIWrite10);
+	}
+
+	if (bIn)
+	{
+		TSCSIRead16 *pSCSIRead = (TSCSIRead16 *) pCmdBlk;
+		pSCSIRead->OperationCode	= SCSI_OP_READ16;
+		pSCSIRead->Flags		= 0;
+		pSCSIRead->LogicalBlockAddress	= uspi_le2be64 (ullBlockAddress);
+		pSCSIRead->TransferLength	= uspi_le2be32 (nBlocks);
+		pSCSIRead->GroupNumber		= 0;
+		pSCSIRead->Control		= SCSI_CONTROL;
+
+		return sizeof (TSCSIRead16);
+	}
+
+	TSCSIWrite16 *pSCSIWrite = (TSCSIWrite16 *) pCmdBlk;
+	pSCSIWrite->OperationCode	= SCSI_OP_WRITE16;
+	pSCSIWrite->Flags		= pThis->m_WritePolicy == UMSDWriteFUA ? SCSI_WRITE_FUA : 0;
+	pSCSIWrite->LogicalBlockAddress	= uspi_le2be64 (ullBlockAddress);
+	pSCSIWrite->TransferLength	= uspi_le2be32 (nBlocks);
+	pSCSIWrite->GroupNumber		= 0;
+	pSCSIWrite->Control		= SCSI_CONTROL;
+
+	return sizeof (TSCSIWrite16);
+}
+
+// returns the length of the command block, which flushes the whole cache
+unsigned USBBulkOnlyMassStorageDeviceInitFlush (TUSBBulkOnlyMassStorageDevice *pThis, void *pCmdBlk)
+{
+	assert (pThis != 0);
+	assert (pCmdBlk != 0);
+
+	if (pThis->m_ullBlockCount <= 0x100000000ULL)
+	{
+		TSCSISynchronizeCache10 *pSCSISync = (TSCSISynchronizeCache10 *) pCmdBlk;
+		memset (pSCSISync, 0, sizeof *pSCSISync);
+		pSCSISync->OperationCode	= SCSI_OP_SYNCHRONIZE_CACHE10;
+		pSCSISync->Control		= SCSI_CONTROL;
+
+		return sizeof (TSCSISynchronizeCache10);
+	}
+
+	TSCSISynchronizeCache16 *pSCSISync = (TSCSISynchronizeCache16 *) pCmdBlk;
+	memset (pSCSISync, 0, sizeof *pSCSISync);
+	pSCSISync->OperationCode	= SCSI_OP_SYNCHRONIZE_CACHE16;
+	pSCSISync->Control		= SCSI_CONTROL;
+
+	return sizeof (TSCSISynchronizeCache16);
 }
 
 int USBBulkOnlyMassStorageDeviceCommand (TUSBBulkOnlyMassStorageDevice *pThis,
@@ -570,17 +1028,8 @@ int USBBulkOnlyMassStorageDeviceCommand (TUSBBulkOnlyMassStorageDevice *pThis,
 	assert (6 <= nCmdBlkLen && nCmdBlkLen <= 16);
 	assert (nBufLen == 0 || pBuffer != 0);
 
-	TCBW CBW;
-	memset (&CBW, 0, sizeof CBW);
-
-	CBW.dCWBSignature	   = CBWSIGNATURE;
-	CBW.dCWBTag		   = ++pThis->m_nCWBTag;
-	CBW.dCBWDataTransferLength = nBufLen;
-	CBW.bmCBWFlags		   = bIn ? CBWFLAGS_DATA_IN : 0;
-	CBW.bCBWLUN		   = CBWLUN;
-	CBW.bCBWCBLength	   = (u8) nCmdBlkLen;
-
-	memcpy (CBW.CBWCB, pCmdBlk, nCmdBlkLen);
+	TCBW CBW ALIGN (4);			// DMA buffer
+	USBBulkOnlyMassStorageDeviceInitCBW (pThis, &CBW, pCmdBlk, nCmdBlkLen, nBufLen, bIn);
 
 	TUSBHostController *pHost = USBFunctionGetHost (&pThis->m_USBFunction);
 	assert (pHost != 0);
@@ -605,7 +1054,7 @@ int USBBulkOnlyMassStorageDeviceCommand (TUSBBulkOnlyMassStorageDevice *pThis,
 		}
 	}
 
-	TCSW CSW;
+	TCSW CSW ALIGN (4);			// DMA buffer
 
 	if (DWHCIDeviceTransfer (pHost, pThis->m_pEndpointIn, &CSW, sizeof CSW) != (int) sizeof CSW)
 	{
@@ -614,33 +1063,66 @@ int USBBulkOnlyMassStorageDeviceCommand (TUSBBulkOnlyMassStorageDevice *pThis,
 		return -1;
 	}
 
-	if (CSW.dCSWSignature != CSWSIGNATURE)
+	if (!USBBulkOnlyMassStorageDeviceCheckCSW (pThis, &CSW))
+	{
+		return -1;
+	}
+
+	return nResult;
+}
+
+void USBBulkOnlyMassStorageDeviceInitCBW (TUSBBulkOnlyMassStorageDevice *pThis, TCBW *pCBW,
+					  const void *pCmdBlk, unsigned nCmdBlkLen, unsigned nBufLen, boolean bIn)
+{
+	assert (pThis != 0);
+	assert (pCBW != 0);
+	assert (pCmdBlk != 0);
+	assert (6 <= nCmdBlkLen && nCmdBlkLen <= 16);
+
+	memset (pCBW, 0, sizeof *pCBW);
+
+	pCBW->dCWBSignature	     = CBWSIGNATURE;
+	pCBW->dCWBTag		     = ++pThis->m_nCWBTag;
+	pCBW->dCBWDataTransferLength = nBufLen;
+	pCBW->bmCBWFlags	     = bIn ? CBWFLAGS_DATA_IN : 0;
+	pCBW->bCBWLUN		     = CBWLUN;
+	pCBW->bCBWCBLength	     = (u8) nCmdBlkLen;
+
+	memcpy (pCBW->CBWCB, pCmdBlk, nCmdBlkLen);
+}
+
+boolean USBBulkOnlyMassStorageDeviceCheckCSW (TUSBBulkOnlyMassStorageDevice *pThis, const TCSW *pCSW)
+{
+	assert (pThis != 0);
+	assert (pCSW != 0);
+
+	if (pCSW->dCSWSignature != CSWSIGNATURE)
 	{
 		LogWrite (FromUmsd, LOG_ERROR, "CSW signature is wrong");
 
-		return -1;
+		return FALSE;
 	}
 
-	if (CSW.dCSWTag != pThis->m_nCWBTag)
+	if (pCSW->dCSWTag != pThis->m_nCWBTag)
 	{
 		LogWrite (FromUmsd, LOG_ERROR, "CSW tag is wrong");
 
-		return -1;
+		return FALSE;
 	}
 
-	if (CSW.bCSWStatus != CSWSTATUS_PASSED)
+	if (pCSW->bCSWStatus != CSWSTATUS_PASSED)
 	{
-		return -1;
+		return FALSE;
 	}
 
-	if (CSW.dCSWDataResidue != 0)
+	if (pCSW->dCSWDataResidue != 0)
 	{
 		LogWrite (FromUmsd, LOG_ERROR, "Data residue is not 0");
 
-		return -1;
+		return FALSE;
 	}
 
-	return nResult;
+	return TRUE;
 }
 
 int USBBulkOnlyMassStorageDeviceReset (TUSBBulkOnlyMassStorageDevice *pThis)
@@ -676,3 +1158,607 @@ int USBBulkOnlyMassStorageDeviceReset (TUSBBulkOnlyMassStorageDevice *pThis)
 
 	return 0;
 }
+
+// reads a page of vital product data (max. SCSI_VPD_MAX_SIZE bytes), returns its length or < 0
+int USBBulkOnlyMassStorageDeviceInquiryVPD (TUSBBulkOnlyMassStorageDevice *pThis, u8 ucPage, void *pBuffer)
+{
+	assert (pThis != 0);
+	assert (pBuffer != 0);
+
+	// the device must not return less data than requested (residue), so get the length first
+	unsigned nLength = sizeof (TSCSIVPDHeader);
+	for (unsigned i = 0; i < 2; i++)
+	{
+		TSCSIInquiry SCSIInquiry;
+		SCSIInquiry.OperationCode	  = SCSI_OP_INQUIRY;
+		SCSIInquiry.LogicalUnitNumberEVPD = SCSI_INQUIRY_EVPD;
+		SCSIInquiry.PageCode		  = ucPage;
+		SCSIInquiry.Reserved		  = 0;
+		SCSIInquiry.AllocationLength	  = (unsigned char) nLength;
+		SCSIInquiry.Control		  = SCSI_CONTROL;
+
+		if (USBBulkOnlyMassStorageDeviceCommand (pThis, &SCSIInquiry, sizeof SCSIInquiry,
+							 pBuffer, nLength, TRUE) != (int) nLength)
+		{
+			USBBulkOnlyMassStorageDeviceReset (pThis);
+
+			return -1;
+		}
+
+		TSCSIVPDHeader *pHeader = (TSCSIVPDHeader *) pBuffer;
+		if (pHeader->PageCode != ucPage)
+		{
+			return -1;
+		}
+
+		nLength = sizeof (TSCSIVPDHeader) + uspi_le2be16 (pHeader->PageLength);
+		if (nLength > SCSI_VPD_MAX_SIZE)
+		{
+			nLength = SCSI_VPD_MAX_SIZE;
+		}
+	}
+
+	return nLength;
+}
+
+// returns the max. number of blocks per command from the Block Limits VPD page or 0
+unsigned USBBulkOnlyMassStorageDeviceGetBlockLimit (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	u8 Buffer[SCSI_VPD_MAX_SIZE] ALIGN (4);			// DMA buffer
+	int nLength = USBBulkOnlyMassStorageDeviceInquiryVPD (pThis, SCSI_VPD_SUPPORTED_PAGES, Buffer);
+	if (nLength < 0)
+	{
+		return 0;
+	}
+
+	int i;
+	for (i = sizeof (TSCSIVPDHeader); i < nLength; i++)
+	{
+		if (Buffer[i] == SCSI_VPD_BLOCK_LIMITS)
+		{
+			break;
+		}
+	}
+
+	if (i >= nLength)
+	{
+		return 0;
+	}
+
+	if (USBBulkOnlyMassStorageDeviceInquiryVPD (pThis, SCSI_VPD_BLOCK_LIMITS, Buffer)
+	    < (int) sizeof (TSCSIBlockLimitsVPD))
+	{
+		return 0;
+	}
+
+	TSCSIBlockLimitsVPD *pBlockLimits = (TSCSIBlockLimitsVPD *) Buffer;
+	unsigned nMaxBlocks = uspi_le2be32 (pBlockLimits->MaximumTransferLength);
+	unsigned nOptimalBlocks = uspi_le2be32 (pBlockLimits->OptimalTransferLength);
+
+	LogWrite (FromUmsd, LOG_DEBUG, "Transfer length is max. %u, optimal %u blocks", nMaxBlocks, nOptimalBlocks);
+
+	// larger transfers may be slower than the optimal length
+	if (   nOptimalBlocks != 0
+	    && (   nMaxBlocks == 0
+		|| nOptimalBlocks < nMaxBlocks))
+	{
+		nMaxBlocks = nOptimalBlocks;
+	}
+
+	return nMaxBlocks;
+}
+
+// the request is split into commands of max. m_nMaxTransfer bytes, which are chained
+// by the asynchronous engine
+int USBBulkOnlyMassStorageDeviceTransferSplit (TUSBBulkOnlyMassStorageDevice *pThis, TUSBMassStorageOp Op,
+					       void *pBuffer, unsigned nCount)
+{
+	assert (pThis != 0);
+	assert (pThis->m_bAsyncIdle);
+
+	volatile int nResult = -1;
+	if (!USBBulkOnlyMassStorageDeviceQueue (pThis, Op, pThis->m_ullOffset, pBuffer, nCount,
+						USBBulkOnlyMassStorageDeviceSplitCompletionRoutine,
+						(void *) &nResult))
+	{
+		return -1;
+	}
+
+	USBBulkOnlyMassStorageDeviceWaitAsync (pThis);
+
+	return nResult;
+}
+
+void USBBulkOnlyMassStorageDeviceSplitCompletionRoutine (int nResult, void *pParam)
+{
+	volatile int *pResult = (volatile int *) pParam;
+	assert (pResult != 0);
+
+	*pResult = nResult;
+}
+
+boolean USBBulkOnlyMassStorageDeviceQueue (TUSBBulkOnlyMassStorageDevice *pThis, TUSBMassStorageOp Op,
+					   unsigned long long ullOffset, void *pBuffer, unsigned nCount,
+					   TUSBMassStorageCompletionRoutine *pRoutine, void *pParam)
+{
+	assert (pThis != 0);
+
+	u8 CmdBlk[SCSI_MAX_CMDBLK_LEN];
+	if (   Op != UMSDOpFlush
+	    && (   USBBulkOnlyMassStorageDeviceInitReadWrite (pThis, CmdBlk, ullOffset, nCount,
+							      Op == UMSDOpRead) == 0
+		|| pBuffer == 0
+		|| nCount == 0))
+	{
+		return FALSE;
+	}
+
+	uspi_EnterCritical ();
+
+	TUSBMassStorageCommand *pCommand = &pThis->m_pAsync->Queue[pThis->m_nAsyncIn & (UMSD_ASYNC_QUEUE_SIZE-1)];
+	if (   pThis->m_bAsyncShutdown
+	    || pThis->m_nAsyncIn - pThis->m_nAsyncOut >= UMSD_ASYNC_QUEUE_SIZE
+#ifdef USPI_DEFER_COMPLETION
+	    || pCommand->bRoutinePending
+#endif
+	   )
+	{
+		uspi_LeaveCritical ();
+
+		return FALSE;
+	}
+
+	pCommand->Op        = Op;
+	pCommand->bFlush    = Op == UMSDOpWrite && pThis->m_WritePolicy == UMSDWriteThrough;
+	pCommand->ullOffset = ullOffset;
+	pCommand->pBuffer   = pBuffer;
+	pCommand->nCount    = nCount;
+	pCommand->nDone     = 0;
+	pCommand->nChunk    = 0;
+	pCommand->nTries    = 4;
+	pCommand->pRoutine  = pRoutine;
+	pCommand->pParam    = pParam;
+
+	pThis->m_nAsyncIn++;
+
+	boolean bCompleted = FALSE;
+	int nResult = 0;
+
+	if (pThis->m_bAsyncIdle)
+	{
+		pThis->m_bAsyncIdle = FALSE;
+
+		pThis->m_bAsyncStarting = TRUE;
+		pThis->m_bAsyncStartCompleted = FALSE;
+
+		USBBulkOnlyMassStorageDeviceAsyncStart (pThis);
+
+		pThis->m_bAsyncStarting = FALSE;
+
+		// the command completed immediately (e.g. a flush with the FUA write policy)
+		bCompleted = pThis->m_bAsyncStartCompleted;
+		nResult = pThis->m_nAsyncStartResult;
+	}
+
+	uspi_LeaveCritical ();
+
+	// the routine is not called with IRQs disabled
+	if (   bCompleted
+	    && pRoutine != 0)
+	{
+		(*pRoutine) (nResult, pParam);
+	}
+
+	return TRUE;
+}
+
+// starts the command at the head of the queue (or goes idle)
+void USBBulkOnlyMassStorageDeviceAsyncStart (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	if (pThis->m_nAsyncOut == pThis->m_nAsyncIn)
+	{
+		pThis->m_AsyncState = UMSDAsyncIdle;
+		pThis->m_bAsyncIdle = TRUE;
+
+#ifdef USPI_WAIT_HOOK
+		SignalCompletion (&pThis->m_bAsyncIdle);
+#endif
+
+		return;
+	}
+
+	if (pThis->m_bAsyncShutdown)
+	{
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);	// the device is removed
+
+		return;
+	}
+
+	TUSBMassStorageCommand *pCommand = &pThis->m_pAsync->Queue[pThis->m_nAsyncOut & (UMSD_ASYNC_QUEUE_SIZE-1)];
+
+	u8 CmdBlk[SCSI_MAX_CMDBLK_LEN];
+	unsigned nCmdBlkLen;
+	unsigned nBufLen = 0;
+	if (pCommand->Op == UMSDOpFlush)
+	{
+		if (pThis->m_WritePolicy == UMSDWriteFUA)
+		{
+			USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, pCommand->nCount);	// nothing cached
+
+			return;
+		}
+
+		nCmdBlkLen = USBBulkOnlyMassStorageDeviceInitFlush (pThis, CmdBlk);
+	}
+	else
+	{
+		assert (pCommand->nDone < pCommand->nCount);
+		pCommand->nChunk = pCommand->nCount - pCommand->nDone;
+		if (pCommand->nChunk > pThis->m_nMaxTransfer)
+		{
+			pCommand->nChunk = pThis->m_nMaxTransfer;
+		}
+
+		nCmdBlkLen = USBBulkOnlyMassStorageDeviceInitReadWrite (pThis, CmdBlk,
+									pCommand->ullOffset + pCommand->nDone,
+									pCommand->nChunk, pCommand->Op == UMSDOpRead);
+		nBufLen = pCommand->nChunk;
+	}
+	assert (nCmdBlkLen != 0);
+
+	USBBulkOnlyMassStorageDeviceInitCBW (pThis, (TCBW *) pThis->m_pAsync->CBW, CmdBlk, nCmdBlkLen,
+					     nBufLen, pCommand->Op == UMSDOpRead);
+
+	if (!USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis, UMSDAsyncCBW, pThis->m_pEndpointOut,
+						      pThis->m_pAsync->CBW, UMSD_CBW_SIZE, FALSE))
+	{
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+	}
+}
+
+// starts the reset recovery, the command is retried afterwards
+void USBBulkOnlyMassStorageDeviceAsyncFailed (TUSBBulkOnlyMassStorageDevice *pThis)
+{
+	assert (pThis != 0);
+
+	TUSBMassStorageCommand *pCommand = &pThis->m_pAsync->Queue[pThis->m_nAsyncOut & (UMSD_ASYNC_QUEUE_SIZE-1)];
+
+	assert (pCommand->nTries > 0);
+	if (--pCommand->nTries == 0)
+	{
+		LogWrite (FromUmsd, LOG_ERROR,   pCommand->Op == UMSDOpRead ? "Async read failed"
+					       : pCommand->Op == UMSDOpWrite ? "Async write failed" : "Async flush failed");
+
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+
+		return;
+	}
+
+	pThis->m_pAsync->Setup.bmRequestType = REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_INTERFACE;
+	pThis->m_pAsync->Setup.bRequest      = 0xFF;		// Bulk-Only Mass Storage Reset
+	pThis->m_pAsync->Setup.wValue        = 0;
+	pThis->m_pAsync->Setup.wIndex        = 0;
+	pThis->m_pAsync->Setup.wLength       = 0;
+
+	if (!USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis, UMSDAsyncReset,
+						      USBFunctionGetEndpoint0 (&pThis->m_USBFunction),
+						      0, 0, TRUE))
+	{
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+	}
+}
+
+// removes the command at the head of the queue, starts the next one and calls the completion routine
+void USBBulkOnlyMassStorageDeviceAsyncComplete (TUSBBulkOnlyMassStorageDevice *pThis, int nResult)
+{
+	assert (pThis != 0);
+
+	assert (pThis->m_nAsyncOut != pThis->m_nAsyncIn);
+	TUSBMassStorageCommand *pCommand = &pThis->m_pAsync->Queue[pThis->m_nAsyncOut & (UMSD_ASYNC_QUEUE_SIZE-1)];
+	TUSBMassStorageCompletionRoutine *pRoutine = pCommand->pRoutine;
+	void *pParam = pCommand->pParam;
+	pThis->m_nAsyncOut++;
+
+#ifdef USPI_DEFER_COMPLETION
+	// the routine of the application is called from DWHCIDeviceProcessCompletions(),
+	// the slot remains in use until then
+	if (   pRoutine != 0
+	    && pRoutine != USBBulkOnlyMassStorageDeviceSplitCompletionRoutine)
+	{
+		pCommand->bRoutinePending = TRUE;
+		pCommand->nResult = nResult;
+
+		USBRequest (&pCommand->CompletionURB, pThis->m_pEndpointIn, 0, 0, 0);
+		USBRequestSetCompletionRoutine (&pCommand->CompletionURB,
+						USBBulkOnlyMassStorageDeviceDeferredCompletionRoutine,
+						pCommand, pThis->m_pAsync);
+
+		TUSBHostController *pHost = USBFunctionGetHost (&pThis->m_USBFunction);
+		assert (pHost != 0);
+		DWHCIDeviceDeferCompletion (pHost, &pCommand->CompletionURB);
+
+		pRoutine = 0;
+	}
+#endif
+
+	// called from USBBulkOnlyMassStorageDeviceQueue(), which calls the routine
+	// after leaving the critical section
+	if (   pRoutine != 0
+	    && pThis->m_bAsyncStarting)
+	{
+		assert (!pThis->m_bAsyncStartCompleted);
+		pThis->m_bAsyncStartCompleted = TRUE;
+		pThis->m_nAsyncStartResult = nResult;
+
+		pRoutine = 0;
+	}
+
+	USBBulkOnlyMassStorageDeviceAsyncStart (pThis);
+
+	if (pRoutine != 0)
+	{
+		(*pRoutine) (nResult, pParam);
+	}
+}
+
+boolean USBBulkOnlyMassStorageDeviceAsyncSubmit (TUSBBulkOnlyMassStorageDevice *pThis,
+						 TUSBMassStorageAsyncState State, TUSBEndpoint *pEndpoint,
+						 void *pBuffer, unsigned nBufLen, boolean bControl)
+{
+	assert (pThis != 0);
+	assert (pEndpoint != 0);
+
+	pThis->m_AsyncState = State;
+
+	USBRequest (&pThis->m_AsyncURB, pEndpoint, pBuffer, nBufLen, bControl ? &pThis->m_pAsync->Setup : 0);
+	USBRequestSetCompletionRoutine (&pThis->m_AsyncURB, USBBulkOnlyMassStorageDeviceCompletionRoutine, 0, pThis);
+	USBRequestSetCompleteAtIRQ (&pThis->m_AsyncURB, TRUE);		// chains the next command
+
+	TUSBHostController *pHost = USBFunctionGetHost (&pThis->m_USBFunction);
+	assert (pHost != 0);
+
+	return DWHCIDeviceSubmitAsyncRequest (pHost, &pThis->m_AsyncURB);
+}
+
+void USBBulkOnlyMassStorageDeviceCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext)
+{
+	TUSBBulkOnlyMassStorageDevice *pThis = (TUSBBulkOnlyMassStorageDevice *) pContext;
+	assert (pThis != 0);
+
+	assert (pURB == &pThis->m_AsyncURB);
+	boolean bStatus = USBRequestGetStatus (pURB);
+	unsigned nResultLen = bStatus ? USBRequestGetResultLength (pURB) : 0;
+	_USBRequest (pURB);
+
+	if (pThis->m_bAsyncShutdown)
+	{
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);	// the request was cancelled
+
+		return;
+	}
+
+	assert (pThis->m_nAsyncOut != pThis->m_nAsyncIn);
+	TUSBMassStorageCommand *pCommand = &pThis->m_pAsync->Queue[pThis->m_nAsyncOut & (UMSD_ASYNC_QUEUE_SIZE-1)];
+
+	boolean bOK = TRUE;
+
+	switch (pThis->m_AsyncState)
+	{
+	case UMSDAsyncCBW:
+		if (!bStatus)
+		{
+			LogWrite (FromUmsd, LOG_ERROR, "CBW transfer failed");
+
+			USBBulkOnlyMassStorageDeviceAsyncFailed (pThis);
+
+			return;
+		}
+
+		if (pCommand->Op == UMSDOpFlush)
+		{
+			bOK = USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis, UMSDAsyncCSW, pThis->m_pEndpointIn,
+								       pThis->m_pAsync->CSW, UMSD_CSW_BUFFER_SIZE, FALSE);
+			break;
+		}
+
+		bOK = USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis, UMSDAsyncData,
+							         pCommand->Op == UMSDOpRead
+							       ? pThis->m_pEndpointIn : pThis->m_pEndpointOut,
+							       (u8 *) pCommand->pBuffer + pCommand->nDone,
+							       pCommand->nChunk, FALSE);
+		break;
+
+	case UMSDAsyncData:
+		if (   !bStatus
+		    || nResultLen != pCommand->nChunk)
+		{
+			LogWrite (FromUmsd, LOG_ERROR, "Data transfer failed");
+
+			USBBulkOnlyMassStorageDeviceAsyncFailed (pThis);
+
+			return;
+		}
+
+		bOK = USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis, UMSDAsyncCSW, pThis->m_pEndpointIn,
+							       pThis->m_pAsync->CSW, UMSD_CSW_BUFFER_SIZE, FALSE);
+		break;
+
+	case UMSDAsyncCSW:
+		if (!bStatus || nResultLen != UMSD_CSW_SIZE)
+		{
+			LogWrite (FromUmsd, LOG_ERROR, "CSW transfer failed");
+
+			USBBulkOnlyMassStorageDeviceAsyncFailed (pThis);
+
+			return;
+		}
+
+		if (!USBBulkOnlyMassStorageDeviceCheckCSW (pThis, (TCSW *) pThis->m_pAsync->CSW))
+		{
+			USBBulkOnlyMassStorageDeviceAsyncFailed (pThis);
+
+			return;
+		}
+
+		if (pCommand->Op != UMSDOpFlush)
+		{
+			pCommand->nDone += pCommand->nChunk;
+			if (pCommand->nDone < pCommand->nCount)
+			{
+				pCommand->nTries = 4;
+
+				USBBulkOnlyMassStorageDeviceAsyncStart (pThis);		// next part
+
+				return;
+			}
+		}
+
+		if (pCommand->bFlush)
+		{
+			// write-through: the write is completed after the flush
+			pCommand->Op = UMSDOpFlush;
+			pCommand->bFlush = FALSE;
+
+			USBBulkOnlyMassStorageDeviceAsyncStart (pThis);
+
+			return;
+		}
+
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, (int) pCommand->nCount);
+
+		return;
+
+	case UMSDAsyncReset:
+	case UMSDAsyncClearHaltIn:
+		if (!bStatus)
+		{
+			LogWrite (FromUmsd, LOG_DEBUG, pThis->m_AsyncState == UMSDAsyncReset
+						       ? "Cannot reset device" : "Cannot clear halt on endpoint 1");
+
+			USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+
+			return;
+		}
+
+		pThis->m_pAsync->Setup.bmRequestType = REQUEST_OUT | REQUEST_TO_ENDPOINT;
+		pThis->m_pAsync->Setup.bRequest      = CLEAR_FEATURE;
+		pThis->m_pAsync->Setup.wValue        = 0;		// ENDPOINT_HALT
+		pThis->m_pAsync->Setup.wIndex        = pThis->m_AsyncState == UMSDAsyncReset ? 1 : 2;
+		pThis->m_pAsync->Setup.wLength       = 0;
+
+		bOK = USBBulkOnlyMassStorageDeviceAsyncSubmit (pThis,
+							         pThis->m_AsyncState == UMSDAsyncReset
+							       ? UMSDAsyncClearHaltIn : UMSDAsyncClearHaltOut,
+							       USBFunctionGetEndpoint0 (&pThis->m_USBFunction),
+							       0, 0, TRUE);
+		break;
+
+	case UMSDAsyncClearHaltOut:
+		if (!bStatus)
+		{
+			LogWrite (FromUmsd, LOG_DEBUG, "Cannot clear halt on endpoint 2");
+
+			USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+
+			return;
+		}
+
+		USBEndpointResetPID (pThis->m_pEndpointIn);
+		USBEndpointResetPID (pThis->m_pEndpointOut);
+
+		USBBulkOnlyMassStorageDeviceAsyncStart (pThis);		// retry
+
+		return;
+
+	default:
+		assert (0);
+		break;
+	}
+
+	if (!bOK)
+	{
+		USBBulkOnlyMassStorageDeviceAsyncComplete (pThis, -1);
+	}
+}
+
+#ifdef USPI_DEFER_COMPLETION
+
+// calls the completion routine of an asynchronous command (from DWHCIDeviceProcessCompletions())
+void USBBulkOnlyMassStorageDeviceDeferredCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext)
+{
+	TUSBMassStorageCommand *pCommand = (TUSBMassStorageCommand *) pParam;
+	assert (pCommand != 0);
+
+	TUSBMassStorageAsyncData *pAsync = (TUSBMassStorageAsyncData *) pContext;
+	assert (pAsync != 0);
+
+	assert (pURB == &pCommand->CompletionURB);
+	_USBRequest (pURB);
+
+	assert (pCommand->bRoutinePending);
+	TUSBMassStorageCompletionRoutine *pRoutine = pCommand->pRoutine;
+	void *pRoutineParam = pCommand->pParam;
+	int nResult = pCommand->nResult;
+
+	DataMemBarrier ();
+
+	uspi_EnterCritical ();
+
+	pCommand->bRoutinePending = FALSE;		// the routine may queue the next command
+
+	// the device has been removed, the last pending routine frees the block
+	boolean bFree =    pAsync->bOrphaned
+			&& !USBBulkOnlyMassStorageDeviceRoutinesPending (pAsync);
+
+	uspi_LeaveCritical ();
+
+	assert (pRoutine != 0);
+	(*pRoutine) (nResult, pRoutineParam);
+
+	if (bFree)
+	{
+		free (pAsync->pBlock);
+	}
+}
+
+boolean USBBulkOnlyMassStorageDeviceRoutinesPending (TUSBMassStorageAsyncData *pAsync)
+{
+	assert (pAsync != 0);
+
+	for (unsigned i = 0; i < UMSD_ASYNC_QUEUE_SIZE; i++)
+	{
+		if (pAsync->Queue[i].bRoutinePending)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+#endif
+
+void USBBulkOnlyMassStorageDeviceFreeAsync (TUSBMassStorageAsyncData *pAsync)
+{
+	assert (pAsync != 0);
+
+#ifdef USPI_DEFER_COMPLETION
+	uspi_EnterCritical ();
+
+	boolean bPending = USBBulkOnlyMassStorageDeviceRoutinesPending (pAsync);
+	pAsync->bOrphaned = bPending;
+
+	uspi_LeaveCritical ();
+
+	if (bPending)
+	{
+		return;			// freed by the last pending completion routine
+	}
+#endif
+
+	free (pAsync->pBlock);
+}
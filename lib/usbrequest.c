@@ -18,6 +18,8 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <uspi/usbrequest.h>
+#include <uspi/usbdevice.h>
+#include <uspi/usbhostcontroller.h>
 #include <uspi/assert.h>
 
 void USBRequest (TUSBRequest *pThis, TUSBEndpoint *pEndpoint, void *pBuffer, u32 nBufLen, TSetupData *pSetupData)
@@ -30,9 +32,21 @@ void USBRequest (TUSBRequest *pThis, TUSBEndpoint *pEndpoint, void *pBuffer, u32
 	pThis->m_nBufLen = nBufLen;
 	pThis->m_bStatus = 0;
 	pThis->m_nResultLen = 0;
+	pThis->m_USBError = USBErrorNone;
+	pThis->m_nTimeoutMs = 0;
+	pThis->m_pIsoPackets = 0;
+	pThis->m_nIsoPackets = 0;
+	pThis->m_nStartFrame = 0;
 	pThis->m_pCompletionRoutine = 0;
 	pThis->m_pCompletionParam = 0;
 	pThis->m_pCompletionContext = 0;
+	pThis->m_bCompleteAtIRQ = FALSE;
+	pThis->m_bStageIn = FALSE;
+	pThis->m_bStatusStage = FALSE;
+	pThis->m_nControlStage = 0;
+	pThis->m_hTimeoutTimer = 0;
+	pThis->m_nSubmitTime = 0;
+	pThis->m_pNext = 0;
 
 	assert (pThis->m_pEndpoint != 0);
 	assert (pThis->m_pBuffer != 0 || pThis->m_nBufLen == 0);
@@ -80,6 +94,80 @@ u32 USBRequestGetResultLength (TUSBRequest *pThis)
 	return pThis->m_nResultLen;
 }
 
+void USBRequestSetUSBError (TUSBRequest *pThis, TUSBError Error)
+{
+	assert (pThis != 0);
+	pThis->m_USBError = Error;
+}
+
+TUSBError USBRequestGetUSBError (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_USBError;
+}
+
+void USBRequestSetTimeout (TUSBRequest *pThis, unsigned nMilliSeconds)
+{
+	assert (pThis != 0);
+	pThis->m_nTimeoutMs = nMilliSeconds;
+}
+
+unsigned USBRequestGetTimeout (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nTimeoutMs;
+}
+
+boolean USBRequestCancel (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+
+	assert (pThis->m_pEndpoint != 0);
+	TUSBHostController *pHost = USBDeviceGetHost (USBEndpointGetDevice (pThis->m_pEndpoint));
+	assert (pHost != 0);
+
+	return DWHCIDeviceCancelRequest (pHost, pThis);
+}
+
+void USBRequestSetIsoPackets (TUSBRequest *pThis, TUSBIsoPacket *pPackets, unsigned nPackets)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pEndpoint != 0);
+	assert (USBEndpointGetType (pThis->m_pEndpoint) == EndpointTypeIsochronous);
+	assert (pPackets != 0);
+	assert (nPackets > 0);
+
+	pThis->m_pIsoPackets = pPackets;
+	pThis->m_nIsoPackets = nPackets;
+}
+
+unsigned USBRequestGetIsoPacketCount (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nIsoPackets;
+}
+
+TUSBIsoPacket *USBRequestGetIsoPacket (TUSBRequest *pThis, unsigned nPacket)
+{
+	assert (pThis != 0);
+	assert (pThis->m_pIsoPackets != 0);
+	assert (nPacket < pThis->m_nIsoPackets);
+
+	return &pThis->m_pIsoPackets[nPacket];
+}
+
+void USBRequestSetStartFrame (TUSBRequest *pThis, unsigned nFrame)
+{
+	assert (pThis != 0);
+	pThis->m_nStartFrame = nFrame;
+}
+
+unsigned USBRequestGetStartFrame (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nStartFrame;
+}
+
 TSetupData *USBRequestGetSetupData (TUSBRequest *pThis)
 {
 	assert (pThis != 0);
@@ -121,3 +209,70 @@ void USBRequestCallCompletionRoutine (TUSBRequest *pThis)
 	
 	(*pThis->m_pCompletionRoutine) (pThis, pThis->m_pCompletionParam, pThis->m_pCompletionContext);
 }
+
+void USBRequestSetCompleteAtIRQ (TUSBRequest *pThis, boolean bAtIRQ)
+{
+	assert (pThis != 0);
+	pThis->m_bCompleteAtIRQ = bAtIRQ;
+}
+
+boolean USBRequestIsCompleteAtIRQ (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bCompleteAtIRQ;
+}
+
+void USBRequestSetStage (TUSBRequest *pThis, boolean bIn, boolean bStatusStage)
+{
+	assert (pThis != 0);
+	pThis->m_bStageIn = bIn;
+	pThis->m_bStatusStage = bStatusStage;
+}
+
+boolean USBRequestIsStageIn (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bStageIn;
+}
+
+boolean USBRequestIsStatusStage (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bStatusStage;
+}
+
+void USBRequestSetControlStage (TUSBRequest *pThis, unsigned nStage)
+{
+	assert (pThis != 0);
+	pThis->m_nControlStage = nStage;
+}
+
+unsigned USBRequestGetControlStage (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nControlStage;
+}
+
+void USBRequestSetTimeoutTimer (TUSBRequest *pThis, unsigned hTimer)
+{
+	assert (pThis != 0);
+	pThis->m_hTimeoutTimer = hTimer;
+}
+
+unsigned USBRequestGetTimeoutTimer (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_hTimeoutTimer;
+}
+
+void USBRequestSetSubmitTime (TUSBRequest *pThis, u32 nTime)
+{
+	assert (pThis != 0);
+	pThis->m_nSubmitTime = nTime;
+}
+
+u32 USBRequestGetSubmitTime (TUSBRequest *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nSubmitTime;
+}
@@ -24,6 +24,7 @@
 #include <uspi/assert.h>
 
 boolean USBStandardHubEnumeratePorts (TUSBStandardHub *pThis);
+static TUSBTransactionTranslator *USBStandardHubGetTT (TUSBStandardHub *pThis, unsigned nPort);
 
 static const char FromHub[] = "usbhub";
 
@@ -36,11 +37,13 @@ void USBStandardHub (TUSBStandardHub *pThis, TUSBFunction *pDevice)
 	
 	pThis->m_pHubDesc = 0;
 	pThis->m_nPorts = 0;
+	pThis->m_bMultiTT = FALSE;
 
 	for (unsigned nPort = 0; nPort < USB_HUB_MAX_PORTS; nPort++)
 	{
 		pThis->m_pDevice[nPort] = 0;
 		pThis->m_pStatus[nPort] = 0;
+		pThis->m_pTT[nPort] = 0;
 	}
 }
 
@@ -66,6 +69,17 @@ void _USBStandardHub (TUSBStandardHub *pThis)
 
 	pThis->m_nPorts = 0;
 
+	// the TTs must be freed after the devices, which have reserved bandwidth in them
+	for (unsigned nPort = 0; nPort < USB_HUB_MAX_PORTS; nPort++)
+	{
+		if (pThis->m_pTT[nPort] != 0)
+		{
+			_USBTransactionTranslator (pThis->m_pTT[nPort]);
+			free (pThis->m_pTT[nPort]);
+			pThis->m_pTT[nPort] = 0;
+		}
+	}
+
 	if (pThis->m_pHubDesc != 0)
 	{
 		free (pThis->m_pHubDesc);
@@ -80,6 +94,25 @@ boolean USBStandardHubConfigure (TUSBFunction *pUSBFunction)
 	TUSBStandardHub *pThis = (TUSBStandardHub *) pUSBFunction;
 	assert (pThis != 0);
 
+	// a multi-TT hub reports protocol 2 and offers the multi-TT operation with
+	// an alternate interface setting of protocol 2 (see USB 2.0 spec chapter 11.23.1)
+	TUSBDevice *pHubDevice = USBFunctionGetDevice (&pThis->m_USBFunction);
+	assert (pHubDevice != 0);
+	const TUSBDeviceDescriptor *pDeviceDesc = USBDeviceGetDeviceDescriptor (pHubDevice);
+	assert (pDeviceDesc != 0);
+	if (   pDeviceDesc->bDeviceProtocol == 2
+	    && USBDeviceGetSpeed (pHubDevice) == USBSpeedHigh)
+	{
+		if (!USBFunctionSelectInterfaceByClass (&pThis->m_USBFunction, 9, 0, 2))
+		{
+			USBFunctionConfigurationError (&pThis->m_USBFunction, FromHub);
+
+			return FALSE;
+		}
+
+		pThis->m_bMultiTT = TRUE;
+	}
+
 	if (USBFunctionGetNumEndpoints (&pThis->m_USBFunction) != 1)
 	{
 		USBFunctionConfigurationError (&pThis->m_USBFunction, FromHub);
@@ -262,6 +295,8 @@ boolean USBStandardHubEnumeratePorts (TUSBStandardHub *pThis)
 		u8 ucHubAddress    = USBDeviceGetHubAddress (pHubDevice);
 		u8 ucHubPortNumber = USBDeviceGetHubPortNumber (pHubDevice);
 
+		TUSBTransactionTranslator *pTT = USBDeviceGetTT (pHubDevice);
+
 		// Is this the first high-speed hub with a non-high-speed device following in chain?
 		if (   !bSplit
 		    && USBDeviceGetSpeed (pHubDevice) == USBSpeedHigh
@@ -271,6 +306,8 @@ boolean USBStandardHubEnumeratePorts (TUSBStandardHub *pThis)
 			bSplit          = TRUE;
 			ucHubAddress    = USBDeviceGetAddress (pHubDevice);
 			ucHubPortNumber = nPort+1;
+
+			pTT = USBStandardHubGetTT (pThis, nPort);
 		}
 
 		// first create default device
@@ -279,6 +316,12 @@ boolean USBStandardHubEnumeratePorts (TUSBStandardHub *pThis)
 		assert (pThis->m_pDevice[nPort] != 0);
 		USBDevice (pThis->m_pDevice[nPort], pHost, Speed, bSplit, ucHubAddress, ucHubPortNumber);
 
+		if (bSplit)
+		{
+			assert (pTT != 0);
+			USBDeviceSetTT (pThis->m_pDevice[nPort], pTT);
+		}
+
 		if (!USBDeviceInitialize (pThis->m_pDevice[nPort]))
 		{
 			_USBDevice (pThis->m_pDevice[nPort]);
@@ -370,3 +413,25 @@ boolean USBStandardHubEnumeratePorts (TUSBStandardHub *pThis)
 
 	return bResult;
 }
+
+static TUSBTransactionTranslator *USBStandardHubGetTT (TUSBStandardHub *pThis, unsigned nPort)
+{
+	assert (pThis != 0);
+	assert (nPort < pThis->m_nPorts);
+
+	// the devices on all ports share the bandwidth of a single TT
+	unsigned nIndex = pThis->m_bMultiTT ? nPort : 0;
+
+	if (pThis->m_pTT[nIndex] == 0)
+	{
+		TUSBDevice *pHubDevice = USBFunctionGetDevice (&pThis->m_USBFunction);
+		assert (pHubDevice != 0);
+
+		pThis->m_pTT[nIndex] = malloc (sizeof (TUSBTransactionTranslator));
+		assert (pThis->m_pTT[nIndex] != 0);
+		USBTransactionTranslator (pThis->m_pTT[nIndex], USBDeviceGetAddress (pHubDevice),
+					  pThis->m_bMultiTT ? nPort+1 : 0);
+	}
+
+	return pThis->m_pTT[nIndex];
+}
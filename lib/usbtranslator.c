@@ -0,0 +1,138 @@
+//
+// usbtranslator.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspi/usbtranslator.h>
+#include <uspi/assert.h>
+
+// bus time limits in full-speed byte times (see USB 2.0 spec chapter 11.18.1)
+#define MICROFRAME_BUDGET	188
+#define FRAME_BUDGET		1157		// 90% of the frame for periodic transfers
+
+// protocol overhead of a periodic transaction (see USB 2.0 spec chapter 5.11.3)
+#define FS_OVERHEAD		14
+#define LS_OVERHEAD		97
+
+static unsigned USBTransactionTranslatorGetBusTime (TUSBSpeed Speed, u32 nMaxPacketSize);
+
+void USBTransactionTranslator (TUSBTransactionTranslator *pThis, u8 ucHubAddress, u8 ucHubPortNumber)
+{
+	assert (pThis != 0);
+
+	pThis->m_ucHubAddress = ucHubAddress;
+	pThis->m_ucHubPortNumber = ucHubPortNumber;
+
+	for (unsigned nMicroframe = 0; nMicroframe < USB_TT_MICROFRAMES; nMicroframe++)
+	{
+		pThis->m_nBusTime[nMicroframe] = 0;
+	}
+
+	pThis->m_nTotalBusTime = 0;
+}
+
+void _USBTransactionTranslator (TUSBTransactionTranslator *pThis)
+{
+	assert (pThis != 0);
+	assert (pThis->m_nTotalBusTime == 0);	// all endpoints must have been removed
+}
+
+unsigned USBTransactionTranslatorReserve (TUSBTransactionTranslator *pThis,
+					  TUSBSpeed Speed, u32 nMaxPacketSize)
+{
+	assert (pThis != 0);
+
+	unsigned nBusTime = USBTransactionTranslatorGetBusTime (Speed, nMaxPacketSize);
+	if (pThis->m_nTotalBusTime + nBusTime > FRAME_BUDGET)
+	{
+		return USB_TT_NO_MICROFRAME;
+	}
+
+	// take the least loaded microframe, so that the transactions of different
+	// devices are spread over the frame and all of them can be polled in it
+	unsigned nResult = USB_TT_NO_MICROFRAME;
+	for (unsigned nMicroframe = 0; nMicroframe < USB_TT_MICROFRAMES; nMicroframe++)
+	{
+		if (nMicroframe == 6)
+		{
+			continue;
+		}
+
+		// a low-speed transaction may exceed the budget of one microframe,
+		// it is admitted into an empty microframe then
+		if (   pThis->m_nBusTime[nMicroframe] + nBusTime > MICROFRAME_BUDGET
+		    && pThis->m_nBusTime[nMicroframe] != 0)
+		{
+			continue;
+		}
+
+		if (   nResult == USB_TT_NO_MICROFRAME
+		    || pThis->m_nBusTime[nMicroframe] < pThis->m_nBusTime[nResult])
+		{
+			nResult = nMicroframe;
+		}
+	}
+
+	if (nResult != USB_TT_NO_MICROFRAME)
+	{
+		pThis->m_nBusTime[nResult] += nBusTime;
+		pThis->m_nTotalBusTime += nBusTime;
+	}
+
+	return nResult;
+}
+
+void USBTransactionTranslatorRelease (TUSBTransactionTranslator *pThis, unsigned nMicroframe,
+				      TUSBSpeed Speed, u32 nMaxPacketSize)
+{
+	assert (pThis != 0);
+	assert (nMicroframe < USB_TT_MICROFRAMES);
+
+	unsigned nBusTime = USBTransactionTranslatorGetBusTime (Speed, nMaxPacketSize);
+
+	assert (pThis->m_nBusTime[nMicroframe] >= nBusTime);
+	pThis->m_nBusTime[nMicroframe] -= nBusTime;
+
+	assert (pThis->m_nTotalBusTime >= nBusTime);
+	pThis->m_nTotalBusTime -= nBusTime;
+}
+
+u8 USBTransactionTranslatorGetHubAddress (TUSBTransactionTranslator *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_ucHubAddress;
+}
+
+u8 USBTransactionTranslatorGetHubPortNumber (TUSBTransactionTranslator *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_ucHubPortNumber;
+}
+
+static unsigned USBTransactionTranslatorGetBusTime (TUSBSpeed Speed, u32 nMaxPacketSize)
+{
+	unsigned nBytes = nMaxPacketSize * 7 / 6;		// worst case bit stuffing
+
+	if (Speed == USBSpeedLow)
+	{
+		return nBytes * 8 + LS_OVERHEAD;
+	}
+
+	assert (Speed == USBSpeedFull);
+
+	return nBytes + FS_OVERHEAD;
+}
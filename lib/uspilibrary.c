@@ -22,6 +22,8 @@
 #include <uspios.h>
 #include <uspi/usbfunction.h>
 #include <uspi/string.h>
+#include <uspi/trace.h>
+#include <uspi/usbcapture.h>
 #include <uspi/util.h>
 #include <uspi/assert.h>
 
@@ -68,6 +70,7 @@ int USPiInitialize (void)
 
 		s_pLibrary->pUMSD[i] = (TUSBBulkOnlyMassStorageDevice *)
 			DeviceNameServiceGetDevice (DeviceNameServiceGet (), StringGet (&DeviceName), TRUE);
+		s_pLibrary->pUMSDCache[i] = 0;
 
 		_String  (&DeviceName);
 	}
@@ -93,6 +96,12 @@ int USPiInitialize (void)
 	return 1;
 }
 
+void USPiProcessCompletions (void)
+{
+	assert (s_pLibrary != 0);
+	DWHCIDeviceProcessCompletions (&s_pLibrary->DWHCI);
+}
+
 int USPiKeyboardAvailable (void)
 {
 	assert (s_pLibrary != 0);
@@ -173,6 +182,11 @@ int USPiMassStorageDeviceRead (unsigned long long ullOffset, void *pBuffer, unsi
 		return -1;
 	}
 
+	if (s_pLibrary->pUMSDCache[nDeviceIndex] != 0)
+	{
+		return USBMassStorageCacheRead (s_pLibrary->pUMSDCache[nDeviceIndex], ullOffset, pBuffer, nCount);
+	}
+
 	if (USBBulkOnlyMassStorageDeviceSeek (s_pLibrary->pUMSD[nDeviceIndex], ullOffset) != ullOffset)
 	{
 		return -1;
@@ -191,6 +205,11 @@ int USPiMassStorageDeviceWrite (unsigned long long ullOffset, const void *pBuffe
 		return -1;
 	}
 
+	if (s_pLibrary->pUMSDCache[nDeviceIndex] != 0)
+	{
+		return USBMassStorageCacheWrite (s_pLibrary->pUMSDCache[nDeviceIndex], ullOffset, pBuffer, nCount);
+	}
+
 	if (USBBulkOnlyMassStorageDeviceSeek (s_pLibrary->pUMSD[nDeviceIndex], ullOffset) != ullOffset)
 	{
 		return -1;
@@ -209,9 +228,195 @@ unsigned USPiMassStorageDeviceGetCapacity (unsigned nDeviceIndex)
 		return 0;
 	}
 
+	unsigned long long ullBlocks = USBBulkOnlyMassStorageDeviceGetCapacity (s_pLibrary->pUMSD[nDeviceIndex]);
+
+	return ullBlocks <= 0xFFFFFFFFU ? (unsigned) ullBlocks : 0xFFFFFFFFU;
+}
+
+unsigned long long USPiMassStorageDeviceGetCapacity64 (unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
 	return USBBulkOnlyMassStorageDeviceGetCapacity (s_pLibrary->pUMSD[nDeviceIndex]);
 }
 
+unsigned USPiMassStorageDeviceGetBlockSize (unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	return USBBulkOnlyMassStorageDeviceGetBlockSize (s_pLibrary->pUMSD[nDeviceIndex]);
+}
+
+int USPiMassStorageDeviceReadAsync (unsigned long long ullOffset, void *pBuffer, unsigned nCount,
+				    unsigned nDeviceIndex,
+				    TUSPiMassStorageCompletionHandler *pHandler, void *pParam)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	return USBBulkOnlyMassStorageDeviceReadAsync (s_pLibrary->pUMSD[nDeviceIndex], ullOffset,
+						      pBuffer, nCount, pHandler, pParam) ? 1 : 0;
+}
+
+int USPiMassStorageDeviceWriteAsync (unsigned long long ullOffset, const void *pBuffer, unsigned nCount,
+				     unsigned nDeviceIndex,
+				     TUSPiMassStorageCompletionHandler *pHandler, void *pParam)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	// the cached data would be outdated, when the write is executed
+	if (s_pLibrary->pUMSDCache[nDeviceIndex] != 0)
+	{
+		USBMassStorageCacheInvalidate (s_pLibrary->pUMSDCache[nDeviceIndex], ullOffset, nCount);
+	}
+
+	return USBBulkOnlyMassStorageDeviceWriteAsync (s_pLibrary->pUMSD[nDeviceIndex], ullOffset,
+						       pBuffer, nCount, pHandler, pParam) ? 1 : 0;
+}
+
+int USPiMassStorageDeviceFlushAsync (unsigned nDeviceIndex,
+				     TUSPiMassStorageCompletionHandler *pHandler, void *pParam)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	return USBBulkOnlyMassStorageDeviceFlushAsync (s_pLibrary->pUMSD[nDeviceIndex],
+						       pHandler, pParam) ? 1 : 0;
+}
+
+int USPiMassStorageDeviceSetWritePolicy (unsigned nPolicy, unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	TUSBMassStorageWritePolicy Policy;
+	switch (nPolicy)
+	{
+	case USPI_WRITE_FUA:		Policy = UMSDWriteFUA;		break;
+	case USPI_WRITE_THROUGH:	Policy = UMSDWriteThrough;	break;
+	case USPI_WRITE_BACK:		Policy = UMSDWriteBack;		break;
+	default:			return 0;
+	}
+
+	return USBBulkOnlyMassStorageDeviceSetWritePolicy (s_pLibrary->pUMSD[nDeviceIndex], Policy) ? 1 : 0;
+}
+
+int USPiMassStorageDeviceFlush (unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return -1;
+	}
+
+	return USBBulkOnlyMassStorageDeviceFlush (s_pLibrary->pUMSD[nDeviceIndex]);
+}
+
+void USPiMassStorageDeviceWaitAsync (unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return;
+	}
+
+	USBBulkOnlyMassStorageDeviceWaitAsync (s_pLibrary->pUMSD[nDeviceIndex]);
+}
+
+int USPiMassStorageDeviceSetCache (unsigned nSize, unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSD[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	if (s_pLibrary->pUMSDCache[nDeviceIndex] != 0)
+	{
+		_USBMassStorageCache (s_pLibrary->pUMSDCache[nDeviceIndex]);
+		free (s_pLibrary->pUMSDCache[nDeviceIndex]);
+		s_pLibrary->pUMSDCache[nDeviceIndex] = 0;
+	}
+
+	if (nSize == 0)
+	{
+		return 1;
+	}
+
+	TUSBMassStorageCache *pCache = (TUSBMassStorageCache *) malloc (sizeof (TUSBMassStorageCache));
+	if (pCache == 0)
+	{
+		return 0;
+	}
+
+	if (!USBMassStorageCache (pCache, s_pLibrary->pUMSD[nDeviceIndex], nSize))
+	{
+		_USBMassStorageCache (pCache);
+		free (pCache);
+
+		return 0;
+	}
+
+	s_pLibrary->pUMSDCache[nDeviceIndex] = pCache;
+
+	return 1;
+}
+
+int USPiMassStorageDeviceGetCacheStatistics (TUSPiCacheStatistics *pStatistics, unsigned nDeviceIndex)
+{
+	assert (s_pLibrary != 0);
+
+	if (   pStatistics == 0
+	    || nDeviceIndex >= MAX_DEVICES
+	    || s_pLibrary->pUMSDCache[nDeviceIndex] == 0)
+	{
+		return 0;
+	}
+
+	USBMassStorageCacheGetStatistics (s_pLibrary->pUMSDCache[nDeviceIndex], pStatistics);
+
+	return 1;
+}
+
 int USPiEthernetAvailable (void)
 {
 	assert (s_pLibrary != 0);
@@ -416,3 +621,48 @@ int USPiDeviceGetInformation (unsigned nClass, unsigned nDeviceIndex, TUSPiDevic
 
 	return 1;
 }
+
+int USPiGetHostStatistics (TUSPiHostStatistics *pStatistics)
+{
+	assert (s_pLibrary != 0);
+
+	if (pStatistics == 0)
+	{
+		return 0;
+	}
+
+	DWHCIDeviceGetHostStatistics (&s_pLibrary->DWHCI, pStatistics);
+
+	return 1;
+}
+
+int USPiCaptureStart (void *pBuffer, unsigned nBufSize, unsigned nSnapLen)
+{
+	return USBCaptureStart (USBCaptureGet (), pBuffer, nBufSize, nSnapLen) ? 1 : 0;
+}
+
+void USPiCaptureStop (void)
+{
+	USBCaptureStop (USBCaptureGet ());
+}
+
+unsigned USPiCaptureRead (void *pBuffer, unsigned nBufSize)
+{
+	if (   pBuffer == 0
+	    || nBufSize < USPI_CAPTURE_MIN_READ)
+	{
+		return 0;
+	}
+
+	return USBCaptureRead (USBCaptureGet (), pBuffer, nBufSize);
+}
+
+unsigned USPiCaptureGetDropped (void)
+{
+	return USBCaptureGetDropped (USBCaptureGet ());
+}
+
+unsigned USPiTraceDump (void *pBuffer, unsigned nBufSize)
+{
+	return uspi_TraceDump (pBuffer, nBufSize);
+}
@@ -198,3 +198,9 @@ u32 uspi_le2be32 (u32 ulValue)
 		| ((ulValue & 0x00FF0000) >> 8)
 		| ((ulValue & 0xFF000000) >> 24);
 }
+
+u64 uspi_le2be64 (u64 ullValue)
+{
+	return    (u64) uspi_le2be32 ((u32) ullValue) << 32
+		| uspi_le2be32 ((u32) (ullValue >> 32));
+}
@@ -0,0 +1,43 @@
+#
+# Rules.mk
+#
+# Build rules for the host simulation (sim/)
+#
+# USPi - An USB driver for Raspberry Pi written in C
+# Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+# 
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+ifeq ($(strip $(USPIHOME)),)
+USPIHOME = ../..
+endif
+
+CC	= gcc
+AR	= ar
+
+OPTIMIZE ?= -O2
+
+# the library must be built with "make HOSTSIM=1" too, which uses the same defines
+CFLAGS	+= -DUSPI_HOSTSIM -DUSPI_MMIO_BACKEND -DRASPPI=2 -fno-pie -Wall -std=gnu11 -g \
+	   -I $(USPIHOME)/include -I $(USPIHOME)/sim/include $(OPTIMIZE)
+LDFLAGS	+= -no-pie
+LDLIBS	+= -lpthread
+
+%.o: %.c
+	@echo "  CC    $@"
+	@$(CC) $(CFLAGS) -c -o $@ $<
+
+clean:
+	rm -f *.o *.a $(TARGET) *~ $(EXTRACLEAN)
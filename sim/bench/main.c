@@ -0,0 +1,1060 @@
+//
+// main.c
+//
+// Benchmark for the USPi library running on the simulated USB host controller
+//
+// Topology: root port - HS hub - port 1: mass-storage device (HS or FS)
+//                              - port 2: LS keyboard (split transactions)
+//                              - port 3: HS isochronous device (optional)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simenv.h>
+#include <uspisim/simhub.h>
+#include <uspisim/simmsd.h>
+#include <uspisim/simkeyboard.h>
+#include <uspisim/simiso.h>
+#include <uspi/usbfunction.h>
+#include <uspi/devicenameservice.h>
+#include <uspi/dwhcidevice.h>
+#include <uspi/synchronize.h>
+#include <uspi.h>
+#include <uspios.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define DISK_BLOCKS		8192			// 4 MByte (in 512 byte blocks)
+#define LARGE_DISK_BLOCKS	(1ULL << 33)		// reported with -L (in device blocks)
+#define MAX_CHUNK		(1024 * 1024)		// larger than one channel program
+#define TRANSFER_TOTAL		(1024 * 1024)		// per chunk size and direction
+#define KEY_PRESSES		20
+#define ISO_PORT		3
+#define ISO_PACKETS		8			// per request (one per microframe)
+#define ISO_REQUESTS		200			// per direction
+#define ISO_QUEUED		2			// requests per direction
+#define ASYNC_CHUNK		(64 * 1024)		// for the asynchronous mass-storage test
+#define ASYNC_QUEUED		4			// requests
+#define LOG_CHUNK		4096			// for the write cache policy test
+#define LOG_WRITES		64			// per policy
+#define BIG_TRANSFER		(DISK_BLOCKS * 512)	// one request for the whole disk
+#define CACHE_SIZE		256			// KByte, default for the read cache test
+#define CACHE_MIN_BLOCKS	64			// the default size holds at least these blocks
+#define CACHE_HOT_SIZE		(128 * 1024)		// region of the random reads
+#define CACHE_HOT_READS		512			// of one block
+#define CACHE_SEQ_OFFSET	(2 * 1024 * 1024)	// of the sequential reads
+#define CACHE_SEQ_CHUNK		4096			// or the block size, if larger
+#define TRACE_BUFFER_SIZE	(4 * 1024 * 1024)	// for the event trace (-T)
+#define CAPTURE_BUFFER_SIZE	(32 * 1024 * 1024)	// for the pcap capture (-P)
+#define CAPTURE_SNAP_LEN	512			// default, for replay use -p 1048576
+
+static const char FromBench[] = "bench";
+
+static const unsigned s_ChunkSizes[] = {512, 4096, 16384, 65536, MAX_CHUNK};
+#define CHUNK_SIZES		(sizeof s_ChunkSizes / sizeof s_ChunkSizes[0])
+
+typedef struct TBenchResult
+{
+	u64	nEnumTime;				// ns
+	unsigned nBlockSize;				// of the mass-storage device
+	unsigned long long ullBlocks;
+	double	fReadRate[CHUNK_SIZES];			// KByte/s
+	double	fWriteRate[CHUNK_SIZES];
+	double	fAsyncReadRate;
+	double	fAsyncWriteRate;
+	double	fLogRate[3];				// [USPI_WRITE_*]
+	double	fBigReadRate;
+	double	fBigWriteRate;
+	unsigned nBigCommands;				// SCSI commands used for both
+	double	fHotRate[2];				// KByte/s [bCached]
+	double	fSeqRate[2];
+	TUSPiCacheStatistics Cache;
+	boolean	bDataOK;
+	unsigned nKeyReports;
+	unsigned nIsoInPackets;
+	unsigned nIsoErrors;			// request or packet failed, IN packet not in expected (micro)frame
+	unsigned nIsoGaps;			// request did not continue the stream seamlessly
+	unsigned nIsoOutRequests;
+	TUSPiHostStatistics Host;
+	u8	*pTrace;				// from USPiTraceDump() or 0
+	unsigned nTraceSize;
+	u8	*pCaptureRing;				// for USPiCaptureStart() or 0
+	u8	*pCapture;				// from USPiCaptureRead()
+	unsigned nCaptureSize;
+	unsigned nCaptureDropped;
+}
+TBenchResult;
+
+typedef struct TIsoStream
+{
+	TDWHCIDevice	*pHost;
+	TUSBEndpoint		 Endpoint;
+	boolean			 bIn;
+	TUSBRequest		 URB[ISO_QUEUED];
+	TUSBIsoPacket		 Packets[ISO_QUEUED][ISO_PACKETS];
+	u8			*pBuffer[ISO_QUEUED];
+	unsigned		 nSubmitted;
+	unsigned		 nCompleted;
+	unsigned		 nNextFrame;		// expected start of the next request
+	u32			 nSequence;		// of the next OUT packet
+}
+TIsoStream;
+
+static TSimMSD *s_pMSD;
+static TSimKeyboard *s_pKeyboard;
+static TSimHub *s_pHub;
+static TSimIso *s_pIso;
+static TBenchResult s_Result;
+static unsigned s_nSnapLen = CAPTURE_SNAP_LEN;
+static unsigned long long s_ullDiskBase;		// offset of the tested region
+static volatile unsigned s_nAsyncCompleted;
+static volatile unsigned s_nAsyncErrors;
+
+static void KeyStatusHandlerRaw (unsigned char ucModifiers, const unsigned char RawKeys[6])
+{
+	s_Result.nKeyReports++;
+}
+
+static void IsoSubmit (TIsoStream *pStream, unsigned nIndex);
+
+// completion routines are called from here with USPI_DEFER_COMPLETION
+static void Idle (unsigned nMilliSeconds)
+{
+	while (nMilliSeconds-- > 0)
+	{
+		MsDelay (1);
+
+		USPiProcessCompletions ();
+	}
+}
+
+static void IsoCompletionRoutine (TUSBRequest *pURB, void *pParam, void *pContext)
+{
+	TIsoStream *pStream = (TIsoStream *) pContext;
+	unsigned nIndex = (unsigned) (unsigned long) pParam;
+
+	unsigned nStartFrame = USBRequestGetStartFrame (pURB);
+	if (   pStream->nCompleted > 0
+	    && nStartFrame != pStream->nNextFrame)
+	{
+		s_Result.nIsoGaps++;
+	}
+	pStream->nNextFrame = (nStartFrame + ISO_PACKETS) & DWHCI_MAX_FRAME_NUMBER;
+	pStream->nCompleted++;
+
+	if (!USBRequestGetStatus (pURB))
+	{
+		s_Result.nIsoErrors++;
+	}
+
+	if (pStream->bIn)
+	{
+		for (unsigned i = 0; i < ISO_PACKETS; i++)
+		{
+			TUSBIsoPacket *pPacket = USBRequestGetIsoPacket (pURB, i);
+			TSimIsoHeader Header;
+			memcpy (&Header, pStream->pBuffer[nIndex] + pPacket->nOffset, sizeof Header);
+
+			if (   pPacket->Error != USBErrorNone
+			    || pPacket->nActualLength != SIM_ISO_PACKET_SIZE
+			    || Header.nFrame != ((nStartFrame + i) & DWHCI_MAX_FRAME_NUMBER))
+			{
+				s_Result.nIsoErrors++;
+			}
+			else
+			{
+				s_Result.nIsoInPackets++;
+			}
+		}
+	}
+	else
+	{
+		s_Result.nIsoOutRequests++;
+	}
+
+	_USBRequest (pURB);
+
+	if (pStream->nSubmitted < ISO_REQUESTS)
+	{
+		IsoSubmit (pStream, nIndex);
+	}
+}
+
+static void IsoSubmit (TIsoStream *pStream, unsigned nIndex)
+{
+	TUSBRequest *pURB = &pStream->URB[nIndex];
+	USBRequest (pURB, &pStream->Endpoint, pStream->pBuffer[nIndex], ISO_PACKETS * SIM_ISO_PACKET_SIZE, 0);
+
+	for (unsigned i = 0; i < ISO_PACKETS; i++)
+	{
+		TUSBIsoPacket *pPacket = &pStream->Packets[nIndex][i];
+		pPacket->nOffset = i * SIM_ISO_PACKET_SIZE;
+		pPacket->nLength = SIM_ISO_PACKET_SIZE;
+
+		if (!pStream->bIn)
+		{
+			TSimIsoHeader Header;
+			Header.nSequence = pStream->nSequence++;
+			Header.nFrame = 0;
+			memcpy (pStream->pBuffer[nIndex] + pPacket->nOffset, &Header, sizeof Header);
+		}
+	}
+
+	USBRequestSetIsoPackets (pURB, pStream->Packets[nIndex], ISO_PACKETS);
+	USBRequestSetCompletionRoutine (pURB, IsoCompletionRoutine, (void *) (unsigned long) nIndex, pStream);
+
+	pStream->nSubmitted++;
+
+	if (!DWHCIDeviceSubmitAsyncRequest (pStream->pHost, pURB))
+	{
+		s_Result.nIsoErrors++;
+	}
+}
+
+// the host controller is not exported by the USPi API, get it from the mass-storage device
+static TDWHCIDevice *GetHost (void)
+{
+	TUSBFunction *pMSD = (TUSBFunction *)
+		DeviceNameServiceGetDevice (DeviceNameServiceGet (), "umsd1", TRUE);
+	if (pMSD == 0)
+	{
+		return 0;
+	}
+
+	return USBDeviceGetHost (USBFunctionGetDevice (pMSD));
+}
+
+// The isochronous device is not supported by a function driver and is left in the address
+// state by the enumeration. It is configured and accessed directly here.
+static boolean IsoTest (void)
+{
+	TDWHCIDevice *pHost = GetHost ();
+	if (pHost == 0)
+	{
+		return FALSE;
+	}
+
+	static TUSBDevice Device;
+	USBDevice (&Device, pHost, USBSpeedHigh, FALSE, SimDeviceGetAddress (&s_pHub->m_Device), ISO_PORT);
+	Device.m_ucAddress = SimDeviceGetAddress (&s_pIso->m_Device);
+	USBEndpointSetMaxPacketSize (USBDeviceGetEndpoint0 (&Device), 64);
+
+	if (!DWHCIDeviceSetConfiguration (pHost, USBDeviceGetEndpoint0 (&Device), 1))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Cannot configure isochronous device");
+
+		return FALSE;
+	}
+
+	static TIsoStream Stream[2];
+	for (unsigned nStream = 0; nStream < 2; nStream++)
+	{
+		TIsoStream *pStream = &Stream[nStream];
+		pStream->pHost = pHost;
+		pStream->bIn = nStream == 0;
+
+		TUSBEndpointDescriptor Desc;
+		Desc.bLength = sizeof Desc;
+		Desc.bDescriptorType = DESCRIPTOR_ENDPOINT;
+		Desc.bEndpointAddress = pStream->bIn ? 0x80 | SIM_ISO_EP_IN : SIM_ISO_EP_OUT;
+		Desc.bmAttributes = 0x01;
+		Desc.wMaxPacketSize = SIM_ISO_PACKET_SIZE;
+		Desc.bInterval = 1;
+		USBEndpoint2 (&pStream->Endpoint, &Device, &Desc);
+
+		for (unsigned i = 0; i < ISO_QUEUED; i++)
+		{
+			pStream->pBuffer[i] = (u8 *) aligned_alloc (DMA_ALIGNMENT, ISO_PACKETS * SIM_ISO_PACKET_SIZE);
+			if (pStream->pBuffer[i] == 0)
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < ISO_QUEUED; i++)
+	{
+		IsoSubmit (&Stream[0], i);
+		IsoSubmit (&Stream[1], i);
+	}
+
+	for (unsigned nTimeout = 0; nTimeout < 1000; nTimeout++)
+	{
+		if (   Stream[0].nCompleted == ISO_REQUESTS
+		    && Stream[1].nCompleted == ISO_REQUESTS)
+		{
+			break;
+		}
+
+		Idle (1);
+	}
+
+	for (unsigned nStream = 0; nStream < 2; nStream++)
+	{
+		for (unsigned i = 0; i < ISO_QUEUED; i++)
+		{
+			free (Stream[nStream].pBuffer[i]);
+		}
+
+		_USBEndpoint (&Stream[nStream].Endpoint);
+	}
+
+	return    Stream[0].nCompleted == ISO_REQUESTS
+	       && Stream[1].nCompleted == ISO_REQUESTS;
+}
+
+static double Rate (unsigned nBytes, u64 nTime)
+{
+	return nTime > 0 ? nBytes / 1024.0 * 1e9 / nTime : 0.0;
+}
+
+static void AsyncCompletionHandler (int nResult, void *pParam)
+{
+	if (nResult != ASYNC_CHUNK)
+	{
+		s_nAsyncErrors++;
+	}
+
+	s_nAsyncCompleted++;
+}
+
+static void FlushCompletionHandler (int nResult, void *pParam)
+{
+	*(volatile int *) pParam = nResult == 0 ? 1 : -1;
+}
+
+// writes LOG_WRITES chunks of LOG_CHUNK bytes with the given write cache policy and flushes them
+static boolean LogTest (const u8 *pPattern, unsigned nPolicy)
+{
+	if (!USPiMassStorageDeviceSetWritePolicy (nPolicy, 0))
+	{
+		return FALSE;
+	}
+
+	for (unsigned n = 0; n < LOG_WRITES; n++)
+	{
+		unsigned long long ullOffset = s_ullDiskBase + (unsigned long long) n * LOG_CHUNK;
+		if (USPiMassStorageDeviceWrite (ullOffset, pPattern + n * LOG_CHUNK, LOG_CHUNK, 0) != LOG_CHUNK)
+		{
+			return FALSE;
+		}
+	}
+
+	volatile int nFlushed = 0;
+	if (!USPiMassStorageDeviceFlushAsync (0, FlushCompletionHandler, (void *) &nFlushed))
+	{
+		return FALSE;
+	}
+
+	while (nFlushed == 0)
+	{
+		usDelay (1);
+
+		USPiProcessCompletions ();
+	}
+
+	return nFlushed > 0;
+}
+
+// transfers TRANSFER_TOTAL bytes in ASYNC_CHUNK requests, with ASYNC_QUEUED requests queued
+static boolean AsyncTransfer (u8 *pBuffer, boolean bIn)
+{
+	unsigned nCount = TRANSFER_TOTAL / ASYNC_CHUNK;
+
+	s_nAsyncCompleted = 0;
+	s_nAsyncErrors = 0;
+
+	for (unsigned n = 0; n < nCount; n++)
+	{
+		while (n - s_nAsyncCompleted >= ASYNC_QUEUED)
+		{
+			usDelay (1);
+
+			USPiProcessCompletions ();
+		}
+
+		unsigned long long ullOffset = s_ullDiskBase + (unsigned long long) n * ASYNC_CHUNK;
+		if (!(bIn ? USPiMassStorageDeviceReadAsync (ullOffset, pBuffer + n * ASYNC_CHUNK, ASYNC_CHUNK, 0,
+							    AsyncCompletionHandler, 0)
+			  : USPiMassStorageDeviceWriteAsync (ullOffset, pBuffer + n * ASYNC_CHUNK, ASYNC_CHUNK, 0,
+							     AsyncCompletionHandler, 0)))
+		{
+			return FALSE;
+		}
+	}
+
+	while (s_nAsyncCompleted < nCount)
+	{
+		usDelay (1);
+
+		USPiProcessCompletions ();
+	}
+
+	return s_nAsyncErrors == 0;
+}
+
+// the driver splits the requests into commands of the max. transfer length
+static boolean BigTest (u8 *pPattern, u8 *pBuffer)
+{
+	for (unsigned j = 0; j < BIG_TRANSFER; j++)
+	{
+		pPattern[j] = (u8) (j * 11 + 1);
+	}
+
+	unsigned nCommands = SimMSDGetCommands (s_pMSD);
+
+	u64 nStart = SimGetTime ();
+	if (USPiMassStorageDeviceWrite (s_ullDiskBase, pPattern, BIG_TRANSFER, 0) != BIG_TRANSFER)
+	{
+		return FALSE;
+	}
+	s_Result.fBigWriteRate = Rate (BIG_TRANSFER, SimGetTime () - nStart);
+
+	memset (pBuffer, 0, BIG_TRANSFER);
+
+	nStart = SimGetTime ();
+	if (USPiMassStorageDeviceRead (s_ullDiskBase, pBuffer, BIG_TRANSFER, 0) != BIG_TRANSFER)
+	{
+		return FALSE;
+	}
+	s_Result.fBigReadRate = Rate (BIG_TRANSFER, SimGetTime () - nStart);
+
+	s_Result.nBigCommands = SimMSDGetCommands (s_pMSD) - nCommands;
+
+	if (memcmp (pBuffer, pPattern, BIG_TRANSFER) != 0)
+	{
+		s_Result.bDataOK = FALSE;
+	}
+
+	return TRUE;
+}
+
+// random reads of single blocks from a small region and sequential reads, without and with
+// the read cache, the disk contains pPattern from the big request test
+static boolean CacheTest (u8 *pPattern, u8 *pBuffer, unsigned nCacheSize)
+{
+	unsigned nBlockSize = s_Result.nBlockSize;
+	unsigned nChunk = nBlockSize > CACHE_SEQ_CHUNK ? nBlockSize : CACHE_SEQ_CHUNK;
+
+	for (unsigned bCached = 0; bCached <= 1; bCached++)
+	{
+		if (   bCached
+		    && !USPiMassStorageDeviceSetCache (nCacheSize, 0))
+		{
+			return FALSE;
+		}
+
+		u32 nRandom = 1;
+		u64 nStart = SimGetTime ();
+		for (unsigned i = 0; i < CACHE_HOT_READS; i++)
+		{
+			nRandom = nRandom * 1103515245 + 12345;
+			unsigned nOffset = (nRandom >> 8) % (CACHE_HOT_SIZE / nBlockSize) * nBlockSize;
+
+			if (USPiMassStorageDeviceRead (s_ullDiskBase + nOffset, pBuffer, nBlockSize, 0)
+				!= (int) nBlockSize)
+			{
+				return FALSE;
+			}
+
+			if (memcmp (pBuffer, pPattern + nOffset, nBlockSize) != 0)
+			{
+				s_Result.bDataOK = FALSE;
+			}
+		}
+		s_Result.fHotRate[bCached] = Rate (CACHE_HOT_READS * nBlockSize, SimGetTime () - nStart);
+
+		nStart = SimGetTime ();
+		for (unsigned nOffset = CACHE_SEQ_OFFSET; nOffset < CACHE_SEQ_OFFSET + TRANSFER_TOTAL; nOffset += nChunk)
+		{
+			if (USPiMassStorageDeviceRead (s_ullDiskBase + nOffset, pBuffer, nChunk, 0) != (int) nChunk)
+			{
+				return FALSE;
+			}
+
+			if (memcmp (pBuffer, pPattern + nOffset, nChunk) != 0)
+			{
+				s_Result.bDataOK = FALSE;
+			}
+		}
+		s_Result.fSeqRate[bCached] = Rate (TRANSFER_TOTAL, SimGetTime () - nStart);
+	}
+
+	// a write must update the cached data
+	for (unsigned i = 0; i < nBlockSize; i++)
+	{
+		pPattern[i] ^= 0xFF;
+	}
+
+	if (   USPiMassStorageDeviceWrite (s_ullDiskBase, pPattern, nBlockSize, 0) != (int) nBlockSize
+	    || USPiMassStorageDeviceRead (s_ullDiskBase, pBuffer, nBlockSize, 0) != (int) nBlockSize)
+	{
+		return FALSE;
+	}
+
+	if (memcmp (pBuffer, pPattern, nBlockSize) != 0)
+	{
+		s_Result.bDataOK = FALSE;
+	}
+
+	USPiMassStorageDeviceGetCacheStatistics (&s_Result.Cache, 0);
+
+	return USPiMassStorageDeviceSetCache (0, 0);
+}
+
+static int BenchMain (void *pParam)
+{
+	if (   s_Result.pCaptureRing != 0
+	    && !USPiCaptureStart (s_Result.pCaptureRing, CAPTURE_BUFFER_SIZE, s_nSnapLen))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Cannot start capture");
+
+		return 1;
+	}
+
+	u64 nStart = SimGetTime ();
+	if (!USPiInitialize ())
+	{
+		LogWrite (FromBench, LOG_ERROR, "Cannot initialize USPi");
+
+		return 1;
+	}
+	s_Result.nEnumTime = SimGetTime () - nStart;
+
+	if (USPiMassStorageDeviceAvailable () < 1)
+	{
+		LogWrite (FromBench, LOG_ERROR, "Mass-storage device not found");
+
+		return 1;
+	}
+
+	u8 *pPattern = (u8 *) malloc (MAX_CHUNK);
+	// the read buffer is suitable for DMA, so that no bounce buffer is needed
+	u8 *pBuffer = (u8 *) aligned_alloc (DMA_ALIGNMENT, MAX_CHUNK);
+	if (   pPattern == 0
+	    || pBuffer == 0)
+	{
+		return 1;
+	}
+
+	s_Result.nBlockSize = USPiMassStorageDeviceGetBlockSize (0);
+	s_Result.ullBlocks = USPiMassStorageDeviceGetCapacity64 (0);
+
+	s_Result.bDataOK = TRUE;
+
+	for (unsigned i = 0; i < CHUNK_SIZES; i++)
+	{
+		unsigned nChunk = s_ChunkSizes[i];
+		unsigned nCount = TRANSFER_TOTAL / nChunk;
+
+		if (nChunk < s_Result.nBlockSize)
+		{
+			continue;
+		}
+
+		for (unsigned j = 0; j < nChunk; j++)
+		{
+			pPattern[j] = (u8) (j * 7 + i);
+		}
+
+		nStart = SimGetTime ();
+		for (unsigned n = 0; n < nCount; n++)
+		{
+			unsigned long long ullOffset = s_ullDiskBase + (unsigned long long) n * nChunk % (DISK_BLOCKS * 512ULL);
+			if (USPiMassStorageDeviceWrite (ullOffset, pPattern, nChunk, 0) != (int) nChunk)
+			{
+				LogWrite (FromBench, LOG_ERROR, "Write failed");
+
+				return 1;
+			}
+		}
+		s_Result.fWriteRate[i] = Rate (TRANSFER_TOTAL, SimGetTime () - nStart);
+
+		nStart = SimGetTime ();
+		for (unsigned n = 0; n < nCount; n++)
+		{
+			unsigned long long ullOffset = s_ullDiskBase + (unsigned long long) n * nChunk % (DISK_BLOCKS * 512ULL);
+			if (USPiMassStorageDeviceRead (ullOffset, pBuffer, nChunk, 0) != (int) nChunk)
+			{
+				LogWrite (FromBench, LOG_ERROR, "Read failed");
+
+				return 1;
+			}
+
+			if (memcmp (pBuffer, pPattern, nChunk) != 0)
+			{
+				s_Result.bDataOK = FALSE;
+			}
+		}
+		s_Result.fReadRate[i] = Rate (TRANSFER_TOTAL, SimGetTime () - nStart);
+	}
+
+	for (unsigned j = 0; j < TRANSFER_TOTAL; j++)
+	{
+		pPattern[j] = (u8) (j * 13 + 5);
+	}
+
+	nStart = SimGetTime ();
+	if (!AsyncTransfer (pPattern, FALSE))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Async write failed");
+
+		return 1;
+	}
+	s_Result.fAsyncWriteRate = Rate (TRANSFER_TOTAL, SimGetTime () - nStart);
+
+	memset (pBuffer, 0, TRANSFER_TOTAL);
+
+	nStart = SimGetTime ();
+	if (!AsyncTransfer (pBuffer, TRUE))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Async read failed");
+
+		return 1;
+	}
+	s_Result.fAsyncReadRate = Rate (TRANSFER_TOTAL, SimGetTime () - nStart);
+
+	if (memcmp (pBuffer, pPattern, TRANSFER_TOTAL) != 0)
+	{
+		s_Result.bDataOK = FALSE;
+	}
+
+	if (s_Result.nBlockSize <= LOG_CHUNK)
+	{
+		static const unsigned Policies[] = {USPI_WRITE_FUA, USPI_WRITE_THROUGH, USPI_WRITE_BACK};
+		for (unsigned i = 0; i < sizeof Policies / sizeof Policies[0]; i++)
+		{
+			for (unsigned j = 0; j < LOG_WRITES * LOG_CHUNK; j++)
+			{
+				pPattern[j] = (u8) (j * 3 + i);
+			}
+
+			nStart = SimGetTime ();
+			if (!LogTest (pPattern, Policies[i]))
+			{
+				LogWrite (FromBench, LOG_ERROR, "Write policy test failed");
+
+				return 1;
+			}
+			s_Result.fLogRate[Policies[i]] = Rate (LOG_WRITES * LOG_CHUNK, SimGetTime () - nStart);
+
+			if (   USPiMassStorageDeviceRead (s_ullDiskBase, pBuffer, LOG_WRITES * LOG_CHUNK, 0)
+				!= LOG_WRITES * LOG_CHUNK
+			    || memcmp (pBuffer, pPattern, LOG_WRITES * LOG_CHUNK) != 0)
+			{
+				s_Result.bDataOK = FALSE;
+			}
+		}
+
+		// asynchronous writes with a flush after each one
+		if (   !USPiMassStorageDeviceSetWritePolicy (USPI_WRITE_THROUGH, 0)
+		    || !AsyncTransfer (pPattern, FALSE)
+		    || !USPiMassStorageDeviceSetWritePolicy (USPI_WRITE_FUA, 0))
+		{
+			LogWrite (FromBench, LOG_ERROR, "Async write-through failed");
+
+			return 1;
+		}
+
+		if (   USPiMassStorageDeviceRead (s_ullDiskBase, pBuffer, TRANSFER_TOTAL, 0) != TRANSFER_TOTAL
+		    || memcmp (pBuffer, pPattern, TRANSFER_TOTAL) != 0)
+		{
+			s_Result.bDataOK = FALSE;
+		}
+	}
+
+	free (pBuffer);
+	free (pPattern);
+
+	pPattern = (u8 *) malloc (BIG_TRANSFER);
+	pBuffer = (u8 *) aligned_alloc (DMA_ALIGNMENT, BIG_TRANSFER);
+	if (   pPattern == 0
+	    || pBuffer == 0)
+	{
+		return 1;
+	}
+
+	if (!BigTest (pPattern, pBuffer))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Large request failed");
+
+		return 1;
+	}
+
+	unsigned nCacheSize = *(int *) pParam;
+	if (   nCacheSize != 0
+	    && !CacheTest (pPattern, pBuffer, nCacheSize))
+	{
+		LogWrite (FromBench, LOG_ERROR, "Read cache test failed");
+
+		return 1;
+	}
+
+	free (pBuffer);
+	free (pPattern);
+
+	if (USPiKeyboardAvailable ())
+	{
+		USPiKeyboardRegisterKeyStatusHandlerRaw (KeyStatusHandlerRaw);
+
+		for (unsigned i = 0; i < KEY_PRESSES; i++)
+		{
+			SimKeyboardPressKey (s_pKeyboard, 0, 0x04 + i, SimGetTime () + 1000000ULL);
+
+			Idle (100);
+		}
+	}
+
+	if (   s_pIso != 0
+	    && !IsoTest ())
+	{
+		LogWrite (FromBench, LOG_ERROR, "Isochronous test failed");
+
+		return 1;
+	}
+
+	USPiGetHostStatistics (&s_Result.Host);
+
+	if (s_Result.pTrace != 0)
+	{
+		s_Result.nTraceSize = USPiTraceDump (s_Result.pTrace, TRACE_BUFFER_SIZE);
+	}
+
+	if (s_Result.pCaptureRing != 0)
+	{
+		USPiCaptureStop ();
+
+		s_Result.nCaptureSize = USPiCaptureRead (s_Result.pCapture, CAPTURE_BUFFER_SIZE);
+		s_Result.nCaptureDropped = USPiCaptureGetDropped ();
+	}
+
+	return 0;
+}
+
+static double CPUTime (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Usage (const char *pProgram)
+{
+	fprintf (stderr, "Usage: %s [-f] [-b blocksize] [-L] [-w commit_us] [-X max_blocks] [-C cache_kb] [-t] [-i] [-c channels] [-n nak_per_mille] [-y nyet_per_mille]\n"
+			 "\t\t[-s seed] [-l latency_us] [-v loglevel] [-e] [-m] [-T tracefile] [-P pcapfile [-p snaplen]]\n"
+			 "\t-f\tfull-speed mass-storage device (uses split transactions)\n"
+			 "\t-b\tlogical block size of the mass-storage device (default 512)\n"
+			 "\t-L\tlarge mass-storage device (2^33 blocks), the test runs at its end\n"
+			 "\t-w\twrite cache of the mass-storage device, time to commit it to the media\n"
+			 "\t-X\tmass-storage device reports this max. transfer length (SPC-3, Block Limits VPD)\n"
+			 "\t-C\tsize of the read cache for the cache test (default %u KByte or %u blocks, 0: no test)\n"
+			 "\t-t\tmulti-TT hub (one transaction translator per port)\n"
+			 "\t-i\tstream to and from an isochronous device\n"
+			 "\t-e\treport the host statistics of each endpoint\n"
+			 "\t-m\tmachine-readable output (key=value)\n"
+			 "\t-T\twrite the event trace to a file (library built with USPI_TRACE)\n"
+			 "\t-P\tcapture the USB requests into a pcap file (usbmon format)\n"
+			 "\t-p\tmax. captured data bytes per request (default %u)\n", pProgram, CACHE_SIZE, CACHE_MIN_BLOCKS, CAPTURE_SNAP_LEN);
+
+	exit (2);
+}
+
+int main (int argc, char **argv)
+{
+	SimInitialize ();
+
+	boolean bFullSpeedMSD = FALSE;
+	unsigned nBlockSize = 512;
+	boolean bLargeDisk = FALSE;
+	unsigned nCommitLatency = 0;
+	int nMaxTransfer = -1;
+	int nCacheSize = -1;
+	boolean bMultiTT = FALSE;
+	boolean bIso = FALSE;
+	unsigned nChannels = DWC2_DEFAULT_CHANNELS;
+	unsigned nNAKRate = 0;
+	unsigned nNYETRate = 0;
+	unsigned nSeed = 1;
+	unsigned nMediaLatency = 0;
+	boolean bEndpoints = FALSE;
+	boolean bMachine = FALSE;
+	const char *pTraceFile = 0;
+	const char *pCaptureFile = 0;
+
+	int nOption;
+	while ((nOption = getopt (argc, argv, "fb:Lw:X:C:tic:n:y:s:l:v:emT:P:p:")) != -1)
+	{
+		switch (nOption)
+		{
+		case 'f':	bFullSpeedMSD = TRUE;			break;
+		case 'b':	nBlockSize = atoi (optarg);		break;
+		case 'L':	bLargeDisk = TRUE;			break;
+		case 'w':	nCommitLatency = atoi (optarg);		break;
+		case 'X':	nMaxTransfer = atoi (optarg);		break;
+		case 'C':	nCacheSize = atoi (optarg) * 1024;	break;
+		case 't':	bMultiTT = TRUE;			break;
+		case 'i':	bIso = TRUE;				break;
+		case 'c':	nChannels = atoi (optarg);		break;
+		case 'n':	nNAKRate = atoi (optarg);		break;
+		case 'y':	nNYETRate = atoi (optarg);		break;
+		case 's':	nSeed = atoi (optarg);			break;
+		case 'l':	nMediaLatency = atoi (optarg);		break;
+		case 'v':	SimSetLogLevel (atoi (optarg));		break;
+		case 'e':	bEndpoints = TRUE;			break;
+		case 'm':	bMachine = TRUE;			break;
+		case 'T':	pTraceFile = optarg;			break;
+		case 'P':	pCaptureFile = optarg;			break;
+		case 'p':	s_nSnapLen = atoi (optarg);		break;
+		default:	Usage (argv[0]);			break;
+		}
+	}
+
+	if (   nChannels < 1
+	    || nChannels > DWC2_MAX_CHANNELS
+	    || nBlockSize < 512
+	    || nBlockSize > ASYNC_CHUNK
+	    || (nBlockSize & (nBlockSize-1)) != 0)
+	{
+		Usage (argv[0]);
+	}
+
+	if (nCacheSize < 0)
+	{
+		nCacheSize = CACHE_SIZE * 1024;
+		if ((unsigned) nCacheSize < CACHE_MIN_BLOCKS * nBlockSize)
+		{
+			nCacheSize = CACHE_MIN_BLOCKS * nBlockSize;
+		}
+	}
+
+	static TSimHub Hub;
+	SimHub (&Hub, USBSpeedHigh, 4, bMultiTT);
+
+	static TSimMSD MSD;
+	unsigned nDiskBlocks = DISK_BLOCKS * 512 / nBlockSize;
+	SimMSD (&MSD, bFullSpeedMSD ? USBSpeedFull : USBSpeedHigh, nDiskBlocks, nBlockSize);
+	if (bLargeDisk)
+	{
+		SimMSDSetVirtualBlocks (&MSD, LARGE_DISK_BLOCKS);
+		s_ullDiskBase = (LARGE_DISK_BLOCKS - nDiskBlocks) * nBlockSize;
+	}
+	SimMSDSetMediaLatency (&MSD, nMediaLatency * 1000ULL);
+	SimMSDSetCommitLatency (&MSD, nCommitLatency * 1000ULL);
+	if (nMaxTransfer >= 0)
+	{
+		SimMSDSetBlockLimits (&MSD, nMaxTransfer, 0);
+	}
+	SimHubAttach (&Hub, 1, &MSD.m_Device);
+	s_pMSD = &MSD;
+
+	static TSimKeyboard Keyboard;
+	SimKeyboard (&Keyboard, USBSpeedLow);
+	SimHubAttach (&Hub, 2, &Keyboard.m_Device);
+	s_pKeyboard = &Keyboard;
+
+	static TSimIso Iso;
+	if (bIso)
+	{
+		SimIso (&Iso);
+		SimHubAttach (&Hub, ISO_PORT, &Iso.m_Device);
+		s_pIso = &Iso;
+	}
+	s_pHub = &Hub;
+
+	if (pTraceFile != 0)
+	{
+		s_Result.pTrace = (u8 *) malloc (TRACE_BUFFER_SIZE);
+		if (s_Result.pTrace == 0)
+		{
+			return 1;
+		}
+	}
+
+	if (pCaptureFile != 0)
+	{
+		s_Result.pCaptureRing = (u8 *) malloc (CAPTURE_BUFFER_SIZE);
+		s_Result.pCapture = (u8 *) malloc (CAPTURE_BUFFER_SIZE);
+		if (   s_Result.pCaptureRing == 0
+		    || s_Result.pCapture == 0)
+		{
+			return 1;
+		}
+	}
+
+	SimAttach (&Hub.m_Device, nChannels);
+	DWC2CoreSetFaultRates (SimGetCore (), nNAKRate, nNYETRate, nSeed);
+
+	double fCPUStart = CPUTime ();
+	int nResult = SimRun (BenchMain, &nCacheSize);
+	double fCPUTime = CPUTime () - fCPUStart;
+
+	TSimStatistics Stat;
+	SimGetStatistics (&Stat);
+	const TDWC2Statistics *pCore = DWC2CoreGetStatistics (SimGetCore ());
+
+	const char *pFormat = bMachine ? "%s=%s\n" : "%-24s %s\n";
+	char Value[200];
+
+#define PRINT(name, ...)	do { snprintf (Value, sizeof Value, __VA_ARGS__); \
+				     printf (pFormat, name, Value); } while (0)
+
+	PRINT ("result", "%s", nResult == 0 ? "ok" : "failed");
+	PRINT ("data_ok", "%d", s_Result.bDataOK);
+	PRINT ("enum_time_ms", "%.3f", s_Result.nEnumTime / 1e6);
+	PRINT ("msd_block_size", "%u", s_Result.nBlockSize);
+	PRINT ("msd_blocks", "%llu", s_Result.ullBlocks);
+	for (unsigned i = 0; i < CHUNK_SIZES; i++)
+	{
+		char Name[40];
+		snprintf (Name, sizeof Name, "write_%u_kbps", s_ChunkSizes[i]);
+		PRINT (Name, "%.1f", s_Result.fWriteRate[i]);
+		snprintf (Name, sizeof Name, "read_%u_kbps", s_ChunkSizes[i]);
+		PRINT (Name, "%.1f", s_Result.fReadRate[i]);
+	}
+	PRINT ("async_write_kbps", "%.1f", s_Result.fAsyncWriteRate);
+	PRINT ("async_read_kbps", "%.1f", s_Result.fAsyncReadRate);
+	PRINT ("log_fua_kbps", "%.1f", s_Result.fLogRate[USPI_WRITE_FUA]);
+	PRINT ("log_through_kbps", "%.1f", s_Result.fLogRate[USPI_WRITE_THROUGH]);
+	PRINT ("log_back_kbps", "%.1f", s_Result.fLogRate[USPI_WRITE_BACK]);
+	PRINT ("msd_commits", "%u", SimMSDGetCommits (&MSD));
+	PRINT ("big_write_kbps", "%.1f", s_Result.fBigWriteRate);
+	PRINT ("big_read_kbps", "%.1f", s_Result.fBigReadRate);
+	PRINT ("big_commands", "%u", s_Result.nBigCommands);
+	if (nCacheSize != 0)
+	{
+		PRINT ("cache_hot_uncached_kbps", "%.1f", s_Result.fHotRate[0]);
+		PRINT ("cache_hot_kbps", "%.1f", s_Result.fHotRate[1]);
+		PRINT ("cache_seq_uncached_kbps", "%.1f", s_Result.fSeqRate[0]);
+		PRINT ("cache_seq_kbps", "%.1f", s_Result.fSeqRate[1]);
+		PRINT ("cache_hits", "%u", s_Result.Cache.nHits);
+		PRINT ("cache_misses", "%u", s_Result.Cache.nMisses);
+		PRINT ("cache_prefetches", "%u", s_Result.Cache.nPrefetches);
+		PRINT ("cache_prefetch_hits", "%u", s_Result.Cache.nPrefetchHits);
+		PRINT ("cache_evictions", "%u", s_Result.Cache.nEvictions);
+		PRINT ("cache_bypasses", "%u", s_Result.Cache.nBypasses);
+	}
+	PRINT ("key_reports", "%u/%u", s_Result.nKeyReports, SimKeyboardGetReportsSent (&Keyboard));
+	PRINT ("key_latency_avg_us", "%.1f", SimKeyboardGetAverageLatency (&Keyboard) / 1e3);
+	PRINT ("key_latency_max_us", "%.1f", SimKeyboardGetMaxLatency (&Keyboard) / 1e3);
+	if (bIso)
+	{
+		PRINT ("iso_in_packets", "%u/%u", s_Result.nIsoInPackets, SimIsoGetInPackets (&Iso));
+				PRINT ("iso_out_packets", "%u/%u", SimIsoGetOutPackets (&Iso), s_Result.nIsoOutRequests * ISO_PACKETS);
+		PRINT ("iso_out_errors", "%u", SimIsoGetOutErrors (&Iso));
+		PRINT ("iso_errors", "%u", s_Result.nIsoErrors);
+		PRINT ("iso_out_gaps", "%u", SimIsoGetOutGaps (&Iso));
+		PRINT ("iso_request_gaps", "%u", s_Result.nIsoGaps);
+	}
+	PRINT ("virtual_time_ms", "%.3f", SimGetTime () / 1e6);
+	PRINT ("idle_time_ms", "%.3f", Stat.nIdleTime / 1e6);
+	PRINT ("host_cpu_time_s", "%.3f", fCPUTime);
+	PRINT ("irqs", "%u", Stat.nIRQs);
+	PRINT ("fiqs", "%u", Stat.nFIQs);
+	PRINT ("timer_irqs", "%u", Stat.nTimerIRQs);
+	PRINT ("mmio_reads", "%llu", (unsigned long long) Stat.nMMIOReads);
+	PRINT ("mmio_writes", "%llu", (unsigned long long) Stat.nMMIOWrites);
+	PRINT ("cache_lines_cleaned", "%llu", (unsigned long long) Stat.nCacheLinesCleaned);
+	PRINT ("cache_lines_invalidated", "%llu", (unsigned long long) Stat.nCacheLinesInvalidated);
+	PRINT ("bounce_stages", "%u", s_Result.Host.nBouncedStages);
+	PRINT ("bounce_bytes", "%llu", s_Result.Host.nBouncedBytes);
+	PRINT ("channel_starts", "%u", pCore->nChannelStarts);
+	PRINT ("packets", "%u", pCore->nPackets);
+	PRINT ("naks", "%u", pCore->nNAKs);
+	PRINT ("nak_retries", "%u", pCore->nNAKRetries);
+	PRINT ("start_splits", "%u", pCore->nStartSplits);
+	PRINT ("complete_splits", "%u", pCore->nCompleteSplits);
+	PRINT ("nyets", "%u", pCore->nNYETs);
+	PRINT ("injected_naks", "%u", pCore->nInjectedNAKs);
+	PRINT ("injected_nyets", "%u", pCore->nInjectedNYETs);
+	PRINT ("errors", "%u", pCore->nErrors);
+
+	const TUSPiHostStatistics *pHost = &s_Result.Host;
+	unsigned nXactErrors = 0;
+	for (unsigned i = 0; i < pHost->nChannels; i++)
+	{
+		nXactErrors += pHost->Channel[i].nXactErrors;
+	}
+	PRINT ("host_xact_errors", "%u", nXactErrors);
+	PRINT ("host_channel_waits", "%u/%u", pHost->nChannelAllocationFailures, pHost->nChannelAllocations);
+
+	for (unsigned i = 0; bEndpoints && i < pHost->nEndpoints; i++)
+	{
+		const TUSPiEndpointStatistics *pEP = &pHost->Endpoint[i];
+
+		// latency bucket, below which half of the requests completed
+		unsigned nMedian = 0;
+		for (unsigned nCount = 0; nMedian < USPI_LATENCY_BUCKETS-1; nMedian++)
+		{
+			nCount += pEP->nLatencyHistogram[nMedian];
+			if (2 * nCount >= pEP->nRequests)
+			{
+				break;
+			}
+		}
+
+		char Name[40];
+		snprintf (Name, sizeof Name, "ep_%u_%02x", pEP->ucDeviceAddress, pEP->ucEndpointAddress);
+		PRINT (Name, "type=%u req=%u failed=%u xact=%u naks=%u nyets=%u split_retries=%u "
+			     "lat_avg_us=%llu lat_median_us<%u lat_max_us=%u bounced=%u channel_waits=%u",
+		       pEP->ucType, pEP->nRequests, pEP->nFailedRequests,
+		       pEP->Counters.nTransactions, pEP->Counters.nNAKs, pEP->Counters.nNYETs,
+		       pEP->Counters.nSplitRetries,
+		       pEP->nRequests > 0 ? pEP->nLatencySum / pEP->nRequests : 0,
+		       2U << nMedian, pEP->nLatencyMax, pEP->nBouncedStages, pEP->nAllocationFailures);
+	}
+
+	if (pTraceFile != 0)
+	{
+		FILE *pFile = fopen (pTraceFile, "wb");
+		if (   pFile == 0
+		    || fwrite (s_Result.pTrace, 1, s_Result.nTraceSize, pFile) != s_Result.nTraceSize
+		    || fclose (pFile) != 0)
+		{
+			fprintf (stderr, "Cannot write %s\n", pTraceFile);
+
+			return 1;
+		}
+
+		PRINT ("trace_bytes", "%u", s_Result.nTraceSize);
+
+		free (s_Result.pTrace);
+	}
+
+	if (pCaptureFile != 0)
+	{
+		FILE *pFile = fopen (pCaptureFile, "wb");
+		if (   pFile == 0
+		    || fwrite (s_Result.pCapture, 1, s_Result.nCaptureSize, pFile) != s_Result.nCaptureSize
+		    || fclose (pFile) != 0)
+		{
+			fprintf (stderr, "Cannot write %s\n", pCaptureFile);
+
+			return 1;
+		}
+
+		PRINT ("capture_bytes", "%u", s_Result.nCaptureSize);
+		PRINT ("capture_dropped", "%u", s_Result.nCaptureDropped);
+
+		free (s_Result.pCapture);
+		free (s_Result.pCaptureRing);
+	}
+
+	return nResult;
+}
@@ -0,0 +1,163 @@
+//
+// dwc2core.h
+//
+// Simulated Synopsys DesignWare Hi-Speed USB 2.0 OTG controller (host mode, internal DMA)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_dwc2core_h
+#define _uspisim_dwc2core_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DWC2_DEFAULT_CHANNELS	8
+#define DWC2_MAX_CHANNELS	16
+#define DWC2_REGISTER_SPACE	0x1000		// bytes, relative to ARM_USB_BASE
+#define DWC2_TT_ENTRIES		16
+#define DWC2_TT_BUFFER_SIZE	1024
+#define DWC2_MAX_INJECTIONS	8
+
+#define DWC2_NO_EVENT		((u64) -1)
+
+typedef struct TDWC2Channel
+{
+	u32		m_nCharacter;
+	u32		m_nSplitControl;
+	u32		m_nInterrupt;
+	u32		m_nInterruptMask;
+	u32		m_nTransferSize;
+	u32		m_nDMAAddress;
+
+	boolean		m_bActive;		// a transaction is in progress
+	u64		m_nEventTime;		// next packet or halt is due at
+	boolean		m_bHaltPending;		// halt at m_nEventTime with m_nHaltStatus
+	u32		m_nHaltStatus;
+	unsigned	m_nFramePackets;	// periodic packets done in this (micro)frame
+}
+TDWC2Channel;
+
+// transaction translator buffer, holds the result of a full-/low-speed transaction
+typedef struct TDWC2TTEntry
+{
+	boolean		m_bValid;
+	u8		m_ucHubAddress;
+	u8		m_ucHubPort;
+	u8		m_ucDeviceAddress;
+	u8		m_ucEndpoint;
+	boolean		m_bIn;
+
+	boolean		m_bPending;		// result has not been fetched by a complete split
+	u64		m_nReadyTime;
+	TSimHandshake	m_Handshake;
+	u8		m_ucPID;
+	unsigned	m_nLength;
+	u8		m_Buffer[DWC2_TT_BUFFER_SIZE];
+}
+TDWC2TTEntry;
+
+// forces the next nCount transactions (or complete splits) to an endpoint to a handshake
+typedef struct TDWC2Injection
+{
+	u8		m_ucDeviceAddress;
+	u8		m_ucEndpoint;
+	TSimHandshake	m_Handshake;		// SimHandshakeNAK or SimHandshakeNYET
+	unsigned	m_nCount;
+}
+TDWC2Injection;
+
+typedef struct TDWC2Statistics
+{
+	unsigned	nChannelStarts;
+	unsigned	nPackets;		// including split tokens
+	u64		nBytes;
+	unsigned	nNAKs;			// received from devices
+	unsigned	nNAKRetries;		// non-periodic NAKs retried by the core
+	unsigned	nStartSplits;
+	unsigned	nCompleteSplits;
+	unsigned	nNYETs;
+	unsigned	nInjectedNAKs;
+	unsigned	nInjectedNYETs;
+	unsigned	nErrors;
+	unsigned	nFrames;		// SOFs generated (frames or microframes)
+}
+TDWC2Statistics;
+
+typedef struct TDWC2Core
+{
+	TSimDevice	*m_pRootDevice;
+	unsigned	 m_nChannels;
+
+	u32		 m_Register[DWC2_REGISTER_SPACE / 4];	// registers without special handling
+	TDWC2Channel	 m_Channel[DWC2_MAX_CHANNELS];
+
+	u32		 m_nHostPort;
+	boolean		 m_bPortReset;
+	u32		 m_nIntStatus;
+
+	u64		 m_nTime;				// in ns
+	u64		 m_nBusFreeTime;
+	u64		 m_nLastFrame;
+
+	TDWC2TTEntry	 m_TT[DWC2_TT_ENTRIES];
+	unsigned	 m_nNextTTEntry;
+
+	unsigned	 m_nNAKRate;				// per mille
+	unsigned	 m_nNYETRate;				// per mille
+	u32		 m_nRandom;
+	TDWC2Injection	 m_Injection[DWC2_MAX_INJECTIONS];
+
+	TDWC2Statistics	 m_Statistics;
+}
+TDWC2Core;
+
+// pRootDevice is connected to the root port (may be 0)
+void DWC2Core (TDWC2Core *pThis, unsigned nChannels, TSimDevice *pRootDevice);
+void _DWC2Core (TDWC2Core *pThis);
+
+// nOffset is relative to ARM_USB_BASE
+u32 DWC2CoreRead (TDWC2Core *pThis, unsigned nOffset);
+void DWC2CoreWrite (TDWC2Core *pThis, unsigned nOffset, u32 nValue);
+
+// process all events up to virtual time nTime (in ns)
+void DWC2CoreAdvance (TDWC2Core *pThis, u64 nTime);
+
+// returns the time of the next internal event or DWC2_NO_EVENT
+u64 DWC2CoreGetNextEventTime (TDWC2Core *pThis);
+
+// returns TRUE if the interrupt line is asserted
+boolean DWC2CoreIRQPending (TDWC2Core *pThis);
+
+// fault injection: rates are per mille of data transactions (NAK) and complete splits (NYET)
+void DWC2CoreSetFaultRates (TDWC2Core *pThis, unsigned nNAKPerMille, unsigned nNYETPerMille, u32 nSeed);
+boolean DWC2CoreInject (TDWC2Core *pThis, u8 ucDeviceAddress, u8 ucEndpoint,
+			TSimHandshake Handshake, unsigned nCount);
+
+const TDWC2Statistics *DWC2CoreGetStatistics (TDWC2Core *pThis);
+
+// returns the current (micro)frame number, as it is reported in HFNUM
+unsigned DWC2CoreGetFrameNumber (TDWC2Core *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+//
+// simdevice.h
+//
+// Base class of the simulated USB devices
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simdevice_h
+#define _uspisim_simdevice_h
+
+#include <uspi/usb.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_MAX_ENDPOINTS		16
+#define SIM_MAX_PORTS			7
+#define SIM_CONTROL_BUFFER_SIZE		1024
+
+// Handshake of a simulated transaction
+typedef enum
+{
+	SimHandshakeACK,
+	SimHandshakeNAK,
+	SimHandshakeSTALL,
+	SimHandshakeNYET,
+	SimHandshakeNone			// no response (timeout)
+}
+TSimHandshake;
+
+typedef enum
+{
+	SimControlIdle,
+	SimControlDataIn,
+	SimControlDataOut,
+	SimControlStatusIn,
+	SimControlStatusOut
+}
+TSimControlStage;
+
+typedef struct TSimDevice
+{
+	// "virtual" methods (set by the derived class, may be 0 if not used)
+	void (*_SimDevice) (struct TSimDevice *pThis);
+
+	// handles all requests, which are not handled by the base class
+	// for IN requests fill pData with max. *pLength bytes and set *pLength to the result length,
+	// for OUT requests *pLength bytes have been received in pData
+	TSimHandshake (*Request) (struct TSimDevice *pThis, const TSetupData *pSetup,
+				  u8 *pData, unsigned *pLength);
+
+	// nEndpoint is 1..15, *pLength is the max. packet size on entry
+	TSimHandshake (*DataIn) (struct TSimDevice *pThis, unsigned nEndpoint,
+				 u8 *pBuffer, unsigned *pLength);
+	TSimHandshake (*DataOut) (struct TSimDevice *pThis, unsigned nEndpoint,
+				  const u8 *pBuffer, unsigned nLength);
+
+	void (*BusReset) (struct TSimDevice *pThis);
+
+	TUSBSpeed			 m_Speed;
+	const TUSBDeviceDescriptor	*m_pDeviceDesc;
+	const TUSBConfigurationDescriptor *m_pConfigDesc;	// followed by the other descriptors
+	const char * const		*m_ppStrings;		// index 1..n, 0-terminated (may be 0)
+
+	boolean				 m_bEnabled;		// port is enabled
+	u8				 m_ucAddress;
+	u8				 m_ucPendingAddress;
+	u8				 m_ucConfiguration;
+
+	TSimControlStage		 m_ControlStage;
+	TSetupData			 m_Setup;
+	u8				 m_ControlBuffer[SIM_CONTROL_BUFFER_SIZE];
+	unsigned			 m_nControlLength;
+	unsigned			 m_nControlOffset;
+	boolean				 m_bControlShortPacket;
+	TSimHandshake			 m_ControlStatus;
+
+	u16				 m_usToggle[2];		// [bIn], one bit per endpoint
+	u16				 m_usHalted[2];		// [bIn], one bit per endpoint
+	u16				 m_usIsochronous[2];	// [bIn], one bit per endpoint
+
+	unsigned			 m_nPorts;		// only used by hubs
+	struct TSimDevice		*m_pPort[SIM_MAX_PORTS];
+
+	unsigned			 m_nToggleErrors;
+}
+TSimDevice;
+
+void SimDevice (TSimDevice *pThis, TUSBSpeed Speed,
+		const TUSBDeviceDescriptor *pDeviceDesc,
+		const TUSBConfigurationDescriptor *pConfigDesc,
+		const char * const *ppStrings);
+void _SimDevice (TSimDevice *pThis);
+
+// called by the simulated host controller
+
+void SimDeviceBusReset (TSimDevice *pThis);		// port reset, device enters default state
+void SimDeviceDisable (TSimDevice *pThis);		// port disabled, recursive
+
+TSimHandshake SimDeviceSetup (TSimDevice *pThis, const void *pPacket, unsigned nLength);
+
+// ucPID is the expected DATA0/1 toggle (0 or 1, ignored for endpoint 0), returned in *pPID
+TSimHandshake SimDeviceIn (TSimDevice *pThis, unsigned nEndpoint, u8 ucPID,
+			   u8 *pBuffer, unsigned nMaxPacketSize, unsigned *pLength, u8 *pPID);
+TSimHandshake SimDeviceOut (TSimDevice *pThis, unsigned nEndpoint, u8 ucPID,
+			    const u8 *pBuffer, unsigned nLength);
+
+// searches the device tree below (and including) pThis for an enabled device with this address
+TSimDevice *SimDeviceFind (TSimDevice *pThis, u8 ucAddress);
+
+// returns the device connected to port nPort (1..n) of a hub or 0
+TSimDevice *SimDeviceGetPort (TSimDevice *pThis, unsigned nPort);
+
+u8 SimDeviceGetAddress (TSimDevice *pThis);
+TUSBSpeed SimDeviceGetSpeed (TSimDevice *pThis);
+boolean SimDeviceIsConfigured (TSimDevice *pThis);
+
+// set or clear the halt condition of an endpoint
+void SimDeviceSetHalt (TSimDevice *pThis, unsigned nEndpoint, boolean bIn, boolean bHalt);
+
+// called by the derived class, isochronous endpoints use DATA0 only and are not toggled
+void SimDeviceSetIsochronous (TSimDevice *pThis, unsigned nEndpoint, boolean bIn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
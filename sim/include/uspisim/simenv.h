@@ -0,0 +1,73 @@
+//
+// simenv.h
+//
+// Host environment for the USPi library (implements the functions from uspios.h)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simenv_h
+#define _uspisim_simenv_h
+
+#include <uspisim/dwc2core.h>
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_DEFAULT_MMIO_COST	100		// ns per register access
+#define SIM_CACHE_LINE_LENGTH	64		// for counting cache maintenance operations
+
+typedef struct TSimStatistics
+{
+	u64		nMMIOReads;
+	u64		nMMIOWrites;
+	unsigned	nIRQs;
+	unsigned	nFIQs;			// only with USPI_USE_FIQ
+	unsigned	nTimerIRQs;
+	u64		nIdleTime;		// virtual time spent waiting for an event (ns)
+	u64		nCacheLinesCleaned;	// by cache maintenance for DMA
+	u64		nCacheLinesInvalidated;
+}
+TSimStatistics;
+
+// must be called first, before any memory is allocated
+void SimInitialize (void);
+
+// connects pRootDevice (may be 0) to the root port of a simulated core with nChannels channels
+void SimAttach (TSimDevice *pRootDevice, unsigned nChannels);
+
+// runs pMain on a thread with a stack in low memory (DMA addresses are 32-bit),
+// returns the return value of pMain
+int SimRun (int (*pMain) (void *pParam), void *pParam);
+
+TDWC2Core *SimGetCore (void);
+
+u64 SimGetTime (void);				// virtual time in ns
+void SimAdvance (u64 nNanoSeconds);		// let virtual time pass (may run interrupt handlers)
+
+void SimSetLogLevel (unsigned nLevel);		// LOG_ERROR..LOG_DEBUG, default LOG_NOTICE
+void SimSetMMIOCost (unsigned nNanoSeconds);
+
+void SimGetStatistics (TSimStatistics *pStatistics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
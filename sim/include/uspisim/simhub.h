@@ -0,0 +1,61 @@
+//
+// simhub.h
+//
+// Simulated USB hub with transaction translator(s)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simhub_h
+#define _uspisim_simhub_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/usbhub.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct TSimHub
+{
+	TSimDevice		m_Device;
+
+	boolean			m_bMultiTT;
+
+	TUSBDeviceDescriptor	m_DeviceDesc;
+	u8			m_ConfigDesc[64];
+
+	TUSBPortStatus		m_PortStatus[SIM_MAX_PORTS];
+
+	unsigned		m_nTTResets;
+}
+TSimHub;
+
+// Speed must be USBSpeedHigh for a hub with transaction translator(s)
+void SimHub (TSimHub *pThis, TUSBSpeed Speed, unsigned nPorts, boolean bMultiTT);
+void _SimHub (TSimDevice *pDevice);
+
+// attach device to port nPort (1..n) before the simulation starts
+void SimHubAttach (TSimHub *pThis, unsigned nPort, TSimDevice *pDevice);
+
+boolean SimHubIsMultiTT (TSimHub *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
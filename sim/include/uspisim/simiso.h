@@ -0,0 +1,74 @@
+//
+// simiso.h
+//
+// Simulated high-speed device with an isochronous IN and OUT endpoint
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simiso_h
+#define _uspisim_simiso_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_ISO_PACKET_SIZE	512
+#define SIM_ISO_EP_IN		1
+#define SIM_ISO_EP_OUT		2
+
+// Each packet starts with this header. IN packets report the (micro)frame, in which they
+// have been sent. OUT packets have to contain a consecutive sequence number.
+typedef struct TSimIsoHeader
+{
+	u32	nSequence;
+	u32	nFrame;
+}
+PACKED TSimIsoHeader;
+
+typedef struct TSimIso
+{
+	TSimDevice		m_Device;
+
+	TUSBDeviceDescriptor	m_DeviceDesc;
+	u8			m_ConfigDesc[64];
+
+	unsigned		m_nInSequence;
+
+	unsigned		m_nOutPackets;
+	unsigned		m_nOutGaps;		// packet not in the (micro)frame after the previous one
+	unsigned		m_nOutErrors;		// wrong sequence number or length
+	unsigned		m_nOutLastFrame;
+	u32			m_nOutLastSequence;
+}
+TSimIso;
+
+void SimIso (TSimIso *pThis);
+void _SimIso (TSimDevice *pDevice);
+
+unsigned SimIsoGetInPackets (TSimIso *pThis);
+unsigned SimIsoGetOutPackets (TSimIso *pThis);
+unsigned SimIsoGetOutGaps (TSimIso *pThis);
+unsigned SimIsoGetOutErrors (TSimIso *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
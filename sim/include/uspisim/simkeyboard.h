@@ -0,0 +1,70 @@
+//
+// simkeyboard.h
+//
+// Simulated USB keyboard (HID boot protocol)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simkeyboard_h
+#define _uspisim_simkeyboard_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_KEYBOARD_REPORT_SIZE	8
+#define SIM_KEYBOARD_QUEUE_SIZE		64
+
+typedef struct TSimKeyboard
+{
+	TSimDevice		m_Device;
+
+	TUSBDeviceDescriptor	m_DeviceDesc;
+	u8			m_ConfigDesc[64];
+
+	u8			m_Queue[SIM_KEYBOARD_QUEUE_SIZE][SIM_KEYBOARD_REPORT_SIZE];
+	u64			m_QueueTime[SIM_KEYBOARD_QUEUE_SIZE];	// report is available from
+	unsigned		m_nInPtr;
+	unsigned		m_nOutPtr;
+
+	u8			m_ucLEDs;
+	unsigned		m_nReportsSent;
+	u64			m_nLatencySum;				// in ns
+	u64			m_nLatencyMax;
+}
+TSimKeyboard;
+
+void SimKeyboard (TSimKeyboard *pThis, TUSBSpeed Speed);
+void _SimKeyboard (TSimDevice *pDevice);
+
+// queue a key press (and release) of the key with usage ID ucKeyCode at virtual time nTime (ns)
+boolean SimKeyboardPressKey (TSimKeyboard *pThis, u8 ucModifiers, u8 ucKeyCode, u64 nTime);
+
+u8 SimKeyboardGetLEDs (TSimKeyboard *pThis);
+
+unsigned SimKeyboardGetReportsSent (TSimKeyboard *pThis);
+u64 SimKeyboardGetAverageLatency (TSimKeyboard *pThis);		// in ns
+u64 SimKeyboardGetMaxLatency (TSimKeyboard *pThis);		// in ns
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+//
+// simmsd.h
+//
+// Simulated USB mass storage device (bulk-only transport, RAM disk)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simmsd_h
+#define _uspisim_simmsd_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+	SimMSDStateCommand,		// waiting for CBW
+	SimMSDStateDataIn,
+	SimMSDStateDataOut,
+	SimMSDStateStatus,		// CSW will be sent
+	SimMSDStateUnknown
+}
+TSimMSDState;
+
+typedef struct TSimMSD
+{
+	TSimDevice		m_Device;
+
+	TUSBDeviceDescriptor	m_DeviceDesc;
+	u8			m_ConfigDesc[64];
+
+	u8			*m_pDisk;
+	unsigned		m_nBlocks;
+	unsigned		m_nBlockSize;
+	u64			m_nVirtualBlocks;	// reported capacity (>= m_nBlocks)
+	u32			m_nMaxTransfer;		// blocks per command (0: no limit)
+	u32			m_nOptimalTransfer;	// blocks (0: not reported)
+	boolean			m_bBlockLimits;		// report SPC-3 and Block Limits VPD page
+
+	u64			m_nMediaLatency;	// per command in ns
+	u64			m_nCommitLatency;	// write cache to media in ns
+	u64			m_nCommandLatency;	// of the current command
+	u64			m_nReadyTime;		// data or status phase may start from
+	boolean			m_bDirty;		// write cache contains data
+
+	TSimMSDState		m_State;
+	u32			m_nTag;
+	u32			m_nDataLength;		// from CBW
+	u8			*m_pData;		// data phase buffer
+	unsigned		m_nDataOffset;
+	unsigned		m_nDataSize;		// valid bytes in data phase buffer
+	u8			m_ucStatus;		// CSW status
+
+	u8			m_Response[64];		// for non-block commands
+	u8			m_ucSenseKey;
+	u8			m_ucASC;
+
+	unsigned		m_nCommands;
+	unsigned		m_nCommits;		// FUA writes and flushes of a dirty cache
+	u64			m_nBlocksRead;
+	u64			m_nBlocksWritten;
+}
+TSimMSD;
+
+// the RAM disk is allocated from the heap (nBlocks * nBlockSize bytes)
+void SimMSD (TSimMSD *pThis, TUSBSpeed Speed, unsigned nBlocks, unsigned nBlockSize);
+void _SimMSD (TSimDevice *pDevice);
+
+// delay between receipt of a command and its data or status phase (default 0)
+void SimMSDSetMediaLatency (TSimMSD *pThis, u64 nNanoSeconds);
+
+// report a capacity of nBlocks (a multiple of the RAM disk size), the RAM disk is mirrored
+// over it, so that large disks (READ(16), WRITE(16)) can be tested
+void SimMSDSetVirtualBlocks (TSimMSD *pThis, u64 nBlocks);
+
+// the device has a write cache, writing it to the media (on a write with FUA or on
+// SYNCHRONIZE CACHE) takes this time in addition to the media latency (default 0)
+void SimMSDSetCommitLatency (TSimMSD *pThis, u64 nNanoSeconds);
+
+// report SPC-3 and the Block Limits VPD page with these transfer lengths (in blocks, 0: not
+// reported), commands with more than nMaxBlocks blocks fail (default: SPC-2 and no limits)
+void SimMSDSetBlockLimits (TSimMSD *pThis, u32 nMaxBlocks, u32 nOptimalBlocks);
+
+u8 *SimMSDGetDisk (TSimMSD *pThis);
+
+unsigned SimMSDGetCommands (TSimMSD *pThis);
+unsigned SimMSDGetCommits (TSimMSD *pThis);
+u64 SimMSDGetBlocksRead (TSimMSD *pThis);
+u64 SimMSDGetBlocksWritten (TSimMSD *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
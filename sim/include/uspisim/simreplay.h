@@ -0,0 +1,153 @@
+//
+// simreplay.h
+//
+// Simulated USB device, which replays the traffic of a device recorded with USPiCaptureStart()
+// (or with usbmon on Linux) from a pcap file (LINKTYPE_USB_LINUX_MMAPPED)
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _uspisim_simreplay_h
+#define _uspisim_simreplay_h
+
+#include <uspisim/simdevice.h>
+#include <uspi/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIM_REPLAY_MAX_DEVICES		127
+#define SIM_REPLAY_MAX_STRINGS		16
+
+// Linux error numbers in the capture
+#define SIM_REPLAY_EINPROGRESS		115
+#define SIM_REPLAY_EPIPE		32
+
+typedef struct TSimCaptureRecord		// one usbmon event
+{
+	u64		nID;			// URB
+	u64		nTime;			// ns since the first record
+	char		chType;			// 'S', 'C' or 'E'
+	u8		ucTransferType;		// 0: isochronous, 1: interrupt, 2: control, 3: bulk
+	u8		ucEndpoint;		// bit 7 set for IN
+	u8		ucDevice;
+	boolean		bSetup;
+	u8		Setup[8];
+	int		nStatus;		// Linux error number (negative) or 0
+	u32		nLength;		// of the request (submit) or of the transferred data
+	u32		nCaptured;		// bytes at pData (may be less than nLength)
+	const u8	*pData;
+}
+TSimCaptureRecord;
+
+typedef struct TSimCapture
+{
+	u8			*m_pFile;	// file contents, the records point into it
+	TSimCaptureRecord	*m_pRecord;
+	unsigned		 m_nRecords;
+}
+TSimCapture;
+
+// returns FALSE if the file cannot be read or has an unsupported format
+boolean SimCapture (TSimCapture *pThis, const char *pFileName);
+void _SimCapture (TSimCapture *pThis);
+
+// returns the index of the submit record of the completion record nRecord or -1
+int SimCaptureFindSubmit (TSimCapture *pThis, unsigned nRecord);
+
+// returns the device descriptor, which has been read from the device with this address, or 0
+const TUSBDeviceDescriptor *SimCaptureGetDeviceDescriptor (TSimCapture *pThis, u8 ucAddress);
+
+// returns the longest configuration descriptor read from the device or 0
+const TUSBConfigurationDescriptor *SimCaptureGetConfigDescriptor (TSimCapture *pThis, u8 ucAddress);
+
+// guesses the speed of the device from its descriptors (usbmon does not record it)
+TUSBSpeed SimCaptureGuessSpeed (TSimCapture *pThis, u8 ucAddress);
+
+typedef struct TSimReplayTransfer		// of a bulk or interrupt endpoint
+{
+	const u8	*pData;			// recorded data (OUT: for comparison)
+	u32		 nLength;
+	u32		 nCaptured;		// bytes beyond are replayed as zero
+	boolean		 bShort;		// shorter than requested, must end with a short packet
+	boolean		 bStall;
+	u64		 nDuration;		// ns from submit (or previous completion) to completion
+}
+TSimReplayTransfer;
+
+typedef struct TSimReplayEndpoint
+{
+	TSimReplayTransfer	*pTransfer;
+	unsigned		 nTransfers;
+	unsigned		 nNext;		// transfer to be replayed next
+	unsigned		 nOffset;	// in the current transfer
+	boolean			 bStarted;	// the current transfer has been polled
+	u64			 nStartTime;	// first poll of the current transfer
+	u64			 nLastPacketTime;
+	u64			 nPacketInterval;	// measured average (ns) or 0
+}
+TSimReplayEndpoint;
+
+typedef struct TSimReplayControl		// class or vendor request
+{
+	TSetupData	 Setup;
+	const u8	*pData;			// IN data
+	u32		 nLength;
+	u32		 nCaptured;
+	boolean		 bStall;
+	boolean		 bReplayed;
+}
+TSimReplayControl;
+
+typedef struct TSimReplay
+{
+	TSimDevice		m_Device;
+
+	TUSBDeviceDescriptor	m_DeviceDesc;
+	u8			m_ConfigDesc[SIM_CONTROL_BUFFER_SIZE];
+	char			m_String[SIM_REPLAY_MAX_STRINGS][128];
+	const char		*m_pString[SIM_REPLAY_MAX_STRINGS+1];
+
+	TSimReplayControl	*m_pControl;
+	unsigned		 m_nControls;
+
+	TSimReplayEndpoint	 m_Endpoint[2][SIM_MAX_ENDPOINTS];	// [bIn]
+	boolean			 m_bTiming;
+
+	unsigned		 m_nMismatches;		// OUT data differs from the recording
+	unsigned		 m_nUnmatched;		// requests, which have not been recorded
+}
+TSimReplay;
+
+// the device with address ucAddress in the capture is replayed, the capture must be valid as
+// long as the device is used, with bTiming the device delays (NAK) the first packet of each
+// transfer, so that the transfer takes as long as recorded, if the simulated bus is as fast
+// as the recorded one, returns FALSE if the device is not found
+boolean SimReplay (TSimReplay *pThis, TSimCapture *pCapture, u8 ucAddress,
+		   TUSBSpeed Speed, boolean bTiming);
+void _SimReplay (TSimDevice *pDevice);
+
+unsigned SimReplayGetTransfers (TSimReplay *pThis);	// recorded bulk and interrupt transfers
+unsigned SimReplayGetReplayed (TSimReplay *pThis);	// of them
+unsigned SimReplayGetMismatches (TSimReplay *pThis);
+unsigned SimReplayGetUnmatched (TSimReplay *pThis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
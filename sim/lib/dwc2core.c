@@ -0,0 +1,1074 @@
+//
+// dwc2core.c
+//
+// The model works on transaction level. Each enabled channel executes one packet per event
+// (serialized on the bus) and halts with the status, which the real controller reports.
+// Non-periodic NAKs are retried internally, split transactions are handled by a simple
+// transaction translator model, which is located in the core (not in the simulated hub).
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/dwc2core.h>
+#include <uspi/dwhci.h>
+#include <string.h>
+#include <assert.h>
+
+#define REG(addr)		((addr) - ARM_USB_BASE)
+#define CHAN_REG(addr)		((addr) - DWHCI_HOST_CHAN_CHARACTER (0))
+
+#define CHAN_REGS_START		REG (DWHCI_HOST_CHAN_CHARACTER (0))
+#define CHAN_REGS_END		REG (DWHCI_HOST_CHAN_CHARACTER (DWC2_MAX_CHANNELS))
+#define CHAN_REGS_SIZE		0x20
+
+#define VENDOR_ID		0x4F54280A
+
+#define CHANNEL_START_DELAY	1000		// ns, non-periodic
+#define NAK_RETRY_DELAY		1000		// ns
+#define HUB_DELAY		10000		// ns, TT processing time (non-periodic)
+#define TIMEOUT_DELAY		1000		// ns, no response from device
+
+#define HIGH_SPEED_FRAME	125000		// ns, micro frame
+#define FULL_SPEED_FRAME	1000000		// ns
+
+#define PORT_CHANGE_MASK	(  DWHCI_HOST_PORT_CONNECT_CHANGED	\
+				 | DWHCI_HOST_PORT_ENABLE_CHANGED	\
+				 | DWHCI_HOST_PORT_OVERCURRENT_CHANGED)
+
+#define INT_STAT_CUR_MODE_HOST	(1 << 0)
+
+static void DWC2CoreStartChannel (TDWC2Core *pThis, TDWC2Channel *pChannel);
+static void DWC2CoreProcessChannel (TDWC2Core *pThis, TDWC2Channel *pChannel);
+static boolean DWC2CoreTransaction (TDWC2Core *pThis, TDWC2Channel *pChannel,
+				    u64 *pDuration, u32 *pStatus);
+static boolean DWC2CoreSplitTransaction (TDWC2Core *pThis, TDWC2Channel *pChannel,
+					 u64 *pDuration, u32 *pStatus);
+static TUSBSpeed DWC2CoreGetRootSpeed (TDWC2Core *pThis);
+static u64 DWC2CoreGetFramePeriod (TDWC2Core *pThis);
+static unsigned DWC2CoreGetMultiCount (TDWC2Channel *pChannel);
+static boolean DWC2CoreInjected (TDWC2Core *pThis, u8 ucDeviceAddress, u8 ucEndpoint,
+				 TSimHandshake Handshake);
+static u32 DWC2CoreGetChannelInterrupts (TDWC2Core *pThis);
+static u64 PacketTime (TUSBSpeed Speed, unsigned nLength);
+
+void DWC2Core (TDWC2Core *pThis, unsigned nChannels, TSimDevice *pRootDevice)
+{
+	assert (pThis != 0);
+	assert (4 <= nChannels && nChannels <= DWC2_MAX_CHANNELS);
+
+	memset (pThis, 0, sizeof *pThis);
+
+	pThis->m_pRootDevice = pRootDevice;
+	pThis->m_nChannels = nChannels;
+
+	pThis->m_nRandom = 1;
+}
+
+void _DWC2Core (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	pThis->m_pRootDevice = 0;
+}
+
+u32 DWC2CoreRead (TDWC2Core *pThis, unsigned nOffset)
+{
+	assert (pThis != 0);
+	assert (nOffset < DWC2_REGISTER_SPACE);
+	assert ((nOffset & 3) == 0);
+
+	if (CHAN_REGS_START <= nOffset && nOffset < CHAN_REGS_END)
+	{
+		TDWC2Channel *pChannel = &pThis->m_Channel[(nOffset - CHAN_REGS_START) / CHAN_REGS_SIZE];
+
+		switch ((nOffset - CHAN_REGS_START) % CHAN_REGS_SIZE)
+		{
+		case CHAN_REG (DWHCI_HOST_CHAN_CHARACTER (0)):
+			return   (pChannel->m_nCharacter & ~DWHCI_HOST_CHAN_CHARACTER_ENABLE)
+			       | (pChannel->m_bActive ? DWHCI_HOST_CHAN_CHARACTER_ENABLE : 0);
+
+		case CHAN_REG (DWHCI_HOST_CHAN_SPLIT_CTRL (0)):	return pChannel->m_nSplitControl;
+		case CHAN_REG (DWHCI_HOST_CHAN_INT (0)):	return pChannel->m_nInterrupt;
+		case CHAN_REG (DWHCI_HOST_CHAN_INT_MASK (0)):	return pChannel->m_nInterruptMask;
+		case CHAN_REG (DWHCI_HOST_CHAN_XFER_SIZ (0)):	return pChannel->m_nTransferSize;
+		case CHAN_REG (DWHCI_HOST_CHAN_DMA_ADDR (0)):	return pChannel->m_nDMAAddress;
+
+		default:
+			return 0;
+		}
+	}
+
+	switch (nOffset)
+	{
+	case REG (DWHCI_CORE_VENDOR_ID):
+		return VENDOR_ID;
+
+	case REG (DWHCI_CORE_HW_CFG2):
+		return   (2 << 3)						// internal DMA
+		       | (DWHCI_CORE_HW_CFG2_HS_PHY_TYPE_UTMI << 6)
+		       | ((pThis->m_nChannels-1) << 14);
+
+	case REG (DWHCI_CORE_HW_CFG3):
+		return 4096 << 16;
+
+	case REG (DWHCI_CORE_RESET):
+		return DWHCI_CORE_RESET_AHB_IDLE;			// all operations complete at once
+
+	case REG (DWHCI_CORE_INT_STAT): {
+		u32 nStatus = pThis->m_nIntStatus | INT_STAT_CUR_MODE_HOST;
+
+		if (DWC2CoreGetChannelInterrupts (pThis) & pThis->m_Register[REG (DWHCI_HOST_ALLCHAN_INT_MASK) / 4])
+		{
+			nStatus |= DWHCI_CORE_INT_STAT_HC_INTR;
+		}
+
+		if (pThis->m_nHostPort & PORT_CHANGE_MASK)
+		{
+			nStatus |= DWHCI_CORE_INT_STAT_PORT_INTR;
+		}
+
+		return nStatus;
+		}
+
+	case REG (DWHCI_HOST_FRM_NUM): {
+		u64 nPeriod = DWC2CoreGetFramePeriod (pThis);
+		u32 nNumber = DWC2CoreGetFrameNumber (pThis);
+		u32 nRemaining = (u32) ((nPeriod - pThis->m_nTime % nPeriod) * 60 / 1000);	// 60 MHz
+
+		return nRemaining << 16 | nNumber;
+		}
+
+	case REG (DWHCI_HOST_ALLCHAN_INT):
+		return DWC2CoreGetChannelInterrupts (pThis);
+
+	case REG (DWHCI_HOST_PORT): {
+		u32 nPort = pThis->m_nHostPort;
+
+		if (   pThis->m_pRootDevice != 0
+		    && (nPort & DWHCI_HOST_PORT_POWER))
+		{
+			nPort |= DWHCI_HOST_PORT_CONNECT;
+		}
+
+		return nPort;
+		}
+
+	default:
+		return pThis->m_Register[nOffset / 4];
+	}
+}
+
+void DWC2CoreWrite (TDWC2Core *pThis, unsigned nOffset, u32 nValue)
+{
+	assert (pThis != 0);
+	assert (nOffset < DWC2_REGISTER_SPACE);
+	assert ((nOffset & 3) == 0);
+
+	if (CHAN_REGS_START <= nOffset && nOffset < CHAN_REGS_END)
+	{
+		unsigned nChannel = (nOffset - CHAN_REGS_START) / CHAN_REGS_SIZE;
+		assert (nChannel < pThis->m_nChannels);
+		TDWC2Channel *pChannel = &pThis->m_Channel[nChannel];
+
+		switch ((nOffset - CHAN_REGS_START) % CHAN_REGS_SIZE)
+		{
+		case CHAN_REG (DWHCI_HOST_CHAN_CHARACTER (0)):
+			pChannel->m_nCharacter = nValue & ~(  DWHCI_HOST_CHAN_CHARACTER_ENABLE
+							    | DWHCI_HOST_CHAN_CHARACTER_DISABLE);
+
+			if (!pChannel->m_bActive)
+			{
+				if (nValue & DWHCI_HOST_CHAN_CHARACTER_ENABLE)
+				{
+					DWC2CoreStartChannel (pThis, pChannel);
+				}
+			}
+			else if (   (nValue & DWHCI_HOST_CHAN_CHARACTER_DISABLE)
+				 && !pChannel->m_bHaltPending)
+			{
+				// halt at the end of the current packet
+				pChannel->m_bHaltPending = TRUE;
+				pChannel->m_nHaltStatus = DWHCI_HOST_CHAN_INT_HALTED;
+
+				u64 nTime = pThis->m_nTime;
+				if (pThis->m_nBusFreeTime > nTime)
+				{
+					nTime = pThis->m_nBusFreeTime;
+				}
+				pChannel->m_nEventTime = nTime + CHANNEL_START_DELAY;
+			}
+			break;
+
+		case CHAN_REG (DWHCI_HOST_CHAN_SPLIT_CTRL (0)):
+			pChannel->m_nSplitControl = nValue;
+			break;
+
+		case CHAN_REG (DWHCI_HOST_CHAN_INT (0)):
+			pChannel->m_nInterrupt &= ~nValue;
+			break;
+
+		case CHAN_REG (DWHCI_HOST_CHAN_INT_MASK (0)):
+			pChannel->m_nInterruptMask = nValue;
+			break;
+
+		case CHAN_REG (DWHCI_HOST_CHAN_XFER_SIZ (0)):
+			pChannel->m_nTransferSize = nValue;
+			break;
+
+		case CHAN_REG (DWHCI_HOST_CHAN_DMA_ADDR (0)):
+			pChannel->m_nDMAAddress = nValue;
+			break;
+
+		default:
+			break;
+		}
+
+		return;
+	}
+
+	switch (nOffset)
+	{
+	case REG (DWHCI_CORE_VENDOR_ID):
+	case REG (DWHCI_CORE_HW_CFG1):
+	case REG (DWHCI_CORE_HW_CFG2):
+	case REG (DWHCI_CORE_HW_CFG3):
+	case REG (DWHCI_CORE_HW_CFG4):
+	case REG (DWHCI_HOST_FRM_NUM):
+	case REG (DWHCI_HOST_ALLCHAN_INT):			// derived from channel interrupts
+		break;
+
+	case REG (DWHCI_CORE_RESET):
+		if (nValue & DWHCI_CORE_RESET_SOFT_RESET)
+		{
+			for (unsigned nChannel = 0; nChannel < DWC2_MAX_CHANNELS; nChannel++)
+			{
+				memset (&pThis->m_Channel[nChannel], 0, sizeof (TDWC2Channel));
+			}
+
+			pThis->m_nIntStatus = 0;
+			pThis->m_Register[REG (DWHCI_CORE_INT_MASK) / 4] = 0;
+			pThis->m_Register[REG (DWHCI_HOST_ALLCHAN_INT_MASK) / 4] = 0;
+		}
+		break;
+
+	case REG (DWHCI_CORE_INT_STAT):
+		pThis->m_nIntStatus &= ~nValue;
+		break;
+
+	case REG (DWHCI_HOST_PORT): {
+		u32 nOld = pThis->m_nHostPort;
+
+		pThis->m_nHostPort &= ~(nValue & PORT_CHANGE_MASK);
+
+		if (   (nValue & DWHCI_HOST_PORT_ENABLE)
+		    && (nOld & DWHCI_HOST_PORT_ENABLE))
+		{
+			pThis->m_nHostPort &= ~DWHCI_HOST_PORT_ENABLE;
+			pThis->m_nHostPort |= DWHCI_HOST_PORT_ENABLE_CHANGED;
+
+			if (pThis->m_pRootDevice != 0)
+			{
+				SimDeviceDisable (pThis->m_pRootDevice);
+			}
+		}
+
+		if (nValue & DWHCI_HOST_PORT_POWER)
+		{
+			if (   !(nOld & DWHCI_HOST_PORT_POWER)
+			    && pThis->m_pRootDevice != 0)
+			{
+				pThis->m_nHostPort |= DWHCI_HOST_PORT_CONNECT_CHANGED;
+			}
+
+			pThis->m_nHostPort |= DWHCI_HOST_PORT_POWER;
+		}
+		else if (nOld & DWHCI_HOST_PORT_POWER)
+		{
+			pThis->m_nHostPort &= ~(DWHCI_HOST_PORT_POWER | DWHCI_HOST_PORT_ENABLE);
+
+			if (pThis->m_pRootDevice != 0)
+			{
+				SimDeviceDisable (pThis->m_pRootDevice);
+			}
+		}
+
+		if (nValue & DWHCI_HOST_PORT_RESET)
+		{
+			pThis->m_nHostPort |= DWHCI_HOST_PORT_RESET;
+		}
+		else if (nOld & DWHCI_HOST_PORT_RESET)
+		{
+			// reset is de-asserted, port is enabled, if a device is connected
+			pThis->m_nHostPort &= ~(DWHCI_HOST_PORT_RESET | (3 << 17));
+
+			if (   pThis->m_pRootDevice != 0
+			    && (pThis->m_nHostPort & DWHCI_HOST_PORT_POWER))
+			{
+				u32 nSpeed = DWHCI_HOST_PORT_SPEED_HIGH;
+				switch (SimDeviceGetSpeed (pThis->m_pRootDevice))
+				{
+				case USBSpeedFull:	nSpeed = DWHCI_HOST_PORT_SPEED_FULL;	break;
+				case USBSpeedLow:	nSpeed = DWHCI_HOST_PORT_SPEED_LOW;	break;
+				default:						break;
+				}
+
+				pThis->m_nHostPort |= DWHCI_HOST_PORT_ENABLE | nSpeed << 17;
+
+				SimDeviceBusReset (pThis->m_pRootDevice);
+				memset (pThis->m_TT, 0, sizeof pThis->m_TT);
+
+				pThis->m_nLastFrame = pThis->m_nTime / DWC2CoreGetFramePeriod (pThis);
+			}
+		}
+		} break;
+
+	default:
+		pThis->m_Register[nOffset / 4] = nValue;
+		break;
+	}
+}
+
+void DWC2CoreAdvance (TDWC2Core *pThis, u64 nTime)
+{
+	assert (pThis != 0);
+
+	while (1)
+	{
+		TDWC2Channel *pNext = 0;
+		for (unsigned nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
+		{
+			TDWC2Channel *pChannel = &pThis->m_Channel[nChannel];
+			if (   pChannel->m_bActive
+			    && pChannel->m_nEventTime <= nTime
+			    && (   pNext == 0
+				|| pChannel->m_nEventTime < pNext->m_nEventTime))
+			{
+				pNext = pChannel;
+			}
+		}
+
+		if (pNext == 0)
+		{
+			break;
+		}
+
+		if (pNext->m_nEventTime > pThis->m_nTime)
+		{
+			pThis->m_nTime = pNext->m_nEventTime;
+		}
+
+		DWC2CoreProcessChannel (pThis, pNext);
+	}
+
+	if (nTime > pThis->m_nTime)
+	{
+		pThis->m_nTime = nTime;
+	}
+
+	if (pThis->m_nHostPort & DWHCI_HOST_PORT_ENABLE)
+	{
+		u64 nFrame = pThis->m_nTime / DWC2CoreGetFramePeriod (pThis);
+		if (nFrame != pThis->m_nLastFrame)
+		{
+			assert (nFrame > pThis->m_nLastFrame);
+			pThis->m_Statistics.nFrames += (unsigned) (nFrame - pThis->m_nLastFrame);
+			pThis->m_nLastFrame = nFrame;
+
+			pThis->m_nIntStatus |= DWHCI_CORE_INT_STAT_SOF_INTR;
+		}
+	}
+}
+
+u64 DWC2CoreGetNextEventTime (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	u64 nResult = DWC2_NO_EVENT;
+
+	for (unsigned nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
+	{
+		TDWC2Channel *pChannel = &pThis->m_Channel[nChannel];
+		if (   pChannel->m_bActive
+		    && pChannel->m_nEventTime < nResult)
+		{
+			nResult = pChannel->m_nEventTime;
+		}
+	}
+
+	// the next SOF is only an event, if it can raise an interrupt
+	if (   (pThis->m_nHostPort & DWHCI_HOST_PORT_ENABLE)
+	    && (pThis->m_Register[REG (DWHCI_CORE_INT_MASK) / 4] & DWHCI_CORE_INT_MASK_SOF_INTR)
+	    && !(pThis->m_nIntStatus & DWHCI_CORE_INT_STAT_SOF_INTR))
+	{
+		u64 nPeriod = DWC2CoreGetFramePeriod (pThis);
+		u64 nNextFrame = (pThis->m_nTime / nPeriod + 1) * nPeriod;
+		if (nNextFrame < nResult)
+		{
+			nResult = nNextFrame;
+		}
+	}
+
+	return nResult;
+}
+
+boolean DWC2CoreIRQPending (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	if (!(pThis->m_Register[REG (DWHCI_CORE_AHB_CFG) / 4] & DWHCI_CORE_AHB_CFG_GLOBALINT_MASK))
+	{
+		return FALSE;
+	}
+
+	return   DWC2CoreRead (pThis, REG (DWHCI_CORE_INT_STAT))
+	       & pThis->m_Register[REG (DWHCI_CORE_INT_MASK) / 4] ? TRUE : FALSE;
+}
+
+void DWC2CoreSetFaultRates (TDWC2Core *pThis, unsigned nNAKPerMille, unsigned nNYETPerMille, u32 nSeed)
+{
+	assert (pThis != 0);
+	assert (nNAKPerMille <= 1000);
+	assert (nNYETPerMille <= 1000);
+
+	pThis->m_nNAKRate = nNAKPerMille;
+	pThis->m_nNYETRate = nNYETPerMille;
+	pThis->m_nRandom = nSeed != 0 ? nSeed : 1;
+}
+
+boolean DWC2CoreInject (TDWC2Core *pThis, u8 ucDeviceAddress, u8 ucEndpoint,
+			TSimHandshake Handshake, unsigned nCount)
+{
+	assert (pThis != 0);
+	assert (Handshake == SimHandshakeNAK || Handshake == SimHandshakeNYET);
+
+	for (unsigned i = 0; i < DWC2_MAX_INJECTIONS; i++)
+	{
+		TDWC2Injection *pInjection = &pThis->m_Injection[i];
+		if (pInjection->m_nCount == 0)
+		{
+			pInjection->m_ucDeviceAddress = ucDeviceAddress;
+			pInjection->m_ucEndpoint = ucEndpoint;
+			pInjection->m_Handshake = Handshake;
+			pInjection->m_nCount = nCount;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+const TDWC2Statistics *DWC2CoreGetStatistics (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+	return &pThis->m_Statistics;
+}
+
+unsigned DWC2CoreGetFrameNumber (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	return (unsigned) (pThis->m_nTime / DWC2CoreGetFramePeriod (pThis)) & DWHCI_MAX_FRAME_NUMBER;
+}
+
+static void DWC2CoreStartChannel (TDWC2Core *pThis, TDWC2Channel *pChannel)
+{
+	assert (pThis != 0);
+	assert (pChannel != 0);
+	assert (!pChannel->m_bActive);
+
+	pChannel->m_bActive = TRUE;
+	pChannel->m_bHaltPending = FALSE;
+	pChannel->m_nFramePackets = 0;
+	pThis->m_Statistics.nChannelStarts++;
+
+	unsigned nType =   (pChannel->m_nCharacter & DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK)
+			>> DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT;
+	if (   nType != DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_INTERRUPT
+	    && nType != DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO)
+	{
+		pChannel->m_nEventTime = pThis->m_nTime + CHANNEL_START_DELAY;
+
+		return;
+	}
+
+	// periodic transactions start in the next (micro)frame with the requested parity,
+	// or in the current one, if it matches and is not nearly over
+	u64 nPeriod = DWC2CoreGetFramePeriod (pThis);
+	u64 nFrame = pThis->m_nTime / nPeriod;
+	u64 nOdd = pChannel->m_nCharacter & DWHCI_HOST_CHAN_CHARACTER_PER_ODD_FRAME ? 1 : 0;
+
+	if (   (nFrame & 1) == nOdd
+	    && pThis->m_nTime - nFrame * nPeriod < nPeriod * 9 / 10)
+	{
+		pChannel->m_nEventTime = pThis->m_nTime;
+
+		return;
+	}
+
+	nFrame++;
+	if ((nFrame & 1) != nOdd)
+	{
+		nFrame++;
+	}
+
+	pChannel->m_nEventTime = nFrame * nPeriod;
+}
+
+static void DWC2CoreProcessChannel (TDWC2Core *pThis, TDWC2Channel *pChannel)
+{
+	assert (pThis != 0);
+	assert (pChannel != 0);
+	assert (pChannel->m_bActive);
+
+	if (pChannel->m_bHaltPending)
+	{
+		pChannel->m_nInterrupt |= pChannel->m_nHaltStatus;
+		pChannel->m_bHaltPending = FALSE;
+		pChannel->m_bActive = FALSE;
+
+		return;
+	}
+
+	if (pThis->m_nBusFreeTime > pThis->m_nTime)
+	{
+		pChannel->m_nEventTime = pThis->m_nBusFreeTime;
+
+		return;
+	}
+
+	u64 nDuration = 0;
+	u32 nStatus = 0;
+	boolean bContinue =   pChannel->m_nSplitControl & DWHCI_HOST_CHAN_SPLIT_CTRL_SPLIT_ENABLE
+			    ? DWC2CoreSplitTransaction (pThis, pChannel, &nDuration, &nStatus)
+			    : DWC2CoreTransaction (pThis, pChannel, &nDuration, &nStatus);
+
+	pThis->m_nBusFreeTime = pThis->m_nTime + nDuration;
+	pThis->m_Statistics.nPackets++;
+
+	if (bContinue)
+	{
+		assert (pChannel->m_nEventTime > pThis->m_nTime);
+
+		return;
+	}
+
+	if (nStatus & DWHCI_HOST_CHAN_INT_ERROR_MASK)
+	{
+		pThis->m_Statistics.nErrors++;
+	}
+
+	pChannel->m_bHaltPending = TRUE;
+	pChannel->m_nHaltStatus = nStatus;
+	pChannel->m_nEventTime = pThis->m_nBusFreeTime;
+}
+
+// executes a transaction with the device, returns the handshake
+static TSimHandshake DWC2CoreExecute (TDWC2Core *pThis, TSimDevice *pDevice, TDWC2Channel *pChannel,
+				      u8 *pBuffer, unsigned *pLength, u8 *pPID)
+{
+	assert (pThis != 0);
+	assert (pDevice != 0);
+	assert (pChannel != 0);
+
+	u32 nChar = pChannel->m_nCharacter;
+	unsigned nMaxPacketSize = nChar & DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK;
+	u8 ucEndpoint = (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__SHIFT;
+	u8 ucAddress =    (nChar & DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK)
+		       >> DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT;
+	unsigned nType = (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT;
+	boolean bIn = nChar & DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN ? TRUE : FALSE;
+
+	unsigned nBytes = pChannel->m_nTransferSize & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK;
+	unsigned nPID = DWHCI_HOST_CHAN_XFER_SIZ_PID (pChannel->m_nTransferSize);
+	u8 ucToggle = nPID == DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA1 ? 1 : 0;
+	*pPID = ucToggle;
+
+	if (   nType == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_CONTROL
+	    && nPID == DWHCI_HOST_CHAN_XFER_SIZ_PID_SETUP
+	    && !bIn)
+	{
+		*pLength = nBytes;
+		memcpy (pBuffer, (void *) (uintptr) pChannel->m_nDMAAddress, nBytes);
+
+		return SimDeviceSetup (pDevice, pBuffer, nBytes);
+	}
+
+	// isochronous transactions do not have a handshake, which could be a NAK
+	if (   nType != DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO
+	    && DWC2CoreInjected (pThis, ucAddress, ucEndpoint, SimHandshakeNAK))
+	{
+		pThis->m_Statistics.nInjectedNAKs++;
+		*pLength = 0;
+
+		return SimHandshakeNAK;
+	}
+
+	TSimHandshake Handshake;
+	if (bIn)
+	{
+		Handshake = SimDeviceIn (pDevice, ucEndpoint, ucToggle, pBuffer, nMaxPacketSize, pLength, pPID);
+	}
+	else
+	{
+		*pLength = nBytes < nMaxPacketSize ? nBytes : nMaxPacketSize;
+		memcpy (pBuffer, (void *) (uintptr) pChannel->m_nDMAAddress, *pLength);
+
+		Handshake = SimDeviceOut (pDevice, ucEndpoint, ucToggle, pBuffer, *pLength);
+		if (Handshake == SimHandshakeNYET)
+		{
+			Handshake = SimHandshakeACK;		// data has been accepted
+		}
+	}
+
+	if (Handshake == SimHandshakeNAK)
+	{
+		pThis->m_Statistics.nNAKs++;
+	}
+
+	return Handshake;
+}
+
+// updates channel registers after a successful data packet, returns the halt status or 0
+static u32 DWC2CoreDataPacket (TDWC2Core *pThis, TDWC2Channel *pChannel,
+			       const u8 *pBuffer, unsigned nLength, u8 ucPID)
+{
+	assert (pThis != 0);
+	assert (pChannel != 0);
+
+	u32 nChar = pChannel->m_nCharacter;
+	unsigned nMaxPacketSize = nChar & DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK;
+	boolean bIn = nChar & DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN ? TRUE : FALSE;
+
+	u32 nSize = pChannel->m_nTransferSize;
+	unsigned nBytes = nSize & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK;
+	unsigned nPackets = DWHCI_HOST_CHAN_XFER_SIZ_PACKETS (nSize);
+	unsigned nPID = DWHCI_HOST_CHAN_XFER_SIZ_PID (nSize);
+	boolean bIsochronous =    (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT
+			       == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO;
+
+	if (bIn)
+	{
+		u8 ucToggle = nPID == DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA1 ? 1 : 0;
+		if (   !bIsochronous
+		    && ucPID != ucToggle)
+		{
+			return DWHCI_HOST_CHAN_INT_DATA_TOGGLE_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+		}
+
+		if (nLength > nBytes)
+		{
+			return DWHCI_HOST_CHAN_INT_BABBLE_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+		}
+
+		memcpy ((void *) (uintptr) pChannel->m_nDMAAddress, pBuffer, nLength);
+	}
+
+	assert (nLength <= nBytes);
+	nBytes -= nLength;
+	if (nPackets > 0)
+	{
+		nPackets--;
+	}
+	nPID = nPID == DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA1 ? DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA0
+							  : DWHCI_HOST_CHAN_XFER_SIZ_PID_DATA1;
+
+	pChannel->m_nTransferSize =   nBytes
+				    | nPackets << DWHCI_HOST_CHAN_XFER_SIZ_PACKETS__SHIFT
+				    | nPID << DWHCI_HOST_CHAN_XFER_SIZ_PID__SHIFT;
+	pChannel->m_nDMAAddress += nLength;
+
+	pThis->m_Statistics.nBytes += nLength;
+
+	if (   nPackets == 0
+	    || (bIn && nLength < nMaxPacketSize))
+	{
+		return DWHCI_HOST_CHAN_INT_XFER_COMPLETE | DWHCI_HOST_CHAN_INT_ACK | DWHCI_HOST_CHAN_INT_HALTED;
+	}
+
+	return 0;
+}
+
+static boolean DWC2CoreTransaction (TDWC2Core *pThis, TDWC2Channel *pChannel,
+				    u64 *pDuration, u32 *pStatus)
+{
+	assert (pThis != 0);
+	assert (pChannel != 0);
+
+	TUSBSpeed RootSpeed = DWC2CoreGetRootSpeed (pThis);
+
+	u32 nChar = pChannel->m_nCharacter;
+	u8 ucAddress =    (nChar & DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK)
+		       >> DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT;
+	unsigned nType = (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT;
+	boolean bPeriodic =    nType == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_INTERRUPT
+			    || nType == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO;
+
+	TSimDevice *pDevice = 0;
+	if (   (pThis->m_nHostPort & DWHCI_HOST_PORT_ENABLE)
+	    && pThis->m_pRootDevice != 0)
+	{
+		pDevice = SimDeviceFind (pThis->m_pRootDevice, ucAddress);
+	}
+
+	// full- and low-speed devices behind a high-speed hub are only reachable with split transactions
+	if (   pDevice == 0
+	    || SimDeviceGetSpeed (pDevice) != RootSpeed)
+	{
+		*pDuration = TIMEOUT_DELAY;
+		*pStatus = DWHCI_HOST_CHAN_INT_XACT_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+
+		return FALSE;
+	}
+
+	u8 Buffer[DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK+1];
+	unsigned nLength = 0;
+	u8 ucPID;
+	TSimHandshake Handshake = DWC2CoreExecute (pThis, pDevice, pChannel, Buffer, &nLength, &ucPID);
+
+	*pDuration = PacketTime (RootSpeed, nLength);
+
+	switch (Handshake)
+	{
+	case SimHandshakeACK:
+		*pStatus = DWC2CoreDataPacket (pThis, pChannel, Buffer, nLength, ucPID);
+		if (*pStatus != 0)
+		{
+			return FALSE;
+		}
+
+		// a periodic channel transfers MULTI_CNT packets per (micro)frame
+		if (   !bPeriodic
+		    || ++pChannel->m_nFramePackets < DWC2CoreGetMultiCount (pChannel))
+		{
+			pChannel->m_nEventTime = pThis->m_nTime + *pDuration;
+		}
+		else
+		{
+			u64 nPeriod = DWC2CoreGetFramePeriod (pThis);
+			pChannel->m_nEventTime = (pThis->m_nTime / nPeriod + 1) * nPeriod;
+			pChannel->m_nFramePackets = 0;
+		}
+		return TRUE;
+
+	case SimHandshakeNAK:
+		if (!bPeriodic)
+		{
+			// the core retries non-periodic transactions without software interaction
+			pThis->m_Statistics.nNAKRetries++;
+			pChannel->m_nEventTime = pThis->m_nTime + *pDuration + NAK_RETRY_DELAY;
+
+			return TRUE;
+		}
+
+		*pStatus = DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_HALTED;
+		return FALSE;
+
+	case SimHandshakeSTALL:
+		*pStatus = DWHCI_HOST_CHAN_INT_STALL | DWHCI_HOST_CHAN_INT_HALTED;
+		return FALSE;
+
+	default:
+		*pDuration += TIMEOUT_DELAY;
+		*pStatus = DWHCI_HOST_CHAN_INT_XACT_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+		return FALSE;
+	}
+}
+
+static TDWC2TTEntry *DWC2CoreFindTTEntry (TDWC2Core *pThis, u8 ucHubAddress, u8 ucHubPort,
+					  u8 ucDeviceAddress, u8 ucEndpoint, boolean bIn)
+{
+	assert (pThis != 0);
+
+	for (unsigned i = 0; i < DWC2_TT_ENTRIES; i++)
+	{
+		TDWC2TTEntry *pEntry = &pThis->m_TT[i];
+		if (   pEntry->m_bValid
+		    && pEntry->m_ucHubAddress == ucHubAddress
+		    && pEntry->m_ucHubPort == ucHubPort
+		    && pEntry->m_ucDeviceAddress == ucDeviceAddress
+		    && pEntry->m_ucEndpoint == ucEndpoint
+		    && pEntry->m_bIn == bIn)
+		{
+			return pEntry;
+		}
+	}
+
+	return 0;
+}
+
+static boolean DWC2CoreSplitTransaction (TDWC2Core *pThis, TDWC2Channel *pChannel,
+					 u64 *pDuration, u32 *pStatus)
+{
+	assert (pThis != 0);
+	assert (pChannel != 0);
+
+	u32 nChar = pChannel->m_nCharacter;
+	u8 ucAddress =    (nChar & DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK)
+		       >> DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT;
+	u8 ucEndpoint = (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__SHIFT;
+	unsigned nType = (nChar & DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__MASK) >> DWHCI_HOST_CHAN_CHARACTER_EP_TYPE__SHIFT;
+	boolean bPeriodic =    nType == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_INTERRUPT
+			    || nType == DWHCI_HOST_CHAN_CHARACTER_EP_TYPE_ISO;
+	boolean bIn = nChar & DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN ? TRUE : FALSE;
+
+	u32 nSplit = pChannel->m_nSplitControl;
+	u8 ucHubAddress =    (nSplit & DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__MASK)
+			  >> DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__SHIFT;
+	u8 ucHubPort = nSplit & DWHCI_HOST_CHAN_SPLIT_CTRL_PORT_ADDRESS__MASK;
+
+	TSimDevice *pHub = 0;
+	if (   (pThis->m_nHostPort & DWHCI_HOST_PORT_ENABLE)
+	    && pThis->m_pRootDevice != 0
+	    && DWC2CoreGetRootSpeed (pThis) == USBSpeedHigh)
+	{
+		pHub = SimDeviceFind (pThis->m_pRootDevice, ucHubAddress);
+	}
+
+	if (   pHub == 0
+	    || SimDeviceGetSpeed (pHub) != USBSpeedHigh)
+	{
+		*pDuration = TIMEOUT_DELAY;
+		*pStatus = DWHCI_HOST_CHAN_INT_XACT_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+
+		return FALSE;
+	}
+
+	TDWC2TTEntry *pEntry = DWC2CoreFindTTEntry (pThis, ucHubAddress, ucHubPort,
+						    ucAddress, ucEndpoint, bIn);
+
+	if (!(nSplit & DWHCI_HOST_CHAN_SPLIT_CTRL_COMPLETE_SPLIT))
+	{
+		pThis->m_Statistics.nStartSplits++;
+
+		if (pEntry == 0)
+		{
+			pEntry = &pThis->m_TT[pThis->m_nNextTTEntry];
+			pThis->m_nNextTTEntry = (pThis->m_nNextTTEntry + 1) % DWC2_TT_ENTRIES;
+
+			pEntry->m_bValid = TRUE;
+			pEntry->m_ucHubAddress = ucHubAddress;
+			pEntry->m_ucHubPort = ucHubPort;
+			pEntry->m_ucDeviceAddress = ucAddress;
+			pEntry->m_ucEndpoint = ucEndpoint;
+			pEntry->m_bIn = bIn;
+		}
+
+		// a start split is retried, if the complete split failed before, the TT does
+		// not execute a successful transaction again, but keeps the result
+		if (   pEntry->m_bPending
+		    && pEntry->m_Handshake == SimHandshakeACK)
+		{
+			*pDuration = PacketTime (USBSpeedHigh, bIn ? 4 : 4 + pEntry->m_nLength);
+			*pStatus = DWHCI_HOST_CHAN_INT_ACK | DWHCI_HOST_CHAN_INT_HALTED;
+
+			return FALSE;
+		}
+
+		// the full-/low-speed transaction is executed by the TT in the background
+		TSimDevice *pDevice = SimDeviceGetPort (pHub, ucHubPort);
+		TUSBSpeed Speed = USBSpeedFull;
+		if (   pDevice != 0
+		    && SimDeviceGetAddress (pDevice) == ucAddress
+		    && SimDeviceFind (pDevice, ucAddress) == pDevice)
+		{
+			Speed = SimDeviceGetSpeed (pDevice);
+
+			pEntry->m_nLength = 0;
+			pEntry->m_Handshake = DWC2CoreExecute (pThis, pDevice, pChannel, pEntry->m_Buffer,
+							       &pEntry->m_nLength, &pEntry->m_ucPID);
+		}
+		else
+		{
+			pEntry->m_nLength = 0;
+			pEntry->m_Handshake = SimHandshakeNone;
+		}
+
+		pEntry->m_bPending = TRUE;
+
+		unsigned nLength = pEntry->m_nLength;
+		*pDuration = PacketTime (USBSpeedHigh, bIn ? 4 : 4 + nLength);
+
+		u64 nTTTime = PacketTime (Speed, nLength);
+		if (!bPeriodic)
+		{
+			pEntry->m_nReadyTime = pThis->m_nTime + *pDuration + nTTTime + HUB_DELAY;
+		}
+		else
+		{
+			pEntry->m_nReadyTime = (pThis->m_nTime / HIGH_SPEED_FRAME + 1) * HIGH_SPEED_FRAME + nTTTime;
+		}
+
+		*pStatus = DWHCI_HOST_CHAN_INT_ACK | DWHCI_HOST_CHAN_INT_HALTED;
+
+		return FALSE;
+	}
+
+	pThis->m_Statistics.nCompleteSplits++;
+
+	if (pEntry == 0)
+	{
+		*pDuration = TIMEOUT_DELAY;
+		*pStatus = DWHCI_HOST_CHAN_INT_XACT_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+
+		return FALSE;
+	}
+
+	*pDuration = PacketTime (USBSpeedHigh, 4);
+
+	boolean bInjected = DWC2CoreInjected (pThis, ucAddress, ucEndpoint, SimHandshakeNYET);
+	if (bInjected)
+	{
+		pThis->m_Statistics.nInjectedNYETs++;
+	}
+
+	if (   bInjected
+	    || pThis->m_nTime < pEntry->m_nReadyTime)
+	{
+		pThis->m_Statistics.nNYETs++;
+		*pStatus = DWHCI_HOST_CHAN_INT_NYET | DWHCI_HOST_CHAN_INT_HALTED;
+
+		return FALSE;
+	}
+
+	pEntry->m_bPending = FALSE;
+
+	switch (pEntry->m_Handshake)
+	{
+	case SimHandshakeACK:
+		if (bIn)
+		{
+			*pDuration = PacketTime (USBSpeedHigh, 4 + pEntry->m_nLength);
+		}
+
+		*pStatus = DWC2CoreDataPacket (pThis, pChannel, pEntry->m_Buffer, pEntry->m_nLength,
+					       pEntry->m_ucPID);
+		if (*pStatus == 0)
+		{
+			// one packet per split transaction
+			*pStatus =   DWHCI_HOST_CHAN_INT_XFER_COMPLETE | DWHCI_HOST_CHAN_INT_ACK
+				   | DWHCI_HOST_CHAN_INT_HALTED;
+		}
+		break;
+
+	case SimHandshakeNAK:
+		*pStatus = DWHCI_HOST_CHAN_INT_NAK | DWHCI_HOST_CHAN_INT_HALTED;
+		break;
+
+	case SimHandshakeSTALL:
+		*pStatus = DWHCI_HOST_CHAN_INT_STALL | DWHCI_HOST_CHAN_INT_HALTED;
+		break;
+
+	default:
+		*pStatus = DWHCI_HOST_CHAN_INT_XACT_ERROR | DWHCI_HOST_CHAN_INT_HALTED;
+		break;
+	}
+
+	return FALSE;
+}
+
+static TUSBSpeed DWC2CoreGetRootSpeed (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	switch (DWHCI_HOST_PORT_SPEED (pThis->m_nHostPort))
+	{
+	case DWHCI_HOST_PORT_SPEED_FULL:	return USBSpeedFull;
+	case DWHCI_HOST_PORT_SPEED_LOW:		return USBSpeedLow;
+	default:				return USBSpeedHigh;
+	}
+}
+
+static u64 DWC2CoreGetFramePeriod (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	if (   pThis->m_pRootDevice != 0
+	    && SimDeviceGetSpeed (pThis->m_pRootDevice) != USBSpeedHigh)
+	{
+		return FULL_SPEED_FRAME;
+	}
+
+	return HIGH_SPEED_FRAME;
+}
+
+static unsigned DWC2CoreGetMultiCount (TDWC2Channel *pChannel)
+{
+	assert (pChannel != 0);
+
+	unsigned nMultiCount =    (pChannel->m_nCharacter & DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__MASK)
+			       >> DWHCI_HOST_CHAN_CHARACTER_MULTI_CNT__SHIFT;
+
+	return nMultiCount != 0 ? nMultiCount : 1;
+}
+
+static boolean DWC2CoreInjected (TDWC2Core *pThis, u8 ucDeviceAddress, u8 ucEndpoint,
+				 TSimHandshake Handshake)
+{
+	assert (pThis != 0);
+
+	for (unsigned i = 0; i < DWC2_MAX_INJECTIONS; i++)
+	{
+		TDWC2Injection *pInjection = &pThis->m_Injection[i];
+		if (   pInjection->m_nCount > 0
+		    && pInjection->m_ucDeviceAddress == ucDeviceAddress
+		    && pInjection->m_ucEndpoint == ucEndpoint
+		    && pInjection->m_Handshake == Handshake)
+		{
+			pInjection->m_nCount--;
+
+			return TRUE;
+		}
+	}
+
+	unsigned nRate = Handshake == SimHandshakeNAK ? pThis->m_nNAKRate : pThis->m_nNYETRate;
+	if (nRate == 0)
+	{
+		return FALSE;
+	}
+
+	pThis->m_nRandom = pThis->m_nRandom * 1103515245 + 12345;
+
+	return (pThis->m_nRandom >> 16) % 1000 < nRate;
+}
+
+static u32 DWC2CoreGetChannelInterrupts (TDWC2Core *pThis)
+{
+	assert (pThis != 0);
+
+	u32 nResult = 0;
+	for (unsigned nChannel = 0; nChannel < pThis->m_nChannels; nChannel++)
+	{
+		TDWC2Channel *pChannel = &pThis->m_Channel[nChannel];
+		if (pChannel->m_nInterrupt & pChannel->m_nInterruptMask)
+		{
+			nResult |= 1 << nChannel;
+		}
+	}
+
+	return nResult;
+}
+
+// returns bus time of a packet with nLength data bytes incl. token, handshake and overhead in ns
+static u64 PacketTime (TUSBSpeed Speed, unsigned nLength)
+{
+	switch (Speed)
+	{
+	case USBSpeedHigh:	return (nLength + 20) * 50 / 3;		// 16.67 ns per byte
+	case USBSpeedFull:	return (nLength + 10) * 2000 / 3;	// 666.7 ns per byte
+	default:		return (nLength + 10) * 16000 / 3;	// 5.33 us per byte
+	}
+}
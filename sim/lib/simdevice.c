@@ -0,0 +1,582 @@
+//
+// simdevice.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simdevice.h>
+#include <string.h>
+#include <assert.h>
+
+#define GET_CONFIGURATION	8
+
+#define FEATURE_ENDPOINT_HALT	0
+
+static void SimDeviceStandardRequest (TSimDevice *pThis);
+static void SimDeviceClassRequest (TSimDevice *pThis, unsigned nLength);
+
+void SimDevice (TSimDevice *pThis, TUSBSpeed Speed,
+		const TUSBDeviceDescriptor *pDeviceDesc,
+		const TUSBConfigurationDescriptor *pConfigDesc,
+		const char * const *ppStrings)
+{
+	assert (pThis != 0);
+	assert (pDeviceDesc != 0);
+	assert (pConfigDesc != 0);
+
+	memset (pThis, 0, sizeof *pThis);
+
+	pThis->m_Speed = Speed;
+	pThis->m_pDeviceDesc = pDeviceDesc;
+	pThis->m_pConfigDesc = pConfigDesc;
+	pThis->m_ppStrings = ppStrings;
+
+	pThis->m_ControlStage = SimControlIdle;
+	pThis->m_ControlStatus = SimHandshakeACK;
+}
+
+void _SimDevice (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+
+	for (unsigned nPort = 0; nPort < pThis->m_nPorts; nPort++)
+	{
+		TSimDevice *pDevice = pThis->m_pPort[nPort];
+		if (   pDevice != 0
+		    && pDevice->_SimDevice != 0)
+		{
+			(*pDevice->_SimDevice) (pDevice);
+		}
+	}
+
+	pThis->m_nPorts = 0;
+}
+
+void SimDeviceBusReset (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+
+	pThis->m_bEnabled = TRUE;
+	pThis->m_ucAddress = USB_DEFAULT_ADDRESS;
+	pThis->m_ucPendingAddress = USB_DEFAULT_ADDRESS;
+	pThis->m_ucConfiguration = 0;
+
+	pThis->m_ControlStage = SimControlIdle;
+	pThis->m_usToggle[0] = pThis->m_usToggle[1] = 0;
+	pThis->m_usHalted[0] = pThis->m_usHalted[1] = 0;
+
+	if (pThis->BusReset != 0)
+	{
+		(*pThis->BusReset) (pThis);
+	}
+}
+
+void SimDeviceDisable (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+
+	pThis->m_bEnabled = FALSE;
+
+	for (unsigned nPort = 0; nPort < pThis->m_nPorts; nPort++)
+	{
+		if (pThis->m_pPort[nPort] != 0)
+		{
+			SimDeviceDisable (pThis->m_pPort[nPort]);
+		}
+	}
+}
+
+TSimHandshake SimDeviceSetup (TSimDevice *pThis, const void *pPacket, unsigned nLength)
+{
+	assert (pThis != 0);
+	assert (pPacket != 0);
+
+	if (nLength != sizeof (TSetupData))
+	{
+		return SimHandshakeNone;
+	}
+
+	memcpy (&pThis->m_Setup, pPacket, sizeof (TSetupData));
+
+	pThis->m_nControlLength = 0;
+	pThis->m_nControlOffset = 0;
+	pThis->m_bControlShortPacket = FALSE;
+	pThis->m_ControlStatus = SimHandshakeACK;
+
+	if (pThis->m_Setup.bmRequestType & REQUEST_IN)
+	{
+		if ((pThis->m_Setup.bmRequestType & 0x60) == 0)
+		{
+			SimDeviceStandardRequest (pThis);
+		}
+		else
+		{
+			SimDeviceClassRequest (pThis, pThis->m_Setup.wLength);
+		}
+
+		pThis->m_ControlStage = pThis->m_Setup.wLength > 0 ? SimControlDataIn : SimControlStatusIn;
+	}
+	else
+	{
+		// OUT requests will be executed in the status stage
+		pThis->m_ControlStage = pThis->m_Setup.wLength > 0 ? SimControlDataOut : SimControlStatusIn;
+	}
+
+	return SimHandshakeACK;		// SETUP is always acknowledged
+}
+
+TSimHandshake SimDeviceIn (TSimDevice *pThis, unsigned nEndpoint, u8 ucPID,
+			   u8 *pBuffer, unsigned nMaxPacketSize, unsigned *pLength, u8 *pPID)
+{
+	assert (pThis != 0);
+	assert (nEndpoint < SIM_MAX_ENDPOINTS);
+	assert (pBuffer != 0);
+	assert (pLength != 0);
+	assert (pPID != 0);
+
+	*pLength = 0;
+	*pPID = ucPID;
+
+	if (nEndpoint == 0)
+	{
+		switch (pThis->m_ControlStage)
+		{
+		case SimControlDataIn: {
+			if (pThis->m_ControlStatus != SimHandshakeACK)
+			{
+				return pThis->m_ControlStatus;
+			}
+
+			unsigned nPacketSize = pThis->m_pDeviceDesc->bMaxPacketSize0;
+			assert (pThis->m_nControlOffset <= pThis->m_nControlLength);
+			unsigned nChunk = pThis->m_nControlLength - pThis->m_nControlOffset;
+			if (nChunk > nPacketSize)
+			{
+				nChunk = nPacketSize;
+			}
+
+			memcpy (pBuffer, pThis->m_ControlBuffer + pThis->m_nControlOffset, nChunk);
+			pThis->m_nControlOffset += nChunk;
+			*pLength = nChunk;
+
+			if (   nChunk < nPacketSize
+			    || pThis->m_nControlOffset == pThis->m_Setup.wLength)
+			{
+				pThis->m_ControlStage = SimControlStatusOut;
+			}
+			} return SimHandshakeACK;
+
+		case SimControlStatusIn:
+			if (pThis->m_Setup.bmRequestType & REQUEST_IN)
+			{
+				pThis->m_ControlStage = SimControlIdle;
+
+				return pThis->m_ControlStatus;
+			}
+
+			if ((pThis->m_Setup.bmRequestType & 0x60) == 0)
+			{
+				SimDeviceStandardRequest (pThis);
+			}
+			else
+			{
+				SimDeviceClassRequest (pThis, pThis->m_nControlLength);
+			}
+
+			pThis->m_ControlStage = SimControlIdle;
+
+			if (   pThis->m_ControlStatus == SimHandshakeACK
+			    && pThis->m_ucPendingAddress != pThis->m_ucAddress)
+			{
+				pThis->m_ucAddress = pThis->m_ucPendingAddress;
+			}
+
+			*pPID = 1;
+			return pThis->m_ControlStatus;
+
+		default:
+			return SimHandshakeSTALL;
+		}
+	}
+
+	if (   !pThis->m_ucConfiguration
+	    || pThis->DataIn == 0)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	u16 usMask = 1 << nEndpoint;
+	if (pThis->m_usHalted[1] & usMask)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	*pLength = nMaxPacketSize;
+	TSimHandshake Handshake = (*pThis->DataIn) (pThis, nEndpoint, pBuffer, pLength);
+	if (Handshake != SimHandshakeACK)
+	{
+		*pLength = 0;
+
+		return Handshake;
+	}
+
+	if (pThis->m_usIsochronous[1] & usMask)
+	{
+		*pPID = 0;
+
+		return SimHandshakeACK;
+	}
+
+	*pPID = pThis->m_usToggle[1] & usMask ? 1 : 0;
+	pThis->m_usToggle[1] ^= usMask;
+
+	return SimHandshakeACK;
+}
+
+TSimHandshake SimDeviceOut (TSimDevice *pThis, unsigned nEndpoint, u8 ucPID,
+			    const u8 *pBuffer, unsigned nLength)
+{
+	assert (pThis != 0);
+	assert (nEndpoint < SIM_MAX_ENDPOINTS);
+	assert (nLength == 0 || pBuffer != 0);
+
+	if (nEndpoint == 0)
+	{
+		switch (pThis->m_ControlStage)
+		{
+		case SimControlDataOut:
+			if (pThis->m_nControlLength + nLength > SIM_CONTROL_BUFFER_SIZE)
+			{
+				pThis->m_ControlStatus = SimHandshakeSTALL;
+
+				return SimHandshakeSTALL;
+			}
+
+			memcpy (pThis->m_ControlBuffer + pThis->m_nControlLength, pBuffer, nLength);
+			pThis->m_nControlLength += nLength;
+
+			if (   nLength < pThis->m_pDeviceDesc->bMaxPacketSize0
+			    || pThis->m_nControlLength >= pThis->m_Setup.wLength)
+			{
+				pThis->m_ControlStage = SimControlStatusIn;
+			}
+			return SimHandshakeACK;
+
+		case SimControlStatusOut:
+			pThis->m_ControlStage = SimControlIdle;
+			return SimHandshakeACK;
+
+		default:
+			return SimHandshakeSTALL;
+		}
+	}
+
+	if (   !pThis->m_ucConfiguration
+	    || pThis->DataOut == 0)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	u16 usMask = 1 << nEndpoint;
+	if (pThis->m_usHalted[0] & usMask)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	if (pThis->m_usIsochronous[0] & usMask)
+	{
+		(*pThis->DataOut) (pThis, nEndpoint, pBuffer, nLength);
+
+		return SimHandshakeACK;			// there is no handshake actually
+	}
+
+	u8 ucToggle = pThis->m_usToggle[0] & usMask ? 1 : 0;
+	if (ucPID != ucToggle)
+	{
+		// the packet is a retry from the view of the device, acknowledge and ignore it
+		pThis->m_nToggleErrors++;
+
+		return SimHandshakeACK;
+	}
+
+	TSimHandshake Handshake = (*pThis->DataOut) (pThis, nEndpoint, pBuffer, nLength);
+	if (   Handshake == SimHandshakeACK
+	    || Handshake == SimHandshakeNYET)
+	{
+		pThis->m_usToggle[0] ^= usMask;
+	}
+
+	return Handshake;
+}
+
+TSimDevice *SimDeviceFind (TSimDevice *pThis, u8 ucAddress)
+{
+	assert (pThis != 0);
+
+	if (!pThis->m_bEnabled)
+	{
+		return 0;
+	}
+
+	if (pThis->m_ucAddress == ucAddress)
+	{
+		return pThis;
+	}
+
+	for (unsigned nPort = 0; nPort < pThis->m_nPorts; nPort++)
+	{
+		if (pThis->m_pPort[nPort] != 0)
+		{
+			TSimDevice *pDevice = SimDeviceFind (pThis->m_pPort[nPort], ucAddress);
+			if (pDevice != 0)
+			{
+				return pDevice;
+			}
+		}
+	}
+
+	return 0;
+}
+
+TSimDevice *SimDeviceGetPort (TSimDevice *pThis, unsigned nPort)
+{
+	assert (pThis != 0);
+
+	if (   nPort == 0
+	    || nPort > pThis->m_nPorts)
+	{
+		return 0;
+	}
+
+	return pThis->m_pPort[nPort-1];
+}
+
+u8 SimDeviceGetAddress (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_ucAddress;
+}
+
+TUSBSpeed SimDeviceGetSpeed (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_Speed;
+}
+
+boolean SimDeviceIsConfigured (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_ucConfiguration != 0;
+}
+
+void SimDeviceSetHalt (TSimDevice *pThis, unsigned nEndpoint, boolean bIn, boolean bHalt)
+{
+	assert (pThis != 0);
+	assert (0 < nEndpoint && nEndpoint < SIM_MAX_ENDPOINTS);
+
+	u16 usMask = 1 << nEndpoint;
+	if (bHalt)
+	{
+		pThis->m_usHalted[bIn ? 1 : 0] |= usMask;
+	}
+	else
+	{
+		pThis->m_usHalted[bIn ? 1 : 0] &= ~usMask;
+	}
+}
+
+void SimDeviceSetIsochronous (TSimDevice *pThis, unsigned nEndpoint, boolean bIn)
+{
+	assert (pThis != 0);
+	assert (0 < nEndpoint && nEndpoint < SIM_MAX_ENDPOINTS);
+
+	pThis->m_usIsochronous[bIn ? 1 : 0] |= 1 << nEndpoint;
+}
+
+static void SimDeviceStandardRequest (TSimDevice *pThis)
+{
+	assert (pThis != 0);
+
+	const TSetupData *pSetup = &pThis->m_Setup;
+	u8 *pBuffer = pThis->m_ControlBuffer;
+	unsigned nLength = 0;
+
+	switch (pSetup->bRequest)
+	{
+	case GET_DESCRIPTOR:
+		switch (pSetup->wValue >> 8)
+		{
+		case DESCRIPTOR_DEVICE:
+			nLength = sizeof (TUSBDeviceDescriptor);
+			memcpy (pBuffer, pThis->m_pDeviceDesc, nLength);
+			break;
+
+		case DESCRIPTOR_CONFIGURATION:
+			nLength = pThis->m_pConfigDesc->wTotalLength;
+			assert (nLength <= SIM_CONTROL_BUFFER_SIZE);
+			memcpy (pBuffer, pThis->m_pConfigDesc, nLength);
+			break;
+
+		case DESCRIPTOR_STRING: {
+			unsigned nIndex = pSetup->wValue & 0xFF;
+			if (nIndex == 0)
+			{
+				pBuffer[0] = 4;
+				pBuffer[1] = DESCRIPTOR_STRING;
+				pBuffer[2] = 0x09;		// English (US)
+				pBuffer[3] = 0x04;
+				nLength = 4;
+
+				break;
+			}
+
+			const char *pString = 0;
+			for (unsigned i = 0; pThis->m_ppStrings != 0 && pThis->m_ppStrings[i] != 0; i++)
+			{
+				if (i+1 == nIndex)
+				{
+					pString = pThis->m_ppStrings[i];
+				}
+			}
+
+			if (pString == 0)
+			{
+				pThis->m_ControlStatus = SimHandshakeSTALL;
+
+				return;
+			}
+
+			nLength = 2;
+			while (*pString != '\0' && nLength < 254)
+			{
+				pBuffer[nLength++] = (u8) *pString++;
+				pBuffer[nLength++] = 0;
+			}
+			pBuffer[0] = (u8) nLength;
+			pBuffer[1] = DESCRIPTOR_STRING;
+			} break;
+
+		default:
+			SimDeviceClassRequest (pThis, pSetup->wLength);
+			return;
+		}
+		break;
+
+	case GET_CONFIGURATION:
+		pBuffer[0] = pThis->m_ucConfiguration;
+		nLength = 1;
+		break;
+
+	case GET_STATUS:
+		pBuffer[0] = 0;
+		pBuffer[1] = 0;
+		if ((pSetup->bmRequestType & 0x1F) == 2)
+		{
+			unsigned nEndpoint = pSetup->wIndex & 0x0F;
+			boolean bIn = pSetup->wIndex & 0x80 ? TRUE : FALSE;
+			pBuffer[0] = pThis->m_usHalted[bIn ? 1 : 0] & (1 << nEndpoint) ? 1 : 0;
+		}
+		nLength = 2;
+		break;
+
+	case SET_ADDRESS:
+		pThis->m_ucPendingAddress = pSetup->wValue & 0x7F;
+		break;
+
+	case SET_CONFIGURATION:
+		if (pSetup->wValue > pThis->m_pDeviceDesc->bNumConfigurations)
+		{
+			pThis->m_ControlStatus = SimHandshakeSTALL;
+
+			return;
+		}
+		pThis->m_ucConfiguration = (u8) pSetup->wValue;
+		pThis->m_usToggle[0] = pThis->m_usToggle[1] = 0;
+		pThis->m_usHalted[0] = pThis->m_usHalted[1] = 0;
+		break;
+
+	case SET_INTERFACE:
+		pThis->m_usToggle[0] = pThis->m_usToggle[1] = 0;
+		break;
+
+	case CLEAR_FEATURE:
+	case SET_FEATURE:
+		if (   (pSetup->bmRequestType & 0x1F) == 2
+		    && pSetup->wValue == FEATURE_ENDPOINT_HALT)
+		{
+			// some hosts do not set the direction bit in wIndex, so handle both directions
+			unsigned nEndpoint = pSetup->wIndex & 0x0F;
+			if (nEndpoint == 0)
+			{
+				break;
+			}
+
+			u16 usMask = 1 << nEndpoint;
+			if (pSetup->bRequest == CLEAR_FEATURE)
+			{
+				pThis->m_usHalted[0] &= ~usMask;
+				pThis->m_usHalted[1] &= ~usMask;
+				pThis->m_usToggle[0] &= ~usMask;
+				pThis->m_usToggle[1] &= ~usMask;
+			}
+			else
+			{
+				SimDeviceSetHalt (pThis, nEndpoint, pSetup->wIndex & 0x80 ? TRUE : FALSE, TRUE);
+			}
+		}
+		break;
+
+	default:
+		SimDeviceClassRequest (pThis, pSetup->wLength);
+		return;
+	}
+
+	if (nLength > pSetup->wLength)
+	{
+		nLength = pSetup->wLength;
+	}
+
+	pThis->m_nControlLength = nLength;
+}
+
+static void SimDeviceClassRequest (TSimDevice *pThis, unsigned nLength)
+{
+	assert (pThis != 0);
+
+	if (pThis->Request == 0)
+	{
+		pThis->m_ControlStatus = SimHandshakeSTALL;
+
+		return;
+	}
+
+	if (nLength > SIM_CONTROL_BUFFER_SIZE)
+	{
+		nLength = SIM_CONTROL_BUFFER_SIZE;
+	}
+
+	pThis->m_ControlStatus = (*pThis->Request) (pThis, &pThis->m_Setup, pThis->m_ControlBuffer, &nLength);
+
+	if (pThis->m_Setup.bmRequestType & REQUEST_IN)
+	{
+		if (nLength > pThis->m_Setup.wLength)
+		{
+			nLength = pThis->m_Setup.wLength;
+		}
+
+		pThis->m_nControlLength = nLength;
+	}
+}
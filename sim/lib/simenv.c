@@ -0,0 +1,704 @@
+//
+// simenv.c
+//
+// The simulated system has a single CPU. Virtual time advances with each register access
+// and while the program waits (delay functions, SimIdle()). Interrupts (USB and kernel
+// timers) are delivered synchronously at these points, if they are enabled.
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simenv.h>
+#include <uspios.h>
+#include <uspi/bcm2835.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define ARM_IRQ_USB		9
+
+#define KERNEL_TIMERS		32
+#define TICK			(1000000000ULL / HZ)	// ns
+
+#define STACK_SIZE		0x100000
+
+#define MAX_IRQ_REPEAT		100000			// interrupt storm detection
+
+typedef struct TSimKernelTimer
+{
+	TKernelTimerHandler	*pHandler;
+	u64			 nElapsesAt;
+	void			*pParam;
+	void			*pContext;
+}
+TSimKernelTimer;
+
+static TDWC2Core s_Core;
+static boolean s_bCoreAttached = FALSE;
+
+static u64 s_nTime = 0;
+static unsigned s_nMMIOCost = SIM_DEFAULT_MMIO_COST;
+static unsigned s_nLogLevel = LOG_NOTICE;
+
+static boolean s_bInterruptsEnabled = TRUE;
+static boolean s_bInIRQ = FALSE;
+static TInterruptHandler *s_pIRQHandler = 0;
+static void *s_pIRQParam = 0;
+
+#ifdef USPI_USE_FIQ
+static boolean s_bFIQEnabled = TRUE;
+static boolean s_bInFIQ = FALSE;
+static TInterruptHandler *s_pFIQHandler = 0;
+static void *s_pFIQParam = 0;
+
+static boolean s_bSoftIRQPending = FALSE;
+static TInterruptHandler *s_pSoftIRQHandler = 0;
+static void *s_pSoftIRQParam = 0;
+#endif
+
+static TSimKernelTimer s_KernelTimer[KERNEL_TIMERS];
+
+static TSimStatistics s_Statistics;
+
+static boolean SimInterruptPending (void);
+static boolean SimUSBInterruptPending (void);
+static void SimCheckInterrupts (void);
+#ifdef USPI_USE_FIQ
+static void SimCheckFIQ (void);
+#endif
+static u64 SimGetNextEventTime (void);
+static void SimAdvanceTo (u64 nTime);
+
+void SimInitialize (void)
+{
+	// all memory must be located below 4 GB, because DMA addresses are 32-bit
+	mallopt (M_MMAP_MAX, 0);
+	mallopt (M_ARENA_MAX, 1);
+
+	s_nTime = 0;
+	s_bInterruptsEnabled = TRUE;
+	s_bInIRQ = FALSE;
+	s_pIRQHandler = 0;
+#ifdef USPI_USE_FIQ
+	s_bFIQEnabled = TRUE;
+	s_bInFIQ = FALSE;
+	s_pFIQHandler = 0;
+	s_bSoftIRQPending = FALSE;
+	s_pSoftIRQHandler = 0;
+#endif
+
+	for (unsigned i = 0; i < KERNEL_TIMERS; i++)
+	{
+		s_KernelTimer[i].pHandler = 0;
+	}
+
+	memset (&s_Statistics, 0, sizeof s_Statistics);
+}
+
+void SimAttach (TSimDevice *pRootDevice, unsigned nChannels)
+{
+	assert (!s_bCoreAttached);
+	DWC2Core (&s_Core, nChannels, pRootDevice);
+	s_bCoreAttached = TRUE;
+}
+
+typedef struct TSimThreadParam
+{
+	int	(*pMain) (void *pParam);
+	void	*pParam;
+	int	nResult;
+}
+TSimThreadParam;
+
+static void *SimThread (void *pParam)
+{
+	TSimThreadParam *pThreadParam = (TSimThreadParam *) pParam;
+	assert (pThreadParam != 0);
+
+	pThreadParam->nResult = (*pThreadParam->pMain) (pThreadParam->pParam);
+
+	return 0;
+}
+
+int SimRun (int (*pMain) (void *pParam), void *pParam)
+{
+	assert (pMain != 0);
+	assert (s_bCoreAttached);
+
+	u8 *pStack = (u8 *) malloc (STACK_SIZE);
+	assert (pStack != 0);
+	if ((uintptr_t) (pStack + STACK_SIZE) > 0xFFFFFFFFUL)
+	{
+		fprintf (stderr, "sim: Heap is not located below 4 GB\n");
+
+		abort ();
+	}
+
+	TSimThreadParam ThreadParam = {pMain, pParam, -1};
+
+	pthread_attr_t Attr;
+	pthread_attr_init (&Attr);
+	pthread_attr_setstack (&Attr, pStack, STACK_SIZE);
+
+	pthread_t Thread;
+	if (pthread_create (&Thread, &Attr, SimThread, &ThreadParam) != 0)
+	{
+		fprintf (stderr, "sim: Cannot create thread\n");
+
+		abort ();
+	}
+
+	pthread_join (Thread, 0);
+	pthread_attr_destroy (&Attr);
+
+	free (pStack);
+
+	return ThreadParam.nResult;
+}
+
+TDWC2Core *SimGetCore (void)
+{
+	assert (s_bCoreAttached);
+	return &s_Core;
+}
+
+u64 SimGetTime (void)
+{
+	return s_nTime;
+}
+
+void SimAdvance (u64 nNanoSeconds)
+{
+	u64 nUntil = s_nTime + nNanoSeconds;
+
+	while (s_nTime < nUntil)
+	{
+		u64 nNext = SimGetNextEventTime ();
+		if (nNext > nUntil)
+		{
+			nNext = nUntil;
+		}
+		else if (nNext <= s_nTime)
+		{
+			nNext = s_nTime + 1;
+		}
+
+		SimAdvanceTo (nNext);
+
+		SimCheckInterrupts ();
+	}
+}
+
+void SimSetLogLevel (unsigned nLevel)
+{
+	s_nLogLevel = nLevel;
+}
+
+void SimSetMMIOCost (unsigned nNanoSeconds)
+{
+	s_nMMIOCost = nNanoSeconds;
+}
+
+void SimGetStatistics (TSimStatistics *pStatistics)
+{
+	assert (pStatistics != 0);
+	*pStatistics = s_Statistics;
+}
+
+static void SimAdvanceTo (u64 nTime)
+{
+	if (nTime > s_nTime)
+	{
+		s_nTime = nTime;
+	}
+
+	if (s_bCoreAttached)
+	{
+		DWC2CoreAdvance (&s_Core, s_nTime);
+	}
+}
+
+static u64 SimGetNextEventTime (void)
+{
+	u64 nResult = DWC2_NO_EVENT;
+
+	if (s_bCoreAttached)
+	{
+		nResult = DWC2CoreGetNextEventTime (&s_Core);
+	}
+
+	// timers, which are already due, are pending until interrupts are enabled
+	for (unsigned i = 0; i < KERNEL_TIMERS; i++)
+	{
+		if (   s_KernelTimer[i].pHandler != 0
+		    && s_KernelTimer[i].nElapsesAt > s_nTime
+		    && s_KernelTimer[i].nElapsesAt < nResult)
+		{
+			nResult = s_KernelTimer[i].nElapsesAt;
+		}
+	}
+
+	return nResult;
+}
+
+static boolean SimInterruptPending (void)
+{
+	for (unsigned i = 0; i < KERNEL_TIMERS; i++)
+	{
+		if (   s_KernelTimer[i].pHandler != 0
+		    && s_KernelTimer[i].nElapsesAt <= s_nTime)
+		{
+			return TRUE;
+		}
+	}
+
+#ifdef USPI_USE_FIQ
+	if (s_bSoftIRQPending)
+	{
+		return TRUE;
+	}
+#endif
+
+	return SimUSBInterruptPending ();
+}
+
+static boolean SimUSBInterruptPending (void)
+{
+#ifdef USPI_USE_FIQ
+	if (s_pFIQHandler != 0)
+	{
+		return    s_bCoreAttached
+		       && DWC2CoreIRQPending (&s_Core);
+	}
+#endif
+
+	return    s_pIRQHandler != 0
+	       && s_bCoreAttached
+	       && DWC2CoreIRQPending (&s_Core);
+}
+
+#ifdef USPI_USE_FIQ
+
+// the FIQ preempts IRQ handlers and is not disabled with "cpsid i"
+static void SimCheckFIQ (void)
+{
+	if (   !s_bFIQEnabled
+	    || s_bInFIQ
+	    || s_pFIQHandler == 0)
+	{
+		return;
+	}
+
+	unsigned nRepeat = 0;
+	u64 nLastTime = s_nTime;
+
+	while (   s_bCoreAttached
+	       && DWC2CoreIRQPending (&s_Core))
+	{
+		boolean bInterruptsEnabled = s_bInterruptsEnabled;
+
+		s_bInFIQ = TRUE;
+		s_bFIQEnabled = FALSE;
+		s_bInterruptsEnabled = FALSE;
+
+		s_Statistics.nFIQs++;
+		(*s_pFIQHandler) (s_pFIQParam);
+
+		s_bInFIQ = FALSE;
+		s_bFIQEnabled = TRUE;
+		s_bInterruptsEnabled = bInterruptsEnabled;
+
+		if (s_nTime == nLastTime)
+		{
+			if (++nRepeat > MAX_IRQ_REPEAT)
+			{
+				fprintf (stderr, "sim: Interrupt is not acknowledged\n");
+
+				abort ();
+			}
+		}
+		else
+		{
+			nRepeat = 0;
+			nLastTime = s_nTime;
+		}
+	}
+}
+
+#endif
+
+static void SimCheckInterrupts (void)
+{
+#ifdef USPI_USE_FIQ
+	SimCheckFIQ ();
+#endif
+
+	if (   !s_bInterruptsEnabled
+	    || s_bInIRQ)
+	{
+		return;
+	}
+
+	unsigned nRepeat = 0;
+	u64 nLastTime = s_nTime;
+
+	while (1)
+	{
+		TSimKernelTimer *pTimer = 0;
+		for (unsigned i = 0; i < KERNEL_TIMERS; i++)
+		{
+			if (   s_KernelTimer[i].pHandler != 0
+			    && s_KernelTimer[i].nElapsesAt <= s_nTime
+			    && (   pTimer == 0
+				|| s_KernelTimer[i].nElapsesAt < pTimer->nElapsesAt))
+			{
+				pTimer = &s_KernelTimer[i];
+			}
+		}
+
+		s_bInIRQ = TRUE;
+		s_bInterruptsEnabled = FALSE;
+
+		if (pTimer != 0)
+		{
+			TKernelTimerHandler *pHandler = pTimer->pHandler;
+			pTimer->pHandler = 0;
+
+			s_Statistics.nTimerIRQs++;
+			(*pHandler) ((TKernelTimerHandle) (pTimer - s_KernelTimer + 1),
+				     pTimer->pParam, pTimer->pContext);
+		}
+#ifdef USPI_USE_FIQ
+		else if (   s_bSoftIRQPending
+			 && s_pSoftIRQHandler != 0)
+		{
+			s_bSoftIRQPending = FALSE;
+
+			s_Statistics.nIRQs++;
+			(*s_pSoftIRQHandler) (s_pSoftIRQParam);
+		}
+		else if (s_pFIQHandler != 0)
+		{
+			s_bInIRQ = FALSE;
+			s_bInterruptsEnabled = TRUE;
+
+			break;
+		}
+#endif
+		else if (   s_pIRQHandler != 0
+			 && s_bCoreAttached
+			 && DWC2CoreIRQPending (&s_Core))
+		{
+			s_Statistics.nIRQs++;
+			(*s_pIRQHandler) (s_pIRQParam);
+
+			if (s_nTime == nLastTime)
+			{
+				if (++nRepeat > MAX_IRQ_REPEAT)
+				{
+					fprintf (stderr, "sim: Interrupt is not acknowledged\n");
+
+					abort ();
+				}
+			}
+			else
+			{
+				nRepeat = 0;
+				nLastTime = s_nTime;
+			}
+		}
+		else
+		{
+			s_bInIRQ = FALSE;
+			s_bInterruptsEnabled = TRUE;
+
+			break;
+		}
+
+		s_bInIRQ = FALSE;
+		s_bInterruptsEnabled = TRUE;
+	}
+}
+
+//
+// uspios.h
+//
+
+void MsDelay (unsigned nMilliSeconds)
+{
+	SimAdvance (nMilliSeconds * 1000000ULL);
+}
+
+void usDelay (unsigned nMicroSeconds)
+{
+	SimAdvance (nMicroSeconds * 1000ULL);
+}
+
+unsigned StartKernelTimer (unsigned nHzDelay, TKernelTimerHandler *pHandler,
+			   void *pParam, void *pContext)
+{
+	assert (pHandler != 0);
+
+	for (unsigned i = 0; i < KERNEL_TIMERS; i++)
+	{
+		if (s_KernelTimer[i].pHandler == 0)
+		{
+			// like the system timer, which is polled once per tick
+			s_KernelTimer[i].nElapsesAt = (s_nTime / TICK + (nHzDelay > 0 ? nHzDelay : 1)) * TICK;
+			s_KernelTimer[i].pParam = pParam;
+			s_KernelTimer[i].pContext = pContext;
+			s_KernelTimer[i].pHandler = pHandler;
+
+			return i+1;
+		}
+	}
+
+	fprintf (stderr, "sim: System limit of kernel timers exceeded\n");
+	abort ();
+
+	return 0;
+}
+
+void CancelKernelTimer (unsigned hTimer)
+{
+	assert (1 <= hTimer && hTimer <= KERNEL_TIMERS);
+	s_KernelTimer[hTimer-1].pHandler = 0;
+}
+
+void ConnectInterrupt (unsigned nIRQ, TInterruptHandler *pHandler, void *pParam)
+{
+	assert (nIRQ == ARM_IRQ_USB);
+	assert (pHandler != 0);
+
+	s_pIRQParam = pParam;
+	s_pIRQHandler = pHandler;
+}
+
+#ifdef USPI_USE_FIQ
+
+void ConnectFIQ (unsigned nIRQ, TInterruptHandler *pHandler, void *pParam)
+{
+	assert (nIRQ == ARM_IRQ_USB);
+	assert (pHandler != 0);
+
+	s_pFIQParam = pParam;
+	s_pFIQHandler = pHandler;
+}
+
+void ConnectSoftInterrupt (TInterruptHandler *pHandler, void *pParam)
+{
+	assert (pHandler != 0);
+
+	s_pSoftIRQParam = pParam;
+	s_pSoftIRQHandler = pHandler;
+}
+
+void TriggerSoftInterrupt (void)
+{
+	s_bSoftIRQPending = TRUE;
+}
+
+#endif
+
+int SetPowerStateOn (unsigned nDeviceId)
+{
+	return 1;
+}
+
+int GetMACAddress (unsigned char Buffer[6])
+{
+	static const unsigned char MACAddress[6] = {0xB8, 0x27, 0xEB, 0x00, 0x00, 0x01};
+
+	memcpy (Buffer, MACAddress, sizeof MACAddress);
+
+	return 1;
+}
+
+void LogWrite (const char *pSource, unsigned Severity, const char *pMessage, ...)
+{
+	if (Severity > s_nLogLevel)
+	{
+		return;
+	}
+
+	static const char *Severities[] = {"", "!", "*", "", ""};
+
+	fprintf (stderr, "%10llu.%03llu %s%s: ", s_nTime / 1000000, s_nTime / 1000 % 1000,
+		 Severity <= LOG_DEBUG ? Severities[Severity] : "", pSource);
+
+	va_list var;
+	va_start (var, pMessage);
+	vfprintf (stderr, pMessage, var);
+	va_end (var);
+
+	fprintf (stderr, "\n");
+}
+
+unsigned MMIORead (unsigned long nAddress)
+{
+	s_Statistics.nMMIOReads++;
+	SimAdvanceTo (s_nTime + s_nMMIOCost);
+
+	if (nAddress == ARM_SYSTIMER_CLO)
+	{
+		return (unsigned) (s_nTime / 1000);
+	}
+
+	assert (ARM_USB_BASE <= nAddress && nAddress < ARM_USB_BASE + DWC2_REGISTER_SPACE);
+	assert (s_bCoreAttached);
+
+	unsigned nValue = DWC2CoreRead (&s_Core, nAddress - ARM_USB_BASE);
+
+	SimCheckInterrupts ();
+
+	return nValue;
+}
+
+void MMIOWrite (unsigned long nAddress, unsigned nValue)
+{
+	assert (ARM_USB_BASE <= nAddress && nAddress < ARM_USB_BASE + DWC2_REGISTER_SPACE);
+	assert (s_bCoreAttached);
+
+	s_Statistics.nMMIOWrites++;
+	SimAdvanceTo (s_nTime + s_nMMIOCost);
+
+	DWC2CoreWrite (&s_Core, nAddress - ARM_USB_BASE, nValue);
+
+	SimCheckInterrupts ();
+}
+
+void SimCacheMaintenance (unsigned long nAddress, unsigned long nLength, int nOperation)
+{
+	unsigned long nLines =   (nAddress + nLength + SIM_CACHE_LINE_LENGTH - 1) / SIM_CACHE_LINE_LENGTH
+			       - nAddress / SIM_CACHE_LINE_LENGTH;
+
+	if (nOperation & SIM_CACHE_CLEAN)
+	{
+		s_Statistics.nCacheLinesCleaned += nLines;
+	}
+
+	if (nOperation & SIM_CACHE_INVALIDATE)
+	{
+		s_Statistics.nCacheLinesInvalidated += nLines;
+	}
+}
+
+void SimDisableInterrupts (void)
+{
+	s_bInterruptsEnabled = FALSE;
+}
+
+void SimEnableInterrupts (void)
+{
+	assert (!s_bInIRQ);
+	s_bInterruptsEnabled = TRUE;
+
+	SimCheckInterrupts ();
+}
+
+int SimInterruptsEnabled (void)
+{
+	return s_bInterruptsEnabled;
+}
+
+#ifdef USPI_USE_FIQ
+
+void SimDisableFIQ (void)
+{
+	s_bFIQEnabled = FALSE;
+}
+
+void SimEnableFIQ (void)
+{
+	assert (!s_bInFIQ);
+	s_bFIQEnabled = TRUE;
+
+	SimCheckInterrupts ();
+}
+
+int SimFIQEnabled (void)
+{
+	return s_bFIQEnabled;
+}
+
+#endif
+
+void SimIdle (void)
+{
+	// like WFI, return immediately, if an interrupt is pending, but disabled
+	if (   !s_bInterruptsEnabled
+	    && !s_bInIRQ
+	    && SimInterruptPending ())
+	{
+		return;
+	}
+
+	u64 nNext = SimGetNextEventTime ();
+	if (nNext == DWC2_NO_EVENT)
+	{
+		if (   !s_bInterruptsEnabled
+		    || !SimUSBInterruptPending ())
+		{
+			fprintf (stderr, "sim: Waiting for an event, which never happens\n");
+
+			abort ();
+		}
+	}
+	else
+	{
+		if (nNext > s_nTime)
+		{
+			s_Statistics.nIdleTime += nNext - s_nTime;
+		}
+
+		SimAdvanceTo (nNext);		// processes events, which are already due, too
+	}
+
+	SimCheckInterrupts ();
+}
+
+#ifndef NDEBUG
+
+void uspi_assertion_failed (const char *pExpr, const char *pFile, unsigned nLine)
+{
+	fprintf (stderr, "assertion failed: %s (%s:%u)\n", pExpr, pFile, nLine);
+
+	abort ();
+}
+
+void DebugHexdump (const void *pBuffer, unsigned nBufLen, const char *pSource)
+{
+	const u8 *pData = (const u8 *) pBuffer;
+
+	for (unsigned nOffset = 0; nOffset < nBufLen; nOffset += 16)
+	{
+		fprintf (stderr, "%s%s%04X:", pSource != 0 ? pSource : "", pSource != 0 ? ": " : "", nOffset);
+
+		for (unsigned i = nOffset; i < nOffset+16 && i < nBufLen; i++)
+		{
+			fprintf (stderr, " %02X", pData[i]);
+		}
+
+		fprintf (stderr, "\n");
+	}
+}
+
+#endif
@@ -0,0 +1,332 @@
+//
+// simhub.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simhub.h>
+#include <string.h>
+#include <assert.h>
+
+// Port features
+#define PORT_ENABLE		1
+#define PORT_SUSPEND		2
+#define C_PORT_CONNECTION	16
+#define C_PORT_ENABLE		17
+#define C_PORT_SUSPEND		18
+#define C_PORT_OVER_CURRENT	19
+#define C_PORT_RESET		20
+
+// Port change bits
+#define C_PORT_CONNECTION__MASK	(1 << 0)
+#define C_PORT_RESET__MASK	(1 << 4)
+
+// Hub class requests
+#define CLEAR_TT_BUFFER		8
+
+static TSimHandshake SimHubRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				    u8 *pData, unsigned *pLength);
+static TSimHandshake SimHubDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength);
+
+void SimHub (TSimHub *pThis, TUSBSpeed Speed, unsigned nPorts, boolean bMultiTT)
+{
+	assert (pThis != 0);
+	assert (0 < nPorts && nPorts <= SIM_MAX_PORTS);
+	assert (!bMultiTT || Speed == USBSpeedHigh);
+
+	memset (&pThis->m_DeviceDesc, 0, sizeof pThis->m_DeviceDesc);
+	pThis->m_DeviceDesc.bLength		= sizeof pThis->m_DeviceDesc;
+	pThis->m_DeviceDesc.bDescriptorType	= DESCRIPTOR_DEVICE;
+	pThis->m_DeviceDesc.bcdUSB		= Speed == USBSpeedHigh ? 0x200 : 0x110;
+	pThis->m_DeviceDesc.bDeviceClass	= USB_DEVICE_CLASS_HUB;
+	pThis->m_DeviceDesc.bDeviceProtocol	= Speed != USBSpeedHigh ? 0 : (bMultiTT ? 2 : 1);
+	pThis->m_DeviceDesc.bMaxPacketSize0	= 64;
+	pThis->m_DeviceDesc.idVendor		= 0x0424;
+	pThis->m_DeviceDesc.idProduct		= 0x2514;
+	pThis->m_DeviceDesc.bNumConfigurations	= 1;
+
+	u8 *p = pThis->m_ConfigDesc;
+	TUSBConfigurationDescriptor *pConfig = (TUSBConfigurationDescriptor *) p;
+	pConfig->bLength		= sizeof *pConfig;
+	pConfig->bDescriptorType	= DESCRIPTOR_CONFIGURATION;
+	pConfig->bNumInterfaces		= 1;
+	pConfig->bConfigurationValue	= 1;
+	pConfig->iConfiguration		= 0;
+	pConfig->bmAttributes		= 0xE0;
+	pConfig->bMaxPower		= 1;
+	p += sizeof *pConfig;
+
+	// a multi-TT hub offers the single TT operation (protocol 1) with alternate setting 0
+	// and the multi-TT operation (protocol 2) with alternate setting 1
+	for (unsigned nSetting = 0; nSetting < (bMultiTT ? 2 : 1); nSetting++)
+	{
+		TUSBInterfaceDescriptor *pInterface = (TUSBInterfaceDescriptor *) p;
+		pInterface->bLength		= sizeof *pInterface;
+		pInterface->bDescriptorType	= DESCRIPTOR_INTERFACE;
+		pInterface->bInterfaceNumber	= 0;
+		pInterface->bAlternateSetting	= (u8) nSetting;
+		pInterface->bNumEndpoints	= 1;
+		pInterface->bInterfaceClass	= USB_DEVICE_CLASS_HUB;
+		pInterface->bInterfaceSubClass	= 0;
+		pInterface->bInterfaceProtocol	= bMultiTT ? 1 + nSetting : 0;
+		pInterface->iInterface		= 0;
+		p += sizeof *pInterface;
+
+		TUSBEndpointDescriptor *pEndpoint = (TUSBEndpointDescriptor *) p;
+		pEndpoint->bLength		= sizeof *pEndpoint;
+		pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+		pEndpoint->bEndpointAddress	= 0x81;
+		pEndpoint->bmAttributes		= 0x03;
+		pEndpoint->wMaxPacketSize	= 1;
+		pEndpoint->bInterval		= Speed == USBSpeedHigh ? 12 : 255;
+		p += sizeof *pEndpoint;
+	}
+
+	pConfig->wTotalLength = (u16) (p - pThis->m_ConfigDesc);
+	assert (pConfig->wTotalLength <= sizeof pThis->m_ConfigDesc);
+
+	SimDevice (&pThis->m_Device, Speed, &pThis->m_DeviceDesc, pConfig, 0);
+
+	pThis->m_Device._SimDevice = _SimHub;
+	pThis->m_Device.Request = SimHubRequest;
+	pThis->m_Device.DataIn = SimHubDataIn;
+	pThis->m_Device.m_nPorts = nPorts;
+
+	pThis->m_bMultiTT = bMultiTT;
+	pThis->m_nTTResets = 0;
+
+	memset (pThis->m_PortStatus, 0, sizeof pThis->m_PortStatus);
+}
+
+void _SimHub (TSimDevice *pDevice)
+{
+	_SimDevice (pDevice);
+}
+
+void SimHubAttach (TSimHub *pThis, unsigned nPort, TSimDevice *pDevice)
+{
+	assert (pThis != 0);
+	assert (0 < nPort && nPort <= pThis->m_Device.m_nPorts);
+	assert (pDevice != 0);
+
+	assert (pThis->m_Device.m_pPort[nPort-1] == 0);
+	pThis->m_Device.m_pPort[nPort-1] = pDevice;
+
+	pThis->m_PortStatus[nPort-1].wPortStatus |= PORT_CONNECTION__MASK;
+	pThis->m_PortStatus[nPort-1].wChangeStatus |= C_PORT_CONNECTION__MASK;
+}
+
+boolean SimHubIsMultiTT (TSimHub *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_bMultiTT;
+}
+
+static TSimHandshake SimHubRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				    u8 *pData, unsigned *pLength)
+{
+	TSimHub *pThis = (TSimHub *) pDevice;
+	assert (pThis != 0);
+	assert (pSetup != 0);
+
+	unsigned nPort = pSetup->wIndex & 0xFF;
+	TUSBPortStatus *pStatus = 0;
+	if (0 < nPort && nPort <= pDevice->m_nPorts)
+	{
+		pStatus = &pThis->m_PortStatus[nPort-1];
+	}
+
+	switch (pSetup->bmRequestType)
+	{
+	case REQUEST_IN | REQUEST_CLASS:
+		if (   pSetup->bRequest == GET_DESCRIPTOR
+		    && pSetup->wValue >> 8 == DESCRIPTOR_HUB)
+		{
+			TUSBHubDescriptor *pHubDesc = (TUSBHubDescriptor *) pData;
+			pHubDesc->bDescLength		= sizeof *pHubDesc;
+			pHubDesc->bDescriptorType	= DESCRIPTOR_HUB;
+			pHubDesc->bNbrPorts		= (u8) pDevice->m_nPorts;
+			pHubDesc->wHubCharacteristics	= HUB_POWER_MODE_INDIVIDUAL;
+			pHubDesc->bPwrOn2PwrGood	= 50;
+			pHubDesc->bHubContrCurrent	= 1;
+			pHubDesc->DeviceRemoveable[0]	= 0;
+			pHubDesc->PortPwrCtrlMask[0]	= 0xFF;
+			*pLength = sizeof *pHubDesc;
+
+			return SimHandshakeACK;
+		}
+
+		if (pSetup->bRequest == GET_STATUS)
+		{
+			memset (pData, 0, sizeof (TUSBHubStatus));
+			*pLength = sizeof (TUSBHubStatus);
+
+			return SimHandshakeACK;
+		}
+		break;
+
+	case REQUEST_IN | REQUEST_CLASS | REQUEST_TO_OTHER:
+		if (   pSetup->bRequest == GET_STATUS
+		    && pStatus != 0)
+		{
+			memcpy (pData, pStatus, sizeof *pStatus);
+			*pLength = sizeof *pStatus;
+
+			return SimHandshakeACK;
+		}
+		break;
+
+	case REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_OTHER:
+		if (pSetup->bRequest == CLEAR_TT_BUFFER)
+		{
+			return SimHandshakeACK;
+		}
+
+		if (pSetup->bRequest == RESET_TT)
+		{
+			pThis->m_nTTResets++;
+
+			return SimHandshakeACK;
+		}
+
+		if (pStatus == 0)
+		{
+			break;
+		}
+
+		if (pSetup->bRequest == SET_FEATURE)
+		{
+			TSimDevice *pChild = pDevice->m_pPort[nPort-1];
+
+			switch (pSetup->wValue)
+			{
+			case PORT_POWER:
+				pStatus->wPortStatus |= PORT_POWER__MASK;
+				return SimHandshakeACK;
+
+			case PORT_RESET:
+				if (   pChild == 0
+				    || !(pStatus->wPortStatus & PORT_POWER__MASK))
+				{
+					return SimHandshakeACK;
+				}
+
+				// the reset completes immediately
+				pStatus->wPortStatus &= ~(PORT_LOW_SPEED__MASK | PORT_HIGH_SPEED__MASK);
+				if (SimDeviceGetSpeed (pChild) == USBSpeedLow)
+				{
+					pStatus->wPortStatus |= PORT_LOW_SPEED__MASK;
+				}
+				else if (SimDeviceGetSpeed (pChild) == USBSpeedHigh)
+				{
+					pStatus->wPortStatus |= PORT_HIGH_SPEED__MASK;
+				}
+				pStatus->wPortStatus |= PORT_ENABLE__MASK;
+				pStatus->wChangeStatus |= C_PORT_RESET__MASK;
+
+				SimDeviceBusReset (pChild);
+				return SimHandshakeACK;
+
+			case PORT_SUSPEND:
+				return SimHandshakeACK;
+
+			default:
+				break;
+			}
+		}
+		else if (pSetup->bRequest == CLEAR_FEATURE)
+		{
+			TSimDevice *pChild = pDevice->m_pPort[nPort-1];
+
+			switch (pSetup->wValue)
+			{
+			case PORT_ENABLE:
+			case PORT_POWER:
+				pStatus->wPortStatus &= ~PORT_ENABLE__MASK;
+				if (pSetup->wValue == PORT_POWER)
+				{
+					pStatus->wPortStatus &= ~PORT_POWER__MASK;
+				}
+				if (pChild != 0)
+				{
+					SimDeviceDisable (pChild);
+				}
+				return SimHandshakeACK;
+
+			case PORT_SUSPEND:
+				return SimHandshakeACK;
+
+			case C_PORT_CONNECTION:
+			case C_PORT_ENABLE:
+			case C_PORT_SUSPEND:
+			case C_PORT_OVER_CURRENT:
+			case C_PORT_RESET:
+				pStatus->wChangeStatus &= ~(1 << (pSetup->wValue - C_PORT_CONNECTION));
+				return SimHandshakeACK;
+
+			default:
+				break;
+			}
+		}
+		break;
+
+	case REQUEST_OUT | REQUEST_CLASS:
+		if (   pSetup->bRequest == CLEAR_FEATURE
+		    || pSetup->bRequest == SET_FEATURE)
+		{
+			return SimHandshakeACK;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return SimHandshakeSTALL;
+}
+
+static TSimHandshake SimHubDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength)
+{
+	TSimHub *pThis = (TSimHub *) pDevice;
+	assert (pThis != 0);
+
+	if (nEndpoint != 1)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	u8 ucChanges = 0;
+	for (unsigned nPort = 0; nPort < pDevice->m_nPorts; nPort++)
+	{
+		if (pThis->m_PortStatus[nPort].wChangeStatus != 0)
+		{
+			ucChanges |= 1 << (nPort+1);
+		}
+	}
+
+	if (ucChanges == 0)
+	{
+		return SimHandshakeNAK;
+	}
+
+	assert (*pLength >= 1);
+	pBuffer[0] = ucChanges;
+	*pLength = 1;
+
+	return SimHandshakeACK;
+}
@@ -0,0 +1,208 @@
+//
+// simiso.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simiso.h>
+#include <uspisim/simenv.h>
+#include <uspisim/dwc2core.h>
+#include <uspi/dwhci.h>
+#include <string.h>
+#include <assert.h>
+
+static const char * const s_Strings[] = {"USPi", "Simulated Isochronous Device", 0};
+
+static TSimHandshake SimIsoDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength);
+static TSimHandshake SimIsoDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				    const u8 *pBuffer, unsigned nLength);
+
+void SimIso (TSimIso *pThis)
+{
+	assert (pThis != 0);
+
+	memset (&pThis->m_DeviceDesc, 0, sizeof pThis->m_DeviceDesc);
+	pThis->m_DeviceDesc.bLength		= sizeof pThis->m_DeviceDesc;
+	pThis->m_DeviceDesc.bDescriptorType	= DESCRIPTOR_DEVICE;
+	pThis->m_DeviceDesc.bcdUSB		= 0x200;
+	pThis->m_DeviceDesc.bMaxPacketSize0	= 64;
+	pThis->m_DeviceDesc.idVendor		= 0x1234;
+	pThis->m_DeviceDesc.idProduct		= 0x0003;
+	pThis->m_DeviceDesc.iManufacturer	= 1;
+	pThis->m_DeviceDesc.iProduct		= 2;
+	pThis->m_DeviceDesc.bNumConfigurations	= 1;
+
+	u8 *p = pThis->m_ConfigDesc;
+	TUSBConfigurationDescriptor *pConfig = (TUSBConfigurationDescriptor *) p;
+	pConfig->bLength		= sizeof *pConfig;
+	pConfig->bDescriptorType	= DESCRIPTOR_CONFIGURATION;
+	pConfig->bNumInterfaces		= 1;
+	pConfig->bConfigurationValue	= 1;
+	pConfig->iConfiguration		= 0;
+	pConfig->bmAttributes		= 0x80;
+	pConfig->bMaxPower		= 50;
+	p += sizeof *pConfig;
+
+	TUSBInterfaceDescriptor *pInterface = (TUSBInterfaceDescriptor *) p;
+	pInterface->bLength		= sizeof *pInterface;
+	pInterface->bDescriptorType	= DESCRIPTOR_INTERFACE;
+	pInterface->bInterfaceNumber	= 0;
+	pInterface->bAlternateSetting	= 0;
+	pInterface->bNumEndpoints	= 2;
+	pInterface->bInterfaceClass	= 0xFF;		// vendor specific
+	pInterface->bInterfaceSubClass	= 0;
+	pInterface->bInterfaceProtocol	= 0;
+	pInterface->iInterface		= 0;
+	p += sizeof *pInterface;
+
+	TUSBEndpointDescriptor *pEndpoint = (TUSBEndpointDescriptor *) p;
+	pEndpoint->bLength		= sizeof *pEndpoint;
+	pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+	pEndpoint->bEndpointAddress	= 0x80 | SIM_ISO_EP_IN;
+	pEndpoint->bmAttributes		= 0x01;		// isochronous, no synchronization
+	pEndpoint->wMaxPacketSize	= SIM_ISO_PACKET_SIZE;
+	pEndpoint->bInterval		= 1;		// every microframe
+	p += sizeof *pEndpoint;
+
+	pEndpoint = (TUSBEndpointDescriptor *) p;
+	pEndpoint->bLength		= sizeof *pEndpoint;
+	pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+	pEndpoint->bEndpointAddress	= SIM_ISO_EP_OUT;
+	pEndpoint->bmAttributes		= 0x01;
+	pEndpoint->wMaxPacketSize	= SIM_ISO_PACKET_SIZE;
+	pEndpoint->bInterval		= 1;
+	p += sizeof *pEndpoint;
+
+	pConfig->wTotalLength = (u16) (p - pThis->m_ConfigDesc);
+	assert (pConfig->wTotalLength <= sizeof pThis->m_ConfigDesc);
+
+	SimDevice (&pThis->m_Device, USBSpeedHigh, &pThis->m_DeviceDesc, pConfig, s_Strings);
+
+	pThis->m_Device._SimDevice = _SimIso;
+	pThis->m_Device.DataIn = SimIsoDataIn;
+	pThis->m_Device.DataOut = SimIsoDataOut;
+
+	SimDeviceSetIsochronous (&pThis->m_Device, SIM_ISO_EP_IN, TRUE);
+	SimDeviceSetIsochronous (&pThis->m_Device, SIM_ISO_EP_OUT, FALSE);
+
+	pThis->m_nInSequence = 0;
+	pThis->m_nOutPackets = 0;
+	pThis->m_nOutGaps = 0;
+	pThis->m_nOutErrors = 0;
+	pThis->m_nOutLastFrame = 0;
+	pThis->m_nOutLastSequence = 0;
+}
+
+void _SimIso (TSimDevice *pDevice)
+{
+	_SimDevice (pDevice);
+}
+
+unsigned SimIsoGetInPackets (TSimIso *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nInSequence;
+}
+
+unsigned SimIsoGetOutPackets (TSimIso *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nOutPackets;
+}
+
+unsigned SimIsoGetOutGaps (TSimIso *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nOutGaps;
+}
+
+unsigned SimIsoGetOutErrors (TSimIso *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nOutErrors;
+}
+
+static TSimHandshake SimIsoDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength)
+{
+	TSimIso *pThis = (TSimIso *) pDevice;
+	assert (pThis != 0);
+	assert (pLength != 0);
+
+	if (   nEndpoint != SIM_ISO_EP_IN
+	    || *pLength < sizeof (TSimIsoHeader))
+	{
+		return SimHandshakeSTALL;
+	}
+
+	if (*pLength > SIM_ISO_PACKET_SIZE)
+	{
+		*pLength = SIM_ISO_PACKET_SIZE;
+	}
+
+	memset (pBuffer, 0, *pLength);
+
+	TSimIsoHeader Header;
+	Header.nSequence = pThis->m_nInSequence++;
+	Header.nFrame = DWC2CoreGetFrameNumber (SimGetCore ());
+	memcpy (pBuffer, &Header, sizeof Header);
+
+	return SimHandshakeACK;
+}
+
+static TSimHandshake SimIsoDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				    const u8 *pBuffer, unsigned nLength)
+{
+	TSimIso *pThis = (TSimIso *) pDevice;
+	assert (pThis != 0);
+
+	if (nEndpoint != SIM_ISO_EP_OUT)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	if (nLength < sizeof (TSimIsoHeader))
+	{
+		pThis->m_nOutErrors++;
+
+		return SimHandshakeACK;
+	}
+
+	TSimIsoHeader Header;
+	memcpy (&Header, pBuffer, sizeof Header);
+
+	unsigned nFrame = DWC2CoreGetFrameNumber (SimGetCore ());
+
+	if (pThis->m_nOutPackets > 0)
+	{
+		if (Header.nSequence != pThis->m_nOutLastSequence + 1)
+		{
+			pThis->m_nOutErrors++;
+		}
+
+		if (nFrame != ((pThis->m_nOutLastFrame + 1) & DWHCI_MAX_FRAME_NUMBER))
+		{
+			pThis->m_nOutGaps++;
+		}
+	}
+
+	pThis->m_nOutPackets++;
+	pThis->m_nOutLastFrame = nFrame;
+	pThis->m_nOutLastSequence = Header.nSequence;
+
+	return SimHandshakeACK;
+}
@@ -0,0 +1,271 @@
+//
+// simkeyboard.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simkeyboard.h>
+#include <uspisim/simenv.h>
+#include <uspi/usbhid.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct THIDDescriptor
+{
+	unsigned char	bLength;
+	unsigned char	bDescriptorType;
+	unsigned short	bcdHID;
+	unsigned char	bCountryCode;
+	unsigned char	bNumDescriptors;
+	unsigned char	bReportDescriptorType;
+	unsigned short	wReportDescriptorLength;
+}
+PACKED THIDDescriptor;
+
+static const u8 s_ReportDescriptor[] =
+{
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+	0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0
+};
+
+static const char * const s_Strings[] = {"USPi", "Simulated Keyboard", 0};
+
+static TSimHandshake SimKeyboardRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+					 u8 *pData, unsigned *pLength);
+static TSimHandshake SimKeyboardDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+					u8 *pBuffer, unsigned *pLength);
+
+void SimKeyboard (TSimKeyboard *pThis, TUSBSpeed Speed)
+{
+	assert (pThis != 0);
+	assert (Speed != USBSpeedHigh);
+
+	memset (&pThis->m_DeviceDesc, 0, sizeof pThis->m_DeviceDesc);
+	pThis->m_DeviceDesc.bLength		= sizeof pThis->m_DeviceDesc;
+	pThis->m_DeviceDesc.bDescriptorType	= DESCRIPTOR_DEVICE;
+	pThis->m_DeviceDesc.bcdUSB		= 0x110;
+	pThis->m_DeviceDesc.bMaxPacketSize0	= 8;
+	pThis->m_DeviceDesc.idVendor		= 0x1234;
+	pThis->m_DeviceDesc.idProduct		= 0x0001;
+	pThis->m_DeviceDesc.iManufacturer	= 1;
+	pThis->m_DeviceDesc.iProduct		= 2;
+	pThis->m_DeviceDesc.bNumConfigurations	= 1;
+
+	u8 *p = pThis->m_ConfigDesc;
+	TUSBConfigurationDescriptor *pConfig = (TUSBConfigurationDescriptor *) p;
+	pConfig->bLength		= sizeof *pConfig;
+	pConfig->bDescriptorType	= DESCRIPTOR_CONFIGURATION;
+	pConfig->bNumInterfaces		= 1;
+	pConfig->bConfigurationValue	= 1;
+	pConfig->iConfiguration		= 0;
+	pConfig->bmAttributes		= 0xA0;
+	pConfig->bMaxPower		= 50;
+	p += sizeof *pConfig;
+
+	TUSBInterfaceDescriptor *pInterface = (TUSBInterfaceDescriptor *) p;
+	pInterface->bLength		= sizeof *pInterface;
+	pInterface->bDescriptorType	= DESCRIPTOR_INTERFACE;
+	pInterface->bInterfaceNumber	= 0;
+	pInterface->bAlternateSetting	= 0;
+	pInterface->bNumEndpoints	= 1;
+	pInterface->bInterfaceClass	= 3;		// HID
+	pInterface->bInterfaceSubClass	= 1;		// boot
+	pInterface->bInterfaceProtocol	= 1;		// keyboard
+	pInterface->iInterface		= 0;
+	p += sizeof *pInterface;
+
+	THIDDescriptor *pHID = (THIDDescriptor *) p;
+	pHID->bLength			= sizeof *pHID;
+	pHID->bDescriptorType		= DESCRIPTOR_HID;
+	pHID->bcdHID			= 0x111;
+	pHID->bCountryCode		= 0;
+	pHID->bNumDescriptors		= 1;
+	pHID->bReportDescriptorType	= DESCRIPTOR_REPORT;
+	pHID->wReportDescriptorLength	= sizeof s_ReportDescriptor;
+	p += sizeof *pHID;
+
+	TUSBEndpointDescriptor *pEndpoint = (TUSBEndpointDescriptor *) p;
+	pEndpoint->bLength		= sizeof *pEndpoint;
+	pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+	pEndpoint->bEndpointAddress	= 0x81;
+	pEndpoint->bmAttributes		= 0x03;
+	pEndpoint->wMaxPacketSize	= SIM_KEYBOARD_REPORT_SIZE;
+	pEndpoint->bInterval		= 10;
+	p += sizeof *pEndpoint;
+
+	pConfig->wTotalLength = (u16) (p - pThis->m_ConfigDesc);
+	assert (pConfig->wTotalLength <= sizeof pThis->m_ConfigDesc);
+
+	SimDevice (&pThis->m_Device, Speed, &pThis->m_DeviceDesc, pConfig, s_Strings);
+
+	pThis->m_Device._SimDevice = _SimKeyboard;
+	pThis->m_Device.Request = SimKeyboardRequest;
+	pThis->m_Device.DataIn = SimKeyboardDataIn;
+
+	pThis->m_nInPtr = 0;
+	pThis->m_nOutPtr = 0;
+	pThis->m_ucLEDs = 0;
+	pThis->m_nReportsSent = 0;
+	pThis->m_nLatencySum = 0;
+	pThis->m_nLatencyMax = 0;
+}
+
+void _SimKeyboard (TSimDevice *pDevice)
+{
+	_SimDevice (pDevice);
+}
+
+static boolean SimKeyboardQueueReport (TSimKeyboard *pThis, u8 ucModifiers, u8 ucKeyCode, u64 nTime)
+{
+	assert (pThis != 0);
+
+	unsigned nInPtr = (pThis->m_nInPtr + 1) % SIM_KEYBOARD_QUEUE_SIZE;
+	if (nInPtr == pThis->m_nOutPtr)
+	{
+		return FALSE;
+	}
+
+	u8 *pReport = pThis->m_Queue[pThis->m_nInPtr];
+	memset (pReport, 0, SIM_KEYBOARD_REPORT_SIZE);
+	pReport[0] = ucModifiers;
+	pReport[2] = ucKeyCode;
+
+	pThis->m_QueueTime[pThis->m_nInPtr] = nTime;
+	pThis->m_nInPtr = nInPtr;
+
+	return TRUE;
+}
+
+boolean SimKeyboardPressKey (TSimKeyboard *pThis, u8 ucModifiers, u8 ucKeyCode, u64 nTime)
+{
+	assert (pThis != 0);
+
+	return    SimKeyboardQueueReport (pThis, ucModifiers, ucKeyCode, nTime)
+	       && SimKeyboardQueueReport (pThis, 0, 0, nTime + 50000000ULL);
+}
+
+u8 SimKeyboardGetLEDs (TSimKeyboard *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_ucLEDs;
+}
+
+unsigned SimKeyboardGetReportsSent (TSimKeyboard *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nReportsSent;
+}
+
+u64 SimKeyboardGetAverageLatency (TSimKeyboard *pThis)
+{
+	assert (pThis != 0);
+	if (pThis->m_nReportsSent == 0)
+	{
+		return 0;
+	}
+
+	return pThis->m_nLatencySum / pThis->m_nReportsSent;
+}
+
+u64 SimKeyboardGetMaxLatency (TSimKeyboard *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nLatencyMax;
+}
+
+static TSimHandshake SimKeyboardRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+					 u8 *pData, unsigned *pLength)
+{
+	TSimKeyboard *pThis = (TSimKeyboard *) pDevice;
+	assert (pThis != 0);
+	assert (pSetup != 0);
+
+	switch (pSetup->bmRequestType)
+	{
+	case REQUEST_IN | REQUEST_TO_INTERFACE:
+		if (   pSetup->bRequest == GET_DESCRIPTOR
+		    && pSetup->wValue >> 8 == DESCRIPTOR_REPORT)
+		{
+			memcpy (pData, s_ReportDescriptor, sizeof s_ReportDescriptor);
+			*pLength = sizeof s_ReportDescriptor;
+
+			return SimHandshakeACK;
+		}
+		break;
+
+	case REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_INTERFACE:
+		switch (pSetup->bRequest)
+		{
+		case SET_PROTOCOL:
+		case SET_IDLE:
+			return SimHandshakeACK;
+
+		case SET_REPORT:
+			if (*pLength >= 1)
+			{
+				pThis->m_ucLEDs = pData[0];
+			}
+			return SimHandshakeACK;
+
+		default:
+			break;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return SimHandshakeSTALL;
+}
+
+static TSimHandshake SimKeyboardDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+					u8 *pBuffer, unsigned *pLength)
+{
+	TSimKeyboard *pThis = (TSimKeyboard *) pDevice;
+	assert (pThis != 0);
+
+	if (nEndpoint != 1)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	u64 nNow = SimGetTime ();
+
+	if (   pThis->m_nOutPtr == pThis->m_nInPtr
+	    || pThis->m_QueueTime[pThis->m_nOutPtr] > nNow)
+	{
+		return SimHandshakeNAK;
+	}
+
+	assert (*pLength >= SIM_KEYBOARD_REPORT_SIZE);
+	memcpy (pBuffer, pThis->m_Queue[pThis->m_nOutPtr], SIM_KEYBOARD_REPORT_SIZE);
+	*pLength = SIM_KEYBOARD_REPORT_SIZE;
+
+	u64 nLatency = nNow - pThis->m_QueueTime[pThis->m_nOutPtr];
+	pThis->m_nLatencySum += nLatency;
+	if (nLatency > pThis->m_nLatencyMax)
+	{
+		pThis->m_nLatencyMax = nLatency;
+	}
+	pThis->m_nReportsSent++;
+
+	pThis->m_nOutPtr = (pThis->m_nOutPtr + 1) % SIM_KEYBOARD_QUEUE_SIZE;
+
+	return SimHandshakeACK;
+}
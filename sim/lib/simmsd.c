@@ -0,0 +1,652 @@
+//
+// simmsd.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simmsd.h>
+#include <uspisim/simenv.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define EP_IN			1
+#define EP_OUT			2
+
+// Bulk-Only Transport
+#define CBW_SIGNATURE		0x43425355
+#define CBW_SIZE		31
+#define CBW_FLAGS_DATA_IN	0x80
+#define CSW_SIGNATURE		0x53425355
+#define CSW_SIZE		13
+#define CSW_STATUS_PASSED	0x00
+#define CSW_STATUS_FAILED	0x01
+
+#define BOT_RESET		0xFF
+#define BOT_GET_MAX_LUN		0xFE
+
+// SCSI
+#define SCSI_TEST_UNIT_READY	0x00
+#define SCSI_REQUEST_SENSE	0x03
+#define SCSI_INQUIRY		0x12
+#define SCSI_MODE_SENSE6	0x1A
+#define SCSI_READ_CAPACITY10	0x25
+#define SCSI_READ10		0x28
+#define SCSI_WRITE10		0x2A
+#define SCSI_READ16		0x88
+#define SCSI_WRITE16		0x8A
+#define SCSI_SERVICE_ACTION_IN16 0x9E
+#define SCSI_SYNCHRONIZE_CACHE10 0x35
+#define SCSI_SYNCHRONIZE_CACHE16 0x91
+#define SCSI_WRITE_FUA		0x08
+#define SA_READ_CAPACITY16	0x10
+#define INQUIRY_EVPD		0x01
+#define VPD_SUPPORTED_PAGES	0x00
+#define VPD_BLOCK_LIMITS	0xB0
+
+#define SENSE_NO_SENSE		0x00
+#define SENSE_ILLEGAL_REQUEST	0x05
+
+#define ASC_INVALID_OPCODE	0x20
+#define ASC_LBA_OUT_OF_RANGE	0x21
+#define ASC_INVALID_FIELD_IN_CDB 0x24
+
+static TSimHandshake SimMSDRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				    u8 *pData, unsigned *pLength);
+static TSimHandshake SimMSDDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength);
+static TSimHandshake SimMSDDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				    const u8 *pBuffer, unsigned nLength);
+static void SimMSDBusReset (TSimDevice *pDevice);
+static void SimMSDCommand (TSimMSD *pThis, const u8 *pCB);
+
+static const char * const s_Strings[] = {"USPi", "Simulated RAM Disk", "0123456789AB", 0};
+
+void SimMSD (TSimMSD *pThis, TUSBSpeed Speed, unsigned nBlocks, unsigned nBlockSize)
+{
+	assert (pThis != 0);
+	assert (Speed == USBSpeedHigh || Speed == USBSpeedFull);
+	assert (nBlocks > 0);
+	assert (nBlockSize >= 512 && (nBlockSize & (nBlockSize-1)) == 0);
+
+	unsigned nMaxPacketSize = Speed == USBSpeedHigh ? 512 : 64;
+
+	memset (&pThis->m_DeviceDesc, 0, sizeof pThis->m_DeviceDesc);
+	pThis->m_DeviceDesc.bLength		= sizeof pThis->m_DeviceDesc;
+	pThis->m_DeviceDesc.bDescriptorType	= DESCRIPTOR_DEVICE;
+	pThis->m_DeviceDesc.bcdUSB		= Speed == USBSpeedHigh ? 0x200 : 0x110;
+	pThis->m_DeviceDesc.bMaxPacketSize0	= 64;
+	pThis->m_DeviceDesc.idVendor		= 0x1234;
+	pThis->m_DeviceDesc.idProduct		= 0x0002;
+	pThis->m_DeviceDesc.iManufacturer	= 1;
+	pThis->m_DeviceDesc.iProduct		= 2;
+	pThis->m_DeviceDesc.iSerialNumber	= 3;
+	pThis->m_DeviceDesc.bNumConfigurations	= 1;
+
+	u8 *p = pThis->m_ConfigDesc;
+	TUSBConfigurationDescriptor *pConfig = (TUSBConfigurationDescriptor *) p;
+	pConfig->bLength		= sizeof *pConfig;
+	pConfig->bDescriptorType	= DESCRIPTOR_CONFIGURATION;
+	pConfig->bNumInterfaces		= 1;
+	pConfig->bConfigurationValue	= 1;
+	pConfig->iConfiguration		= 0;
+	pConfig->bmAttributes		= 0x80;
+	pConfig->bMaxPower		= 100;
+	p += sizeof *pConfig;
+
+	TUSBInterfaceDescriptor *pInterface = (TUSBInterfaceDescriptor *) p;
+	pInterface->bLength		= sizeof *pInterface;
+	pInterface->bDescriptorType	= DESCRIPTOR_INTERFACE;
+	pInterface->bInterfaceNumber	= 0;
+	pInterface->bAlternateSetting	= 0;
+	pInterface->bNumEndpoints	= 2;
+	pInterface->bInterfaceClass	= 8;		// mass storage
+	pInterface->bInterfaceSubClass	= 6;		// SCSI transparent
+	pInterface->bInterfaceProtocol	= 0x50;		// bulk-only
+	pInterface->iInterface		= 0;
+	p += sizeof *pInterface;
+
+	TUSBEndpointDescriptor *pEndpoint = (TUSBEndpointDescriptor *) p;
+	pEndpoint->bLength		= sizeof *pEndpoint;
+	pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+	pEndpoint->bEndpointAddress	= 0x80 | EP_IN;
+	pEndpoint->bmAttributes		= 0x02;
+	pEndpoint->wMaxPacketSize	= nMaxPacketSize;
+	pEndpoint->bInterval		= 0;
+	p += sizeof *pEndpoint;
+
+	pEndpoint = (TUSBEndpointDescriptor *) p;
+	pEndpoint->bLength		= sizeof *pEndpoint;
+	pEndpoint->bDescriptorType	= DESCRIPTOR_ENDPOINT;
+	pEndpoint->bEndpointAddress	= EP_OUT;
+	pEndpoint->bmAttributes		= 0x02;
+	pEndpoint->wMaxPacketSize	= nMaxPacketSize;
+	pEndpoint->bInterval		= 0;
+	p += sizeof *pEndpoint;
+
+	pConfig->wTotalLength = (u16) (p - pThis->m_ConfigDesc);
+	assert (pConfig->wTotalLength <= sizeof pThis->m_ConfigDesc);
+
+	SimDevice (&pThis->m_Device, Speed, &pThis->m_DeviceDesc, pConfig, s_Strings);
+
+	pThis->m_Device._SimDevice = _SimMSD;
+	pThis->m_Device.Request = SimMSDRequest;
+	pThis->m_Device.DataIn = SimMSDDataIn;
+	pThis->m_Device.DataOut = SimMSDDataOut;
+	pThis->m_Device.BusReset = SimMSDBusReset;
+
+	pThis->m_nBlocks = nBlocks;
+	pThis->m_nBlockSize = nBlockSize;
+	pThis->m_nVirtualBlocks = nBlocks;
+	pThis->m_nMaxTransfer = 0;
+	pThis->m_nOptimalTransfer = 0;
+	pThis->m_bBlockLimits = FALSE;
+	pThis->m_pDisk = (u8 *) calloc (nBlocks, nBlockSize);
+	assert (pThis->m_pDisk != 0);
+
+	pThis->m_nMediaLatency = 0;
+	pThis->m_nCommitLatency = 0;
+	pThis->m_nCommandLatency = 0;
+	pThis->m_nReadyTime = 0;
+	pThis->m_bDirty = FALSE;
+
+	pThis->m_State = SimMSDStateCommand;
+	pThis->m_ucSenseKey = SENSE_NO_SENSE;
+	pThis->m_ucASC = 0;
+
+	pThis->m_nCommands = 0;
+	pThis->m_nCommits = 0;
+	pThis->m_nBlocksRead = 0;
+	pThis->m_nBlocksWritten = 0;
+}
+
+void _SimMSD (TSimDevice *pDevice)
+{
+	TSimMSD *pThis = (TSimMSD *) pDevice;
+	assert (pThis != 0);
+
+	free (pThis->m_pDisk);
+	pThis->m_pDisk = 0;
+
+	_SimDevice (pDevice);
+}
+
+void SimMSDSetMediaLatency (TSimMSD *pThis, u64 nNanoSeconds)
+{
+	assert (pThis != 0);
+	pThis->m_nMediaLatency = nNanoSeconds;
+}
+
+void SimMSDSetCommitLatency (TSimMSD *pThis, u64 nNanoSeconds)
+{
+	assert (pThis != 0);
+	pThis->m_nCommitLatency = nNanoSeconds;
+}
+
+void SimMSDSetVirtualBlocks (TSimMSD *pThis, u64 nBlocks)
+{
+	assert (pThis != 0);
+	assert (nBlocks >= pThis->m_nBlocks && nBlocks % pThis->m_nBlocks == 0);
+	pThis->m_nVirtualBlocks = nBlocks;
+}
+
+void SimMSDSetBlockLimits (TSimMSD *pThis, u32 nMaxBlocks, u32 nOptimalBlocks)
+{
+	assert (pThis != 0);
+	pThis->m_nMaxTransfer = nMaxBlocks;
+	pThis->m_nOptimalTransfer = nOptimalBlocks;
+	pThis->m_bBlockLimits = TRUE;
+}
+
+u8 *SimMSDGetDisk (TSimMSD *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_pDisk;
+}
+
+unsigned SimMSDGetCommands (TSimMSD *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nCommands;
+}
+
+unsigned SimMSDGetCommits (TSimMSD *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nCommits;
+}
+
+u64 SimMSDGetBlocksRead (TSimMSD *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nBlocksRead;
+}
+
+u64 SimMSDGetBlocksWritten (TSimMSD *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nBlocksWritten;
+}
+
+static TSimHandshake SimMSDRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				    u8 *pData, unsigned *pLength)
+{
+	TSimMSD *pThis = (TSimMSD *) pDevice;
+	assert (pThis != 0);
+	assert (pSetup != 0);
+
+	switch (pSetup->bmRequestType)
+	{
+	case REQUEST_OUT | REQUEST_CLASS | REQUEST_TO_INTERFACE:
+		if (pSetup->bRequest == BOT_RESET)
+		{
+			pThis->m_State = SimMSDStateCommand;
+
+			return SimHandshakeACK;
+		}
+		break;
+
+	case REQUEST_IN | REQUEST_CLASS | REQUEST_TO_INTERFACE:
+		if (pSetup->bRequest == BOT_GET_MAX_LUN)
+		{
+			pData[0] = 0;
+			*pLength = 1;
+
+			return SimHandshakeACK;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return SimHandshakeSTALL;
+}
+
+static TSimHandshake SimMSDDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				   u8 *pBuffer, unsigned *pLength)
+{
+	TSimMSD *pThis = (TSimMSD *) pDevice;
+	assert (pThis != 0);
+
+	if (nEndpoint != EP_IN)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	if (SimGetTime () < pThis->m_nReadyTime)
+	{
+		return SimHandshakeNAK;
+	}
+
+	unsigned nMaxPacketSize = *pLength;
+
+	switch (pThis->m_State)
+	{
+	case SimMSDStateDataIn: {
+		unsigned nChunk = 0;
+		if (pThis->m_nDataOffset < pThis->m_nDataSize)
+		{
+			nChunk = pThis->m_nDataSize - pThis->m_nDataOffset;
+			if (nChunk > nMaxPacketSize)
+			{
+				nChunk = nMaxPacketSize;
+			}
+
+			memcpy (pBuffer, pThis->m_pData + pThis->m_nDataOffset, nChunk);
+			pThis->m_nDataOffset += nChunk;
+		}
+
+		*pLength = nChunk;
+
+		if (   nChunk < nMaxPacketSize
+		    || pThis->m_nDataOffset >= pThis->m_nDataLength)
+		{
+			pThis->m_State = SimMSDStateStatus;
+		}
+		} return SimHandshakeACK;
+
+	case SimMSDStateStatus: {
+		assert (nMaxPacketSize >= CSW_SIZE);
+
+		u32 nResidue = 0;
+		if (pThis->m_nDataLength > pThis->m_nDataOffset)
+		{
+			nResidue = pThis->m_nDataLength - pThis->m_nDataOffset;
+		}
+
+		u32 nSignature = CSW_SIGNATURE;
+		memcpy (pBuffer, &nSignature, 4);
+		memcpy (pBuffer+4, &pThis->m_nTag, 4);
+		memcpy (pBuffer+8, &nResidue, 4);
+		pBuffer[12] = pThis->m_ucStatus;
+		*pLength = CSW_SIZE;
+
+		pThis->m_State = SimMSDStateCommand;
+		} return SimHandshakeACK;
+
+	default:
+		return SimHandshakeNAK;
+	}
+}
+
+static TSimHandshake SimMSDDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				    const u8 *pBuffer, unsigned nLength)
+{
+	TSimMSD *pThis = (TSimMSD *) pDevice;
+	assert (pThis != 0);
+
+	if (nEndpoint != EP_OUT)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	switch (pThis->m_State)
+	{
+	case SimMSDStateCommand: {
+		u32 nSignature;
+		memcpy (&nSignature, pBuffer, 4);
+		if (   nLength != CBW_SIZE
+		    || nSignature != CBW_SIGNATURE)
+		{
+			return SimHandshakeSTALL;
+		}
+
+		memcpy (&pThis->m_nTag, pBuffer+4, 4);
+		memcpy (&pThis->m_nDataLength, pBuffer+8, 4);
+
+		pThis->m_pData = 0;
+		pThis->m_nDataOffset = 0;
+		pThis->m_nDataSize = 0;
+		pThis->m_ucStatus = CSW_STATUS_PASSED;
+		pThis->m_nCommandLatency = 0;
+		pThis->m_nCommands++;
+
+		SimMSDCommand (pThis, pBuffer+15);
+
+		if (pThis->m_nDataSize > pThis->m_nDataLength)
+		{
+			pThis->m_nDataSize = pThis->m_nDataLength;
+		}
+
+		if (pThis->m_nDataLength == 0)
+		{
+			pThis->m_State = SimMSDStateStatus;
+		}
+		else
+		{
+			pThis->m_State =   pBuffer[12] & CBW_FLAGS_DATA_IN
+					 ? SimMSDStateDataIn : SimMSDStateDataOut;
+		}
+
+		pThis->m_nReadyTime = SimGetTime () + pThis->m_nMediaLatency + pThis->m_nCommandLatency;
+		} return SimHandshakeACK;
+
+	case SimMSDStateDataOut:
+		if (SimGetTime () < pThis->m_nReadyTime)
+		{
+			return SimHandshakeNAK;
+		}
+
+		if (pThis->m_nDataOffset < pThis->m_nDataSize)
+		{
+			unsigned nChunk = pThis->m_nDataSize - pThis->m_nDataOffset;
+			if (nChunk > nLength)
+			{
+				nChunk = nLength;
+			}
+
+			memcpy (pThis->m_pData + pThis->m_nDataOffset, pBuffer, nChunk);
+		}
+
+		pThis->m_nDataOffset += nLength;
+		if (pThis->m_nDataOffset >= pThis->m_nDataLength)
+		{
+			pThis->m_State = SimMSDStateStatus;
+		}
+		return SimHandshakeACK;
+
+	default:
+		return SimHandshakeSTALL;
+	}
+}
+
+static void SimMSDBusReset (TSimDevice *pDevice)
+{
+	TSimMSD *pThis = (TSimMSD *) pDevice;
+	assert (pThis != 0);
+
+	pThis->m_State = SimMSDStateCommand;
+}
+
+static void SimMSDSetSense (TSimMSD *pThis, u8 ucSenseKey, u8 ucASC)
+{
+	assert (pThis != 0);
+
+	pThis->m_ucSenseKey = ucSenseKey;
+	pThis->m_ucASC = ucASC;
+
+	pThis->m_ucStatus = CSW_STATUS_FAILED;
+}
+
+static u32 GetBE32 (const u8 *p)
+{
+	return (u32) p[0] << 24 | (u32) p[1] << 16 | (u32) p[2] << 8 | p[3];
+}
+
+static void PutBE32 (u8 *p, u32 nValue)
+{
+	p[0] = nValue >> 24;
+	p[1] = nValue >> 16;
+	p[2] = nValue >> 8;
+	p[3] = nValue;
+}
+
+static u64 GetBE64 (const u8 *p)
+{
+	return (u64) GetBE32 (p) << 32 | GetBE32 (p+4);
+}
+
+static void PutBE64 (u8 *p, u64 nValue)
+{
+	PutBE32 (p, nValue >> 32);
+	PutBE32 (p+4, (u32) nValue);
+}
+
+static void SimMSDCommand (TSimMSD *pThis, const u8 *pCB)
+{
+	assert (pThis != 0);
+	assert (pCB != 0);
+
+	u8 *pResponse = pThis->m_Response;
+
+	switch (pCB[0])
+	{
+	case SCSI_TEST_UNIT_READY:
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		memset (pResponse, 0, 18);
+		pResponse[0] = 0x70;
+		pResponse[2] = pThis->m_ucSenseKey;
+		pResponse[7] = 10;
+		pResponse[12] = pThis->m_ucASC;
+		pThis->m_pData = pResponse;
+		pThis->m_nDataSize = pCB[4] < 18 ? pCB[4] : 18;
+
+		pThis->m_ucSenseKey = SENSE_NO_SENSE;
+		pThis->m_ucASC = 0;
+		break;
+
+	case SCSI_INQUIRY:
+		if (pCB[1] & INQUIRY_EVPD)
+		{
+			if (!pThis->m_bBlockLimits)
+			{
+				SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+				break;
+			}
+
+			unsigned nLength;
+			memset (pResponse, 0, 64);
+			pResponse[1] = pCB[2];
+			switch (pCB[2])
+			{
+			case VPD_SUPPORTED_PAGES:
+				pResponse[3] = 2;
+				pResponse[4] = VPD_SUPPORTED_PAGES;
+				pResponse[5] = VPD_BLOCK_LIMITS;
+				nLength = 6;
+				break;
+
+			case VPD_BLOCK_LIMITS:
+				pResponse[3] = 0x3C;
+				PutBE32 (pResponse+8, pThis->m_nMaxTransfer);
+				PutBE32 (pResponse+12, pThis->m_nOptimalTransfer);
+				nLength = 64;
+				break;
+
+			default:
+				SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+				nLength = 0;
+				break;
+			}
+
+			if (nLength > 0)
+			{
+				pThis->m_pData = pResponse;
+				pThis->m_nDataSize = pCB[4] < nLength ? pCB[4] : nLength;
+			}
+			break;
+		}
+
+		memset (pResponse, 0, 36);
+		pResponse[0] = 0x00;		// direct access block device
+		pResponse[1] = 0x80;		// removable
+		pResponse[2] = pThis->m_bBlockLimits ? 0x05 : 0x04;	// SPC-3 or SPC-2
+		pResponse[3] = 0x02;		// response data format
+		pResponse[4] = 36-5;
+		memcpy (pResponse+8, "USPi    ", 8);
+		memcpy (pResponse+16, "RAM Disk        ", 16);
+		memcpy (pResponse+32, "1.00", 4);
+		pThis->m_pData = pResponse;
+		pThis->m_nDataSize = pCB[4] < 36 ? pCB[4] : 36;
+		break;
+
+	case SCSI_MODE_SENSE6:
+		memset (pResponse, 0, 4);
+		pResponse[0] = 3;		// mode data length
+		pThis->m_pData = pResponse;
+		pThis->m_nDataSize = pCB[4] < 4 ? pCB[4] : 4;
+		break;
+
+	case SCSI_READ_CAPACITY10:
+		PutBE32 (pResponse,   pThis->m_nVirtualBlocks <= 0xFFFFFFFFULL
+				    ? (u32) (pThis->m_nVirtualBlocks-1) : 0xFFFFFFFF);
+		PutBE32 (pResponse+4, pThis->m_nBlockSize);
+		pThis->m_pData = pResponse;
+		pThis->m_nDataSize = 8;
+		break;
+
+	case SCSI_SERVICE_ACTION_IN16: {
+		if ((pCB[1] & 0x1F) != SA_READ_CAPACITY16)
+		{
+			SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+			break;
+		}
+
+		memset (pResponse, 0, 32);
+		PutBE64 (pResponse, pThis->m_nVirtualBlocks-1);
+		PutBE32 (pResponse+8, pThis->m_nBlockSize);
+		pThis->m_pData = pResponse;
+		u32 nAllocLength = GetBE32 (pCB+10);
+		pThis->m_nDataSize = nAllocLength < 32 ? nAllocLength : 32;
+		} break;
+
+	case SCSI_READ10:
+	case SCSI_WRITE10:
+	case SCSI_READ16:
+	case SCSI_WRITE16: {
+		u64 nLBA;
+		u32 nCount;
+		if (   pCB[0] == SCSI_READ10
+		    || pCB[0] == SCSI_WRITE10)
+		{
+			nLBA = GetBE32 (pCB+2);
+			nCount = (u32) pCB[7] << 8 | pCB[8];
+		}
+		else
+		{
+			nLBA = GetBE64 (pCB+2);
+			nCount = GetBE32 (pCB+10);
+		}
+
+		// the RAM disk is mirrored over the virtual capacity
+		u64 nBlock = nLBA % pThis->m_nBlocks;
+		if (   nLBA >= pThis->m_nVirtualBlocks
+		    || nCount > pThis->m_nBlocks - nBlock)
+		{
+			SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+			break;
+		}
+
+		if (   pThis->m_nMaxTransfer != 0
+		    && nCount > pThis->m_nMaxTransfer)
+		{
+			SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+			break;
+		}
+
+		pThis->m_pData = pThis->m_pDisk + nBlock * pThis->m_nBlockSize;
+		pThis->m_nDataSize = nCount * pThis->m_nBlockSize;	// nCount <= m_nBlocks
+
+		if (   pCB[0] == SCSI_READ10
+		    || pCB[0] == SCSI_READ16)
+		{
+			pThis->m_nBlocksRead += nCount;
+		}
+		else
+		{
+			pThis->m_nBlocksWritten += nCount;
+
+			if (pCB[1] & SCSI_WRITE_FUA)
+			{
+				pThis->m_nCommandLatency = pThis->m_nCommitLatency;
+				pThis->m_nCommits++;
+			}
+			else
+			{
+				pThis->m_bDirty = TRUE;
+			}
+		}
+		} break;
+
+	case SCSI_SYNCHRONIZE_CACHE10:
+	case SCSI_SYNCHRONIZE_CACHE16:
+		if (pThis->m_bDirty)
+		{
+			pThis->m_nCommandLatency = pThis->m_nCommitLatency;
+			pThis->m_nCommits++;
+
+			pThis->m_bDirty = FALSE;
+		}
+		break;
+
+	default:
+		SimMSDSetSense (pThis, SENSE_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+		break;
+	}
+}
@@ -0,0 +1,805 @@
+//
+// simreplay.c
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simreplay.h>
+#include <uspisim/simenv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define PCAP_MAGIC_US		0xA1B2C3D4
+#define PCAP_MAGIC_NS		0xA1B23C4D
+#define PCAP_FILE_HEADER_SIZE	24
+#define PCAP_RECORD_HEADER_SIZE	16
+
+#define LINKTYPE_USB_LINUX		189		// 48 bytes header
+#define LINKTYPE_USB_LINUX_MMAPPED	220		// 64 bytes header, isochronous descriptors
+
+#define USBMON_HEADER_SIZE(linktype)	((linktype) == LINKTYPE_USB_LINUX ? 48 : 64)
+#define USBMON_ISO_DESC_SIZE		16
+
+#define XFER_CONTROL		2
+
+// Linux error numbers
+#define ENOENT			2
+#define EREMOTEIO		121
+
+// wire time per byte in ns, until the packet interval of an endpoint has been measured
+static const unsigned s_WireTime[] = {17, 667, 5333};	// high, full, low speed
+
+static TSimHandshake SimReplayRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				       u8 *pData, unsigned *pLength);
+static TSimHandshake SimReplayDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				      u8 *pBuffer, unsigned *pLength);
+static TSimHandshake SimReplayDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				       const u8 *pBuffer, unsigned nLength);
+static boolean SimReplayStartTransfer (TSimReplay *pThis, TSimReplayEndpoint *pEP, unsigned nPacketSize);
+static void SimReplayPacketDone (TSimReplay *pThis, TSimReplayEndpoint *pEP);
+static unsigned SimReplayGetMaxPacketSize (TSimReplay *pThis, unsigned nEndpoint, boolean bIn);
+static const TSimCaptureRecord *SimCaptureFindDescriptor (TSimCapture *pThis, u8 ucAddress,
+							  u8 ucType, u8 ucIndex, boolean bLongest,
+							  unsigned nEndRecord);
+
+static u16 GetLE16 (const u8 *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static u32 GetLE32 (const u8 *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+}
+
+boolean SimCapture (TSimCapture *pThis, const char *pFileName)
+{
+	assert (pThis != 0);
+	assert (pFileName != 0);
+
+	memset (pThis, 0, sizeof *pThis);
+
+	FILE *pFile = fopen (pFileName, "rb");
+	if (pFile == 0)
+	{
+		return FALSE;
+	}
+
+	fseek (pFile, 0, SEEK_END);
+	long nSize = ftell (pFile);
+	fseek (pFile, 0, SEEK_SET);
+
+	pThis->m_pFile = (u8 *) malloc (nSize > 0 ? nSize : 1);
+	if (   pThis->m_pFile == 0
+	    || fread (pThis->m_pFile, 1, nSize, pFile) != (size_t) nSize
+	    || nSize < PCAP_FILE_HEADER_SIZE)
+	{
+		fclose (pFile);
+		_SimCapture (pThis);
+
+		return FALSE;
+	}
+
+	fclose (pFile);
+
+	// little endian files only (the byte order of the Raspberry Pi and x86)
+	u32 nMagic = GetLE32 (pThis->m_pFile);
+	u32 nLinkType = GetLE32 (pThis->m_pFile + 20);
+	if (   (nMagic != PCAP_MAGIC_US && nMagic != PCAP_MAGIC_NS)
+	    || (nLinkType != LINKTYPE_USB_LINUX && nLinkType != LINKTYPE_USB_LINUX_MMAPPED))
+	{
+		_SimCapture (pThis);
+
+		return FALSE;
+	}
+
+	unsigned nHeaderSize = USBMON_HEADER_SIZE (nLinkType);
+	unsigned nMaxRecords = (nSize - PCAP_FILE_HEADER_SIZE) / (PCAP_RECORD_HEADER_SIZE + nHeaderSize);
+	pThis->m_pRecord = (TSimCaptureRecord *) calloc (nMaxRecords + 1, sizeof (TSimCaptureRecord));
+	assert (pThis->m_pRecord != 0);
+
+	u64 nFirstTime = 0;
+	long nOffset = PCAP_FILE_HEADER_SIZE;
+	while (nOffset + PCAP_RECORD_HEADER_SIZE <= nSize)
+	{
+		const u8 *pHeader = pThis->m_pFile + nOffset;
+		u64 nTime =   GetLE32 (pHeader) * 1000000000ULL
+			    + GetLE32 (pHeader + 4) * (nMagic == PCAP_MAGIC_US ? 1000ULL : 1ULL);
+		u32 nInclLen = GetLE32 (pHeader + 8);
+
+		nOffset += PCAP_RECORD_HEADER_SIZE;
+		if (   nOffset + nInclLen > (unsigned long) nSize
+		    || nInclLen < nHeaderSize)
+		{
+			break;				// truncated
+		}
+
+		const u8 *pPacket = pThis->m_pFile + nOffset;
+		nOffset += nInclLen;
+
+		assert (pThis->m_nRecords < nMaxRecords);
+		TSimCaptureRecord *pRecord = &pThis->m_pRecord[pThis->m_nRecords++];
+
+		if (pThis->m_nRecords == 1)
+		{
+			nFirstTime = nTime;
+		}
+
+		pRecord->nID = GetLE32 (pPacket) | (u64) GetLE32 (pPacket + 4) << 32;
+		pRecord->nTime = nTime - nFirstTime;
+		pRecord->chType = (char) pPacket[8];
+		pRecord->ucTransferType = pPacket[9];
+		pRecord->ucEndpoint = pPacket[10];
+		pRecord->ucDevice = pPacket[11];
+		pRecord->bSetup = pPacket[14] == 0;
+		pRecord->nStatus = (int) GetLE32 (pPacket + 28);
+		pRecord->nLength = GetLE32 (pPacket + 32);
+		pRecord->nCaptured = GetLE32 (pPacket + 36);
+		memcpy (pRecord->Setup, pPacket + 40, sizeof pRecord->Setup);
+
+		unsigned nDataOffset = nHeaderSize;
+		if (nLinkType == LINKTYPE_USB_LINUX_MMAPPED)
+		{
+			nDataOffset += GetLE32 (pPacket + 60) * USBMON_ISO_DESC_SIZE;
+		}
+
+		if (nDataOffset + pRecord->nCaptured > nInclLen)
+		{
+			pRecord->nCaptured = nDataOffset < nInclLen ? nInclLen - nDataOffset : 0;
+		}
+		pRecord->pData = pPacket + nDataOffset;
+	}
+
+	return TRUE;
+}
+
+void _SimCapture (TSimCapture *pThis)
+{
+	assert (pThis != 0);
+
+	free (pThis->m_pRecord);
+	pThis->m_pRecord = 0;
+	pThis->m_nRecords = 0;
+
+	free (pThis->m_pFile);
+	pThis->m_pFile = 0;
+}
+
+int SimCaptureFindSubmit (TSimCapture *pThis, unsigned nRecord)
+{
+	assert (pThis != 0);
+	assert (nRecord < pThis->m_nRecords);
+
+	const TSimCaptureRecord *pComplete = &pThis->m_pRecord[nRecord];
+	for (int i = (int) nRecord - 1; i >= 0; i--)
+	{
+		const TSimCaptureRecord *pRecord = &pThis->m_pRecord[i];
+		if (pRecord->nID != pComplete->nID)
+		{
+			continue;
+		}
+
+		if (pRecord->chType != 'S')
+		{
+			return -1;			// the request has been completed before
+		}
+
+		return i;
+	}
+
+	return -1;
+}
+
+const TUSBDeviceDescriptor *SimCaptureGetDeviceDescriptor (TSimCapture *pThis, u8 ucAddress)
+{
+	const TSimCaptureRecord *pRecord =
+		SimCaptureFindDescriptor (pThis, ucAddress, DESCRIPTOR_DEVICE, 0, FALSE, pThis->m_nRecords);
+	if (pRecord == 0)
+	{
+		// the device descriptor may have been read in the default state only,
+		// use the last one read there, before the address has been assigned
+		for (unsigned i = 0; i < pThis->m_nRecords; i++)
+		{
+			const TSimCaptureRecord *pSetAddress = &pThis->m_pRecord[i];
+			if (   pSetAddress->ucDevice == 0
+			    && pSetAddress->chType == 'S'
+			    && pSetAddress->bSetup
+			    && pSetAddress->Setup[0] == REQUEST_OUT
+			    && pSetAddress->Setup[1] == SET_ADDRESS
+			    && pSetAddress->Setup[2] == ucAddress)
+			{
+				pRecord = SimCaptureFindDescriptor (pThis, 0, DESCRIPTOR_DEVICE, 0, FALSE, i);
+
+				break;
+			}
+		}
+	}
+
+	if (   pRecord == 0
+	    || pRecord->nCaptured < sizeof (TUSBDeviceDescriptor))
+	{
+		return 0;
+	}
+
+	return (const TUSBDeviceDescriptor *) pRecord->pData;
+}
+
+const TUSBConfigurationDescriptor *SimCaptureGetConfigDescriptor (TSimCapture *pThis, u8 ucAddress)
+{
+	const TSimCaptureRecord *pRecord =
+		SimCaptureFindDescriptor (pThis, ucAddress, DESCRIPTOR_CONFIGURATION, 0, TRUE,
+					  pThis->m_nRecords);
+	if (   pRecord == 0
+	    || pRecord->nCaptured < sizeof (TUSBConfigurationDescriptor))
+	{
+		return 0;
+	}
+
+	const TUSBConfigurationDescriptor *pConfig = (const TUSBConfigurationDescriptor *) pRecord->pData;
+	if (pConfig->wTotalLength > pRecord->nCaptured)
+	{
+		return 0;
+	}
+
+	return pConfig;
+}
+
+TUSBSpeed SimCaptureGuessSpeed (TSimCapture *pThis, u8 ucAddress)
+{
+	const TUSBDeviceDescriptor *pDevice = SimCaptureGetDeviceDescriptor (pThis, ucAddress);
+	const TUSBConfigurationDescriptor *pConfig = SimCaptureGetConfigDescriptor (pThis, ucAddress);
+	if (   pDevice == 0
+	    || pConfig == 0)
+	{
+		return USBSpeedFull;
+	}
+
+	unsigned nMaxPacketSize = 0;
+	const u8 *p = (const u8 *) pConfig;
+	for (unsigned i = 0; i + 1 < pConfig->wTotalLength && p[i] != 0; i += p[i])
+	{
+		if (   p[i+1] == DESCRIPTOR_ENDPOINT
+		    && i + sizeof (TUSBEndpointDescriptor) <= pConfig->wTotalLength)
+		{
+			unsigned nSize = GetLE16 (p + i + 4) & 0x7FF;
+			if (nSize > nMaxPacketSize)
+			{
+				nMaxPacketSize = nSize;
+			}
+		}
+	}
+
+	// full-speed bulk and interrupt endpoints have 64 bytes at most,
+	// low-speed devices have 8 bytes packets and are USB 1.x devices
+	if (   nMaxPacketSize > 64
+	    || (   pDevice->bcdUSB >= 0x200
+		&& pDevice->bMaxPacketSize0 == 64
+		&& nMaxPacketSize == 0))
+	{
+		return USBSpeedHigh;
+	}
+
+	if (   pDevice->bMaxPacketSize0 == 8
+	    && nMaxPacketSize <= 8
+	    && pDevice->bcdUSB < 0x200)
+	{
+		return USBSpeedLow;
+	}
+
+	return USBSpeedFull;
+}
+
+boolean SimReplay (TSimReplay *pThis, TSimCapture *pCapture, u8 ucAddress,
+		   TUSBSpeed Speed, boolean bTiming)
+{
+	assert (pThis != 0);
+	assert (pCapture != 0);
+
+	memset (pThis, 0, sizeof *pThis);
+
+	const TUSBDeviceDescriptor *pDeviceDesc = SimCaptureGetDeviceDescriptor (pCapture, ucAddress);
+	const TUSBConfigurationDescriptor *pConfigDesc = SimCaptureGetConfigDescriptor (pCapture, ucAddress);
+	if (   pDeviceDesc == 0
+	    || pConfigDesc == 0
+	    || pConfigDesc->wTotalLength > sizeof pThis->m_ConfigDesc)
+	{
+		return FALSE;
+	}
+
+	memcpy (&pThis->m_DeviceDesc, pDeviceDesc, sizeof pThis->m_DeviceDesc);
+	memcpy (pThis->m_ConfigDesc, pConfigDesc, pConfigDesc->wTotalLength);
+
+	// the base class returns the strings in UTF-16 again, other characters get lost
+	for (unsigned i = 0; i < SIM_REPLAY_MAX_STRINGS; i++)
+	{
+		const TSimCaptureRecord *pRecord =
+			SimCaptureFindDescriptor (pCapture, ucAddress, DESCRIPTOR_STRING, i+1, TRUE,
+						  pCapture->m_nRecords);
+
+		char *pString = pThis->m_String[i];
+		for (unsigned j = 2; pRecord != 0 && j+1 < pRecord->nCaptured && j+1 < pRecord->pData[0]; j += 2)
+		{
+			*pString++ = pRecord->pData[j+1] == 0 ? (char) pRecord->pData[j] : '?';
+		}
+		*pString = '\0';
+
+		pThis->m_pString[i] = pThis->m_String[i];
+	}
+	pThis->m_pString[SIM_REPLAY_MAX_STRINGS] = 0;
+
+	SimDevice (&pThis->m_Device, Speed, &pThis->m_DeviceDesc,
+		   (TUSBConfigurationDescriptor *) pThis->m_ConfigDesc, pThis->m_pString);
+
+	pThis->m_Device._SimDevice = _SimReplay;
+	pThis->m_Device.Request = SimReplayRequest;
+	pThis->m_Device.DataIn = SimReplayDataIn;
+	pThis->m_Device.DataOut = SimReplayDataOut;
+
+	pThis->m_bTiming = bTiming;
+
+	for (unsigned nEndpoint = 1; nEndpoint < SIM_MAX_ENDPOINTS; nEndpoint++)
+	{
+		for (unsigned bIn = 0; bIn <= 1; bIn++)
+		{
+			if (SimReplayGetMaxPacketSize (pThis, nEndpoint | (bIn ? 0x80 : 0), bIn) == 0)
+			{
+				// no isochronous endpoints, which are not replayed
+				continue;
+			}
+
+			pThis->m_Endpoint[bIn][nEndpoint].pTransfer =
+				(TSimReplayTransfer *) calloc (pCapture->m_nRecords, sizeof (TSimReplayTransfer));
+			assert (pThis->m_Endpoint[bIn][nEndpoint].pTransfer != 0);
+		}
+	}
+
+	pThis->m_pControl = (TSimReplayControl *) calloc (pCapture->m_nRecords + 1, sizeof (TSimReplayControl));
+	assert (pThis->m_pControl != 0);
+
+	u64 LastComplete[2][SIM_MAX_ENDPOINTS];
+	memset (LastComplete, 0, sizeof LastComplete);
+
+	for (unsigned i = 0; i < pCapture->m_nRecords; i++)
+	{
+		const TSimCaptureRecord *pRecord = &pCapture->m_pRecord[i];
+		if (   pRecord->ucDevice != ucAddress
+		    || pRecord->chType != 'C'
+		    || (   pRecord->nStatus != 0
+			&& pRecord->nStatus != -SIM_REPLAY_EPIPE
+			&& pRecord->nStatus != -EREMOTEIO))
+		{
+			continue;			// cancelled requests did not reach the device
+		}
+
+		int nSubmit = SimCaptureFindSubmit (pCapture, i);
+		if (nSubmit < 0)
+		{
+			continue;
+		}
+		const TSimCaptureRecord *pSubmit = &pCapture->m_pRecord[nSubmit];
+
+		boolean bIn = pRecord->ucEndpoint & 0x80 ? TRUE : FALSE;
+		unsigned nEndpoint = pRecord->ucEndpoint & 0x0F;
+
+		if (pRecord->ucTransferType == XFER_CONTROL)
+		{
+			if (!pSubmit->bSetup)
+			{
+				continue;
+			}
+
+			TSimReplayControl *pControl = &pThis->m_pControl[pThis->m_nControls++];
+			memcpy (&pControl->Setup, pSubmit->Setup, sizeof pControl->Setup);
+			pControl->pData = pRecord->pData;
+			pControl->nLength = bIn ? pRecord->nLength : 0;
+			pControl->nCaptured = bIn ? pRecord->nCaptured : 0;
+			pControl->bStall = pRecord->nStatus == -SIM_REPLAY_EPIPE;
+
+			continue;
+		}
+
+		TSimReplayEndpoint *pEP = &pThis->m_Endpoint[bIn][nEndpoint];
+		if (pEP->pTransfer == 0)
+		{
+			continue;
+		}
+
+		TSimReplayTransfer *pTransfer = &pEP->pTransfer[pEP->nTransfers++];
+		if (bIn)
+		{
+			pTransfer->pData = pRecord->pData;
+			pTransfer->nCaptured = pRecord->nCaptured;
+		}
+		else
+		{
+			pTransfer->pData = pSubmit->pData;
+			pTransfer->nCaptured = pSubmit->nCaptured;
+		}
+		pTransfer->nLength = pRecord->nLength;
+		pTransfer->bShort = pRecord->nLength < pSubmit->nLength;
+		pTransfer->bStall = pRecord->nStatus == -SIM_REPLAY_EPIPE;
+
+		// the request was started, when it was submitted or the previous one completed
+		u64 nStart = pSubmit->nTime > LastComplete[bIn][nEndpoint] ? pSubmit->nTime
+									   : LastComplete[bIn][nEndpoint];
+		pTransfer->nDuration = pRecord->nTime - nStart;
+
+		LastComplete[bIn][nEndpoint] = pRecord->nTime;
+	}
+
+	return TRUE;
+}
+
+void _SimReplay (TSimDevice *pDevice)
+{
+	TSimReplay *pThis = (TSimReplay *) pDevice;
+	assert (pThis != 0);
+
+	for (unsigned bIn = 0; bIn <= 1; bIn++)
+	{
+		for (unsigned nEndpoint = 0; nEndpoint < SIM_MAX_ENDPOINTS; nEndpoint++)
+		{
+			free (pThis->m_Endpoint[bIn][nEndpoint].pTransfer);
+			pThis->m_Endpoint[bIn][nEndpoint].pTransfer = 0;
+		}
+	}
+
+	free (pThis->m_pControl);
+	pThis->m_pControl = 0;
+
+	_SimDevice (pDevice);
+}
+
+unsigned SimReplayGetTransfers (TSimReplay *pThis)
+{
+	assert (pThis != 0);
+
+	unsigned nResult = 0;
+	for (unsigned bIn = 0; bIn <= 1; bIn++)
+	{
+		for (unsigned nEndpoint = 0; nEndpoint < SIM_MAX_ENDPOINTS; nEndpoint++)
+		{
+			nResult += pThis->m_Endpoint[bIn][nEndpoint].nTransfers;
+		}
+	}
+
+	return nResult;
+}
+
+unsigned SimReplayGetReplayed (TSimReplay *pThis)
+{
+	assert (pThis != 0);
+
+	unsigned nResult = 0;
+	for (unsigned bIn = 0; bIn <= 1; bIn++)
+	{
+		for (unsigned nEndpoint = 0; nEndpoint < SIM_MAX_ENDPOINTS; nEndpoint++)
+		{
+			nResult += pThis->m_Endpoint[bIn][nEndpoint].nNext;
+		}
+	}
+
+	return nResult;
+}
+
+unsigned SimReplayGetMismatches (TSimReplay *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nMismatches;
+}
+
+unsigned SimReplayGetUnmatched (TSimReplay *pThis)
+{
+	assert (pThis != 0);
+	return pThis->m_nUnmatched;
+}
+
+// class, vendor and unknown standard requests are answered like recorded, in the recorded
+// order, the last answer is repeated, if the request is issued more often than recorded
+static TSimHandshake SimReplayRequest (TSimDevice *pDevice, const TSetupData *pSetup,
+				       u8 *pData, unsigned *pLength)
+{
+	TSimReplay *pThis = (TSimReplay *) pDevice;
+	assert (pThis != 0);
+	assert (pSetup != 0);
+	assert (pLength != 0);
+
+	TSimReplayControl *pControl = 0;
+	for (unsigned i = 0; i < pThis->m_nControls; i++)
+	{
+		if (memcmp (&pThis->m_pControl[i].Setup, pSetup, sizeof (TSetupData)) == 0)
+		{
+			pControl = &pThis->m_pControl[i];
+			if (!pControl->bReplayed)
+			{
+				break;
+			}
+		}
+	}
+
+	if (pControl == 0)
+	{
+		pThis->m_nUnmatched++;
+
+		return SimHandshakeSTALL;
+	}
+
+	pControl->bReplayed = TRUE;
+
+	if (pControl->bStall)
+	{
+		return SimHandshakeSTALL;
+	}
+
+	if (pSetup->bmRequestType & REQUEST_IN)
+	{
+		unsigned nLength = pControl->nLength < *pLength ? pControl->nLength : *pLength;
+		memset (pData, 0, nLength);
+		memcpy (pData, pControl->pData, pControl->nCaptured < nLength ? pControl->nCaptured : nLength);
+
+		*pLength = nLength;
+	}
+
+	return SimHandshakeACK;
+}
+
+static TSimHandshake SimReplayDataIn (TSimDevice *pDevice, unsigned nEndpoint,
+				      u8 *pBuffer, unsigned *pLength)
+{
+	TSimReplay *pThis = (TSimReplay *) pDevice;
+	assert (pThis != 0);
+	assert (nEndpoint < SIM_MAX_ENDPOINTS);
+	assert (pBuffer != 0);
+	assert (pLength != 0);
+
+	TSimReplayEndpoint *pEP = &pThis->m_Endpoint[1][nEndpoint];
+	if (!SimReplayStartTransfer (pThis, pEP, *pLength))
+	{
+		*pLength = 0;
+
+		return SimHandshakeNAK;
+	}
+
+	TSimReplayTransfer *pTransfer = &pEP->pTransfer[pEP->nNext];
+	if (pTransfer->bStall)
+	{
+		pEP->nNext++;
+		pEP->bStarted = FALSE;
+
+		SimDeviceSetHalt (pDevice, nEndpoint, TRUE, TRUE);
+
+		return SimHandshakeSTALL;
+	}
+
+	unsigned nMaxPacketSize = *pLength;
+	assert (pEP->nOffset <= pTransfer->nLength);
+	unsigned nChunk = pTransfer->nLength - pEP->nOffset;
+	if (nChunk > nMaxPacketSize)
+	{
+		nChunk = nMaxPacketSize;
+	}
+
+	memset (pBuffer, 0, nChunk);
+	if (pEP->nOffset < pTransfer->nCaptured)
+	{
+		unsigned nCopy = pTransfer->nCaptured - pEP->nOffset;
+		memcpy (pBuffer, pTransfer->pData + pEP->nOffset, nCopy < nChunk ? nCopy : nChunk);
+	}
+
+	SimReplayPacketDone (pThis, pEP);
+
+	pEP->nOffset += nChunk;
+	*pLength = nChunk;
+
+	// a transfer shorter than requested ends with a short packet, which may be a ZLP
+	if (   pEP->nOffset == pTransfer->nLength
+	    && (   nChunk < nMaxPacketSize
+		|| !pTransfer->bShort))
+	{
+		pEP->nNext++;
+		pEP->bStarted = FALSE;
+	}
+
+	return SimHandshakeACK;
+}
+
+static TSimHandshake SimReplayDataOut (TSimDevice *pDevice, unsigned nEndpoint,
+				       const u8 *pBuffer, unsigned nLength)
+{
+	TSimReplay *pThis = (TSimReplay *) pDevice;
+	assert (pThis != 0);
+	assert (nEndpoint < SIM_MAX_ENDPOINTS);
+
+	TSimReplayEndpoint *pEP = &pThis->m_Endpoint[0][nEndpoint];
+	if (   pEP->pTransfer != 0
+	    && pEP->nNext >= pEP->nTransfers)
+	{
+		pThis->m_nUnmatched++;		// more data than recorded, accept it
+
+		return SimHandshakeACK;
+	}
+
+	if (!SimReplayStartTransfer (pThis, pEP, nLength))
+	{
+		return SimHandshakeNAK;
+	}
+
+	TSimReplayTransfer *pTransfer = &pEP->pTransfer[pEP->nNext];
+	if (pTransfer->bStall)
+	{
+		pEP->nNext++;
+		pEP->bStarted = FALSE;
+
+		SimDeviceSetHalt (pDevice, nEndpoint, FALSE, TRUE);
+
+		return SimHandshakeSTALL;
+	}
+
+	if (pEP->nOffset < pTransfer->nCaptured)
+	{
+		unsigned nCompare = pTransfer->nCaptured - pEP->nOffset;
+		if (nCompare > nLength)
+		{
+			nCompare = nLength;
+		}
+
+		if (memcmp (pBuffer, pTransfer->pData + pEP->nOffset, nCompare) != 0)
+		{
+			pThis->m_nMismatches++;
+		}
+	}
+
+	SimReplayPacketDone (pThis, pEP);
+
+	pEP->nOffset += nLength;
+
+	if (   pEP->nOffset >= pTransfer->nLength
+	    || nLength < SimReplayGetMaxPacketSize (pThis, nEndpoint, FALSE))
+	{
+		pEP->nNext++;
+		pEP->bStarted = FALSE;
+	}
+
+	return SimHandshakeACK;
+}
+
+// returns FALSE, if there is no transfer left or the device is not ready for the next packet yet
+static boolean SimReplayStartTransfer (TSimReplay *pThis, TSimReplayEndpoint *pEP, unsigned nPacketSize)
+{
+	assert (pThis != 0);
+	assert (pEP != 0);
+
+	if (pEP->nNext >= pEP->nTransfers)
+	{
+		return FALSE;
+	}
+
+	if (!pEP->bStarted)
+	{
+		pEP->bStarted = TRUE;
+		pEP->nOffset = 0;
+		pEP->nStartTime = SimGetTime ();
+	}
+
+	// the device is not ready for the first packet, before the recorded duration of the
+	// transfer has elapsed, less the time its packets take in the simulation
+	const TSimReplayTransfer *pTransfer = &pEP->pTransfer[pEP->nNext];
+	if (   !pThis->m_bTiming
+	    || pEP->nOffset > 0)
+	{
+		return TRUE;
+	}
+
+	u64 nTransferTime = (u64) pTransfer->nLength * s_WireTime[pThis->m_Device.m_Speed];
+	if (pEP->nPacketInterval != 0)
+	{
+		unsigned nPackets = (pTransfer->nLength + nPacketSize-1) / nPacketSize;
+		nTransferTime = (nPackets > 0 ? nPackets : 1) * pEP->nPacketInterval;
+	}
+
+	return    pTransfer->nDuration <= nTransferTime
+	       || SimGetTime () >= pEP->nStartTime + pTransfer->nDuration - nTransferTime;
+}
+
+// measures the time between the packets of a transfer, which are not delayed by the replay
+static void SimReplayPacketDone (TSimReplay *pThis, TSimReplayEndpoint *pEP)
+{
+	assert (pThis != 0);
+	assert (pEP != 0);
+
+	u64 nTime = SimGetTime ();
+	if (pEP->nOffset > 0)
+	{
+		u64 nInterval = nTime - pEP->nLastPacketTime;
+		pEP->nPacketInterval =   pEP->nPacketInterval != 0
+				       ? (3 * pEP->nPacketInterval + nInterval) / 4 : nInterval;
+	}
+
+	pEP->nLastPacketTime = nTime;
+}
+
+// returns 0 if the endpoint is not found or isochronous
+static unsigned SimReplayGetMaxPacketSize (TSimReplay *pThis, unsigned nEndpoint, boolean bIn)
+{
+	assert (pThis != 0);
+
+	const TUSBConfigurationDescriptor *pConfig = (const TUSBConfigurationDescriptor *) pThis->m_ConfigDesc;
+	const u8 *p = pThis->m_ConfigDesc;
+	for (unsigned i = 0; i + 1 < pConfig->wTotalLength && p[i] != 0; i += p[i])
+	{
+		if (   p[i+1] == DESCRIPTOR_ENDPOINT
+		    && (p[i+2] & 0x0F) == (nEndpoint & 0x0F)
+		    && !(p[i+2] & 0x80) == !bIn
+		    && (p[i+3] & 3) != 1)
+		{
+			return GetLE16 (p + i + 4) & 0x7FF;
+		}
+	}
+
+	return 0;
+}
+
+// returns the longest or the last complete descriptor read before record nEndRecord
+static const TSimCaptureRecord *SimCaptureFindDescriptor (TSimCapture *pThis, u8 ucAddress,
+							  u8 ucType, u8 ucIndex, boolean bLongest,
+							  unsigned nEndRecord)
+{
+	assert (pThis != 0);
+	assert (nEndRecord <= pThis->m_nRecords);
+
+	const TSimCaptureRecord *pResult = 0;
+	for (unsigned i = 0; i < nEndRecord; i++)
+	{
+		const TSimCaptureRecord *pRecord = &pThis->m_pRecord[i];
+		if (   pRecord->ucDevice != ucAddress
+		    || pRecord->chType != 'C'
+		    || pRecord->ucTransferType != XFER_CONTROL
+		    || pRecord->nStatus != 0)
+		{
+			continue;
+		}
+
+		int nSubmit = SimCaptureFindSubmit (pThis, i);
+		if (nSubmit < 0)
+		{
+			continue;
+		}
+
+		const u8 *pSetup = pThis->m_pRecord[nSubmit].Setup;
+		if (   !pThis->m_pRecord[nSubmit].bSetup
+		    || pSetup[0] != REQUEST_IN
+		    || pSetup[1] != GET_DESCRIPTOR
+		    || pSetup[2] != ucIndex
+		    || pSetup[3] != ucType
+		    || (ucType == DESCRIPTOR_STRING && GetLE16 (pSetup + 4) == 0))
+		{
+			continue;
+		}
+
+		if (   pResult == 0
+		    || (   bLongest
+			&& pRecord->nCaptured > pResult->nCaptured)
+		    || (   !bLongest
+			&& pRecord->nCaptured >= sizeof (TUSBDeviceDescriptor)))
+		{
+			pResult = pRecord;
+		}
+	}
+
+	return pResult;
+}
@@ -0,0 +1,810 @@
+//
+// uspireplay.c
+//
+// Replays a USB capture (see USPiCaptureStart()) against the unmodified USPi drivers
+//
+// The recorded devices are replaced by simulated devices, which answer like recorded
+// (see sim/lib/simreplay.c). The application calls (mass-storage reads and writes,
+// sent Ethernet frames) are reconstructed from the recorded requests and issued again.
+//
+// Topology: root port - hub (live model, if a hub has been recorded) - port 1..n: the
+//           recorded devices in the order of their addresses
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspisim/simenv.h>
+#include <uspisim/simhub.h>
+#include <uspisim/simreplay.h>
+#include <uspi/synchronize.h>
+#include <uspi.h>
+#include <uspios.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_OPERATION		(1024 * 1024)		// bytes per read or write
+#define IDLE_TIMEOUT		1000			// ms without progress at the end
+#define IDLE_TAIL		100			// ms to process the last completions
+
+#define XFER_BULK		3
+
+#define CBW_SIGNATURE		0x43425355		// "USBC"
+#define CBW_LENGTH		31
+#define CBW_DATA_LENGTH_OFFSET	8
+#define CBW_CDB_OFFSET		15
+#define CSW_LENGTH		13
+#define SCSI_READ10		0x28
+#define SCSI_WRITE10		0x2A
+#define SCSI_READ16		0x88
+#define SCSI_WRITE16		0x8A
+#define SCSI_SYNCHRONIZE_CACHE10 0x35
+#define SCSI_SYNCHRONIZE_CACHE16 0x91
+#define SCSI_WRITE_FUA		0x08
+
+#define ETH_TX_HEADER		8			// in front of each frame (SMSC951x, LAN7800)
+
+static const char FromReplay[] = "replay";
+
+typedef enum
+{
+	DeviceOther,					// the driver works on its own (HID)
+	DeviceHub,
+	DeviceMassStorage,
+	DeviceEthernet
+}
+TDeviceKind;
+
+typedef enum
+{
+	OperationRead,
+	OperationWrite,
+	OperationSend,
+	OperationFlush,
+	OperationUnknown
+}
+TOperationType;
+
+typedef struct TOperation
+{
+	TOperationType		 Type;
+	unsigned		 nDevice;	// index of the mass-storage device
+	unsigned long long	 ullOffset;
+	unsigned		 nCount;
+	boolean			 bFUA;		// write: recorded with FUA
+	const TSimCaptureRecord	*pData;		// write or send: submit with the data or 0
+	unsigned		 nDataOffset;
+	u64			 nRecordedTime;	// ns, 0 if unknown
+}
+TOperation;
+
+typedef struct TReplayResult
+{
+	u64		nEnumTime;
+	unsigned	nOperations[OperationUnknown];	// [TOperationType]
+	unsigned	nFailed;
+	u64		nBytes[OperationUnknown];
+	u64		nTime[OperationUnknown];	// ns
+	u64		nRecordedTime[OperationUnknown];
+	u64		nMaxLatency;			// of an operation (ns)
+	unsigned	nKeyReports;
+	unsigned	nMouseReports;
+	unsigned	nGamePadReports;
+	unsigned	nFramesReceived;
+}
+TReplayResult;
+
+static TSimCapture s_Capture;
+static TDeviceKind s_Kind[SIM_REPLAY_MAX_DEVICES+1];
+static TSimReplay s_Replay[SIM_MAX_PORTS];
+static unsigned s_nReplays;
+static TOperation *s_pOperation;
+static unsigned s_nOperations;
+static TReplayResult s_Result;
+static boolean s_bWriteBack[SIM_REPLAY_MAX_DEVICES];	// write policy of mass-storage device
+
+static u32 GetBE32 (const u8 *p)
+{
+	return (u32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static u32 GetLE32 (const u8 *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+}
+
+static void KeyStatusHandlerRaw (unsigned char ucModifiers, const unsigned char RawKeys[6])
+{
+	s_Result.nKeyReports++;
+}
+
+static void MouseStatusHandler (unsigned nButtons, int nDisplacementX, int nDisplacementY)
+{
+	s_Result.nMouseReports++;
+}
+
+static void GamePadStatusHandler (unsigned nDeviceIndex, const USPiGamePadState *pGamePadState)
+{
+	s_Result.nGamePadReports++;
+}
+
+static TDeviceKind GetDeviceKind (u8 ucAddress)
+{
+	const TUSBDeviceDescriptor *pDevice = SimCaptureGetDeviceDescriptor (&s_Capture, ucAddress);
+	const TUSBConfigurationDescriptor *pConfig = SimCaptureGetConfigDescriptor (&s_Capture, ucAddress);
+	if (   pDevice == 0
+	    || pConfig == 0)
+	{
+		return DeviceOther;
+	}
+
+	if (pDevice->bDeviceClass == 0x09)
+	{
+		return DeviceHub;
+	}
+
+	if (   pDevice->idVendor == 0x0424
+	    && (   pDevice->idProduct == 0xEC00
+		|| pDevice->idProduct == 0x7800))
+	{
+		return DeviceEthernet;
+	}
+
+	const u8 *p = (const u8 *) pConfig;
+	for (unsigned i = 0; i + 5 < pConfig->wTotalLength && p[i] != 0; i += p[i])
+	{
+		if (   p[i+1] == DESCRIPTOR_INTERFACE
+		    && p[i+5] == 0x08)
+		{
+			return DeviceMassStorage;
+		}
+	}
+
+	return DeviceOther;
+}
+
+// returns the number of ports from the recorded hub descriptor or 0
+static unsigned GetHubPorts (u8 ucAddress)
+{
+	for (unsigned i = 0; i < s_Capture.m_nRecords; i++)
+	{
+		const TSimCaptureRecord *pRecord = &s_Capture.m_pRecord[i];
+		if (   pRecord->ucDevice == ucAddress
+		    && pRecord->chType == 'C'
+		    && pRecord->nStatus == 0
+		    && pRecord->nCaptured > 2)
+		{
+			int nSubmit = SimCaptureFindSubmit (&s_Capture, i);
+			if (   nSubmit >= 0
+			    && s_Capture.m_pRecord[nSubmit].bSetup
+			    && s_Capture.m_pRecord[nSubmit].Setup[0] == (REQUEST_IN | REQUEST_CLASS)
+			    && s_Capture.m_pRecord[nSubmit].Setup[1] == GET_DESCRIPTOR
+			    && s_Capture.m_pRecord[nSubmit].Setup[3] == 0x29)
+			{
+				return pRecord->pData[2];
+			}
+		}
+	}
+
+	return 0;
+}
+
+// the time from the submit of the CBW until the completion of the CSW
+static u64 GetRecordedTime (unsigned nCBW)
+{
+	const TSimCaptureRecord *pCBW = &s_Capture.m_pRecord[nCBW];
+	for (unsigned i = nCBW+1; i < s_Capture.m_nRecords; i++)
+	{
+		const TSimCaptureRecord *pRecord = &s_Capture.m_pRecord[i];
+		if (   pRecord->ucDevice == pCBW->ucDevice
+		    && pRecord->ucTransferType == XFER_BULK
+		    && (pRecord->ucEndpoint & 0x80)
+		    && pRecord->chType == 'C'
+		    && pRecord->nLength == CSW_LENGTH)
+		{
+			return pRecord->nTime - pCBW->nTime;
+		}
+	}
+
+	return 0;
+}
+
+// returns the next submit of an OUT request to the same endpoint or 0
+static const TSimCaptureRecord *GetNextOutSubmit (unsigned nRecord)
+{
+	const TSimCaptureRecord *pPrevious = &s_Capture.m_pRecord[nRecord];
+	for (unsigned i = nRecord+1; i < s_Capture.m_nRecords; i++)
+	{
+		const TSimCaptureRecord *pRecord = &s_Capture.m_pRecord[i];
+		if (   pRecord->ucDevice == pPrevious->ucDevice
+		    && pRecord->ucEndpoint == pPrevious->ucEndpoint
+		    && pRecord->chType == 'S')
+		{
+			return pRecord;
+		}
+	}
+
+	return 0;
+}
+
+// reconstructs the application calls from the recorded CBWs and Ethernet frames
+static void GetOperations (void)
+{
+	unsigned nMSDIndex[SIM_REPLAY_MAX_DEVICES+1];
+	unsigned nMSDs = 0;
+	for (unsigned nAddress = 1; nAddress <= SIM_REPLAY_MAX_DEVICES; nAddress++)
+	{
+		if (s_Kind[nAddress] == DeviceMassStorage)
+		{
+			nMSDIndex[nAddress] = nMSDs++;
+		}
+	}
+
+	s_pOperation = (TOperation *) calloc (s_Capture.m_nRecords + 1, sizeof (TOperation));
+	if (s_pOperation == 0)
+	{
+		return;
+	}
+
+	for (unsigned i = 0; i < s_Capture.m_nRecords; i++)
+	{
+		const TSimCaptureRecord *pRecord = &s_Capture.m_pRecord[i];
+		if (   pRecord->chType != 'S'
+		    || pRecord->ucTransferType != XFER_BULK
+		    || (pRecord->ucEndpoint & 0x80)
+		    || pRecord->ucDevice > SIM_REPLAY_MAX_DEVICES)
+		{
+			continue;
+		}
+
+		TOperation *pOperation = &s_pOperation[s_nOperations];
+
+		if (s_Kind[pRecord->ucDevice] == DeviceMassStorage)
+		{
+			if (   pRecord->nLength != CBW_LENGTH
+			    || pRecord->nCaptured < CBW_LENGTH
+			    || GetLE32 (pRecord->pData) != CBW_SIGNATURE)
+			{
+				continue;
+			}
+
+			const u8 *pCDB = pRecord->pData + CBW_CDB_OFFSET;
+			if (   pCDB[0] == SCSI_SYNCHRONIZE_CACHE10
+			    || pCDB[0] == SCSI_SYNCHRONIZE_CACHE16)
+			{
+				pOperation->Type = OperationFlush;
+				pOperation->nDevice = nMSDIndex[pRecord->ucDevice];
+				pOperation->nRecordedTime = GetRecordedTime (i);
+
+				s_nOperations++;
+
+				continue;
+			}
+
+			unsigned long long ullBlock;
+			unsigned nBlocks;
+			if (   pCDB[0] == SCSI_READ10
+			    || pCDB[0] == SCSI_WRITE10)
+			{
+				ullBlock = GetBE32 (pCDB + 2);
+				nBlocks = pCDB[7] << 8 | pCDB[8];
+			}
+			else if (   pCDB[0] == SCSI_READ16
+				 || pCDB[0] == SCSI_WRITE16)
+			{
+				ullBlock = (unsigned long long) GetBE32 (pCDB + 2) << 32 | GetBE32 (pCDB + 6);
+				nBlocks = GetBE32 (pCDB + 10);
+			}
+			else
+			{
+				continue;		// issued by the driver itself
+			}
+
+			// the block size of the device follows from the transfer length
+			u32 nDataLength = GetLE32 (pRecord->pData + CBW_DATA_LENGTH_OFFSET);
+			if (   nBlocks == 0
+			    || nDataLength % nBlocks != 0)
+			{
+				continue;
+			}
+
+			pOperation->Type =    pCDB[0] == SCSI_READ10
+					   || pCDB[0] == SCSI_READ16 ? OperationRead : OperationWrite;
+			pOperation->nDevice = nMSDIndex[pRecord->ucDevice];
+			pOperation->ullOffset = ullBlock * (nDataLength / nBlocks);
+			pOperation->nCount = nDataLength;
+			pOperation->nRecordedTime = GetRecordedTime (i);
+
+			if (pOperation->Type == OperationWrite)
+			{
+				pOperation->bFUA = !!(pCDB[1] & SCSI_WRITE_FUA);
+				pOperation->pData = GetNextOutSubmit (i);
+			}
+		}
+		else if (s_Kind[pRecord->ucDevice] == DeviceEthernet)
+		{
+			if (pRecord->nLength <= ETH_TX_HEADER)
+			{
+				continue;
+			}
+
+			pOperation->Type = OperationSend;
+			pOperation->nCount = pRecord->nLength - ETH_TX_HEADER;
+			pOperation->pData = pRecord;
+			pOperation->nDataOffset = ETH_TX_HEADER;
+		}
+		else
+		{
+			continue;
+		}
+
+		if (   pOperation->nCount == 0
+		    || pOperation->nCount > MAX_OPERATION)
+		{
+			continue;
+		}
+
+		s_nOperations++;
+	}
+}
+
+// returns TRUE if the next write to the device after operation nOperation has been
+// recorded with FUA and there is no flush in between
+static boolean IsNextWriteFUA (unsigned nOperation)
+{
+	unsigned nDevice = s_pOperation[nOperation].nDevice;
+	for (unsigned i = nOperation+1; i < s_nOperations; i++)
+	{
+		if (s_pOperation[i].nDevice != nDevice)
+		{
+			continue;
+		}
+
+		if (s_pOperation[i].Type == OperationWrite)
+		{
+			return s_pOperation[i].bFUA;
+		}
+
+		if (s_pOperation[i].Type == OperationFlush)
+		{
+			return FALSE;
+		}
+	}
+
+	return FALSE;
+}
+
+// the write policy is switched with the flushes in the recording, so that each of them
+// results in exactly one SYNCHRONIZE CACHE and the writes get the recorded FUA flag
+static boolean Flush (unsigned nOperation)
+{
+	unsigned nDevice = s_pOperation[nOperation].nDevice;
+
+	if (!s_bWriteBack[nDevice])
+	{
+		// the driver checks the support of SYNCHRONIZE CACHE with a flush
+		s_bWriteBack[nDevice] = USPiMassStorageDeviceSetWritePolicy (USPI_WRITE_BACK, nDevice);
+
+		return s_bWriteBack[nDevice];
+	}
+
+	if (IsNextWriteFUA (nOperation))
+	{
+		// the cache is flushed before the policy is changed
+		s_bWriteBack[nDevice] = !USPiMassStorageDeviceSetWritePolicy (USPI_WRITE_FUA, nDevice);
+
+		return !s_bWriteBack[nDevice];
+	}
+
+	return USPiMassStorageDeviceFlush (nDevice) == 0;
+}
+
+static boolean IsReplayComplete (void)
+{
+	for (unsigned i = 0; i < s_nReplays; i++)
+	{
+		if (SimReplayGetReplayed (&s_Replay[i]) < SimReplayGetTransfers (&s_Replay[i]))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static unsigned GetReplayed (void)
+{
+	unsigned nResult = 0;
+	for (unsigned i = 0; i < s_nReplays; i++)
+	{
+		nResult += SimReplayGetReplayed (&s_Replay[i]);
+	}
+
+	return nResult;
+}
+
+// completion routines are called from here with USPI_DEFER_COMPLETION
+static void Idle (void)
+{
+	MsDelay (1);
+
+	USPiProcessCompletions ();
+
+	static u8 Frame[USPI_FRAME_BUFFER_SIZE];
+	unsigned nLength;
+	while (   USPiEthernetAvailable ()
+	       && USPiReceiveFrame (Frame, &nLength))
+	{
+		s_Result.nFramesReceived++;
+	}
+}
+
+static int ReplayMain (void *pParam)
+{
+	u64 nStart = SimGetTime ();
+	if (!USPiInitialize ())
+	{
+		LogWrite (FromReplay, LOG_ERROR, "Cannot initialize USPi");
+
+		return 1;
+	}
+	s_Result.nEnumTime = SimGetTime () - nStart;
+
+	if (USPiKeyboardAvailable ())
+	{
+		USPiKeyboardRegisterKeyStatusHandlerRaw (KeyStatusHandlerRaw);
+	}
+
+	if (USPiMouseAvailable ())
+	{
+		USPiMouseRegisterStatusHandler (MouseStatusHandler);
+	}
+
+	if (USPiGamePadAvailable ())
+	{
+		USPiGamePadRegisterStatusHandler (GamePadStatusHandler);
+	}
+
+	u8 *pBuffer = (u8 *) aligned_alloc (DMA_ALIGNMENT, MAX_OPERATION);
+	if (pBuffer == 0)
+	{
+		return 1;
+	}
+
+	for (unsigned i = 0; i < s_nOperations; i++)
+	{
+		TOperation *pOperation = &s_pOperation[i];
+
+		// data, which has not been captured, is written as zero
+		if (pOperation->Type != OperationRead)
+		{
+			memset (pBuffer, 0, pOperation->nCount);
+
+			if (   pOperation->pData != 0
+			    && pOperation->pData->nCaptured > pOperation->nDataOffset)
+			{
+				unsigned nCopy = pOperation->pData->nCaptured - pOperation->nDataOffset;
+				memcpy (pBuffer, pOperation->pData->pData + pOperation->nDataOffset,
+					nCopy < pOperation->nCount ? nCopy : pOperation->nCount);
+			}
+		}
+
+		boolean bOK = FALSE;
+		nStart = SimGetTime ();
+		switch (pOperation->Type)
+		{
+		case OperationRead:
+			bOK = USPiMassStorageDeviceRead (pOperation->ullOffset, pBuffer, pOperation->nCount,
+							 pOperation->nDevice) == (int) pOperation->nCount;
+			break;
+
+		case OperationWrite:
+			bOK = USPiMassStorageDeviceWrite (pOperation->ullOffset, pBuffer, pOperation->nCount,
+							  pOperation->nDevice) == (int) pOperation->nCount;
+			break;
+
+		case OperationSend:
+			bOK = USPiSendFrame (pBuffer, pOperation->nCount) != 0;
+			break;
+
+		case OperationFlush:
+			bOK = Flush (i);
+			break;
+
+		default:
+			break;
+		}
+		u64 nTime = SimGetTime () - nStart;
+
+		if (!bOK)
+		{
+			s_Result.nFailed++;
+
+			continue;
+		}
+
+		s_Result.nOperations[pOperation->Type]++;
+		s_Result.nBytes[pOperation->Type] += pOperation->nCount;
+		s_Result.nTime[pOperation->Type] += nTime;
+		s_Result.nRecordedTime[pOperation->Type] += pOperation->nRecordedTime;
+
+		if (nTime > s_Result.nMaxLatency)
+		{
+			s_Result.nMaxLatency = nTime;
+		}
+	}
+
+	free (pBuffer);
+
+	// let the interrupt endpoints and the Ethernet receiver consume the rest of the recording
+	unsigned nLastReplayed = GetReplayed ();
+	for (unsigned nIdle = 0; nIdle < IDLE_TIMEOUT && !IsReplayComplete (); nIdle++)
+	{
+		Idle ();
+
+		if (GetReplayed () != nLastReplayed)
+		{
+			nLastReplayed = GetReplayed ();
+			nIdle = 0;
+		}
+	}
+
+	for (unsigned i = 0; i < IDLE_TAIL; i++)
+	{
+		Idle ();
+	}
+
+	return 0;
+}
+
+static double CPUTime (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double Rate (u64 nBytes, u64 nTime)
+{
+	return nTime > 0 ? nBytes / 1024.0 * 1e9 / nTime : 0.0;
+}
+
+static void Usage (const char *pProgram)
+{
+	fprintf (stderr, "Usage: %s [-t] [-c channels] [-S address:h|f|l] [-v loglevel] [-m] pcapfile\n"
+			 "\t-t\tthe devices answer with the recorded latency\n"
+			 "\t-S\tspeed of the device with this address (default: guessed)\n"
+			 "\t-m\tmachine-readable output (key=value)\n", pProgram);
+
+	exit (2);
+}
+
+int main (int argc, char **argv)
+{
+	SimInitialize ();
+
+	boolean bTiming = FALSE;
+	unsigned nChannels = DWC2_DEFAULT_CHANNELS;
+	boolean bMachine = FALSE;
+	static TUSBSpeed Speed[SIM_REPLAY_MAX_DEVICES+1];
+	static boolean bSpeedSet[SIM_REPLAY_MAX_DEVICES+1];
+
+	int nOption;
+	while ((nOption = getopt (argc, argv, "tc:S:v:m")) != -1)
+	{
+		switch (nOption)
+		{
+		case 't':	bTiming = TRUE;				break;
+		case 'c':	nChannels = atoi (optarg);		break;
+		case 'v':	SimSetLogLevel (atoi (optarg));		break;
+		case 'm':	bMachine = TRUE;			break;
+
+		case 'S': {
+			unsigned nAddress;
+			char chSpeed;
+			if (   sscanf (optarg, "%u:%c", &nAddress, &chSpeed) != 2
+			    || nAddress < 1 || nAddress > SIM_REPLAY_MAX_DEVICES
+			    || strchr ("hfl", chSpeed) == 0)
+			{
+				Usage (argv[0]);
+			}
+
+			Speed[nAddress] = chSpeed == 'h' ? USBSpeedHigh : chSpeed == 'f' ? USBSpeedFull : USBSpeedLow;
+			bSpeedSet[nAddress] = TRUE;
+			} break;
+
+		default:	Usage (argv[0]);			break;
+		}
+	}
+
+	if (   optind != argc-1
+	    || nChannels < 1
+	    || nChannels > DWC2_MAX_CHANNELS)
+	{
+		Usage (argv[0]);
+	}
+
+	if (!SimCapture (&s_Capture, argv[optind]))
+	{
+		fprintf (stderr, "%s: Cannot read capture\n", argv[optind]);
+
+		return 1;
+	}
+
+	// the hub is simulated by the live model, the other devices are replayed
+	static TSimHub Hub;
+	boolean bHub = FALSE;
+	unsigned nDevices = 0;
+	for (unsigned nAddress = 1; nAddress <= SIM_REPLAY_MAX_DEVICES; nAddress++)
+	{
+		if (SimCaptureGetDeviceDescriptor (&s_Capture, nAddress) == 0)
+		{
+			continue;
+		}
+
+		s_Kind[nAddress] = GetDeviceKind (nAddress);
+		if (!bSpeedSet[nAddress])
+		{
+			Speed[nAddress] = SimCaptureGuessSpeed (&s_Capture, nAddress);
+		}
+
+		if (s_Kind[nAddress] == DeviceHub)
+		{
+			if (bHub)
+			{
+				fprintf (stderr, "Only one hub is supported\n");
+
+				return 1;
+			}
+
+			const TUSBDeviceDescriptor *pDesc = SimCaptureGetDeviceDescriptor (&s_Capture, nAddress);
+			unsigned nPorts = GetHubPorts (nAddress);
+			if (   nPorts == 0
+			    || nPorts > SIM_MAX_PORTS)
+			{
+				nPorts = SIM_MAX_PORTS;
+			}
+
+			SimHub (&Hub, bSpeedSet[nAddress] ? Speed[nAddress]
+							  : pDesc->bcdUSB >= 0x200 ? USBSpeedHigh : USBSpeedFull,
+				nPorts, pDesc->bDeviceProtocol == 2);
+			bHub = TRUE;
+
+			continue;
+		}
+
+		if (nDevices == SIM_MAX_PORTS)
+		{
+			fprintf (stderr, "Too many devices\n");
+
+			return 1;
+		}
+
+		if (!SimReplay (&s_Replay[nDevices], &s_Capture, nAddress, Speed[nAddress], bTiming))
+		{
+			fprintf (stderr, "Cannot replay device %u\n", nAddress);
+
+			return 1;
+		}
+
+		nDevices++;
+	}
+
+	if (   nDevices == 0
+	    || (!bHub && nDevices > 1))
+	{
+		fprintf (stderr, "%s: No device or more devices than ports\n", argv[optind]);
+
+		return 1;
+	}
+
+	s_nReplays = nDevices;
+	for (unsigned i = 0; bHub && i < nDevices; i++)
+	{
+		SimHubAttach (&Hub, i+1, &s_Replay[i].m_Device);
+	}
+
+	GetOperations ();
+	if (s_pOperation == 0)
+	{
+		return 1;
+	}
+
+	SimAttach (bHub ? &Hub.m_Device : &s_Replay[0].m_Device, nChannels);
+
+	double fCPUStart = CPUTime ();
+	int nResult = SimRun (ReplayMain, 0);
+	double fCPUTime = CPUTime () - fCPUStart;
+
+	unsigned nTransfers = 0;
+	unsigned nMismatches = 0;
+	unsigned nUnmatched = 0;
+	for (unsigned i = 0; i < s_nReplays; i++)
+	{
+		nTransfers += SimReplayGetTransfers (&s_Replay[i]);
+		nMismatches += SimReplayGetMismatches (&s_Replay[i]);
+		nUnmatched += SimReplayGetUnmatched (&s_Replay[i]);
+	}
+
+	if (   s_Result.nFailed > 0
+	    || GetReplayed () < nTransfers)
+	{
+		nResult = 1;
+	}
+
+	TSimStatistics Stat;
+	SimGetStatistics (&Stat);
+	const TDWC2Statistics *pCore = DWC2CoreGetStatistics (SimGetCore ());
+
+	const char *pFormat = bMachine ? "%s=%s\n" : "%-24s %s\n";
+	char Value[200];
+
+#define PRINT(name, ...)	do { snprintf (Value, sizeof Value, __VA_ARGS__); \
+				     printf (pFormat, name, Value); } while (0)
+
+	unsigned nOperations = 0;
+	u64 nTime = 0;
+	for (unsigned i = 0; i < OperationUnknown; i++)
+	{
+		nOperations += s_Result.nOperations[i];
+		nTime += s_Result.nTime[i];
+	}
+
+	PRINT ("result", "%s", nResult == 0 ? "ok" : "failed");
+	PRINT ("devices", "%u%s", s_nReplays, bHub ? " (hub)" : "");
+	PRINT ("enum_time_ms", "%.3f", s_Result.nEnumTime / 1e6);
+	PRINT ("operations", "%u/%u", nOperations, s_nOperations);
+	PRINT ("failed_operations", "%u", s_Result.nFailed);
+	PRINT ("read_ops", "%u", s_Result.nOperations[OperationRead]);
+	PRINT ("read_kbps", "%.1f", Rate (s_Result.nBytes[OperationRead], s_Result.nTime[OperationRead]));
+	PRINT ("recorded_read_kbps", "%.1f", Rate (s_Result.nBytes[OperationRead],
+						   s_Result.nRecordedTime[OperationRead]));
+	PRINT ("write_ops", "%u", s_Result.nOperations[OperationWrite]);
+	PRINT ("write_kbps", "%.1f", Rate (s_Result.nBytes[OperationWrite], s_Result.nTime[OperationWrite]));
+	PRINT ("recorded_write_kbps", "%.1f", Rate (s_Result.nBytes[OperationWrite],
+						    s_Result.nRecordedTime[OperationWrite]));
+	PRINT ("flush_ops", "%u", s_Result.nOperations[OperationFlush]);
+	PRINT ("op_latency_avg_us", "%.1f", nOperations > 0 ? nTime / 1e3 / nOperations : 0.0);
+	PRINT ("op_latency_max_us", "%.1f", s_Result.nMaxLatency / 1e3);
+	PRINT ("eth_frames_sent", "%u", s_Result.nOperations[OperationSend]);
+	PRINT ("eth_frames_received", "%u", s_Result.nFramesReceived);
+	PRINT ("key_reports", "%u", s_Result.nKeyReports);
+	PRINT ("mouse_reports", "%u", s_Result.nMouseReports);
+	PRINT ("gamepad_reports", "%u", s_Result.nGamePadReports);
+	PRINT ("transfers_replayed", "%u/%u", GetReplayed (), nTransfers);
+	PRINT ("out_mismatches", "%u", nMismatches);
+	PRINT ("unmatched_requests", "%u", nUnmatched);
+	PRINT ("virtual_time_ms", "%.3f", SimGetTime () / 1e6);
+	PRINT ("host_cpu_time_s", "%.3f", fCPUTime);
+	PRINT ("irqs", "%u", Stat.nIRQs);
+	PRINT ("packets", "%u", pCore->nPackets);
+	PRINT ("naks", "%u", pCore->nNAKs);
+	PRINT ("errors", "%u", pCore->nErrors);
+
+	free (s_pOperation);
+
+	for (unsigned i = 0; i < s_nReplays; i++)
+	{
+		_SimReplay (&s_Replay[i].m_Device);
+	}
+
+	_SimCapture (&s_Capture);
+
+	return nResult;
+}
@@ -0,0 +1,283 @@
+//
+// uspitrace.c
+//
+// Decodes the event trace of the USPi library (see USPiTraceDump()) into a timeline
+//
+// USPi - An USB driver for Raspberry Pi written in C
+// Copyright (C) 2020  R. Stange <rsta2@o2online.de>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <uspi/trace.h>
+#include <uspi/dwhci.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// must match TStageState and TStageSubState in lib/dwhcidevice.c
+static const char *s_pStateName[] =
+{
+	"nosplit", "ssplit", "csplit", "perdelay", "iso"
+};
+#define STATES		(sizeof s_pStateName / sizeof s_pStateName[0])
+
+static const char *s_pSubStateName[] =
+{
+	"wait-disable", "wait-xact", "wait-frame"
+};
+#define SUB_STATES	(sizeof s_pSubStateName / sizeof s_pSubStateName[0])
+
+static const char *s_pEventName[TraceEventUnknown] =
+{
+	"submit", "stage", "start", "ssplit", "csplit", "disable", "halt", "xact", "wait-frame",
+	"finish", "complete"
+};
+
+static const char *s_pPIDName[] = {"DATA0", "DATA2", "DATA1", "MDATA/SETUP"};
+
+// see DWHCI_HOST_CHAN_INT_*
+static const char *s_pInterruptName[] =
+{
+	"XFERC", "HALT", "AHBERR", "STALL", "NAK", "ACK", "NYET", "XACTERR", "BABBLE", "FRMOVR",
+	"DTERR"
+};
+#define INTERRUPTS	(sizeof s_pInterruptName / sizeof s_pInterruptName[0])
+
+static const char *StateName (unsigned nState)
+{
+	return nState < STATES ? s_pStateName[nState] : "?";
+}
+
+static void PrintInterrupts (u32 nInterrupts)
+{
+	for (unsigned i = 0; i < INTERRUPTS; i++)
+	{
+		if (nInterrupts & (1 << i))
+		{
+			printf (" %s", s_pInterruptName[i]);
+		}
+	}
+}
+
+static void PrintTransferSize (u32 nTransferSize)
+{
+	printf (" %s pkts=%u size=%u",
+		s_pPIDName[DWHCI_HOST_CHAN_XFER_SIZ_PID (nTransferSize)],
+		DWHCI_HOST_CHAN_XFER_SIZ_PACKETS (nTransferSize),
+		nTransferSize & DWHCI_HOST_CHAN_XFER_SIZ_BYTES__MASK);
+}
+
+static void PrintEvent (const TUSPiTraceEvent *pEvent)
+{
+	switch (pEvent->ucEvent)
+	{
+	case TraceEventSubmit:
+		printf (" urb=%08x ep=%02x len=%u", pEvent->nParam1, pEvent->usParam, pEvent->nParam2);
+		break;
+
+	case TraceEventStageStart:
+		printf (" urb=%08x %s%s%s len=%u", pEvent->nParam1,
+			pEvent->usParam & 1 ? "IN" : "OUT",
+			pEvent->usParam & 2 ? " status" : "",
+			pEvent->usParam & 4 ? " split" : "", pEvent->nParam2);
+		break;
+
+	case TraceEventChannelStart:
+		PrintTransferSize (pEvent->nParam1);
+		printf (" dev=%u ep=%u%s mps=%u",
+			(pEvent->nParam2 & DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__MASK)
+				>> DWHCI_HOST_CHAN_CHARACTER_DEVICE_ADDRESS__SHIFT,
+			(pEvent->nParam2 & DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__MASK)
+				>> DWHCI_HOST_CHAN_CHARACTER_EP_NUMBER__SHIFT,
+			pEvent->nParam2 & DWHCI_HOST_CHAN_CHARACTER_EP_DIRECTION_IN ? "in" : "out",
+			pEvent->nParam2 & DWHCI_HOST_CHAN_CHARACTER_MAX_PKT_SIZ__MASK);
+		break;
+
+	case TraceEventStartSplit:
+	case TraceEventCompleteSplit:
+		PrintTransferSize (pEvent->nParam1);
+		printf (" hub=%u port=%u",
+			(pEvent->nParam2 & DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__MASK)
+				>> DWHCI_HOST_CHAN_SPLIT_CTRL_HUB_ADDRESS__SHIFT,
+			pEvent->nParam2 & DWHCI_HOST_CHAN_SPLIT_CTRL_PORT_ADDRESS__MASK);
+		break;
+
+	case TraceEventChannelHalt:
+		printf (" urb=%08x %s", pEvent->nParam1, StateName (pEvent->usParam));
+		break;
+
+	case TraceEventTransaction: {
+		unsigned nSubState = pEvent->usParam & 0xFF;
+		printf (" %s/%s", StateName (pEvent->usParam >> 8),
+			nSubState < SUB_STATES ? s_pSubStateName[nSubState] : "?");
+		PrintInterrupts (pEvent->nParam1);
+		PrintTransferSize (pEvent->nParam2);
+		} break;
+
+	case TraceEventWaitFrame:
+		printf (" %s due=%u", StateName (pEvent->usParam), pEvent->nParam1);
+		break;
+
+	case TraceEventStageFinish:
+		printf (" urb=%08x stage=%u status=%u", pEvent->nParam1, pEvent->usParam, pEvent->nParam2);
+		break;
+
+	case TraceEventComplete:
+		printf (" urb=%08x %s len=%u", pEvent->nParam1,
+			pEvent->nParam2 >> 31 ? "ok" : "failed", pEvent->nParam2 & 0x7FFFFFFF);
+		if (pEvent->usParam != 0)
+		{
+			printf (" error=%u", pEvent->usParam);	// see TUSBError
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void Usage (const char *pProgram)
+{
+	fprintf (stderr, "Usage: %s [-c channel] [-u urb] tracefile\n"
+			 "\t-c\tshow the events of this channel only\n"
+			 "\t-u\tshow the events of this request (hex) only\n", pProgram);
+
+	exit (2);
+}
+
+int main (int argc, char **argv)
+{
+	int nChannel = -1;
+	u32 nURB = 0;
+
+	int nOption;
+	while ((nOption = getopt (argc, argv, "c:u:")) != -1)
+	{
+		switch (nOption)
+		{
+		case 'c':	nChannel = atoi (optarg);			break;
+		case 'u':	nURB = (u32) strtoul (optarg, 0, 16);		break;
+		default:	Usage (argv[0]);				break;
+		}
+	}
+
+	if (optind != argc-1)
+	{
+		Usage (argv[0]);
+	}
+
+	FILE *pFile = fopen (argv[optind], "rb");
+	if (pFile == 0)
+	{
+		fprintf (stderr, "Cannot open %s\n", argv[optind]);
+
+		return 1;
+	}
+
+	// the trace is little endian, like the host
+	TUSPiTraceHeader Header;
+	if (   fread (&Header, sizeof Header, 1, pFile) != 1
+	    || Header.nMagic != USPI_TRACE_MAGIC
+	    || Header.usVersion != USPI_TRACE_VERSION
+	    || Header.usEventSize != sizeof (TUSPiTraceEvent)
+	    || Header.nClockRate == 0)
+	{
+		fprintf (stderr, "%s: Invalid trace\n", argv[optind]);
+
+		return 1;
+	}
+
+	printf ("# %u events, %u lost before, clock %u Hz\n",
+		Header.nEvents, Header.nLost, Header.nClockRate);
+	printf ("#     time_us   delta_us ch event\n");
+
+	u64 nTime = 0;				// ticks since the first event
+	u32 nLastTime = 0;
+	u64 nLastShown = 0;
+	boolean bURBActive[USPI_TRACE_NO_CHANNEL+1] = {FALSE};
+	for (unsigned i = 0; i < Header.nEvents; i++)
+	{
+		TUSPiTraceEvent Event;
+		if (fread (&Event, sizeof Event, 1, pFile) != 1)
+		{
+			fprintf (stderr, "%s: Truncated after %u events\n", argv[optind], i);
+
+			return 1;
+		}
+
+		// the time stamp wraps around, the events are in order
+		if (i > 0)
+		{
+			nTime += Event.nTime - nLastTime;
+		}
+		nLastTime = Event.nTime;
+
+		if (   nChannel >= 0
+		    && Event.ucChannel != nChannel)
+		{
+			continue;
+		}
+
+		if (nURB != 0)
+		{
+			// the channel events do not contain the URB, show them while
+			// a stage of the request is active on the channel
+			if (   Event.ucEvent == TraceEventStageStart
+			    && Event.nParam1 == nURB)
+			{
+				bURBActive[Event.ucChannel] = TRUE;
+			}
+
+			boolean bShow = bURBActive[Event.ucChannel];
+			if (   Event.ucEvent == TraceEventSubmit
+			    || Event.ucEvent == TraceEventStageStart
+			    || Event.ucEvent == TraceEventChannelHalt
+			    || Event.ucEvent == TraceEventStageFinish
+			    || Event.ucEvent == TraceEventComplete)
+			{
+				bShow = Event.nParam1 == nURB;
+			}
+
+			if (Event.ucEvent == TraceEventStageFinish)
+			{
+				bURBActive[Event.ucChannel] = FALSE;
+			}
+
+			if (!bShow)
+			{
+				continue;
+			}
+		}
+
+		double fTime = (double) nTime * 1e6 / Header.nClockRate;
+		double fDelta = (double) (nTime - nLastShown) * 1e6 / Header.nClockRate;
+		nLastShown = nTime;
+
+		char Channel[4] = " -";
+		if (Event.ucChannel != USPI_TRACE_NO_CHANNEL)
+		{
+			snprintf (Channel, sizeof Channel, "%2u", Event.ucChannel);
+		}
+
+		printf ("%13.3f %10.3f %s %-10s", fTime, fDelta, Channel,
+			Event.ucEvent < TraceEventUnknown ? s_pEventName[Event.ucEvent] : "?");
+		PrintEvent (&Event);
+		printf ("\n");
+	}
+
+	fclose (pFile);
+
+	return 0;
+}